@@ -0,0 +1,307 @@
+#pragma once
+
+struct AdaptiveOptions {
+	// The result is accepted once its error bound is at most
+	// max(absoluteTolerance, relativeTolerance * |result|)
+	double relativeTolerance = 1e-15;
+	double absoluteTolerance = 0;
+
+	// The MPFR precisions tried if double is not accurate enough, in bits.
+	// Each attempt doubles the precision of the last
+	int64_t firstPrecision = 128;
+	int64_t maxPrecision   = 1024;
+};
+
+struct AdaptiveResult {
+	lrc::mpfr value;
+	double errorBound; // Estimated bound on |value - exact value|
+	int64_t precision; // Bits used: 53 if double was accurate enough
+	bool converged;	   // False if the tolerance was not met at maxPrecision
+};
+
+/**
+ * Evaluates a tree in double while keeping a running bound on the error of
+ * each node, and only when the bound at the root is larger than the tolerance
+ * evaluates it again in lrc::mpfr, at increasing precision until it is met.
+ * Subtrees whose value was exact in an earlier attempt are not evaluated
+ * again, so only the parts affected by rounding pay for the extra precision.
+ *
+ * The bounds are a first-order running error analysis: arithmetic and
+ * integer powers are bounded directly, and other functions by evaluating them
+ * at the ends of each operand's error interval. A division or power whose
+ * operand's interval is not bounded away from a singularity has an infinite
+ * bound, which forces a more precise attempt.
+ */
+class AdaptiveEvaluator {
+public:
+	AdaptiveEvaluator(std::shared_ptr<Component> tree,
+					  const std::map<std::string, Scalar> &values,
+					  AdaptiveOptions options = {}) :
+			m_tree(std::move(tree)),
+			m_values(values), m_options(options) {}
+
+	AdaptiveResult eval() {
+		auto res = pass<double>(std::numeric_limits<double>::digits);
+		if (accepted(res))
+			return {lrc::mpfr(res.value), res.error, 53, true};
+
+		int64_t bits = m_options.firstPrecision;
+		while (true) {
+			MpfrPrecisionScope scope(bits);
+			auto precise   = pass<lrc::mpfr>(bits);
+			bool converged = accepted(precise);
+			if (converged || bits >= m_options.maxPrecision)
+				return {precise.value, precise.error, bits, converged};
+			bits = lrc::min(bits * 2, m_options.maxPrecision);
+		}
+	}
+
+private:
+	// A value and a bound on its absolute error
+	template<typename V>
+	struct Bounded {
+		V value;
+		double error;
+	};
+
+	template<typename V>
+	static double magnitude(const V &value) {
+		using std::abs;
+		return scalarCast<double>(abs(value));
+	}
+
+	template<typename V>
+	bool accepted(const Bounded<V> &res) const {
+		// An infinite bound is never accepted, even for an infinite value
+		double relative = m_options.relativeTolerance * magnitude(res.value);
+		return res.error < std::numeric_limits<double>::infinity() &&
+			   res.error <= lrc::max(m_options.absoluteTolerance, relative);
+	}
+
+	// Evaluate the tree in V with a unit roundoff of 2^-bits
+	template<typename V>
+	Bounded<V> pass(int64_t bits) {
+		double unit = std::ldexp(1.0, static_cast<int>(-bits));
+		std::unordered_map<const Component *, Bounded<V>> results;
+
+		auto prune = [&](const auto &node, Bounded<V> &result) {
+			auto it = results.find(node.get());
+			if (it != results.end()) {
+				result = it->second;
+				return true;
+			}
+
+			if (auto exact = m_exactDouble.find(node.get());
+				exact != m_exactDouble.end()) {
+				result = {scalarCast<V>(exact->second), 0};
+				return true;
+			}
+
+			if (auto exact = m_exactMpfr.find(node.get());
+				exact != m_exactMpfr.end()) {
+				result = {scalarCast<V>(exact->second), 0};
+				return true;
+			}
+
+			return false;
+		};
+
+		auto visitor = [&](const auto &node, auto first, auto last) {
+			Bounded<V> res = evalNode<V>(node, first, last, unit);
+			if (!(res.error < std::numeric_limits<double>::infinity()))
+				res.error = std::numeric_limits<double>::infinity(); // Or NaN
+			results.emplace(node.get(), res);
+			if (res.error == 0 && !node->children().empty()) {
+				if constexpr (std::is_same_v<V, double>) {
+					m_exactDouble.emplace(node.get(), res.value);
+				} else {
+					m_exactMpfr.emplace(node.get(), res.value);
+				}
+			}
+			return res;
+		};
+
+		return foldTree<Bounded<V>>(m_tree, visitor, prune);
+	}
+
+	// The value of a Scalar in V, with the error of converting it
+	template<typename V>
+	static Bounded<V> convert(const Scalar &value, double unit) {
+		V res = scalarCast<V>(value);
+		if (scalarCast<Scalar>(res) == value) return {res, 0};
+		return {res, magnitude(res) * unit};
+	}
+
+	// Whether a + b, a * b and a / b were computed exactly, found with
+	// error-free transformations. Only known for double
+	template<typename V>
+	static bool exactSum(const V &a, const V &b, const V &sum) {
+		if constexpr (std::is_same_v<V, double>) {
+			double bb = sum - a;
+			return (a - (sum - bb)) + (b - bb) == 0;
+		} else {
+			return false;
+		}
+	}
+
+	template<typename V>
+	static bool exactProduct(const V &a, const V &b, const V &product) {
+		if constexpr (std::is_same_v<V, double>) {
+			return std::fma(a, b, -product) == 0;
+		} else {
+			return false;
+		}
+	}
+
+	template<typename V>
+	static bool exactQuotient(const V &a, const V &b, const V &quotient) {
+		if constexpr (std::is_same_v<V, double>) {
+			return std::fma(quotient, b, -a) == 0;
+		} else {
+			return false;
+		}
+	}
+
+	template<typename V, typename Iter>
+	Bounded<V> evalNode(const std::shared_ptr<Component> &node, Iter first,
+						Iter last, double unit) const {
+		using std::log;
+		using std::pow;
+
+		std::string type = node->type();
+		if (type == "NUMBER") {
+			return convert<V>(std::dynamic_pointer_cast<Number>(node)->value(),
+							  unit);
+		}
+
+		if (type == "VARIABLE") {
+			auto it = m_values.find(node->name());
+			LR_ASSERT(it != m_values.end(),
+					  "No value given for variable {}",
+					  node->name());
+			return convert<V>(it->second, unit);
+		}
+
+		LR_ASSERT(type == "FUNCTION" || type == "TREE",
+				  "{} object cannot be evaluated (numerically) directly",
+				  type);
+		if (type == "TREE") return *first;
+
+		std::vector<Bounded<V>> args(first, last);
+		constexpr double infinity = std::numeric_limits<double>::infinity();
+
+		// Rounding the result of an operation adds up to ``units`` unit
+		// roundoffs, or nothing if it was exact
+		auto rounded = [&](const V &value, double error, double units) {
+			return Bounded<V> {value, error + units * unit * magnitude(value)};
+		};
+
+		std::string name = node->name();
+		if (name == "PLUS") return args[0];
+		if (name == "MINUS") return {-args[0].value, args[0].error};
+
+		if (name == "ADD" || name == "SUB") {
+			Bounded<V> res = args[0];
+			for (size_t j = 1; j < args.size(); ++j) {
+				V b		   = name == "ADD" ? args[j].value : -args[j].value;
+				V sum	   = res.value + b;
+				bool exact = exactSum(res.value, b, sum);
+				res = rounded(sum, res.error + args[j].error, exact ? 0 : 1);
+			}
+			return res;
+		}
+
+		if (name == "MUL") {
+			Bounded<V> res = args[0];
+			for (size_t j = 1; j < args.size(); ++j) {
+				const auto &arg = args[j];
+				double error	= magnitude(res.value) * arg.error +
+							   magnitude(arg.value) * res.error +
+							   res.error * arg.error;
+				V product  = res.value * arg.value;
+				bool exact = exactProduct(res.value, arg.value, product);
+				res		   = rounded(product, error, exact ? 0 : 1);
+			}
+			return res;
+		}
+
+		if (name == "DIV") {
+			const auto &[a, ea] = args[0];
+			const auto &[b, eb] = args[1];
+			double absA = magnitude(a), absB = magnitude(b);
+			V quotient	= a / b;
+			if (absB <= eb) return {quotient, infinity};
+			return rounded(quotient,
+						   (absA * eb + absB * ea) / (absB * (absB - eb)),
+						   exactQuotient(a, b, quotient) ? 0 : 1);
+		}
+
+		if (name == "POW") {
+			const auto &[a, ea] = args[0];
+			const auto &[b, eb] = args[1];
+			V value		= pow(a, b);
+			double absV = magnitude(value), absA = magnitude(a);
+			if (ea == 0 && eb == 0) return rounded(value, 0, 2);
+
+			// An exact integer power: the relative error of a, raised to n
+			double n = scalarCast<double>(b);
+			if (eb == 0 && n == std::trunc(n)) {
+				if (absA <= ea) return {value, infinity};
+				double growth = std::expm1(std::abs(n) * std::log1p(ea / absA));
+				return rounded(value, absV * growth, 2);
+			}
+
+			if (scalarCast<double>(a) <= ea) return {value, infinity};
+			double logA = magnitude(log(a));
+			return rounded(value,
+						   absV * (magnitude(b) * ea / absA + logA * eb),
+						   2);
+		}
+
+		// Any other function: evaluated at both ends of each operand's error
+		// interval. Functions without a kernel for V are evaluated in Scalar,
+		// so rounding error is at least that of Scalar
+		const Function *prototype = findFunction(name);
+		bool native = std::is_same_v<V, Scalar> ||
+					  (prototype && prototype->kernel<V>());
+		double functionUnit =
+		  native ? unit : lrc::max(unit, std::ldexp(1.0, -53));
+
+		auto func	 = std::dynamic_pointer_cast<Function>(node);
+		auto functor = functorAs<V>(name, args.size(), func->functor());
+
+		std::vector<V> operands;
+		for (const auto &arg : args) operands.emplace_back(arg.value);
+		V value = functor(operands);
+
+		double error = 0;
+		for (size_t j = 0; j < operands.size(); ++j) {
+			if (args[j].error == 0) continue;
+
+			double change = 0;
+			for (double sign : {-1.0, 1.0}) {
+				operands[j] = args[j].value + V(sign * args[j].error);
+				change = lrc::max(change, magnitude(functor(operands) - value));
+			}
+			operands[j] = args[j].value;
+			error += change;
+		}
+
+		return {value, error + 2 * functionUnit * magnitude(value)};
+	}
+
+	std::shared_ptr<Component> m_tree;
+	std::map<std::string, Scalar> m_values;
+	AdaptiveOptions m_options;
+
+	// Subtrees whose value was found exactly by an earlier attempt
+	std::unordered_map<const Component *, double> m_exactDouble;
+	std::unordered_map<const Component *, lrc::mpfr> m_exactMpfr;
+};
+
+// Evaluate a tree with AdaptiveEvaluator
+inline AdaptiveResult evalAdaptive(const std::shared_ptr<Component> &input,
+								   const std::map<std::string, Scalar> &values,
+								   AdaptiveOptions options = {}) {
+	return AdaptiveEvaluator(input, values, options).eval();
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+/**
+ * A read-only view of a file's contents. The file is memory-mapped where
+ * possible, so reading a large file does not copy it
+ */
+class MappedFile {
+public:
+	explicit MappedFile(const std::string &path) {
+#if defined(_WIN32)
+		std::ifstream file(path, std::ios::binary);
+		LR_ASSERT(file.is_open(), "Could not open file '{}'", path);
+		m_contents.assign(std::istreambuf_iterator<char>(file),
+						  std::istreambuf_iterator<char>());
+		m_data = m_contents.data();
+		m_size = m_contents.size();
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		LR_ASSERT(fd >= 0, "Could not open file '{}'", path);
+
+		struct stat info {};
+		if (::fstat(fd, &info) != 0) {
+			::close(fd);
+			LR_ASSERT(false, "Could not read file '{}'", path);
+		}
+
+		m_size = static_cast<size_t>(info.st_size);
+		if (m_size > 0) {
+			void *data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			LR_ASSERT(data != MAP_FAILED, "Could not map file '{}'", path);
+			::madvise(data, m_size, MADV_SEQUENTIAL);
+			m_data = static_cast<const char *>(data);
+		} else {
+			::close(fd);
+		}
+#endif
+	}
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	~MappedFile() {
+#if !defined(_WIN32)
+		if (m_data) ::munmap(const_cast<char *>(m_data), m_size);
+#endif
+	}
+
+	LR_NODISCARD("") std::string_view view() const { return {m_data, m_size}; }
+
+private:
+	const char *m_data = nullptr;
+	size_t m_size	   = 0;
+
+#if defined(_WIN32)
+	std::string m_contents;
+#endif
+};
+
+/**
+ * Parse one expression per line of ``text`` using a thread pool, returning the
+ * trees in the order of the lines. Empty lines are skipped.
+ *
+ * The lines are divided into chunks of ``chunkLines``, each of which is parsed
+ * by a single task with autoParse(). The nodes created by a task are allocated
+ * from an arena owned by that task (see makeNode()), so the threads do not
+ * contend on the heap, and the nodes of each tree end up close together.
+ *
+ * If a line cannot be parsed, the error for the first such line is rethrown
+ * after all the tasks have finished.
+ */
+std::vector<std::shared_ptr<Component>>
+parseLines(std::string_view text, ThreadPool &pool = ThreadPool::global(),
+		   size_t chunkLines = 1024) {
+	std::vector<std::string_view> lines;
+	std::vector<size_t> lineNumbers;
+	size_t lineNumber = 0;
+	while (!text.empty()) {
+		size_t end			  = text.find('\n');
+		std::string_view line = text.substr(0, end);
+		text.remove_prefix(end == text.npos ? text.size() : end + 1);
+		++lineNumber;
+
+		if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+		if (line.find_first_not_of(' ') == line.npos) continue;
+
+		lines.emplace_back(line);
+		lineNumbers.emplace_back(lineNumber);
+	}
+
+	chunkLines		 = lrc::max(chunkLines, size_t(1));
+	size_t numChunks = (lines.size() + chunkLines - 1) / chunkLines;
+
+	std::vector<std::shared_ptr<Component>> res(lines.size());
+	std::vector<std::exception_ptr> errors(numChunks);
+	std::atomic<size_t> pending {numChunks};
+
+	for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+		pool.submit([&, chunk]() {
+			size_t begin = chunk * chunkLines;
+			size_t end	 = lrc::min(begin + chunkLines, lines.size());
+			ArenaScope scope(std::make_shared<NodeArena>());
+
+			for (size_t i = begin; i < end; ++i) {
+				try {
+					res[i] = autoParse(std::string(lines[i]));
+				} catch (const std::exception &e) {
+					errors[chunk] = std::make_exception_ptr(std::runtime_error(
+					  fmt::format("Line {}: {}", lineNumbers[i], e.what())));
+					break;
+				}
+			}
+
+			pending.fetch_sub(1, std::memory_order_release);
+		});
+	}
+
+	pool.helpUntil(
+	  [&]() { return pending.load(std::memory_order_acquire) == 0; });
+
+	for (const auto &error : errors) {
+		if (error) std::rethrow_exception(error);
+	}
+
+	return res;
+}
+
+// Parse a file containing one expression per line. See parseLines()
+std::vector<std::shared_ptr<Component>>
+parseFile(const std::string &path, ThreadPool &pool = ThreadPool::global(),
+		  size_t chunkLines = 1024) {
+	MappedFile file(path);
+	return parseLines(file.view(), pool, chunkLines);
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+/**
+ * A map holding at most ``capacity`` entries, which evicts the least recently
+ * used entry when it is full. Not thread-safe
+ */
+template<typename Key, typename Value>
+class LruCache {
+public:
+	explicit LruCache(size_t capacity) :
+			m_capacity(lrc::max(capacity, size_t(1))) {}
+
+	// Returns the value for ``key`` and marks it as the most recently used,
+	// or nullptr if there is no such entry
+	Value *find(const Key &key) {
+		auto it = m_index.find(key);
+		if (it == m_index.end()) return nullptr;
+		m_entries.splice(m_entries.begin(), m_entries, it->second);
+		return &it->second->second;
+	}
+
+	// Insert an entry, unless there already is one for ``key``. Returns the
+	// entry's value
+	Value &insert(const Key &key, Value value) {
+		if (Value *existing = find(key)) return *existing;
+
+		m_entries.emplace_front(key, std::move(value));
+		m_index.emplace(key, m_entries.begin());
+		if (m_entries.size() > m_capacity) {
+			m_index.erase(m_entries.back().first);
+			m_entries.pop_back();
+			++m_evictions;
+		}
+		return m_entries.front().second;
+	}
+
+	void clear() {
+		m_index.clear();
+		m_entries.clear();
+	}
+
+	LR_NODISCARD("") size_t size() const { return m_entries.size(); }
+	LR_NODISCARD("") size_t capacity() const { return m_capacity; }
+	LR_NODISCARD("") uint64_t evictions() const { return m_evictions; }
+
+private:
+	using List = std::list<std::pair<Key, Value>>;
+
+	size_t m_capacity;
+	List m_entries; // Most recently used first
+	std::unordered_map<Key, typename List::iterator> m_index;
+	uint64_t m_evictions = 0;
+};
+
+/**
+ * A thread-safe cache of the work done on an expression string: its parsed
+ * tree, simplified form, derivatives and compiled programs. Each is computed
+ * the first time it is asked for and shared by later requests, so repeated
+ * traffic does not parse, differentiate or compile the same expression twice.
+ *
+ * Expressions are keyed by their text with whitespace removed. At most
+ * ``capacity`` expressions are kept, evicting the least recently used. Trees
+ * are never modified, so the results may be used freely by several threads.
+ *
+ * Each request for a tree, simplified form, derivative or program counts as
+ * one hit or miss in stats(). The cache is cleared whenever a new registry is
+ * published, since the results depend on the registered functions and rules.
+ *
+ * With setDiskCache(), simplified forms, derivatives and programs which are
+ * not in memory are loaded from disk if possible, and saved to disk when they
+ * are computed, so they outlive the process.
+ */
+class ExpressionCache {
+public:
+	struct Stats {
+		uint64_t hits	   = 0;
+		uint64_t misses	   = 0;
+		uint64_t evictions = 0;
+		size_t size		   = 0;
+	};
+
+	explicit ExpressionCache(size_t capacity = 4096) : m_entries(capacity) {}
+
+	// A cache shared by the whole program
+	static ExpressionCache &global() {
+		static ExpressionCache cache;
+		return cache;
+	}
+
+	// The whitespace-free form of an expression used as the key
+	static std::string normalize(const std::string &expression) {
+		std::string res;
+		res.reserve(expression.size());
+		for (char c : expression) {
+			if (c != ' ' && c != '\t' && c != '\r' && c != '\n') res += c;
+		}
+		return res;
+	}
+
+	std::shared_ptr<Component> parse(const std::string &expression) {
+		bool hit;
+		auto item = entry(expression, hit);
+		countLookup(hit);
+		return item->tree;
+	}
+
+	std::shared_ptr<Component> simplified(const std::string &expression) {
+		bool hit;
+		auto item = entry(expression, hit);
+		std::lock_guard<std::mutex> lock(item->mutex);
+		countLookup(item->simplified != nullptr);
+		if (!item->simplified) {
+			item->simplified = persistentTree(
+			  "simplify\n" + item->key, [&]() { return simplify(item->tree); });
+		}
+		return item->simplified;
+	}
+
+	std::shared_ptr<Component> derivative(const std::string &expression,
+										  const std::string &wrt) {
+		bool hit;
+		auto item = entry(expression, hit);
+		std::lock_guard<std::mutex> lock(item->mutex);
+		auto it = item->derivatives.find(wrt);
+		countLookup(it != item->derivatives.end());
+		if (it == item->derivatives.end()) {
+			auto derivative =
+			  persistentTree("derivative\n" + wrt + "\n" + item->key,
+							 [&]() { return differentiate(item->tree, wrt); });
+			it = item->derivatives.emplace(wrt, std::move(derivative)).first;
+		}
+		return it->second;
+	}
+
+	// The expression compiled with compileExpression()
+	std::shared_ptr<const Program>
+	program(const std::string &expression,
+			const std::vector<std::string> &variables) {
+		std::string key;
+		for (const auto &name : variables) key += name + ',';
+
+		bool hit;
+		auto item = entry(expression, hit);
+		std::lock_guard<std::mutex> lock(item->mutex);
+		auto it = item->programs.find(key);
+		countLookup(it != item->programs.end());
+		if (it == item->programs.end()) {
+			auto compiled = persistentProgram(
+			  "program\n" + key + "\n" + item->key,
+			  [&]() { return compileExpression(item->tree, variables); });
+			it = item->programs.emplace(key, std::move(compiled)).first;
+		}
+		return it->second;
+	}
+
+	LR_NODISCARD("") Stats stats() const {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Stats res;
+		res.hits	  = m_hits.load();
+		res.misses	  = m_misses.load();
+		res.evictions = m_entries.evictions();
+		res.size	  = m_entries.size();
+		return res;
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_entries.clear();
+	}
+
+	// Also keep results on disk. Pass nullptr to stop using the disk cache
+	void setDiskCache(std::shared_ptr<DiskCache> disk) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_disk = std::move(disk);
+	}
+
+	LR_NODISCARD("") std::shared_ptr<DiskCache> diskCache() const {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_disk;
+	}
+
+private:
+	struct Entry {
+		std::string key;
+		std::shared_ptr<Component> tree;
+
+		// Guards the fields below, which are filled in on first use
+		std::mutex mutex;
+		std::shared_ptr<Component> simplified;
+		std::map<std::string, std::shared_ptr<Component>> derivatives;
+		std::map<std::string, std::shared_ptr<const Program>> programs;
+	};
+
+	void countLookup(bool hit) { ++(hit ? m_hits : m_misses); }
+
+	// Load a tree from the disk cache, or compute it and save it there
+	template<typename Compute>
+	std::shared_ptr<Component> persistentTree(const std::string &key,
+											  Compute &&compute) {
+		auto disk = diskCache();
+		if (!disk) return compute();
+		if (auto res = disk->loadTree(key)) return res;
+
+		auto res = compute();
+		disk->storeTree(key, res);
+		return res;
+	}
+
+	template<typename Compute>
+	std::shared_ptr<const Program> persistentProgram(const std::string &key,
+													 Compute &&compute) {
+		auto disk = diskCache();
+		if (disk) {
+			if (auto res = disk->loadProgram(key)) return res;
+		}
+
+		auto res = std::make_shared<const Program>(compute());
+		if (disk) disk->storeProgram(key, *res);
+		return res;
+	}
+
+	// The entry for an expression, parsing it if it is not in the cache.
+	// ``hit`` is set to whether it was
+	std::shared_ptr<Entry> entry(const std::string &expression, bool &hit) {
+		std::string key	 = normalize(expression);
+		uint64_t version = registry().version();
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (version != m_version) {
+				m_entries.clear();
+				m_version = version;
+			}
+
+			if (auto *found = m_entries.find(key)) {
+				hit = true;
+				return *found;
+			}
+		}
+
+		// Parse without holding the lock. If another thread parses the same
+		// expression at the same time, the first to finish is kept
+		hit		  = false;
+		auto res  = std::make_shared<Entry>();
+		res->key  = key;
+		res->tree = autoParse(key);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_entries.insert(key, std::move(res));
+	}
+
+	mutable std::mutex m_mutex;
+	LruCache<std::string, std::shared_ptr<Entry>> m_entries;
+	uint64_t m_version = 0;
+	std::shared_ptr<DiskCache> m_disk;
+
+	std::atomic<uint64_t> m_hits {0};
+	std::atomic<uint64_t> m_misses {0};
+};
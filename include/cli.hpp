@@ -0,0 +1,513 @@
+#pragma once
+
+inline constexpr const char *usage = R"(Usage:
+  SymboMath                       Run the demo
+  SymboMath eval EXPR [options]   Evaluate EXPR for each row of the input
+  SymboMath serve -s PATH [options]
+                                  Serve evaluation requests on a socket
+  SymboMath client EXPR -s PATH [options]
+                                  Like eval, but evaluate on a server
+  SymboMath loadgen EXPR -s PATH [options]
+                                  Measure the throughput of a server
+  SymboMath range EXPR X=LO:HI ...
+                                  Print bounds on EXPR for X in [LO, HI]
+  SymboMath plot EXPR X=LO:HI [options]
+                                  Sample EXPR for X in [LO, HI], with more
+                                  points where it curves
+
+Options for eval and client:
+  -i, --input PATH     Read the input from PATH instead of stdin
+  -o, --output PATH    Write the results to PATH instead of stdout
+  -f, --format FORMAT  csv (default) or binary
+  --vars X,Y,...       The fields of each binary record (default: the
+                       variables of EXPR, in sorted order)
+  --chunk ROWS         Rows evaluated at once (default: 4096)
+  -p, --precision P    Evaluate in float, double (default) or mpfr (eval
+                       only)
+  -a, --accuracy A     1ulp (default) or 4ulp: the largest error of the
+                       standard functions in float and double (eval only)
+  --cache-dir PATH     Keep compiled expressions in PATH, and reuse those
+                       saved by earlier runs (eval only)
+  -s, --socket PATH    The server's socket (client only)
+
+Options for serve:
+  --batch-wait US      How long to wait for more requests before running a
+                       batch (default: 0; requests which arrive while a
+                       batch is running are still batched together)
+  --max-batch ROWS     Rows at which a batch is run without waiting
+                       (default: 65536)
+  --max-connections N  Clients served at once; others wait to be accepted
+                       (default: 64)
+  --cache-dir PATH     Keep compiled expressions in PATH, and reuse those
+                       saved by earlier runs
+
+Options for loadgen:
+  --clients N          Concurrent connections (default: 4)
+  --requests N         Requests per connection (default: 1000)
+  --rows N             Rows per request (default: 16)
+
+Options for plot:
+  -o, --output PATH    Write the points to PATH instead of stdout
+  --tolerance T        The largest distance between EXPR and the lines
+                       joining the points, as a fraction of its range
+                       (default: 0.001)
+  --intervals N        Evenly spaced intervals sampled first (default: 64)
+  --max-depth D        The most times an interval is halved, at most 52
+                       (default: 16)
+)";
+
+struct EvalOptions {
+	std::string expression;
+	std::string input;
+	std::string output;
+	std::string format = "csv";
+	std::vector<std::string> variables;
+	size_t chunkRows	= 4096;
+	Precision precision = Precision::FLOAT64;
+	Accuracy accuracy	= Accuracy::ULP1;
+	std::string cacheDir;
+	std::string socket;
+};
+
+// Split a comma-separated list, trimming spaces around each item
+inline std::vector<std::string> splitList(const std::string &list) {
+	std::vector<std::string> res;
+	std::string_view rest = list;
+	while (true) {
+		size_t end			  = rest.find(',');
+		std::string_view item = rest.substr(0, end);
+		size_t first		  = item.find_first_not_of(" \t\r");
+		size_t last			  = item.find_last_not_of(" \t\r");
+		if (first == item.npos)
+			res.emplace_back();
+		else
+			res.emplace_back(item.substr(first, last - first + 1));
+
+		if (end == rest.npos) break;
+		rest.remove_prefix(end + 1);
+	}
+	return res;
+}
+
+// The value of the option at args[i], advancing i past it
+inline const std::string &optionValue(const std::vector<std::string> &args,
+									  size_t &i) {
+	LR_ASSERT(i + 1 < args.size(), "Missing value for {}", args[i]);
+	return args[++i];
+}
+
+/**
+ * The whole number given for ``option``, which must be in [minimum, maximum].
+ * Unlike std::stoull, a sign or trailing characters are an error, so -1
+ * does not wrap to 2^64 - 1
+ */
+inline uint64_t
+parseCountOption(const std::string &option, const std::string &text,
+				 uint64_t minimum = 1,
+				 uint64_t maximum = std::numeric_limits<uint64_t>::max()) {
+	uint64_t res	  = 0;
+	const char *last  = text.data() + text.size();
+	auto [end, error] = std::from_chars(text.data(), last, res);
+	LR_ASSERT(!text.empty() && error != std::errc::invalid_argument &&
+				end == last,
+			  "{} must be a whole number, got '{}'",
+			  option,
+			  text);
+	LR_ASSERT(error == std::errc() && res >= minimum && res <= maximum,
+			  "{} must be between {} and {}, got '{}'",
+			  option,
+			  minimum,
+			  maximum,
+			  text);
+	return res;
+}
+
+inline EvalOptions parseEvalOptions(const std::vector<std::string> &args) {
+	EvalOptions res;
+	for (size_t i = 0; i < args.size(); ++i) {
+		const std::string &arg = args[i];
+		auto value			   = [&]() { return optionValue(args, i); };
+
+		if (arg == "-i" || arg == "--input") {
+			res.input = value();
+		} else if (arg == "-o" || arg == "--output") {
+			res.output = value();
+		} else if (arg == "-f" || arg == "--format") {
+			res.format = value();
+			LR_ASSERT(res.format == "csv" || res.format == "binary",
+					  "Unknown format '{}'",
+					  res.format);
+		} else if (arg == "--vars") {
+			res.variables = splitList(value());
+		} else if (arg == "--chunk") {
+			res.chunkRows = parseCountOption(arg, value());
+		} else if (arg == "-p" || arg == "--precision") {
+			res.precision = parsePrecision(value());
+		} else if (arg == "-a" || arg == "--accuracy") {
+			res.accuracy = parseAccuracy(value());
+		} else if (arg == "--cache-dir") {
+			res.cacheDir = value();
+		} else if (arg == "-s" || arg == "--socket") {
+			res.socket = value();
+		} else {
+			LR_ASSERT(res.expression.empty(), "Unexpected argument '{}'", arg);
+			res.expression = arg;
+		}
+	}
+
+	LR_ASSERT(!res.expression.empty(), "No expression given");
+	return res;
+}
+
+/**
+ * Evaluates a Program in T over a stream of rows, a chunk at a time, so the
+ * memory used does not depend on the length of the input. The values of each
+ * row are set with value() and added with row(), and flush() evaluates the
+ * chunk, with standard functions to the given accuracy
+ */
+template<typename T = Scalar>
+class ChunkEvaluator {
+public:
+	ChunkEvaluator(Program program, size_t chunkRows,
+				   Accuracy accuracy = Accuracy::ULP1) :
+			m_program(std::move(program)), m_chunkRows(chunkRows),
+			m_accuracy(accuracy),
+			m_columns(m_program.variables().size(), std::vector<T>(chunkRows)),
+			m_results(chunkRows) {
+		for (const auto &column : m_columns)
+			m_pointers.emplace_back(column.data());
+	}
+
+	LR_NODISCARD("") bool full() const { return m_rows == m_chunkRows; }
+
+	// The values of the next row, one per variable of the program
+	LR_NODISCARD("") T &value(size_t variable) {
+		return m_columns[variable][m_rows];
+	}
+
+	void row() { ++m_rows; }
+
+	// Evaluate the rows added since the last flush, returning their results
+	std::pair<const T *, size_t> flush() {
+		size_t rows = m_rows;
+		m_program.run(
+		  m_pointers, rows, m_results.data(), m_workspace, m_accuracy);
+		m_rows = 0;
+		return {m_results.data(), rows};
+	}
+
+private:
+	Program m_program;
+	size_t m_chunkRows;
+	Accuracy m_accuracy;
+	std::vector<std::vector<T>> m_columns;
+	std::vector<const T *> m_pointers;
+	std::vector<T> m_results;
+	std::vector<T> m_workspace;
+	size_t m_rows = 0;
+};
+
+// CSV input has a header naming each column. Each result is written on its
+// own line, under the header "result". ``makeEvaluator(names)`` creates the
+// evaluator (see ChunkEvaluator) for the given columns
+template<typename MakeEvaluator>
+void evalCsv(std::istream &in, std::ostream &out,
+			 MakeEvaluator &&makeEvaluator) {
+	std::string line;
+	LR_ASSERT(std::getline(in, line), "Missing CSV header");
+	auto names = splitList(line);
+
+	auto evaluator = makeEvaluator(names);
+	fmt::memory_buffer buffer;
+
+	auto flush = [&]() {
+		auto [results, rows] = evaluator.flush();
+		for (size_t i = 0; i < rows; ++i)
+			fmt::format_to(std::back_inserter(buffer), "{}\n", results[i]);
+		out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+		buffer.clear();
+	};
+
+	out << "result\n";
+	for (size_t lineNumber = 2; std::getline(in, line); ++lineNumber) {
+		if (line.find_first_not_of(" \t\r") == line.npos) continue;
+
+		const char *pos = line.c_str();
+		for (size_t i = 0; i < names.size(); ++i) {
+			char *end;
+			double value = std::strtod(pos, &end);
+			LR_ASSERT(end != pos, "Invalid number on line {}", lineNumber);
+
+			pos = end;
+			while (*pos == ' ' || *pos == '\t' || *pos == '\r') ++pos;
+			bool last = i + 1 == names.size();
+			LR_ASSERT(last ? *pos == '\0' : *pos == ',',
+					  "Line {} does not have {} fields",
+					  lineNumber,
+					  names.size());
+			if (!last) ++pos;
+
+			evaluator.value(i) = value;
+		}
+
+		evaluator.row();
+		if (evaluator.full()) flush();
+	}
+
+	flush();
+}
+
+// Binary input is a sequence of records, each holding one native-endian
+// double per variable. Each result is written as a double
+template<typename MakeEvaluator>
+void evalBinary(const std::shared_ptr<Component> &tree,
+				const EvalOptions &options, std::istream &in, std::ostream &out,
+				MakeEvaluator &&makeEvaluator) {
+	auto names = options.variables;
+	if (names.empty()) {
+		const auto &constants = registry().constants();
+		for (const auto &name : variableNames(tree)) {
+			if (constants.find(name) == constants.end())
+				names.emplace_back(name);
+		}
+	}
+
+	LR_ASSERT(!names.empty(), "Binary input needs at least one variable");
+
+	size_t numFields = names.size();
+	auto evaluator	 = makeEvaluator(names);
+	std::vector<double> records(options.chunkRows * numFields);
+	std::vector<double> results(options.chunkRows);
+
+	while (in) {
+		in.read(reinterpret_cast<char *>(records.data()),
+				static_cast<std::streamsize>(records.size() * sizeof(double)));
+		auto bytes = static_cast<size_t>(in.gcount());
+		LR_ASSERT(bytes % (numFields * sizeof(double)) == 0,
+				  "Input ends with an incomplete record");
+
+		size_t rows = bytes / (numFields * sizeof(double));
+		for (size_t row = 0; row < rows; ++row) {
+			for (size_t i = 0; i < numFields; ++i)
+				evaluator.value(i) = records[row * numFields + i];
+			evaluator.row();
+		}
+
+		auto [values, count] = evaluator.flush();
+		for (size_t i = 0; i < count; ++i)
+			results[i] = static_cast<double>(values[i]);
+		out.write(reinterpret_cast<const char *>(results.data()),
+				  static_cast<std::streamsize>(count * sizeof(double)));
+	}
+}
+
+// Stream the input given by ``options`` through an evaluator, in either format
+template<typename MakeEvaluator>
+void evalStream(const EvalOptions &options,
+				const std::shared_ptr<Component> &tree,
+				MakeEvaluator &&makeEvaluator) {
+	std::ifstream inFile;
+	std::ofstream outFile;
+	std::istream *in  = &std::cin;
+	std::ostream *out = &std::cout;
+
+	if (!options.input.empty()) {
+		inFile.open(options.input, std::ios::binary);
+		LR_ASSERT(inFile.is_open(), "Could not open file '{}'", options.input);
+		in = &inFile;
+	}
+
+	if (!options.output.empty()) {
+		outFile.open(options.output, std::ios::binary);
+		LR_ASSERT(
+		  outFile.is_open(), "Could not open file '{}'", options.output);
+		out = &outFile;
+	}
+
+	std::ios::sync_with_stdio(false);
+	if (options.format == "csv")
+		evalCsv(*in, *out, makeEvaluator);
+	else
+		evalBinary(tree, options, *in, *out, makeEvaluator);
+
+	out->flush();
+}
+
+/**
+ * ``SymboMath eval EXPR``: evaluate an expression for each row of a CSV or
+ * binary input, streaming the results to the output. The expression is
+ * compiled once (see compileExpression()), or loaded from the cache directory
+ * if one is given, and evaluated a chunk of rows at a time in the chosen
+ * precision and accuracy
+ */
+inline int evalCommand(const std::vector<std::string> &args) {
+	EvalOptions options = parseEvalOptions(args);
+	auto &cache			= ExpressionCache::global();
+	if (!options.cacheDir.empty())
+		cache.setDiskCache(std::make_shared<DiskCache>(options.cacheDir));
+
+	auto tree = cache.parse(options.expression);
+	withPrecision(options.precision, [&](auto zero) {
+		using T = decltype(zero);
+		evalStream(options, tree, [&](const std::vector<std::string> &names) {
+			return ChunkEvaluator<T>(*cache.program(options.expression, names),
+									 options.chunkRows,
+									 options.accuracy);
+		});
+	});
+	return 0;
+}
+
+// A range of a variable given as X=LO:HI, or X=V for the single value V
+struct RangeArgument {
+	std::string name;
+	double lower;
+	double upper;
+};
+
+// A number given in ``arg``. Unlike std::stod, trailing characters are an
+// error, so X=-1,2 is not read as X=-1
+inline double parseNumberArgument(const std::string &text,
+								  const std::string &arg) {
+	size_t end = 0;
+	double res = 0;
+	try {
+		res = std::stod(text, &end);
+	} catch (const std::exception &) { end = 0; }
+	LR_ASSERT(end > 0 && end == text.size(),
+			  "Expected a number, got '{}' in '{}'",
+			  text,
+			  arg);
+	return res;
+}
+
+inline RangeArgument parseRangeArgument(const std::string &arg) {
+	size_t equals = arg.find('=');
+	LR_ASSERT(equals != arg.npos && equals > 0,
+			  "Expected X=LO:HI, got '{}'",
+			  arg);
+
+	std::string range = arg.substr(equals + 1);
+	size_t colon	  = range.find(':');
+	double lower	  = parseNumberArgument(range.substr(0, colon), arg);
+	double upper	  = colon == range.npos
+						? lower
+						: parseNumberArgument(range.substr(colon + 1), arg);
+	LR_ASSERT(lower <= upper, "Empty range '{}'", arg);
+	return {arg.substr(0, equals), lower, upper};
+}
+
+/**
+ * ``SymboMath range EXPR X=LO:HI ...``: print an interval containing every
+ * value of an expression for its variables in the given ranges (see
+ * evalInterval()). ``X=V`` gives X the single value V
+ */
+inline int rangeCommand(const std::vector<std::string> &args) {
+	LR_ASSERT(!args.empty(), "No expression given");
+
+	std::map<std::string, Interval> box;
+	for (size_t i = 1; i < args.size(); ++i) {
+		auto range		= parseRangeArgument(args[i]);
+		box[range.name] = Interval(range.lower, range.upper);
+	}
+
+	auto tree = ExpressionCache::global().parse(args[0]);
+	fmt::print("{}\n", evalInterval(tree, box));
+	return 0;
+}
+
+/**
+ * ``SymboMath plot EXPR X=LO:HI``: sample an expression of one variable with
+ * AdaptiveSampler, writing a CSV row of X and the result for each point
+ */
+inline int plotCommand(const std::vector<std::string> &args) {
+	std::string expression;
+	std::string output;
+	std::optional<RangeArgument> range;
+	SamplerOptions options;
+	for (size_t i = 0; i < args.size(); ++i) {
+		const std::string &arg = args[i];
+		auto value			   = [&]() { return optionValue(args, i); };
+
+		if (arg == "-o" || arg == "--output") {
+			output = value();
+		} else if (arg == "--tolerance") {
+			options.tolerance = parseNumberArgument(value(), arg);
+			LR_ASSERT(options.tolerance >= 0,
+					  "--tolerance must not be negative");
+		} else if (arg == "--intervals") {
+			options.initialIntervals = parseCountOption(
+			  arg, value(), 1, SamplerOptions::maxInitialIntervals);
+		} else if (arg == "--max-depth") {
+			options.maxDepth =
+			  parseCountOption(arg, value(), 0, SamplerOptions::maxDepthLimit);
+		} else if (expression.empty()) {
+			expression = arg;
+		} else {
+			LR_ASSERT(!range, "Unexpected argument '{}'", arg);
+			range = parseRangeArgument(arg);
+		}
+	}
+
+	LR_ASSERT(!expression.empty(), "No expression given");
+	LR_ASSERT(range.has_value(), "No range given");
+
+	auto tree = ExpressionCache::global().parse(expression);
+	AdaptiveSampler sampler(tree, range->name, options);
+
+	std::ofstream outFile;
+	std::ostream *out = &std::cout;
+	if (!output.empty()) {
+		outFile.open(output, std::ios::binary);
+		LR_ASSERT(outFile.is_open(), "Could not open file '{}'", output);
+		out = &outFile;
+	}
+
+	std::ios::sync_with_stdio(false);
+	fmt::memory_buffer buffer;
+	auto flush = [&]() {
+		out->write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+		buffer.clear();
+	};
+
+	fmt::format_to(std::back_inserter(buffer), "{},result\n", range->name);
+	auto stats =
+	  sampler.sample(range->lower, range->upper, [&](double x, double y) {
+		  fmt::format_to(std::back_inserter(buffer), "{},{}\n", x, y);
+		  if (buffer.size() >= 65536) flush();
+	  });
+
+	flush();
+	out->flush();
+	if (stats.truncated > 0) {
+		fmt::print(stderr,
+				   "Warning: the tolerance was not met in {} windows, which "
+				   "would need too many points\n",
+				   stats.truncated);
+	}
+	return 0;
+}
+
+// Defined in server.hpp
+inline int serveCommand(const std::vector<std::string> &args);
+inline int clientCommand(const std::vector<std::string> &args);
+inline int loadgenCommand(const std::vector<std::string> &args);
+
+// Run the command given on the command line, returning the exit code
+inline int runCommand(const std::vector<std::string> &args) {
+	try {
+		std::vector<std::string> rest(args.begin() + 1, args.end());
+		if (args[0] == "eval") return evalCommand(rest);
+		if (args[0] == "serve") return serveCommand(rest);
+		if (args[0] == "client") return clientCommand(rest);
+		if (args[0] == "loadgen") return loadgenCommand(rest);
+		if (args[0] == "range") return rangeCommand(rest);
+		if (args[0] == "plot") return plotCommand(rest);
+	} catch (const std::exception &e) {
+		fmt::print(stderr, "Error: {}\n", e.what());
+		return 1;
+	}
+
+	fmt::print(stderr, "{}", usage);
+	return 1;
+}
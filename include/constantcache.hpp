@@ -0,0 +1,116 @@
+#pragma once
+
+/**
+ * Named constants such as pi and e, computed at whatever precision they are
+ * needed in rather than parsed from a decimal string at the precision set
+ * when they were registered. A value is computed the first time its precision
+ * is asked for and then kept, so later uses at the same precision neither
+ * parse nor compute it again. Values are never removed, so references to them
+ * stay valid, and the cache may be used from any thread.
+ *
+ * The names registered with registerConstants() decide which variables are
+ * constants; the cache only supplies the values of those it defines (see
+ * constantTree())
+ */
+class ConstantCache {
+public:
+	// Computes the constant at the default MPFR precision
+	using Definition = std::function<lrc::mpfr()>;
+
+	ConstantCache() {
+		define("pi", []() {
+			lrc::mpfr res;
+			mpfr_const_pi(res.mpfr_ptr(), lrc::mpfr::get_default_rnd());
+			return res;
+		});
+
+		define("e", []() {
+			lrc::mpfr res(1);
+			mpfr_exp(res.mpfr_ptr(),
+					 res.mpfr_srcptr(),
+					 lrc::mpfr::get_default_rnd());
+			return res;
+		});
+	}
+
+	ConstantCache(const ConstantCache &)			= delete;
+	ConstantCache &operator=(const ConstantCache &) = delete;
+
+	static ConstantCache &global() {
+		static ConstantCache cache;
+		return cache;
+	}
+
+	// Constants cannot be redefined, since their values may be in use
+	void define(const std::string &name, Definition definition) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		bool added = m_definitions.emplace(name, std::move(definition)).second;
+		LR_ASSERT(added, "Constant {} is already defined", name);
+	}
+
+	LR_NODISCARD("") bool defines(const std::string &name) const {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_definitions.find(name) != m_definitions.end();
+	}
+
+	// The constant to ``bits`` bits of precision
+	const lrc::mpfr &value(const std::string &name, int64_t bits) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return valueLocked(name, bits);
+	}
+
+	// A NUMBER node holding the constant as a Scalar, at the current precision
+	// if Scalar is lrc::mpfr. The same node is returned for each precision.
+	// The node is named (see Number::constant()), so a Program looks the
+	// constant up again in the precision it is run in
+	std::shared_ptr<Component> node(const std::string &name) {
+		int64_t bits = scalarPrecision();
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_nodes.find({name, bits});
+		if (it == m_nodes.end()) {
+			auto value = scalarCast<Scalar>(valueLocked(name, bits));
+			auto node  = std::make_shared<Number>(value, name);
+			it = m_nodes.emplace(std::make_pair(name, bits), node).first;
+		}
+		return it->second;
+	}
+
+	// The precision of a Scalar, in bits
+	static int64_t scalarPrecision() {
+		if constexpr (std::is_same_v<Scalar, lrc::mpfr>) {
+			return static_cast<int64_t>(lrc::mpfr::get_default_prec());
+		} else {
+			return std::numeric_limits<Scalar>::digits;
+		}
+	}
+
+private:
+	const lrc::mpfr &valueLocked(const std::string &name, int64_t bits) {
+		auto key = std::make_pair(name, bits);
+		auto it	 = m_values.find(key);
+		if (it != m_values.end()) return it->second;
+
+		auto definition = m_definitions.find(name);
+		LR_ASSERT(definition != m_definitions.end(),
+				  "Constant {} is not defined",
+				  name);
+
+		MpfrPrecisionScope scope(bits);
+		return m_values.emplace(key, definition->second()).first->second;
+	}
+
+	mutable std::mutex m_mutex;
+	std::map<std::string, Definition> m_definitions;
+	std::map<std::pair<std::string, int64_t>, lrc::mpfr> m_values;
+	std::map<std::pair<std::string, int64_t>, std::shared_ptr<Component>>
+	  m_nodes;
+};
+
+// The tree to substitute for the registered constant ``name``: the cached
+// value if the cache defines it, otherwise the registered tree
+inline std::shared_ptr<Component>
+constantTree(const std::string &name,
+			 const std::shared_ptr<Component> &registered) {
+	auto &cache = ConstantCache::global();
+	return cache.defines(name) ? cache.node(name) : registered;
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+// Increment when a change to the parser, simplification, differentiation or
+// compilation changes their results, so files saved by older builds are not
+// loaded
+inline constexpr uint32_t diskCacheVersion = 3;
+
+// 64-bit FNV-1a hash
+inline uint64_t fnv1a(std::string_view data,
+					  uint64_t hash = 14695981039346656037ull) {
+	for (char c : data) {
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+/**
+ * A hash of everything other than the expression which cached results depend
+ * on: diskCacheVersion, the Scalar type, and the functions, constants and
+ * rules in the registry
+ */
+inline std::string registryFingerprint(const Registry &snapshot) {
+	std::string desc =
+	  fmt::format("{};{};", diskCacheVersion, typeid(Scalar).name());
+	for (const auto &func : snapshot.functions()) {
+		desc += fmt::format(
+		  "{};{};{};", func->name(), func->format(), func->numOperands());
+	}
+	for (const auto &constant : snapshot.constants())
+		desc += fmt::format(
+		  "{}={};", constant.first, prettyPrint(constant.second));
+	for (const auto &rule : snapshot.derivativeRules())
+		desc += fmt::format("{};", typeid(*rule).name());
+	for (const auto &rule : snapshot.simplificationRules())
+		desc += fmt::format("{};", typeid(*rule).name());
+	return fmt::format("{:016x}", fnv1a(desc));
+}
+
+/**
+ * Saves simplified trees, derivatives and compiled programs to a directory, so
+ * that a restarted process can load them rather than compute them again. Each
+ * result is a file named by a hash of its key and the registryFingerprint(),
+ * holding a serialized tree or program (see serialize.hpp), which is mapped
+ * into memory to load it.
+ *
+ * A file also holds the full key it was saved under and is only used if that
+ * matches, so hash collisions and files saved by another build or with other
+ * registered functions are ignored. Missing, corrupt and partly written files
+ * are treated as misses. Files are written under a temporary name and renamed
+ * into place, so several processes may share a directory.
+ */
+class DiskCache {
+public:
+	struct Stats {
+		uint64_t hits		  = 0;
+		uint64_t misses		  = 0;
+		uint64_t writes		  = 0; // Files saved and renamed into place
+		uint64_t errors		  = 0; // Files which were corrupt
+		uint64_t failedWrites = 0; // Files which could not be saved
+	};
+
+	explicit DiskCache(std::string directory) :
+			m_directory(std::move(directory)) {
+#if defined(_WIN32)
+		int status = ::_mkdir(m_directory.c_str());
+#else
+		int status = ::mkdir(m_directory.c_str(), 0755);
+#endif
+		LR_ASSERT(status == 0 || errno == EEXIST,
+				  "Could not create directory '{}'",
+				  m_directory);
+	}
+
+	LR_NODISCARD("") const std::string &directory() const {
+		return m_directory;
+	}
+
+	// The tree saved under ``key``, or nullptr if there is none
+	std::shared_ptr<Component> loadTree(const std::string &key) {
+		return load<std::shared_ptr<Component>>(
+		  key, Kind::TREE, [](std::string_view data) {
+			  return MappedExpression(data.data(), data.size()).toTree();
+		  });
+	}
+
+	void storeTree(const std::string &key,
+				   const std::shared_ptr<Component> &tree) {
+		store(key, Kind::TREE, serializeExpression(tree));
+	}
+
+	// The program saved under ``key``, or nullptr if there is none
+	std::shared_ptr<const Program> loadProgram(const std::string &key) {
+		return load<std::shared_ptr<const Program>>(
+		  key, Kind::PROGRAM, [](std::string_view data) {
+			  return std::make_shared<const Program>(
+				Program::deserialize(data));
+		  });
+	}
+
+	void storeProgram(const std::string &key, const Program &program) {
+		store(key, Kind::PROGRAM, program.serialize());
+	}
+
+	LR_NODISCARD("") Stats stats() const {
+		Stats res;
+		res.hits		 = m_hits.load();
+		res.misses		 = m_misses.load();
+		res.writes		 = m_writes.load();
+		res.errors		 = m_errors.load();
+		res.failedWrites = m_failedWrites.load();
+		return res;
+	}
+
+private:
+	enum class Kind : uint32_t { TREE, PROGRAM };
+
+	// The file is this header, the key, then the payload at payloadOffset
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		Kind kind;
+		uint64_t keyLength;
+		uint64_t payloadOffset;
+		uint64_t payloadSize;
+	};
+
+	static constexpr char fileMagic[8] = {
+	  'S', 'Y', 'M', 'C', 'A', 'C', 'H', 'E'};
+
+	// The key with the fingerprint of the current registry appended
+	std::string fullKey(const std::string &key) {
+		const Registry &snapshot = registry();
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_fingerprint.empty() || m_version != snapshot.version()) {
+			m_fingerprint = registryFingerprint(snapshot);
+			m_version	  = snapshot.version();
+		}
+		return key + '\0' + m_fingerprint;
+	}
+
+	LR_NODISCARD("") std::string path(const std::string &fullKey) const {
+		return fmt::format("{}/{:016x}.symc", m_directory, fnv1a(fullKey));
+	}
+
+	// Whether ``data`` is a file of the given kind saved under ``fullKey``,
+	// setting ``payload`` to its contents if it is
+	static bool matches(std::string_view data, Kind kind,
+						const std::string &fullKey, std::string_view &payload) {
+		if (data.size() < sizeof(FileHeader)) return false;
+		const auto &header = *reinterpret_cast<const FileHeader *>(data.data());
+		if (!std::equal(fileMagic, fileMagic + 8, header.magic) ||
+			header.version != diskCacheVersion || header.kind != kind ||
+			header.keyLength != fullKey.size())
+			return false;
+
+		uint64_t keyEnd = sizeof(FileHeader) + fullKey.size();
+		if (header.payloadOffset % 8 != 0 || header.payloadOffset < keyEnd ||
+			header.payloadOffset > data.size() ||
+			header.payloadSize > data.size() - header.payloadOffset ||
+			data.substr(sizeof(FileHeader), fullKey.size()) != fullKey)
+			return false;
+
+		payload = data.substr(header.payloadOffset, header.payloadSize);
+		return true;
+	}
+
+	template<typename Result, typename Decode>
+	Result load(const std::string &key, Kind kind, Decode &&decode) {
+		std::string name = fullKey(key);
+		std::string file = path(name);
+
+		std::shared_ptr<MappedFile> mapped;
+		try {
+			mapped = std::make_shared<MappedFile>(file);
+		} catch (const std::exception &) {
+			++m_misses;
+			return nullptr;
+		}
+
+		std::string_view payload;
+		if (!matches(mapped->view(), kind, name, payload)) {
+			++m_misses;
+			return nullptr;
+		}
+
+		try {
+			Result res = decode(payload);
+			++m_hits;
+			return res;
+		} catch (const std::exception &) {
+			++m_misses;
+			++m_errors;
+			return nullptr;
+		}
+	}
+
+	void store(const std::string &key, Kind kind, const std::string &payload) {
+		std::string name = fullKey(key);
+		std::string file = path(name);
+
+		FileHeader header {};
+		std::copy_n(fileMagic, 8, header.magic);
+		header.version		 = diskCacheVersion;
+		header.kind			 = kind;
+		header.keyLength	 = name.size();
+		header.payloadOffset = (sizeof(FileHeader) + name.size() + 7) & ~7ull;
+		header.payloadSize	 = payload.size();
+
+		std::string data(header.payloadOffset, '\0');
+		std::memcpy(data.data(), &header, sizeof(header));
+		std::memcpy(data.data() + sizeof(header), name.data(), name.size());
+		data += payload;
+
+		static thread_local std::mt19937_64 rng {std::random_device {}()};
+		std::string temporary = fmt::format("{}.{:016x}.tmp", file, rng());
+		std::ofstream out(temporary, std::ios::binary);
+		out.write(data.data(), static_cast<std::streamsize>(data.size()));
+		out.close();
+		if (!out) {
+			std::remove(temporary.c_str());
+			++m_failedWrites;
+			return;
+		}
+
+		// Renaming fails on Windows if another process saved the same result
+		// first, in which case its file is kept
+		if (std::rename(temporary.c_str(), file.c_str()) != 0) {
+			std::remove(temporary.c_str());
+			++m_failedWrites;
+			return;
+		}
+		++m_writes;
+	}
+
+	std::string m_directory;
+
+	std::mutex m_mutex;
+	std::string m_fingerprint;
+	uint64_t m_version = 0;
+
+	std::atomic<uint64_t> m_hits {0};
+	std::atomic<uint64_t> m_misses {0};
+	std::atomic<uint64_t> m_writes {0};
+	std::atomic<uint64_t> m_errors {0};
+	std::atomic<uint64_t> m_failedWrites {0};
+};
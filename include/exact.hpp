@@ -0,0 +1,442 @@
+#pragma once
+
+// Overflow-checked 64-bit arithmetic, returning false on overflow
+inline bool checkedAdd(int64_t a, int64_t b, int64_t &res) {
+#if defined(__GNUC__) || defined(__clang__)
+	return !__builtin_add_overflow(a, b, &res);
+#else
+	if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b))
+		return false;
+	res = a + b;
+	return true;
+#endif
+}
+
+inline bool checkedMul(int64_t a, int64_t b, int64_t &res) {
+#if defined(__GNUC__) || defined(__clang__)
+	return !__builtin_mul_overflow(a, b, &res);
+#else
+	if (a != 0 && b != 0) {
+		if (a == -1 || b == -1) {
+			if (a == INT64_MIN || b == INT64_MIN) return false;
+		} else if (std::abs(a) > INT64_MAX / std::abs(b)) {
+			return false;
+		}
+	}
+	res = a * b;
+	return true;
+#endif
+}
+
+// 64-bit integers to and from GMP integers, which only take a long directly
+inline void mpzFromInt64(mpz_ptr out, int64_t value) {
+	uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value)
+								   : static_cast<uint64_t>(value);
+	mpz_import(out, 1, 1, sizeof(magnitude), 0, 0, &magnitude);
+	if (value < 0) mpz_neg(out, out);
+}
+
+// False if the value does not fit in (INT64_MIN, INT64_MAX]
+inline bool mpzToInt64(mpz_srcptr value, int64_t &out) {
+	if (mpz_sizeinbase(value, 2) > 63) return false;
+	uint64_t magnitude = 0;
+	mpz_export(&magnitude, nullptr, 1, sizeof(magnitude), 0, 0, value);
+	out = static_cast<int64_t>(magnitude);
+	if (mpz_sgn(value) < 0) out = -out;
+	return true;
+}
+
+// A GMP rational rounded to the nearest double or lrc::mpfr
+inline void roundRational(mpq_srcptr value, double &out) {
+	mpfr_t res;
+	mpfr_init2(res, 53);
+	mpfr_set_q(res, value, MPFR_RNDN);
+	out = mpfr_get_d(res, MPFR_RNDN);
+	mpfr_clear(res);
+}
+
+inline void roundRational(mpq_srcptr value, lrc::mpfr &out) {
+	mpfr_set_q(out.mpfr_ptr(), value, MPFR_RNDN);
+}
+
+// A GMP rational, freed when the last Rational sharing it is destroyed
+class BigRational {
+public:
+	BigRational() { mpq_init(m_value); }
+	BigRational(const BigRational &)			= delete;
+	BigRational &operator=(const BigRational &) = delete;
+	~BigRational() { mpq_clear(m_value); }
+
+	mpq_ptr get() { return m_value; }
+	LR_NODISCARD("") mpq_srcptr get() const { return m_value; }
+
+private:
+	mpq_t m_value;
+};
+
+// Integer powers of exact numbers above this are not computed, since their
+// size grows with the power
+inline constexpr int64_t maxExactPower = 64;
+
+/**
+ * An exact rational number, used by Number so that symbolic work on
+ * integers and fractions does not accumulate rounding error. Numerators and
+ * denominators which fit in 64 bits are stored inline, so arithmetic on them
+ * does not allocate; a result which does not fit is promoted to a GMP
+ * rational, and demoted again by later results which fit.
+ *
+ * Values are always in lowest terms with a positive denominator, and only
+ * stored as a GMP rational if they do not fit inline.
+ */
+class Rational {
+public:
+	Rational() = default;
+
+	Rational(int64_t value) {
+		if (value == INT64_MIN) {
+			*this = fromBig([&](mpq_ptr res) {
+				mpzFromInt64(mpq_numref(res), value);
+			});
+		} else {
+			m_numerator = value;
+		}
+	}
+
+	Rational(int64_t numerator, int64_t denominator) {
+		LR_ASSERT(denominator != 0, "Division by zero");
+		if (numerator == INT64_MIN || denominator == INT64_MIN) {
+			*this = fromBig([&](mpq_ptr res) {
+				mpzFromInt64(mpq_numref(res), numerator);
+				mpzFromInt64(mpq_denref(res), denominator);
+				mpq_canonicalize(res);
+			});
+			return;
+		}
+
+		int64_t divisor = std::gcd(numerator, denominator);
+		if (denominator < 0) divisor = -divisor;
+		m_numerator	  = numerator / divisor;
+		m_denominator = denominator / divisor;
+	}
+
+	/**
+	 * The exact value of a decimal literal such as "12", "0.125" or
+	 * "1.5e-3", or nullopt if ``text`` is not one or its exponent is too
+	 * large to hold exactly
+	 */
+	static std::optional<Rational> parse(std::string_view text) {
+		// The digits are read straight from ``text``. Literals of up to 18
+		// significant digits are accumulated into an int64_t, and only longer
+		// ones are copied into a string for GMP
+		int64_t mantissa   = 0;
+		int64_t exponent   = 0;
+		size_t numDigits   = 0;
+		size_t significant = 0;
+		size_t i		   = 0;
+		bool point		   = false;
+		for (; i < text.size(); ++i) {
+			char c = text[i];
+			if (c >= '0' && c <= '9') {
+				++numDigits;
+				if (point) --exponent;
+				if (significant == 0 && c == '0') continue;
+				if (++significant <= 18) mantissa = mantissa * 10 + (c - '0');
+			} else if (c == '.' && !point) {
+				point = true;
+			} else {
+				break;
+			}
+		}
+
+		if (numDigits == 0) return std::nullopt;
+		size_t mantissaEnd = i;
+		if (i < text.size()) {
+			if (text[i] != 'e' && text[i] != 'E') return std::nullopt;
+			int64_t power = 0;
+			auto first	  = text.data() + i + 1;
+			auto last	  = text.data() + text.size();
+			if (first != last && *first == '+') ++first;
+			auto [end, error] = std::from_chars(first, last, power);
+			if (error != std::errc() || end != last) return std::nullopt;
+			if (power < -maxDecimalExponent || power > maxDecimalExponent)
+				return std::nullopt;
+			exponent += power;
+		}
+
+		if (significant <= 18 && exponent >= -18 && exponent <= 18) {
+			int64_t scale = 1;
+			for (int64_t j = 0; j < std::abs(exponent); ++j) scale *= 10;
+			if (exponent < 0) return Rational(mantissa, scale);
+
+			int64_t value;
+			if (checkedMul(mantissa, scale, value)) return Rational(value);
+		}
+
+		if (exponent < -maxDecimalExponent || exponent > maxDecimalExponent)
+			return std::nullopt;
+
+		std::string digits;
+		digits.reserve(mantissaEnd);
+		for (char c : text.substr(0, mantissaEnd))
+			if (c != '.') digits += c;
+
+		return fromBig([&](mpq_ptr res) {
+			mpz_set_str(mpq_numref(res), digits.c_str(), 10);
+			mpz_t scale;
+			mpz_init(scale);
+			mpz_ui_pow_ui(scale, 10, static_cast<unsigned long>(
+									   std::abs(exponent)));
+			if (exponent < 0)
+				mpz_set(mpq_denref(res), scale);
+			else
+				mpz_mul(mpq_numref(res), mpq_numref(res), scale);
+			mpz_clear(scale);
+			mpq_canonicalize(res);
+		});
+	}
+
+	// The value of a Scalar which is an integer small enough to be exact in a
+	// double, or nullopt for anything else
+	static std::optional<Rational> fromInteger(const Scalar &value) {
+		const Scalar limit(static_cast<double>(int64_t(1) << 53));
+		if (!(value >= -limit && value <= limit)) return std::nullopt;
+		auto integer = static_cast<int64_t>(value);
+		if (Scalar(integer) != value) return std::nullopt;
+		return Rational(integer);
+	}
+
+	LR_NODISCARD("") bool isBig() const { return m_big != nullptr; }
+
+	LR_NODISCARD("") bool isInteger() const {
+		return m_big ? mpz_cmp_ui(mpq_denref(m_big->get()), 1) == 0
+					 : m_denominator == 1;
+	}
+
+	LR_NODISCARD("") int sign() const {
+		if (m_big) return mpq_sgn(m_big->get());
+		return (m_numerator > 0) - (m_numerator < 0);
+	}
+
+	// The numerator and denominator, if they fit inline
+	LR_NODISCARD("") int64_t numerator() const { return m_numerator; }
+	LR_NODISCARD("") int64_t denominator() const { return m_denominator; }
+
+	/**
+	 * The value rounded to the nearest Scalar. Small values are converted by
+	 * one correctly rounded division, so converting does not use MPFR for
+	 * them when Scalar is double
+	 */
+	LR_NODISCARD("") Scalar toScalar() const {
+		constexpr int64_t exactLimit = int64_t(1) << 53;
+		if (!m_big && m_numerator >= -exactLimit &&
+			m_numerator <= exactLimit && m_denominator <= exactLimit) {
+			return Scalar(static_cast<double>(m_numerator)) /
+				   Scalar(static_cast<double>(m_denominator));
+		}
+
+		BigRational value;
+		toMpq(value.get());
+		Scalar res;
+		roundRational(value.get(), res);
+		return res;
+	}
+
+	/**
+	 * The value rounded to the nearest float, double or lrc::mpfr (at the
+	 * default precision), which is more precise than toScalar() when T is
+	 * more precise than Scalar
+	 */
+	template<typename T>
+	LR_NODISCARD("")
+	T round() const {
+		if constexpr (std::is_same_v<T, lrc::mpfr>) {
+			T res;
+			round(res.mpfr_ptr(), lrc::mpfr::get_default_rnd());
+			return res;
+		} else {
+			constexpr int digits		 = std::numeric_limits<T>::digits;
+			constexpr int64_t exactLimit = int64_t(1) << digits;
+			if (!m_big && m_numerator >= -exactLimit &&
+				m_numerator <= exactLimit && m_denominator <= exactLimit) {
+				return static_cast<T>(m_numerator) /
+					   static_cast<T>(m_denominator);
+			}
+
+			mpfr_t res;
+			mpfr_init2(res, digits);
+			round(res, MPFR_RNDN);
+			auto out = static_cast<T>(mpfr_get_d(res, MPFR_RNDN));
+			mpfr_clear(res);
+			return out;
+		}
+	}
+
+	// Round the value to the precision of ``out``
+	void round(mpfr_ptr out, mpfr_rnd_t rounding) const {
+		if (m_big) {
+			mpfr_set_q(out, m_big->get(), rounding);
+			return;
+		}
+
+		BigRational value;
+		toMpq(value.get());
+		mpfr_set_q(out, value.get(), rounding);
+	}
+
+	// The value written by str(), or nullopt if ``text`` is not one
+	static std::optional<Rational> fromString(const std::string &text) {
+		bool valid	 = false;
+		Rational res = fromBig([&](mpq_ptr value) {
+			valid = mpq_set_str(value, text.c_str(), 10) == 0 &&
+					mpz_sgn(mpq_denref(value)) != 0;
+			if (valid)
+				mpq_canonicalize(value);
+			else
+				mpq_set_ui(value, 0, 1);
+		});
+
+		if (!valid) return std::nullopt;
+		return res;
+	}
+
+	LR_NODISCARD("") std::string str() const {
+		if (!m_big) {
+			if (m_denominator == 1) return std::to_string(m_numerator);
+			return fmt::format("{}/{}", m_numerator, m_denominator);
+		}
+
+		mpq_srcptr value = m_big->get();
+		std::string res(mpz_sizeinbase(mpq_numref(value), 10) +
+						  mpz_sizeinbase(mpq_denref(value), 10) + 3,
+						'\0');
+		mpq_get_str(res.data(), 10, value);
+		res.resize(std::strlen(res.c_str()));
+		return res;
+	}
+
+	Rational operator-() const {
+		if (m_big) {
+			return fromBig([&](mpq_ptr res) { mpq_neg(res, m_big->get()); });
+		}
+
+		Rational res;
+		res.m_numerator	  = -m_numerator;
+		res.m_denominator = m_denominator;
+		return res;
+	}
+
+	friend Rational operator+(const Rational &a, const Rational &b) {
+		if (!a.m_big && !b.m_big) {
+			// a/b + c/d = (a (d/g) + c (b/g)) / (b (d/g)), with g = gcd(b, d)
+			int64_t g = std::gcd(a.m_denominator, b.m_denominator);
+			int64_t left, right, numerator, denominator;
+			if (checkedMul(a.m_numerator, b.m_denominator / g, left) &&
+				checkedMul(b.m_numerator, a.m_denominator / g, right) &&
+				checkedAdd(left, right, numerator) &&
+				checkedMul(a.m_denominator, b.m_denominator / g, denominator))
+				return Rational(numerator, denominator);
+		}
+		return binaryBig(a, b, mpq_add);
+	}
+
+	friend Rational operator-(const Rational &a, const Rational &b) {
+		return a + -b;
+	}
+
+	friend Rational operator*(const Rational &a, const Rational &b) {
+		if (!a.m_big && !b.m_big) {
+			// Cancel first, so the products are as small as possible
+			int64_t g1 = std::gcd(a.m_numerator, b.m_denominator);
+			int64_t g2 = std::gcd(b.m_numerator, a.m_denominator);
+			if (g1 == 0) g1 = 1;
+			if (g2 == 0) g2 = 1;
+			int64_t numerator, denominator;
+			if (checkedMul(a.m_numerator / g1, b.m_numerator / g2, numerator) &&
+				checkedMul(
+				  a.m_denominator / g2, b.m_denominator / g1, denominator))
+				return Rational(numerator, denominator);
+		}
+		return binaryBig(a, b, mpq_mul);
+	}
+
+	friend Rational operator/(const Rational &a, const Rational &b) {
+		LR_ASSERT(b.sign() != 0, "Division by zero");
+		return a * b.reciprocal();
+	}
+
+	friend bool operator==(const Rational &a, const Rational &b) {
+		if (!a.m_big && !b.m_big) {
+			return a.m_numerator == b.m_numerator &&
+				   a.m_denominator == b.m_denominator;
+		}
+		return a.m_big && b.m_big && mpq_equal(a.m_big->get(), b.m_big->get());
+	}
+
+	friend bool operator!=(const Rational &a, const Rational &b) {
+		return !(a == b);
+	}
+
+	// Exact integer power, which must not divide by zero
+	LR_NODISCARD("") Rational pow(int64_t power) const {
+		if (power < 0) return reciprocal().pow(-power);
+		Rational res(1), base = *this;
+		while (power > 0) {
+			if (power & 1) res = res * base;
+			power >>= 1;
+			if (power > 0) base = base * base;
+		}
+		return res;
+	}
+
+private:
+	// Larger decimal exponents are not held exactly
+	static constexpr int64_t maxDecimalExponent = 1000;
+
+	LR_NODISCARD("") Rational reciprocal() const {
+		LR_ASSERT(sign() != 0, "Division by zero");
+		if (m_big) {
+			return fromBig([&](mpq_ptr res) { mpq_inv(res, m_big->get()); });
+		}
+		return Rational(m_denominator, m_numerator);
+	}
+
+	void toMpq(mpq_ptr out) const {
+		if (m_big) {
+			mpq_set(out, m_big->get());
+		} else {
+			mpzFromInt64(mpq_numref(out), m_numerator);
+			mpzFromInt64(mpq_denref(out), m_denominator);
+		}
+	}
+
+	// The canonical GMP rational set by ``func``, demoted if it fits inline
+	template<typename Func>
+	static Rational fromBig(Func &&func) {
+		auto big = std::make_shared<BigRational>();
+		func(big->get());
+
+		Rational res;
+		if (mpzToInt64(mpq_numref(big->get()), res.m_numerator) &&
+			mpzToInt64(mpq_denref(big->get()), res.m_denominator))
+			return res;
+
+		res.m_numerator	  = 0;
+		res.m_denominator = 1;
+		res.m_big		  = std::move(big);
+		return res;
+	}
+
+	template<typename Op>
+	static Rational binaryBig(const Rational &a, const Rational &b, Op op) {
+		return fromBig([&](mpq_ptr res) {
+			BigRational lhs, rhs;
+			a.toMpq(lhs.get());
+			b.toMpq(rhs.get());
+			op(res, lhs.get(), rhs.get());
+		});
+	}
+
+	int64_t m_numerator	  = 0;
+	int64_t m_denominator = 1;
+	std::shared_ptr<const BigRational> m_big;
+};
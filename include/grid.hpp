@@ -0,0 +1,376 @@
+#pragma once
+
+// A shape such as 3x4x5, for error messages
+inline std::string shapeString(const std::vector<size_t> &shape) {
+	std::string res;
+	for (size_t extent : shape)
+		res += (res.empty() ? "" : "x") + std::to_string(extent);
+	return res.empty() ? "()" : res;
+}
+
+/**
+ * A strided view of an N-dimensional array of T, which does not own its
+ * values. ``strides[i]`` is the distance, in elements, between values which
+ * are adjacent along dimension i. A stride may be 0, so the same values are
+ * used at every position along that dimension (see broadcastTo())
+ */
+template<typename T>
+class ArrayView {
+public:
+	ArrayView() = default;
+
+	// A contiguous array in row-major order
+	ArrayView(T *data, std::vector<size_t> shape) :
+			m_data(data), m_shape(std::move(shape)), m_strides(m_shape.size()) {
+		int64_t stride = 1;
+		for (size_t i = m_shape.size(); i > 0; --i) {
+			m_strides[i - 1] = stride;
+			stride *= static_cast<int64_t>(m_shape[i - 1]);
+		}
+	}
+
+	ArrayView(T *data, std::vector<size_t> shape,
+			  std::vector<int64_t> strides) :
+			m_data(data), m_shape(std::move(shape)),
+			m_strides(std::move(strides)) {
+		LR_ASSERT(m_shape.size() == m_strides.size(),
+				  "Expected {} strides but got {}",
+				  m_shape.size(),
+				  m_strides.size());
+	}
+
+	// A view of an array may be used as a view of constant values
+	template<typename U,
+			 typename = std::enable_if_t<std::is_same_v<const U, T>>>
+	ArrayView(const ArrayView<U> &other) :
+			m_data(other.data()), m_shape(other.shape()),
+			m_strides(other.strides()) {}
+
+	/**
+	 * The ``size`` values at ``values`` as an axis of an ``ndim``-dimensional
+	 * grid, varying along dimension ``dim``. Broadcasting one axis for each
+	 * dimension gives every point of the grid without storing it
+	 */
+	static ArrayView axis(T *values, size_t size, size_t dim, size_t ndim) {
+		LR_ASSERT(dim < ndim,
+				  "Dimension {} is out of range for a {}-dimensional grid",
+				  dim,
+				  ndim);
+		std::vector<size_t> shape(ndim, 1);
+		std::vector<int64_t> strides(ndim, 0);
+		shape[dim]	 = size;
+		strides[dim] = 1;
+		return {values, std::move(shape), std::move(strides)};
+	}
+
+	LR_NODISCARD("") T *data() const { return m_data; }
+	LR_NODISCARD("") const std::vector<size_t> &shape() const {
+		return m_shape;
+	}
+
+	LR_NODISCARD("") const std::vector<int64_t> &strides() const {
+		return m_strides;
+	}
+
+	LR_NODISCARD("") size_t ndim() const { return m_shape.size(); }
+
+	LR_NODISCARD("") size_t size() const {
+		size_t res = 1;
+		for (size_t extent : m_shape) res *= extent;
+		return res;
+	}
+
+	/**
+	 * This view as an array of the given shape, following NumPy's rules. The
+	 * shapes are aligned at their last dimension, and a dimension of size 1,
+	 * or one this view does not have, is repeated with a stride of 0
+	 */
+	LR_NODISCARD("")
+	ArrayView broadcastTo(const std::vector<size_t> &shape) const {
+		LR_ASSERT(ndim() <= shape.size() && broadcastable(shape),
+				  "Cannot broadcast an array of shape {} to {}",
+				  shapeString(m_shape),
+				  shapeString(shape));
+
+		size_t offset = shape.size() - ndim();
+		std::vector<int64_t> strides(shape.size(), 0);
+		for (size_t i = 0; i < ndim(); ++i) {
+			if (m_shape[i] == shape[offset + i])
+				strides[offset + i] = m_strides[i];
+		}
+		return {m_data, shape, std::move(strides)};
+	}
+
+private:
+	bool broadcastable(const std::vector<size_t> &shape) const {
+		size_t offset = shape.size() - ndim();
+		for (size_t i = 0; i < ndim(); ++i) {
+			if (m_shape[i] != shape[offset + i] && m_shape[i] != 1)
+				return false;
+		}
+		return true;
+	}
+
+	T *m_data = nullptr;
+	std::vector<size_t> m_shape;
+	std::vector<int64_t> m_strides;
+};
+
+/**
+ * A view of a dense librapid array on the CPU, such as lrc::Array<double>,
+ * whose values are read or written in place
+ */
+template<typename Array>
+auto arrayView(Array &array) {
+	auto *data		   = array.storage().heap();
+	const auto &extent = array.extent();
+	using T			   = std::remove_pointer_t<decltype(data)>;
+
+	std::vector<size_t> shape;
+	for (int64_t i = 0; i < static_cast<int64_t>(extent.dims()); ++i)
+		shape.emplace_back(static_cast<size_t>(extent[i]));
+	return ArrayView<T>(data, std::move(shape));
+}
+
+/**
+ * The shape of a grid and the strides of each array over it, after
+ * broadcasting. Dimensions of size 1 are dropped, and adjacent dimensions
+ * which every array steps through evenly are merged, so the last dimension is
+ * as long as possible
+ */
+class GridLayout {
+public:
+	GridLayout(const std::vector<size_t> &shape,
+			   const std::vector<std::vector<int64_t>> &strides) :
+			m_strides(strides.size()) {
+		for (size_t dim = 0; dim < shape.size(); ++dim) {
+			if (shape[dim] == 1) continue;
+
+			bool merge = !m_shape.empty();
+			for (size_t i = 0; merge && i < strides.size(); ++i) {
+				auto extent = static_cast<int64_t>(shape[dim]);
+				merge		= m_strides[i].back() == strides[i][dim] * extent;
+			}
+
+			if (merge) {
+				m_shape.back() *= shape[dim];
+				for (size_t i = 0; i < strides.size(); ++i)
+					m_strides[i].back() = strides[i][dim];
+			} else {
+				m_shape.emplace_back(shape[dim]);
+				for (size_t i = 0; i < strides.size(); ++i)
+					m_strides[i].emplace_back(strides[i][dim]);
+			}
+		}
+	}
+
+	LR_NODISCARD("") size_t size() const {
+		size_t res = 1;
+		for (size_t extent : m_shape) res *= extent;
+		return res;
+	}
+
+	// The number of points along the last dimension
+	LR_NODISCARD("") size_t rowLength() const {
+		return m_shape.empty() ? 1 : m_shape.back();
+	}
+
+	// The offset of the point with row-major ``index`` in array ``array``
+	LR_NODISCARD("") int64_t offset(size_t array, size_t index) const {
+		int64_t res = 0;
+		for (size_t dim = m_shape.size(); dim > 0; --dim) {
+			res += static_cast<int64_t>(index % m_shape[dim - 1]) *
+				   m_strides[array][dim - 1];
+			index /= m_shape[dim - 1];
+		}
+		return res;
+	}
+
+	// Whether the ``count`` points from ``index`` are adjacent in ``array``
+	LR_NODISCARD("")
+	bool contiguous(size_t array, size_t index, size_t count) const {
+		int64_t stride = m_shape.empty() ? 1 : m_strides[array].back();
+		return (count == 1 || stride == 1) &&
+			   index % rowLength() + count <= rowLength();
+	}
+
+	// Copy the ``count`` points from ``index`` of an array to ``dst``
+	template<typename T>
+	void gather(size_t array, const T *data, size_t index, size_t count,
+				T *dst) const {
+		int64_t stride = m_shape.empty() ? 0 : m_strides[array].back();
+		forEachRun(index, count, [&](size_t first, size_t i, size_t run) {
+			const T *src = data + offset(array, first);
+			if (stride == 0) {
+				std::fill_n(dst + i, run, *src);
+			} else {
+				for (size_t j = 0; j < run; ++j)
+					dst[i + j] = src[static_cast<int64_t>(j) * stride];
+			}
+		});
+	}
+
+	// Copy ``count`` values to the points of an array from ``index``
+	template<typename T>
+	void scatter(size_t array, const T *src, size_t index, size_t count,
+				 T *data) const {
+		int64_t stride = m_shape.empty() ? 0 : m_strides[array].back();
+		forEachRun(index, count, [&](size_t first, size_t i, size_t run) {
+			T *dst = data + offset(array, first);
+			for (size_t j = 0; j < run; ++j)
+				dst[static_cast<int64_t>(j) * stride] = src[i + j];
+		});
+	}
+
+private:
+	// Split the points from ``index`` at the ends of rows, calling
+	// ``func(index, position, length)`` for each part
+	template<typename Func>
+	void forEachRun(size_t index, size_t count, Func &&func) const {
+		size_t rowLength = this->rowLength();
+		for (size_t i = 0; i < count;) {
+			size_t run = lrc::min(rowLength - index % rowLength, count - i);
+			func(index, i, run);
+			i += run;
+			index += run;
+		}
+	}
+
+	std::vector<size_t> m_shape;
+	std::vector<std::vector<int64_t>> m_strides;
+};
+
+/**
+ * Evaluate a compiled program at every point of a grid, writing the results
+ * to ``out``. ``inputs[i]`` holds the values of the i'th variable of the
+ * program and is broadcast to the shape of ``out`` (see
+ * ArrayView::broadcastTo()), so each variable may be bound to an axis, a
+ * plane or a full array.
+ *
+ * The points are evaluated in row-major order, a block at a time. An input
+ * whose values for a block are adjacent is read in place, and so are the
+ * results if they are adjacent in ``out``. Other blocks are copied through a
+ * buffer, so the inputs are never expanded to the whole grid. Large grids are
+ * divided between tasks on ``pool``, each with its own workspace. In
+ * lrc::mpfr, the tasks use the precision of the calling thread
+ */
+template<typename T>
+void evalGrid(const Program &program,
+			  const std::vector<ArrayView<const T>> &inputs,
+			  const ArrayView<T> &out, Accuracy accuracy = Accuracy::ULP1,
+			  ThreadPool &pool = ThreadPool::global()) {
+	LR_ASSERT(inputs.size() == program.variables().size(),
+			  "Expected {} inputs but got {}",
+			  program.variables().size(),
+			  inputs.size());
+
+	// Each block is a few chunks of the program, and each task a few blocks
+	constexpr size_t blockPoints = Program::chunkSize * 16;
+	constexpr size_t taskPoints	 = blockPoints * 16;
+
+	std::vector<const T *> data;
+	std::vector<std::vector<int64_t>> strides;
+	for (const auto &input : inputs) {
+		auto view = input.broadcastTo(out.shape());
+		data.emplace_back(view.data());
+		strides.emplace_back(view.strides());
+	}
+	strides.emplace_back(out.strides());
+
+	GridLayout layout(out.shape(), strides);
+	size_t numInputs = inputs.size();
+	size_t rowLength = layout.rowLength();
+	size_t size		 = layout.size();
+	int64_t bits	 = 0;
+	if constexpr (std::is_same_v<T, lrc::mpfr>)
+		bits = static_cast<int64_t>(lrc::mpfr::get_default_prec());
+
+	auto evalPoints = [&](size_t first, size_t last) {
+		std::optional<MpfrPrecisionScope> scope;
+		if constexpr (std::is_same_v<T, lrc::mpfr>) scope.emplace(bits);
+
+		std::vector<T> workspace;
+		std::vector<std::vector<T>> buffers(numInputs);
+		std::vector<T> results;
+		std::vector<const T *> columns(numInputs);
+		for (size_t begin = first; begin < last;) {
+			// Long rows are split at their ends, so they are read in place
+			size_t end = lrc::min(begin + blockPoints, last);
+			if (rowLength >= Program::chunkSize)
+				end = lrc::min(end, (begin / rowLength + 1) * rowLength);
+			size_t count = end - begin;
+
+			for (size_t i = 0; i < numInputs; ++i) {
+				if (layout.contiguous(i, begin, count)) {
+					columns[i] = data[i] + layout.offset(i, begin);
+				} else {
+					buffers[i].resize(blockPoints);
+					layout.gather(i, data[i], begin, count, buffers[i].data());
+					columns[i] = buffers[i].data();
+				}
+			}
+
+			if (layout.contiguous(numInputs, begin, count)) {
+				T *dst = out.data() + layout.offset(numInputs, begin);
+				program.run(columns, count, dst, workspace, accuracy);
+			} else {
+				results.resize(blockPoints);
+				program.run(
+				  columns, count, results.data(), workspace, accuracy);
+				layout.scatter(
+				  numInputs, results.data(), begin, count, out.data());
+			}
+
+			begin = end;
+		}
+	};
+
+	size_t numTasks = (size + taskPoints - 1) / taskPoints;
+	if (numTasks <= 1) {
+		evalPoints(0, size);
+		return;
+	}
+
+	std::vector<std::exception_ptr> errors(numTasks);
+	std::atomic<size_t> pending {numTasks};
+	for (size_t task = 0; task < numTasks; ++task) {
+		pool.submit([&, task]() {
+			try {
+				evalPoints(task * taskPoints,
+						   lrc::min((task + 1) * taskPoints, size));
+			} catch (...) {
+				errors[task] = std::current_exception();
+			}
+			pending.fetch_sub(1, std::memory_order_release);
+		});
+	}
+
+	pool.helpUntil(
+	  [&]() { return pending.load(std::memory_order_acquire) == 0; });
+
+	for (const auto &error : errors) {
+		if (error) std::rethrow_exception(error);
+	}
+}
+
+/**
+ * Evaluate an expression at every point of a grid, with each of its variables
+ * bound by name to an array or an axis (see evalGrid() above). The expression
+ * is compiled with compileExpression(), so registered constants are
+ * substituted unless they are bound. Values are computed directly into
+ * ``out``, without creating a node for any point
+ */
+template<typename T>
+void evalGrid(const std::shared_ptr<Component> &tree,
+			  const std::map<std::string, ArrayView<const T>> &bindings,
+			  const ArrayView<T> &out, Accuracy accuracy = Accuracy::ULP1,
+			  ThreadPool &pool = ThreadPool::global()) {
+	std::vector<std::string> names;
+	std::vector<ArrayView<const T>> inputs;
+	for (const auto &[name, view] : bindings) {
+		names.emplace_back(name);
+		inputs.emplace_back(view);
+	}
+
+	evalGrid(compileExpression(tree, names), inputs, out, accuracy, pool);
+}
@@ -0,0 +1,338 @@
+#pragma once
+
+// The cost of evaluating a single node once its operands are known
+inline uint64_t nodeCost(const std::shared_ptr<Component> &node,
+						 uint64_t numOperands) {
+	if (node->type() != "FUNCTION") return 0;
+
+	std::string name = node->name();
+	if (name == "ADD" || name == "SUB" || name == "MUL")
+		return lrc::max(numOperands, uint64_t(2)) - 1;
+	if (name == "PLUS") return 0;
+	if (name == "MINUS") return 1;
+	if (name == "DIV") return 4;
+	return 16;
+}
+
+/**
+ * A rough estimate of the cost of evaluating a tree, counting one unit for
+ * each addition, subtraction, multiplication or negation, and more for
+ * divisions, powers and calls to other functions. A subtree which appears
+ * more than once (by pointer) is counted once, as a Program evaluates it once
+ */
+inline uint64_t evalCost(const std::shared_ptr<Component> &input) {
+	std::unordered_set<const Component *> visited;
+	auto visitor = [](const auto &node, auto first, auto last) {
+		auto count = static_cast<uint64_t>(std::distance(first, last));
+		return std::accumulate(first, last, nodeCost(node, count));
+	};
+	auto prune = [&](const auto &node, uint64_t &) {
+		return !visited.insert(node.get()).second;
+	};
+
+	return foldTree<uint64_t>(input, visitor, prune);
+}
+
+using HornerTerms = std::vector<std::pair<Polynomial::Exponents, Scalar>>;
+
+// Powers up to this are written as repeated multiplication. A compiled
+// product of up to 8 factors is as fast as the INTPOW instruction (binary
+// exponentiation), which is faster for higher powers
+constexpr uint64_t maxPowerProduct = 8;
+
+inline bool isNumberValue(const std::shared_ptr<Component> &node,
+						  const Scalar &value) {
+	return node->type() == "NUMBER" &&
+		   std::dynamic_pointer_cast<Number>(node)->value() == value;
+}
+
+// base^power, with small powers written as a product
+inline std::shared_ptr<Component>
+hornerPower(const std::shared_ptr<Component> &base, uint64_t power) {
+	if (power == 1) return base;
+	if (power > maxPowerProduct)
+		return ::pow(base, std::make_shared<Number>(Scalar(power)));
+
+	auto mulIt = findFunction("MUL");
+	LR_ASSERT(mulIt != nullptr, "Function not found");
+	return makeAssociative(
+	  *mulIt, std::vector<std::shared_ptr<Component>>(power, base));
+}
+
+// value * base^power, skipping multiplication by 1 or -1
+inline std::shared_ptr<Component>
+hornerScale(const std::shared_ptr<Component> &value,
+			const std::shared_ptr<Component> &base, uint64_t power) {
+	if (power == 0) return value;
+	if (isNumberValue(value, 1)) return hornerPower(base, power);
+	if (isNumberValue(value, -1)) return minus(hornerPower(base, power));
+
+	auto mulIt = findFunction("MUL");
+	LR_ASSERT(mulIt != nullptr, "Function not found");
+	return makeAssociative(*mulIt, {value, hornerPower(base, power)});
+}
+
+// left + right, written as a subtraction if right is negative
+inline std::shared_ptr<Component>
+hornerAdd(const std::shared_ptr<Component> &left,
+		  const std::shared_ptr<Component> &right) {
+	if (isNumberValue(right, 0)) return left;
+
+	if (right->type() == "NUMBER") {
+		Scalar value = std::dynamic_pointer_cast<Number>(right)->value();
+		if (value < 0)
+			return sub(left, std::make_shared<Number>(-value));
+	}
+
+	if (right->type() == "FUNCTION" && right->name() == "MINUS")
+		return sub(left, right->children()[0]);
+
+	auto addIt = findFunction("ADD");
+	LR_ASSERT(addIt != nullptr, "Function not found");
+	return makeAssociative(*addIt, {left, right});
+}
+
+/**
+ * Recursive multivariate Horner scheme. The variable appearing in the most
+ * terms is factored out, so the polynomial is written as
+ *
+ *     (((q_n * x^(k_n - k_{n-1}) + q_{n-1}) * ...) + q_0) * x^k_0
+ *
+ * where each q_i is a polynomial in the remaining variables, which is
+ * written in Horner form in the same way
+ */
+inline std::shared_ptr<Component>
+hornerTerms(const HornerTerms &terms,
+			const std::vector<std::shared_ptr<Component>> &vars) {
+	using Exponents = Polynomial::Exponents;
+
+	size_t best = vars.size(), bestCount = 0;
+	for (size_t i = 0; i < vars.size(); ++i) {
+		size_t count = std::count_if(
+		  terms.begin(), terms.end(), [&](const auto &term) {
+			  return Polynomial::exponent(term.first, i) > 0;
+		  });
+		if (count > bestCount) {
+			best	  = i;
+			bestCount = count;
+		}
+	}
+
+	// All the terms are constant, and like terms have already been
+	// collected, so there is at most one term left
+	if (best == vars.size()) {
+		Scalar value = terms.empty() ? Scalar(0) : terms[0].second;
+		return std::make_shared<Number>(value);
+	}
+
+	// Group the terms by their power of the chosen variable
+	uint64_t shift = best * Polynomial::exponentBits;
+	Exponents mask = ~(Polynomial::maxExponent << shift);
+	std::map<uint64_t, HornerTerms, std::greater<>> groups;
+	for (const auto &term : terms) {
+		uint64_t power = Polynomial::exponent(term.first, best);
+		groups[power].emplace_back(term.first & mask, term.second);
+	}
+
+	std::shared_ptr<Component> res;
+	uint64_t prevPower = 0;
+	for (const auto &group : groups) {
+		auto inner = hornerTerms(group.second, vars);
+		if (res) {
+			res = hornerAdd(
+			  hornerScale(res, vars[best], prevPower - group.first),
+			  inner);
+		} else {
+			res = inner;
+		}
+		prevPower = group.first;
+	}
+
+	return hornerScale(res, vars[best], prevPower);
+}
+
+/**
+ * Estrin's scheme for a univariate polynomial. Pairs of coefficients are
+ * combined as c_i + c_{i+1} * x, then pairs of those as p_i + p_{i+1} *
+ * x^2, and so on, giving a tree of depth log2(n) instead of n. The powers
+ * x^2, x^4, ... are shared between the nodes which use them
+ */
+inline std::shared_ptr<Component>
+estrinForm(const Polynomial &poly, const std::shared_ptr<Component> &var) {
+	std::vector<std::shared_ptr<Component>> parts(poly.degree(size_t(0)) +
+												  1);
+	for (const auto &term : poly.terms())
+		parts[term.first] = std::make_shared<Number>(term.second);
+
+	std::shared_ptr<Component> power = var;
+	while (parts.size() > 1) {
+		std::vector<std::shared_ptr<Component>> next;
+		for (size_t i = 0; i < parts.size(); i += 2) {
+			const auto &low = parts[i];
+			std::shared_ptr<Component> high;
+			if (i + 1 < parts.size() && parts[i + 1]) {
+				// Use mul() rather than hornerScale() so the shared power is
+				// not merged into the product
+				const auto &coeff = parts[i + 1];
+				high = isNumberValue(coeff, 1) ? power : mul(coeff, power);
+			}
+
+			if (!high)
+				next.emplace_back(low);
+			else
+				next.emplace_back(low ? hornerAdd(high, low) : high);
+		}
+
+		parts = std::move(next);
+		if (parts.size() > 1) power = mul(power, power);
+	}
+
+	return parts[0];
+}
+
+/**
+ * Rewrite a polynomial in Horner form, or using Estrin's scheme if it has a
+ * single variable and that is cheaper (see evalCost()). Horner's scheme needs
+ * the fewest operations for dense polynomials, but Estrin's squares its way
+ * to high powers, so it wins for sparse ones such as x^16 + x^8 + 1. Small
+ * integer powers are written as multiplications
+ */
+inline std::shared_ptr<Component> hornerForm(const Polynomial &poly) {
+	std::vector<std::shared_ptr<Component>> vars;
+	for (const auto &name : poly.variables())
+		vars.emplace_back(std::make_shared<Variable>(name));
+
+	HornerTerms terms(poly.terms().begin(), poly.terms().end());
+	auto res = hornerTerms(terms, vars);
+	if (vars.size() != 1 || poly.degree(size_t(0)) < 4) return res;
+
+	auto estrin = estrinForm(poly, vars[0]);
+	return evalCost(estrin) < evalCost(res) ? estrin : res;
+}
+
+// Whether a rational is exactly a Scalar, i.e. an integer of up to 53 bits
+// divided by a power of two
+inline bool isScalarExact(const Rational &value) {
+	constexpr int64_t limit = int64_t(1) << 53;
+	uint64_t denominator	= static_cast<uint64_t>(value.denominator());
+	return !value.isBig() && value.numerator() >= -limit &&
+		   value.numerator() <= limit &&
+		   (denominator & (denominator - 1)) == 0;
+}
+
+/**
+ * Replace the numbers in a tree which are not exactly Scalars, and divisions
+ * by constants whose reciprocals are not, with variables named "~0", "~1" and
+ * so on, which cannot be parsed. ``hidden`` maps their names to the exact
+ * numbers they stand for. Polynomial coefficients are Scalars, so this keeps
+ * the exact values for a Program to round to the type it is run in. Named
+ * constants (see isNamedNumber()) are replaced for the same reason
+ */
+inline std::shared_ptr<Component>
+hideInexact(const std::shared_ptr<Component> &input,
+			std::map<std::string, std::shared_ptr<Component>> &hidden) {
+	// Exact values are keyed by Rational::str() and named constants by name,
+	// which cannot be confused as names start with a letter
+	std::map<std::string, std::shared_ptr<Component>> names;
+	auto placeholder = [&](const std::string &key, const auto &makeNumber) {
+		auto &name = names[key];
+		if (!name) {
+			auto label	  = fmt::format("~{}", names.size() - 1);
+			name		  = std::make_shared<Variable>(label);
+			hidden[label] = makeNumber();
+		}
+		return name;
+	};
+
+	std::vector<std::shared_ptr<Component>> values;
+	auto visitor = [&](const auto &node, auto first, auto last) {
+		if (isNamedNumber(node)) {
+			auto number = std::dynamic_pointer_cast<Number>(node);
+			return placeholder(number->constant(), [&]() { return node; });
+		}
+
+		if (node->type() == "NUMBER") {
+			auto number		  = std::dynamic_pointer_cast<Number>(node);
+			const auto &exact = number->exact();
+			if (exact && !isScalarExact(*exact)) {
+				return placeholder(exact->str(), [&]() {
+					return std::make_shared<Number>(*exact);
+				});
+			}
+			return std::shared_ptr<Component>(node);
+		}
+
+		values.assign(first, last);
+		if (node->type() == "FUNCTION" && node->name() == "DIV" &&
+			values.size() == 2) {
+			auto divisor = exactEval(node->children()[1]);
+			if (divisor && divisor->sign() != 0) {
+				Rational reciprocal = Rational(1) / *divisor;
+				if (!isScalarExact(reciprocal)) {
+					auto number = placeholder(reciprocal.str(), [&]() {
+						return std::make_shared<Number>(reciprocal);
+					});
+					return mul(values[0], number);
+				}
+			}
+		}
+		return node->withChildren(values);
+	};
+
+	return foldTree<std::shared_ptr<Component>>(input, visitor);
+}
+
+/**
+ * Find the polynomial subtrees of a tree and rewrite them in Horner form (see
+ * hornerForm()), e.g. 3x^2 - 5x + 2 becomes (3 * x - 5) * x + 2. A subtree is
+ * only replaced if the result is cheaper to evaluate, so factorised inputs
+ * such as (x + 1)^20 are left as they are.
+ *
+ * Numbers which are not exactly Scalars are treated as variables (see
+ * hideInexact()), so 0.1x^2 + x/3 becomes (0.1 * x + 1/3) * x with both
+ * coefficients exact
+ */
+std::shared_ptr<Component> horner(const std::shared_ptr<Component> &input) {
+	struct Rewritten {
+		std::optional<Polynomial> poly;
+		std::shared_ptr<Component> node;
+		uint64_t cost = 0;
+
+		std::shared_ptr<Component> component() const {
+			if (!poly) return node;
+			auto res = hornerForm(*poly);
+			return evalCost(res) < cost ? res : node;
+		}
+	};
+
+	std::vector<std::optional<Polynomial>> polys;
+	std::vector<std::shared_ptr<Component>> values;
+
+	auto visitor = [&](const auto &node, auto first, auto last) {
+		polys.clear();
+		for (auto it = first; it != last; ++it) polys.emplace_back(it->poly);
+
+		Rewritten res;
+		if (node->type() != "TREE")
+			res.poly = Polynomial::fromNode(node, polys.begin(), polys.end());
+
+		if (res.poly) {
+			// The subtree is unchanged until it is converted
+			res.node = node;
+			res.cost = nodeCost(node, polys.size());
+			for (auto it = first; it != last; ++it) res.cost += it->cost;
+			return res;
+		}
+
+		values.clear();
+		for (auto it = first; it != last; ++it)
+			values.emplace_back(it->component());
+		res.node = node->withChildren(values);
+		return res;
+	};
+
+	std::map<std::string, std::shared_ptr<Component>> hidden;
+	auto res = foldTree<Rewritten>(hideInexact(input, hidden), visitor);
+	if (hidden.empty()) return res.component();
+	return substitute(res.component(), hidden);
+}
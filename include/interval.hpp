@@ -0,0 +1,417 @@
+#pragma once
+
+/*
+ * Outward rounding. Each operation is done in the default rounding mode and
+ * the result moved outwards only when it was inexact, which is found with
+ * error-free transformations for the basic operations. A NaN remainder means
+ * the result overflowed, so it is moved outwards too.
+ */
+
+inline constexpr double intervalInfinity =
+  std::numeric_limits<double>::infinity();
+
+// The double nearest pi, which is just below it
+inline constexpr double intervalPi = 3.141592653589793;
+
+// Elementary functions (sin, exp, ...) are assumed accurate to this many ulps
+inline constexpr int elementaryUlps = 2;
+
+inline double nextDown(double value, int ulps = 1) {
+	for (int i = 0; i < ulps; ++i)
+		value = std::nextafter(value, -intervalInfinity);
+	return value;
+}
+
+inline double nextUp(double value, int ulps = 1) {
+	for (int i = 0; i < ulps; ++i)
+		value = std::nextafter(value, intervalInfinity);
+	return value;
+}
+
+// The bounds of a result ``value`` which is ``remainder`` below the exact one
+inline double roundedDown(double value, double remainder) {
+	if (value != value) return -intervalInfinity;
+	return remainder < 0 || remainder != remainder ? nextDown(value) : value;
+}
+
+inline double roundedUp(double value, double remainder) {
+	if (value != value) return intervalInfinity;
+	return remainder > 0 || remainder != remainder ? nextUp(value) : value;
+}
+
+// The remainder of a + b (TwoSum)
+inline double sumRemainder(double a, double b, double sum) {
+	double bb = sum - a;
+	return (a - (sum - bb)) + (b - bb);
+}
+
+inline double addDown(double a, double b) {
+	double sum = a + b;
+	return roundedDown(sum, sumRemainder(a, b, sum));
+}
+
+inline double addUp(double a, double b) {
+	double sum = a + b;
+	return roundedUp(sum, sumRemainder(a, b, sum));
+}
+
+// Products of zero and infinity are zero, as the bounds are limits
+inline double mulDown(double a, double b) {
+	if (a == 0 || b == 0) return 0;
+	double product = a * b;
+	return roundedDown(product, std::fma(a, b, -product));
+}
+
+inline double mulUp(double a, double b) {
+	if (a == 0 || b == 0) return 0;
+	double product = a * b;
+	return roundedUp(product, std::fma(a, b, -product));
+}
+
+// The remainder of a / b is (a - q * b) / b, which has the sign of
+// (a - q * b) * b
+inline double divDown(double a, double b) {
+	double quotient = a / b;
+	if (std::isinf(b) && std::isfinite(a)) return quotient;
+	return roundedDown(quotient, std::fma(-quotient, b, a) * b);
+}
+
+inline double divUp(double a, double b) {
+	double quotient = a / b;
+	if (std::isinf(b) && std::isfinite(a)) return quotient;
+	return roundedUp(quotient, std::fma(-quotient, b, a) * b);
+}
+
+/**
+ * A closed interval of real numbers with double bounds, which may be infinite.
+ * Every operation returns an interval containing every result of the
+ * operation on numbers in its operands, so evaluating an expression over
+ * intervals gives guaranteed bounds on its range. The empty interval has NaN
+ * bounds, and is the result of an operation with no real results, such as
+ * sqrt([-2, -1]).
+ */
+class Interval {
+public:
+	Interval() = default;
+
+	// The interval containing only ``value``
+	Interval(double value) : m_lower(value), m_upper(value) {}
+
+	Interval(double lower, double upper) : m_lower(lower), m_upper(upper) {
+		LR_ASSERT(!(lower > upper), "Invalid interval [{}, {}]", lower, upper);
+	}
+
+	// The smallest interval of doubles containing ``value``
+	explicit Interval(const lrc::mpfr &value) {
+		auto nearest = static_cast<double>(value);
+		m_lower = value < lrc::mpfr(nearest) ? nextDown(nearest) : nearest;
+		m_upper = value > lrc::mpfr(nearest) ? nextUp(nearest) : nearest;
+	}
+
+	static Interval entire() { return {-intervalInfinity, intervalInfinity}; }
+
+	static Interval empty() {
+		Interval res;
+		res.m_lower = res.m_upper = std::numeric_limits<double>::quiet_NaN();
+		return res;
+	}
+
+	// The interval containing ``value`` and the doubles either side of it,
+	// for a value which has been rounded to the nearest double
+	static Interval around(double value) {
+		return {nextDown(value), nextUp(value)};
+	}
+
+	LR_NODISCARD("") double lower() const { return m_lower; }
+	LR_NODISCARD("") double upper() const { return m_upper; }
+	LR_NODISCARD("") bool isEmpty() const { return m_lower != m_lower; }
+
+	LR_NODISCARD("") double width() const { return m_upper - m_lower; }
+
+	LR_NODISCARD("") double midpoint() const {
+		if (std::isinf(m_lower) || std::isinf(m_upper))
+			return std::isinf(m_lower) == std::isinf(m_upper) ? 0 : m_lower;
+		return m_lower + (m_upper - m_lower) / 2;
+	}
+
+	LR_NODISCARD("") bool contains(double value) const {
+		return m_lower <= value && value <= m_upper;
+	}
+
+	Interval operator-() const {
+		if (isEmpty()) return empty();
+		return {-m_upper, -m_lower};
+	}
+
+	friend Interval operator+(const Interval &a, const Interval &b) {
+		if (a.isEmpty() || b.isEmpty()) return empty();
+		return {addDown(a.m_lower, b.m_lower), addUp(a.m_upper, b.m_upper)};
+	}
+
+	friend Interval operator-(const Interval &a, const Interval &b) {
+		return a + -b;
+	}
+
+	friend Interval operator*(const Interval &a, const Interval &b) {
+		if (a.isEmpty() || b.isEmpty()) return empty();
+		double lower = intervalInfinity, upper = -intervalInfinity;
+		for (double x : {a.m_lower, a.m_upper}) {
+			for (double y : {b.m_lower, b.m_upper}) {
+				lower = std::min(lower, mulDown(x, y));
+				upper = std::max(upper, mulUp(x, y));
+			}
+		}
+		return {lower, upper};
+	}
+
+	// Division by an interval containing zero gives the entire real line
+	friend Interval operator/(const Interval &a, const Interval &b) {
+		if (a.isEmpty() || b.isEmpty()) return empty();
+		if (b.m_lower == 0 && b.m_upper == 0) return empty();
+		if (b.contains(0)) return entire();
+
+		double lower = intervalInfinity, upper = -intervalInfinity;
+		for (double x : {a.m_lower, a.m_upper}) {
+			for (double y : {b.m_lower, b.m_upper}) {
+				lower = std::min(lower, divDown(x, y));
+				upper = std::max(upper, divUp(x, y));
+			}
+		}
+		return {lower, upper};
+	}
+
+	Interval &operator+=(const Interval &other) {
+		return *this = *this + other;
+	}
+
+	Interval &operator-=(const Interval &other) {
+		return *this = *this - other;
+	}
+
+	Interval &operator*=(const Interval &other) {
+		return *this = *this * other;
+	}
+
+	Interval &operator/=(const Interval &other) {
+		return *this = *this / other;
+	}
+
+private:
+	double m_lower = 0;
+	double m_upper = 0;
+};
+
+// base^power for base >= 0, rounded down or up
+inline double powMagnitude(double base, uint64_t power, bool up) {
+	double res = 1;
+	while (power > 0) {
+		if (power & 1) res = up ? mulUp(res, base) : mulDown(res, base);
+		power >>= 1;
+		if (power > 0) base = up ? mulUp(base, base) : mulDown(base, base);
+	}
+	return res;
+}
+
+// x^power, which unlike repeated multiplication knows that both factors of
+// x * x are the same number, so [-1, 2]^2 is [0, 4] rather than [-2, 4]
+inline Interval integerPow(const Interval &x, int64_t power) {
+	if (x.isEmpty()) return Interval::empty();
+	if (power == 0) return 1;
+	if (power < 0) return Interval(1) / integerPow(x, -power);
+
+	auto n = static_cast<uint64_t>(power);
+	double lo = x.lower(), hi = x.upper();
+	if (n % 2 == 1) {
+		double lower = lo < 0 ? -powMagnitude(-lo, n, true)
+							  : powMagnitude(lo, n, false);
+		double upper = hi < 0 ? -powMagnitude(-hi, n, false)
+							  : powMagnitude(hi, n, true);
+		return {lower, upper};
+	}
+
+	double least	= x.contains(0) ? 0 : std::min(std::abs(lo), std::abs(hi));
+	double greatest = std::max(std::abs(lo), std::abs(hi));
+	return {powMagnitude(least, n, false), powMagnitude(greatest, n, true)};
+}
+
+inline Interval abs(const Interval &x) {
+	if (x.isEmpty()) return x;
+	if (x.lower() >= 0) return x;
+	if (x.upper() <= 0) return -x;
+	return {0, std::max(-x.lower(), x.upper())};
+}
+
+inline Interval sqrt(const Interval &x) {
+	if (x.isEmpty() || x.upper() < 0) return Interval::empty();
+
+	auto bound = [](double value, bool up) {
+		double root		 = std::sqrt(value);
+		double remainder = std::fma(-root, root, value);
+		return up ? roundedUp(root, remainder) : roundedDown(root, remainder);
+	};
+
+	return {bound(std::max(x.lower(), 0.0), false), bound(x.upper(), true)};
+}
+
+// An increasing function of x, with its result clamped to [least, greatest]
+template<typename Func>
+Interval increasing(const Interval &x, Func &&func, double least,
+					double greatest) {
+	if (x.isEmpty()) return x;
+	double lower = std::max(nextDown(func(x.lower()), elementaryUlps), least);
+	double upper = std::min(nextUp(func(x.upper()), elementaryUlps), greatest);
+	return {lower, upper};
+}
+
+inline Interval exp(const Interval &x) {
+	return increasing(
+	  x, [](double v) { return std::exp(v); }, 0, intervalInfinity);
+}
+
+// Only defined for x >= 0
+inline Interval log(const Interval &x) {
+	if (x.isEmpty() || x.upper() < 0) return Interval::empty();
+	Interval domain(std::max(x.lower(), 0.0), x.upper());
+	return increasing(
+	  domain,
+	  [](double v) { return std::log(v); },
+	  -intervalInfinity,
+	  intervalInfinity);
+}
+
+inline Interval atan(const Interval &x) {
+	double halfPi = nextUp(intervalPi / 2);
+	return increasing(
+	  x, [](double v) { return std::atan(v); }, -halfPi, halfPi);
+}
+
+// Only defined for -1 <= x <= 1
+inline Interval asin(const Interval &x) {
+	if (x.isEmpty() || x.upper() < -1 || x.lower() > 1)
+		return Interval::empty();
+	Interval domain(std::max(x.lower(), -1.0), std::min(x.upper(), 1.0));
+	double halfPi = nextUp(intervalPi / 2);
+	return increasing(
+	  domain, [](double v) { return std::asin(v); }, -halfPi, halfPi);
+}
+
+inline Interval acos(const Interval &x) {
+	if (x.isEmpty() || x.upper() < -1 || x.lower() > 1)
+		return Interval::empty();
+	double lower = std::max(nextDown(std::acos(std::min(x.upper(), 1.0)),
+									 elementaryUlps),
+							0.0);
+	double upper = std::min(
+	  nextUp(std::acos(std::max(x.lower(), -1.0)), elementaryUlps),
+	  nextUp(intervalPi));
+	return {lower, upper};
+}
+
+// Whether x is inside (-2^20, 2^20), where the error in the phases computed by
+// containsPhase() is far too small to matter
+inline bool smallArgument(const Interval &x) {
+	double limit = 1 << 20;
+	return x.lower() > -limit && x.upper() < limit;
+}
+
+// Whether x contains phase + k period for some integer k
+inline bool containsPhase(const Interval &x, double phase, double period) {
+	double k = std::ceil((x.lower() - phase) / period);
+	return phase + k * period <= x.upper();
+}
+
+// sin or cos, which reach 1 at ``maxPhase`` and -1 at ``minPhase`` (mod 2 pi)
+template<typename Func>
+Interval periodic(const Interval &x, Func &&func, double maxPhase,
+				  double minPhase) {
+	if (x.isEmpty()) return x;
+	if (!smallArgument(x) || x.width() >= 2 * intervalPi) return {-1, 1};
+
+	double a = func(x.lower()), b = func(x.upper());
+	double lower = std::max(nextDown(std::min(a, b), elementaryUlps), -1.0);
+	double upper = std::min(nextUp(std::max(a, b), elementaryUlps), 1.0);
+	if (containsPhase(x, maxPhase, 2 * intervalPi)) upper = 1;
+	if (containsPhase(x, minPhase, 2 * intervalPi)) lower = -1;
+	return {lower, upper};
+}
+
+inline Interval sin(const Interval &x) {
+	return periodic(
+	  x, [](double v) { return std::sin(v); }, intervalPi / 2, -intervalPi / 2);
+}
+
+inline Interval cos(const Interval &x) {
+	return periodic(x, [](double v) { return std::cos(v); }, 0, intervalPi);
+}
+
+// Intervals containing a pole, or close enough to one that rounding could
+// hide it, give the entire real line
+inline Interval tan(const Interval &x) {
+	if (x.isEmpty()) return x;
+	if (!smallArgument(x) || x.width() >= intervalPi) return Interval::entire();
+
+	double margin = 1e-9;
+	Interval widened(x.lower() - margin, x.upper() + margin);
+	if (containsPhase(widened, intervalPi / 2, intervalPi))
+		return Interval::entire();
+	return increasing(
+	  x,
+	  [](double v) { return std::tan(v); },
+	  -intervalInfinity,
+	  intervalInfinity);
+}
+
+// The smallest interval containing both a and b
+inline Interval hull(const Interval &a, const Interval &b) {
+	if (a.isEmpty()) return b;
+	if (b.isEmpty()) return a;
+	return {std::min(a.lower(), b.lower()), std::max(a.upper(), b.upper())};
+}
+
+// The most integer exponents pow() takes one at a time for a negative base
+inline constexpr double maxNegativeBasePowers = 64;
+
+/**
+ * Integer and half-integer exponents known exactly use integerPow() and
+ * sqrt(). Otherwise x^y = exp(y log x) for x >= 0. For x < 0, x^y is only
+ * real for integer y, so each integer in y is taken with integerPow(), or if
+ * there are too many the result is the entire real line
+ */
+inline Interval pow(const Interval &x, const Interval &y) {
+	if (x.isEmpty() || y.isEmpty()) return Interval::empty();
+
+	double power = y.lower();
+	if (power == y.upper()) {
+		if (power == std::trunc(power) && std::abs(power) <= 0x1p62)
+			return integerPow(x, static_cast<int64_t>(power));
+		if (power == 0.5) return sqrt(x);
+	}
+
+	Interval res = exp(y * log(x));
+	if (x.lower() >= 0) return res;
+
+	double first = std::ceil(y.lower()), last = std::floor(y.upper());
+	if (first > last) return res;
+	if (!(last - first < maxNegativeBasePowers) ||
+		!(std::abs(first) <= 0x1p62 && std::abs(last) <= 0x1p62))
+		return Interval::entire();
+
+	Interval negative(x.lower(), std::min(x.upper(), 0.0));
+	for (double k = first; k <= last; ++k)
+		res = hull(res, integerPow(negative, static_cast<int64_t>(k)));
+	return res;
+}
+
+template<>
+struct fmt::formatter<Interval> : fmt::formatter<double> {
+	template<typename FormatContext>
+	auto format(const Interval &value, FormatContext &ctx) const {
+		if (value.isEmpty()) return fmt::format_to(ctx.out(), "[empty]");
+		auto out = fmt::format_to(ctx.out(), "[");
+		out		 = fmt::formatter<double>::format(value.lower(), ctx);
+		out		 = fmt::format_to(out, ", ");
+		ctx.advance_to(out);
+		out = fmt::formatter<double>::format(value.upper(), ctx);
+		return fmt::format_to(out, "]");
+	}
+};
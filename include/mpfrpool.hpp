@@ -0,0 +1,184 @@
+#pragma once
+
+using MpfrUnary	 = int (*)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+using MpfrBinary = int (*)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr, mpfr_rnd_t);
+
+/**
+ * The MPFR functions which compute the standard functions (see
+ * registerKernels()) in place, or nullptr for other functions. These are
+ * used for CALL instructions by Program::run() in lrc::mpfr
+ */
+inline MpfrUnary mpfrUnary(const std::string &name) {
+	static const std::unordered_map<std::string, MpfrUnary> table = {
+	  {"sqrt", mpfr_sqrt},
+	  {"exp", mpfr_exp},
+	  {"sin", mpfr_sin},
+	  {"cos", mpfr_cos},
+	  {"tan", mpfr_tan},
+	  {"asin", mpfr_asin},
+	  {"acos", mpfr_acos},
+	  {"atan", mpfr_atan}};
+
+	auto it = table.find(name);
+	return it == table.end() ? nullptr : it->second;
+}
+
+inline MpfrBinary mpfrBinary(const std::string &name) {
+	static const std::unordered_map<std::string, MpfrBinary> table = {
+	  {"ADD", mpfr_add},
+	  {"SUB", mpfr_sub},
+	  {"MUL", mpfr_mul},
+	  {"DIV", mpfr_div},
+	  {"POW", mpfr_pow}};
+
+	auto it = table.find(name);
+	return it == table.end() ? nullptr : it->second;
+}
+
+inline void mpfrAssign(lrc::mpfr &dst, double value, mpfr_rnd_t rounding) {
+	mpfr_set_d(dst.mpfr_ptr(), value, rounding);
+}
+
+inline void mpfrAssign(lrc::mpfr &dst, const lrc::mpfr &value,
+					   mpfr_rnd_t rounding) {
+	mpfr_set(dst.mpfr_ptr(), value.mpfr_srcptr(), rounding);
+}
+
+/**
+ * Every operation writes its result into a value in the workspace with the
+ * mpfr_* functions, rather than creating a temporary lrc::mpfr, so once the
+ * workspace has been used no MPFR values are created or freed. Values keep
+ * their limbs between calls, and are only changed if the default precision
+ * has changed since the last call.
+ *
+ * Functions without an in-place MPFR function are called through their kernel
+ * (see functorAs()), with their operands copied into values which are also
+ * reused, so only their result is allocated
+ */
+inline void Program::runMpfr(const std::vector<const lrc::mpfr *> &columns,
+							 size_t count, lrc::mpfr *out,
+							 std::vector<lrc::mpfr> &workspace) const {
+	size_t numVariables = m_variables.size();
+	size_t numConstants = m_constants.size();
+	auto precision = static_cast<mpfr_prec_t>(lrc::mpfr::get_default_prec());
+	auto rounding  = lrc::mpfr::get_default_rnd();
+
+	size_t size = (numConstants + m_numRegisters) * chunkSize;
+	if (workspace.size() < size) workspace.resize(size);
+	for (auto &value : workspace) {
+		if (value.get_prec() != precision)
+			mpfr_set_prec(value.mpfr_ptr(), precision);
+	}
+
+	for (size_t i = 0; i < numConstants; ++i) {
+		lrc::mpfr &value			 = workspace[i * chunkSize];
+		const ConstantSource &source = m_sources[i];
+		if (!source.name.empty()) {
+			auto &cache = ConstantCache::global();
+			auto bits	= static_cast<int64_t>(lrc::mpfr::get_default_prec());
+			mpfrAssign(value, cache.value(source.name, bits), rounding);
+		} else if (source.exact) {
+			source.exact->round(value.mpfr_ptr(), rounding);
+		} else {
+			mpfrAssign(value, m_constants[i], rounding);
+		}
+
+		for (size_t j = 1; j < chunkSize; ++j)
+			mpfrAssign(workspace[i * chunkSize + j], value, rounding);
+	}
+
+	// The MPFR function for each functor, or its kernel if it has none
+	struct Call {
+		MpfrUnary unary	  = nullptr;
+		MpfrBinary binary = nullptr;
+		std::function<lrc::mpfr(const std::vector<lrc::mpfr> &)> kernel;
+	};
+
+	std::vector<Call> calls(m_functors.size());
+	for (const auto &instr : m_instructions) {
+		if (instr.op != Op::CALL) continue;
+		const std::string &name = m_functionNames[instr.functor];
+		Call &call				= calls[instr.functor];
+		if (instr.count == 1) call.unary = mpfrUnary(name);
+		if (instr.count == 2) call.binary = mpfrBinary(name);
+		if (!call.unary && !call.binary) {
+			call.kernel = functorAs<lrc::mpfr>(
+			  name, instr.count, m_functors[instr.functor]);
+		}
+	}
+
+	lrc::mpfr *registers = workspace.data() + numConstants * chunkSize;
+	std::vector<const lrc::mpfr *> slots(numVariables + numConstants +
+										 m_numRegisters);
+	for (size_t i = 0; i < numConstants + m_numRegisters; ++i)
+		slots[numVariables + i] = workspace.data() + i * chunkSize;
+
+	static thread_local std::vector<lrc::mpfr> args;
+	for (size_t start = 0; start < count; start += chunkSize) {
+		size_t n = lrc::min(chunkSize, count - start);
+		for (size_t i = 0; i < numVariables; ++i)
+			slots[i] = columns[i] + start;
+
+		for (const auto &instr : m_instructions) {
+			lrc::mpfr *dst		 = registers + instr.dst * chunkSize;
+			const lrc::mpfr *lhs = slots[instr.lhs];
+			const lrc::mpfr *rhs = slots[instr.rhs];
+
+			auto binary = [&](MpfrBinary func) {
+				for (size_t i = 0; i < n; ++i) {
+					func(dst[i].mpfr_ptr(),
+						 lhs[i].mpfr_srcptr(),
+						 rhs[i].mpfr_srcptr(),
+						 rounding);
+				}
+			};
+
+			auto unary = [&](MpfrUnary func) {
+				for (size_t i = 0; i < n; ++i)
+					func(dst[i].mpfr_ptr(), lhs[i].mpfr_srcptr(), rounding);
+			};
+
+			switch (instr.op) {
+				case Op::ADD: binary(mpfr_add); break;
+				case Op::SUB: binary(mpfr_sub); break;
+				case Op::MUL: binary(mpfr_mul); break;
+				case Op::DIV: binary(mpfr_div); break;
+				case Op::NEG: unary(mpfr_neg); break;
+				case Op::SQRT: unary(mpfr_sqrt); break;
+				case Op::INTPOW:
+					for (size_t i = 0; i < n; ++i) {
+						mpfr_pow_si(dst[i].mpfr_ptr(),
+									lhs[i].mpfr_srcptr(),
+									static_cast<long>(instr.power),
+									rounding);
+					}
+					break;
+				case Op::CALL: {
+					const Call &call = calls[instr.functor];
+					const uint32_t *operands = m_operands.data() + instr.first;
+					lhs						 = slots[operands[0]];
+					if (call.unary) {
+						unary(call.unary);
+						break;
+					}
+
+					if (call.binary) {
+						rhs = slots[operands[1]];
+						binary(call.binary);
+						break;
+					}
+
+					args.resize(instr.count);
+					for (size_t i = 0; i < n; ++i) {
+						for (uint32_t j = 0; j < instr.count; ++j)
+							args[j] = slots[operands[j]][i];
+						dst[i] = call.kernel(args);
+					}
+					break;
+				}
+			}
+		}
+
+		std::copy_n(slots[m_result], n, out + start);
+	}
+}
@@ -0,0 +1,368 @@
+#pragma once
+
+/**
+ * Sets the precision, in bits, of the lrc::mpfr values created on this thread
+ * while it exists. MPFR keeps the default precision per thread, so other
+ * threads are not affected
+ */
+class MpfrPrecisionScope {
+public:
+	explicit MpfrPrecisionScope(int64_t bits) :
+			m_previous(static_cast<int64_t>(lrc::mpfr::get_default_prec())) {
+		lrc::mpfr::set_default_prec(bits);
+	}
+
+	MpfrPrecisionScope(const MpfrPrecisionScope &)			  = delete;
+	MpfrPrecisionScope &operator=(const MpfrPrecisionScope &) = delete;
+
+	~MpfrPrecisionScope() { lrc::mpfr::set_default_prec(m_previous); }
+
+private:
+	int64_t m_previous;
+};
+
+/**
+ * A fixed-size pool of worker threads with work stealing. Each worker has its
+ * own queue: tasks submitted by a worker go to the back of its own queue and
+ * are taken from the back (so a worker keeps working on the most recent, and
+ * most cache-friendly, task), while idle workers steal from the front of other
+ * workers' queues. Tasks submitted from outside the pool are spread across the
+ * queues.
+ */
+class ThreadPool {
+public:
+	using Task = std::function<void()>;
+
+	explicit ThreadPool(
+	  size_t numThreads = lrc::max(std::thread::hardware_concurrency(), 1u)) {
+		for (size_t i = 0; i < numThreads; ++i)
+			m_queues.emplace_back(std::make_unique<Queue>());
+		for (size_t i = 0; i < numThreads; ++i)
+			m_threads.emplace_back([this, i]() { workerLoop(i); });
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (auto &thread : m_threads) thread.join();
+	}
+
+	// A pool shared by the whole program, with one thread per core
+	static ThreadPool &global() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	LR_NODISCARD("") size_t size() const { return m_threads.size(); }
+
+	void submit(Task task) {
+		size_t index = currentWorker().pool == this
+						 ? currentWorker().index
+						 : m_nextQueue.fetch_add(1) % m_queues.size();
+
+		{
+			std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+			m_queues[index]->tasks.emplace_back(std::move(task));
+		}
+
+		// Take the lock so a worker cannot miss the notification between
+		// checking for work and going to sleep
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			++m_queued;
+		}
+		m_wake.notify_one();
+	}
+
+	/**
+	 * Run queued tasks on the calling thread until ``done()`` returns true.
+	 * Used to wait for a result without leaving a core idle (and without
+	 * deadlocking if called from a worker thread). When there is nothing to
+	 * run, the thread sleeps until a task is queued or finishes, so
+	 * ``done()`` must only become true in a task run by this pool
+	 */
+	template<typename Predicate>
+	void helpUntil(Predicate &&done) {
+		size_t start = currentWorker().pool == this ? currentWorker().index : 0;
+		while (!done()) {
+			if (runOne(start)) continue;
+
+			std::unique_lock<std::mutex> lock(m_sleepMutex);
+			++m_helpers;
+			m_wake.wait(lock, [&]() { return m_queued > 0 || done(); });
+			--m_helpers;
+		}
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	struct WorkerInfo {
+		const ThreadPool *pool = nullptr;
+		size_t index		   = 0;
+	};
+
+	static WorkerInfo &currentWorker() {
+		static thread_local WorkerInfo info;
+		return info;
+	}
+
+	// Take a task from the back of queue ``index``, or steal one from the
+	// front of another queue, and run it. Returns false if there was no work
+	bool runOne(size_t index) {
+		Task task;
+		for (size_t i = 0; i < m_queues.size() && !task; ++i) {
+			Queue &queue = *m_queues[(index + i) % m_queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty()) continue;
+
+			if (i == 0) {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			} else {
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+		}
+
+		if (!task) return false;
+
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			--m_queued;
+		}
+		task();
+
+		// The task may have finished what a thread in helpUntil() is waiting
+		// for. Checking under the lock means the wake-up cannot be missed
+		bool helpers;
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			helpers = m_helpers > 0;
+		}
+		if (helpers) m_wake.notify_all();
+		return true;
+	}
+
+	void workerLoop(size_t index) {
+		currentWorker() = {this, index};
+
+		// Tasks started here are not nested in other tasks, so the thread
+		// holds no registry references between them
+		while (true) {
+			registryQuiescent();
+			if (runOne(index)) continue;
+
+			std::unique_lock<std::mutex> lock(m_sleepMutex);
+			m_wake.wait(lock, [&]() { return m_stop || m_queued > 0; });
+			if (m_stop && m_queued == 0) return;
+		}
+	}
+
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread> m_threads;
+	std::atomic<size_t> m_nextQueue {0};
+
+	std::mutex m_sleepMutex;
+	std::condition_variable m_wake;
+	size_t m_queued	 = 0;
+	size_t m_helpers = 0; // Threads sleeping in helpUntil()
+	bool m_stop		 = false;
+};
+
+// The state shared by the tasks of a single call to parallelEval()
+struct ParallelEvalState {
+	// A task evaluates one or more sibling subtrees
+	struct Task {
+		std::vector<std::shared_ptr<Component>> roots;
+		std::vector<Scalar> values;
+		std::vector<size_t> children;
+		size_t parent = 0;
+		std::atomic<size_t> pending {0};
+	};
+
+	ThreadPool *pool = nullptr;
+
+	// The caller's MPFR precision, used by every task when Scalar is
+	// lrc::mpfr, since MPFR keeps a separate default for each thread
+	int64_t precision = 0;
+
+	// Tasks are created from the bottom up, so the root task is the last
+	std::deque<Task> tasks;
+	size_t rootTask = 0;
+
+	std::atomic<bool> done {false};
+	std::mutex errorMutex;
+	std::exception_ptr error;
+
+	size_t addTask(std::vector<std::shared_ptr<Component>> roots,
+				   std::vector<size_t> children) {
+		size_t index = tasks.size();
+		auto &task	 = tasks.emplace_back();
+		task.roots	 = std::move(roots);
+		task.pending = children.size();
+		for (size_t child : children) tasks[child].parent = index;
+		task.children = std::move(children);
+		return index;
+	}
+};
+
+inline void runParallelEvalTask(const std::shared_ptr<ParallelEvalState> &state,
+								size_t index) {
+	auto &task = state->tasks[index];
+
+	bool failed;
+	{
+		std::lock_guard<std::mutex> lock(state->errorMutex);
+		failed = state->error != nullptr;
+	}
+
+	// If another task has failed, finish without evaluating anything so the
+	// tasks waiting on this one are still released
+	if (!failed) {
+		std::optional<MpfrPrecisionScope> scope;
+		if constexpr (std::is_same_v<Scalar, lrc::mpfr>)
+			scope.emplace(state->precision);
+
+		try {
+			// The results of the tasks below this one, which are used in place
+			// of their subtrees
+			std::unordered_map<const Component *, Scalar> known;
+			for (size_t child : task.children) {
+				const auto &childTask = state->tasks[child];
+				for (size_t i = 0; i < childTask.roots.size(); ++i) {
+					known.emplace(childTask.roots[i].get(),
+								  childTask.values[i]);
+				}
+			}
+
+			std::vector<Scalar> operands;
+			auto visitor = [&](const auto &node, auto first, auto last) {
+				operands.assign(first, last);
+				return node->evalNode(operands);
+			};
+
+			auto prune = [&](const auto &node, Scalar &result) {
+				if (known.empty()) return false;
+				auto it = known.find(node.get());
+				if (it == known.end()) return false;
+				result = it->second;
+				return true;
+			};
+
+			for (const auto &root : task.roots) {
+				task.values.emplace_back(
+				  foldTree<Scalar>(root, visitor, prune));
+			}
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(state->errorMutex);
+			if (!state->error) state->error = std::current_exception();
+		}
+	}
+
+	if (index == state->rootTask) {
+		state->done.store(true, std::memory_order_release);
+		return;
+	}
+
+	size_t parent = task.parent;
+	if (state->tasks[parent].pending.fetch_sub(
+		  1, std::memory_order_acq_rel) == 1) {
+		state->pool->submit(
+		  [state, parent]() { runParallelEvalTask(state, parent); });
+	}
+}
+
+/**
+ * Evaluate a tree using a thread pool. The operands of a node are divided into
+ * groups of at least ``grainSize`` nodes, and if there are at least two such
+ * groups, each is evaluated as a separate task. Smaller subtrees (and trees
+ * with no independent large subtrees, such as long chains) are evaluated
+ * sequentially, exactly as eval() would.
+ *
+ * Each task evaluates its subtrees with foldTree(), using the results of the
+ * tasks below it in place of their subtrees, and is started once those tasks
+ * have finished.
+ */
+Scalar parallelEval(const std::shared_ptr<Component> &input,
+					uint64_t grainSize = 1 << 14,
+					ThreadPool &pool   = ThreadPool::global()) {
+	auto state	= std::make_shared<ParallelEvalState>();
+	state->pool = &pool;
+	if constexpr (std::is_same_v<Scalar, lrc::mpfr>)
+		state->precision = static_cast<int64_t>(lrc::mpfr::get_default_prec());
+
+	// Count the nodes in each subtree while creating the tasks. ``open`` holds
+	// the tasks in the subtree which do not have a parent task yet
+	struct Cost {
+		uint64_t nodes = 0;
+		std::vector<size_t> open;
+	};
+
+	std::vector<size_t> groupEnds;
+	auto visitor = [&](const auto &node, auto first, auto last) {
+		Cost res;
+		res.nodes = 1;
+		groupEnds.clear();
+		uint64_t groupNodes = 0;
+		for (auto it = first; it != last; ++it) {
+			res.nodes += it->nodes;
+			groupNodes += it->nodes;
+			if (groupNodes >= grainSize) {
+				groupEnds.emplace_back(std::distance(first, it) + 1);
+				groupNodes = 0;
+			}
+		}
+
+		if (groupEnds.size() < 2) {
+			for (auto it = first; it != last; ++it) {
+				res.open.insert(
+				  res.open.end(), it->open.begin(), it->open.end());
+			}
+			return res;
+		}
+
+		// Any remaining operands join the last group
+		groupEnds.back()	 = std::distance(first, last);
+		const auto &children = node->children();
+		size_t begin		 = 0;
+		for (size_t end : groupEnds) {
+			std::vector<size_t> open;
+			for (size_t i = begin; i < end; ++i) {
+				const auto &childOpen = (first + i)->open;
+				open.insert(open.end(), childOpen.begin(), childOpen.end());
+			}
+
+			res.open.emplace_back(state->addTask(
+			  {children.begin() + begin, children.begin() + end},
+			  std::move(open)));
+			begin = end;
+		}
+
+		return res;
+	};
+
+	Cost cost = foldTree<Cost>(input, visitor);
+	if (cost.open.empty()) return input->eval();
+
+	state->rootTask = state->addTask({input}, std::move(cost.open));
+	for (size_t i = 0; i < state->tasks.size(); ++i) {
+		if (state->tasks[i].children.empty())
+			pool.submit([state, i]() { runParallelEvalTask(state, i); });
+	}
+
+	pool.helpUntil(
+	  [&]() { return state->done.load(std::memory_order_acquire); });
+
+	if (state->error) std::rethrow_exception(state->error);
+	return state->tasks[state->rootTask].values[0];
+}
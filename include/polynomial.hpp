@@ -0,0 +1,529 @@
+#pragma once
+
+/**
+ * A sparse multivariate polynomial with Scalar coefficients.
+ *
+ * The exponents of a term are packed into a single 64 bit integer, with 8 bits
+ * per variable, so a polynomial can have up to 8 variables with a degree of at
+ * most 255 in each. Multiplying two monomials is then a single integer
+ * addition, and terms are stored in a hash map keyed by their packed
+ * exponents, so like terms are collected as they are produced.
+ *
+ * Variables are stored in sorted order. Arithmetic on polynomials with
+ * different variables first re-packs both operands in terms of the union of
+ * their variables.
+ */
+class Polynomial {
+public:
+	using Exponents = uint64_t;
+
+	static constexpr size_t maxVariables	= 8;
+	static constexpr uint64_t exponentBits = 8;
+	static constexpr uint64_t maxExponent  = (1ULL << exponentBits) - 1;
+
+	// Mix the bits of the packed exponents, since std::hash<uint64_t> is
+	// usually the identity function
+	struct ExponentHash {
+		size_t operator()(Exponents exponents) const {
+			exponents ^= exponents >> 33;
+			exponents *= 0xff51afd7ed558ccdULL;
+			exponents ^= exponents >> 33;
+			return static_cast<size_t>(exponents);
+		}
+	};
+
+	using Terms = std::unordered_map<Exponents, Scalar, ExponentHash>;
+
+	Polynomial() = default;
+
+	explicit Polynomial(const Scalar &constant) {
+		if (constant != 0) m_terms.emplace(0, constant);
+	}
+
+	LR_NODISCARD("") static Polynomial variable(const std::string &name) {
+		Polynomial res;
+		res.m_variables = {name};
+		res.m_terms.emplace(1, Scalar(1));
+		return res;
+	}
+
+	LR_NODISCARD("") const std::vector<std::string> &variables() const {
+		return m_variables;
+	}
+
+	LR_NODISCARD("") const Terms &terms() const { return m_terms; }
+
+	// The exponent of the variable at ``index`` in a packed set of exponents
+	LR_NODISCARD("")
+	static uint64_t exponent(Exponents exponents, size_t index) {
+		return (exponents >> (index * exponentBits)) & maxExponent;
+	}
+
+	LR_NODISCARD("") bool isZero() const { return m_terms.empty(); }
+
+	LR_NODISCARD("") bool isConstant() const {
+		return m_terms.empty() || (m_terms.size() == 1 && m_terms.count(0));
+	}
+
+	// The constant term of the polynomial
+	LR_NODISCARD("") Scalar constant() const {
+		auto it = m_terms.find(0);
+		return it == m_terms.end() ? Scalar(0) : it->second;
+	}
+
+	// The highest power of ``name`` in the polynomial
+	LR_NODISCARD("") uint64_t degree(const std::string &name) const {
+		auto it = std::find(m_variables.begin(), m_variables.end(), name);
+		if (it == m_variables.end()) return 0;
+		return degree(static_cast<size_t>(it - m_variables.begin()));
+	}
+
+	LR_NODISCARD("") uint64_t degree(size_t index) const {
+		uint64_t res = 0;
+		for (const auto &term : m_terms)
+			res = lrc::max(res, exponent(term.first, index));
+		return res;
+	}
+
+	// The index of a variable in variables(), or variables().size() if the
+	// polynomial does not use it
+	LR_NODISCARD("") size_t variableIndex(const std::string &name) const {
+		auto it =
+		  std::lower_bound(m_variables.begin(), m_variables.end(), name);
+		if (it == m_variables.end() || *it != name) return m_variables.size();
+		return static_cast<size_t>(it - m_variables.begin());
+	}
+
+	// The coefficient of name^power, as a polynomial in the other variables
+	LR_NODISCARD("")
+	Polynomial coefficient(const std::string &name, uint64_t power) const {
+		size_t index = variableIndex(name);
+		if (index == m_variables.size())
+			return power == 0 ? *this : Polynomial();
+
+		Exponents mask = ~(maxExponent << (index * exponentBits));
+		Polynomial res;
+		res.m_variables = m_variables;
+		for (const auto &term : m_terms) {
+			if (exponent(term.first, index) == power)
+				res.m_terms.emplace(term.first & mask, term.second);
+		}
+		return res;
+	}
+
+	// Remove the terms containing name^power
+	void removePower(const std::string &name, uint64_t power) {
+		size_t index = variableIndex(name);
+		if (index == m_variables.size()) {
+			if (power == 0) m_terms.clear();
+			return;
+		}
+
+		for (auto it = m_terms.begin(); it != m_terms.end();) {
+			if (exponent(it->first, index) == power)
+				it = m_terms.erase(it);
+			else
+				++it;
+		}
+	}
+
+	/**
+	 * The term with the largest packed exponents. Since no field can overflow,
+	 * comparing packed exponents is a lexicographic order on the exponents,
+	 * with the last variable being the most significant
+	 */
+	LR_NODISCARD("") std::pair<Exponents, Scalar> leadingTerm() const {
+		LR_ASSERT(!m_terms.empty(), "Zero polynomial has no leading term");
+		auto it = std::max_element(
+		  m_terms.begin(), m_terms.end(), [](const auto &a, const auto &b) {
+			  return a.first < b.first;
+		  });
+		return *it;
+	}
+
+	// Returns true if the product of two polynomials can be represented
+	LR_NODISCARD("")
+	static bool canMultiply(const Polynomial &lhs, const Polynomial &rhs) {
+		std::vector<std::string> vars;
+		std::set_union(lhs.m_variables.begin(),
+					   lhs.m_variables.end(),
+					   rhs.m_variables.begin(),
+					   rhs.m_variables.end(),
+					   std::back_inserter(vars));
+		if (vars.size() > maxVariables) return false;
+
+		for (const auto &var : vars) {
+			if (lhs.degree(var) + rhs.degree(var) > maxExponent) return false;
+		}
+		return true;
+	}
+
+	LR_NODISCARD("") Polynomial operator-() const {
+		Polynomial res = *this;
+		for (auto &term : res.m_terms) term.second = -term.second;
+		return res;
+	}
+
+	LR_NODISCARD("") Polynomial operator+(const Polynomial &other) const {
+		auto vars	   = mergeVariables(other);
+		Polynomial res = withVariables(vars);
+		Polynomial rhs = other.withVariables(vars);
+		for (const auto &term : rhs.m_terms)
+			res.m_terms[term.first] += term.second;
+		res.removeZeros();
+		return res;
+	}
+
+	LR_NODISCARD("") Polynomial operator-(const Polynomial &other) const {
+		return *this + (-other);
+	}
+
+	LR_NODISCARD("") Polynomial operator*(const Polynomial &other) const {
+		auto vars	   = mergeVariables(other);
+		Polynomial lhs = withVariables(vars);
+		Polynomial rhs = other.withVariables(vars);
+
+		for (size_t i = 0; i < vars.size(); ++i) {
+			LR_ASSERT(lhs.degree(i) + rhs.degree(i) <= maxExponent,
+					  "Polynomial degree in {} exceeds {}",
+					  vars[i],
+					  maxExponent);
+		}
+
+		// Exponents of the product are the sum of the packed exponents, since
+		// no field can overflow into the next
+		Polynomial res;
+		res.m_variables = std::move(vars);
+		res.m_terms.reserve(lhs.m_terms.size() * rhs.m_terms.size());
+		for (const auto &a : lhs.m_terms) {
+			for (const auto &b : rhs.m_terms)
+				res.m_terms[a.first + b.first] += a.second * b.second;
+		}
+
+		res.removeZeros();
+		return res;
+	}
+
+	LR_NODISCARD("") Polynomial pow(uint64_t power) const {
+		// Exponentiation by squaring
+		Polynomial res(1), base = *this;
+		while (power > 0) {
+			if (power & 1) res = res * base;
+			power >>= 1;
+			if (power > 0) base = base * base;
+		}
+		return res;
+	}
+
+	/**
+	 * Divide by another polynomial. Returns an empty optional if the division
+	 * leaves a remainder (or if the divisor has inexact coefficients, so the
+	 * remainder does not cancel exactly)
+	 */
+	LR_NODISCARD("")
+	std::optional<Polynomial> divide(const Polynomial &divisor) const {
+		LR_ASSERT(!divisor.isZero(), "Division by zero polynomial");
+		if (isZero()) return Polynomial();
+
+		if (divisor.isConstant()) {
+			Polynomial res = *this;
+			Scalar value   = divisor.constant();
+			for (auto &term : res.m_terms) term.second /= value;
+			return res;
+		}
+
+		std::vector<std::string> vars;
+		std::set_union(m_variables.begin(),
+					   m_variables.end(),
+					   divisor.m_variables.begin(),
+					   divisor.m_variables.end(),
+					   std::back_inserter(vars));
+		if (vars.size() > maxVariables) return std::nullopt;
+
+		Polynomial rem = withVariables(vars);
+		Polynomial div = divisor.withVariables(vars);
+		Polynomial res;
+		res.m_variables = vars;
+
+		std::vector<uint64_t> divDegrees;
+		for (size_t i = 0; i < vars.size(); ++i)
+			divDegrees.emplace_back(div.degree(i));
+
+		auto lead = div.leadingTerm();
+		while (!rem.isZero()) {
+			auto top = rem.leadingTerm();
+
+			// The leading term of the divisor must divide the leading term of
+			// the remainder, and the shifted divisor must be representable
+			for (size_t i = 0; i < vars.size(); ++i) {
+				uint64_t topExp = exponent(top.first, i);
+				uint64_t divExp = exponent(lead.first, i);
+				if (divExp > topExp ||
+					divDegrees[i] + topExp - divExp > maxExponent)
+					return std::nullopt;
+			}
+
+			Exponents shift = top.first - lead.first;
+			Scalar factor	= top.second / lead.second;
+			res.m_terms[shift] += factor;
+			for (const auto &term : div.m_terms)
+				rem.m_terms[term.first + shift] -= factor * term.second;
+
+			// The leading term cancels by construction
+			rem.m_terms.erase(top.first);
+			rem.removeZeros();
+		}
+
+		res.removeZeros();
+		return res;
+	}
+
+	LR_NODISCARD("") bool operator==(const Polynomial &other) const {
+		return (*this - other).isZero();
+	}
+
+	LR_NODISCARD("") bool operator!=(const Polynomial &other) const {
+		return !(*this == other);
+	}
+
+	/**
+	 * Convert a Component into a polynomial. Returns an empty optional if the
+	 * input is not a polynomial (e.g. it contains a function, a division by a
+	 * non-constant or a power which is not a non-negative integer), or uses
+	 * more variables or higher powers than can be represented.
+	 */
+	LR_NODISCARD("")
+	static std::optional<Polynomial>
+	fromComponent(const std::shared_ptr<Component> &input) {
+		auto visitor = [](const auto &node, auto first, auto last) {
+			return fromNode(node, first, last);
+		};
+
+		return foldTree<std::optional<Polynomial>>(input, visitor);
+	}
+
+	// Convert the polynomial into a tree of ADD, MUL and POW nodes
+	LR_NODISCARD("") std::shared_ptr<Component> toComponent() const {
+		if (m_terms.empty()) return std::make_shared<Number>(0);
+
+		auto addIt	 = findFunction("ADD");
+		auto mulIt	 = findFunction("MUL");
+		auto minusIt = findFunction("MINUS");
+		LR_ASSERT(addIt != nullptr, "Function not found");
+		LR_ASSERT(mulIt != nullptr, "Function not found");
+		LR_ASSERT(minusIt != nullptr, "Function not found");
+
+		std::vector<std::shared_ptr<Component>> vars;
+		for (const auto &name : m_variables)
+			vars.emplace_back(std::make_shared<Variable>(name));
+
+		std::vector<std::shared_ptr<Component>> terms;
+		for (const auto &term : sortedTerms()) {
+			std::vector<std::shared_ptr<Component>> factors;
+			Scalar coefficient = term.second;
+			bool negate		   = coefficient == -1 && term.first != 0;
+			if (coefficient != 1 && !negate)
+				factors.emplace_back(std::make_shared<Number>(coefficient));
+
+			for (size_t i = 0; i < m_variables.size(); ++i) {
+				uint64_t power = exponent(term.first, i);
+				if (power == 1) {
+					factors.emplace_back(vars[i]);
+				} else if (power > 1) {
+					factors.emplace_back(::pow(
+					  vars[i], std::make_shared<Number>(Scalar(power))));
+				}
+			}
+
+			if (factors.empty())
+				factors.emplace_back(std::make_shared<Number>(1));
+
+			auto monomial = factors.size() == 1
+							  ? factors[0]
+							  : makeAssociative(*mulIt, factors);
+
+			if (negate) {
+				auto func = std::make_shared<Function>(*minusIt);
+				func->addValue(monomial);
+				monomial = func;
+			}
+
+			terms.emplace_back(monomial);
+		}
+
+		if (terms.size() == 1) return terms[0];
+		return makeAssociative(*addIt, terms);
+	}
+
+	// Convert a single node, given its operands converted to polynomials (or
+	// empty if they could not be converted). Used by fromComponent() and
+	// horner()
+	template<typename Iter>
+	static std::optional<Polynomial>
+	fromNode(const std::shared_ptr<Component> &node, Iter first, Iter last) {
+		if (std::any_of(first, last, [](const auto &val) { return !val; }))
+			return std::nullopt;
+
+		std::string type = node->type();
+		if (type == "NUMBER")
+			return Polynomial(std::dynamic_pointer_cast<Number>(node)->value());
+		if (type == "VARIABLE") return variable(node->name());
+		if (type == "TREE") return *first;
+		if (type != "FUNCTION") return std::nullopt;
+
+		std::string name = node->name();
+		auto count		 = std::distance(first, last);
+		if (name == "PLUS" && count == 1) return *first;
+		if (name == "MINUS" && count == 1) return -**first;
+
+		if (name == "ADD" || name == "MUL") {
+			// Reject inputs which would use too many variables
+			std::vector<std::string> vars;
+			for (auto it = first; it != last; ++it) {
+				std::vector<std::string> tmp;
+				std::set_union(vars.begin(),
+							   vars.end(),
+							   (*it)->m_variables.begin(),
+							   (*it)->m_variables.end(),
+							   std::back_inserter(tmp));
+				vars = std::move(tmp);
+			}
+			if (vars.size() > maxVariables) return std::nullopt;
+
+			Polynomial res(name == "ADD" ? 0 : 1);
+			for (auto it = first; it != last; ++it) {
+				if (name == "ADD") {
+					res = res + **it;
+				} else {
+					for (size_t i = 0; i < vars.size(); ++i) {
+						if (res.degree(vars[i]) + (*it)->degree(vars[i]) >
+							maxExponent)
+							return std::nullopt;
+					}
+					res = res * **it;
+				}
+			}
+			return res;
+		}
+
+		if (count != 2) return std::nullopt;
+		const Polynomial &lhs = **first, &rhs = **(first + 1);
+
+		std::vector<std::string> vars;
+		std::set_union(lhs.m_variables.begin(),
+					   lhs.m_variables.end(),
+					   rhs.m_variables.begin(),
+					   rhs.m_variables.end(),
+					   std::back_inserter(vars));
+		if (vars.size() > maxVariables) return std::nullopt;
+
+		if (name == "SUB") return lhs - rhs;
+
+		if (name == "DIV") {
+			// Only division by a non-zero constant gives a polynomial
+			if (!rhs.isConstant() || rhs.isZero()) return std::nullopt;
+			return lhs * Polynomial(Scalar(1) / rhs.constant());
+		}
+
+		if (name == "POW") {
+			// The exponent must be a small, non-negative integer
+			if (!rhs.isConstant()) return std::nullopt;
+			Scalar power = rhs.constant();
+			if (power < 0 || power > Scalar(maxExponent) ||
+				power != Scalar(static_cast<int64_t>(power)))
+				return std::nullopt;
+
+			auto intPower = static_cast<uint64_t>(power);
+			for (const auto &var : lhs.m_variables) {
+				if (lhs.degree(var) * intPower > maxExponent)
+					return std::nullopt;
+			}
+			return lhs.pow(intPower);
+		}
+
+		return std::nullopt;
+	}
+
+private:
+	/**
+	 * Terms in a deterministic order: highest total degree first, then by
+	 * exponent of the first variable, the second variable, etc.
+	 */
+	LR_NODISCARD("")
+	std::vector<std::pair<Exponents, Scalar>> sortedTerms() const {
+		std::vector<std::pair<Exponents, Scalar>> res(m_terms.begin(),
+													  m_terms.end());
+		auto totalDegree = [&](Exponents exponents) {
+			uint64_t total = 0;
+			for (size_t i = 0; i < m_variables.size(); ++i)
+				total += exponent(exponents, i);
+			return total;
+		};
+
+		std::sort(res.begin(), res.end(), [&](const auto &a, const auto &b) {
+			uint64_t degA = totalDegree(a.first), degB = totalDegree(b.first);
+			if (degA != degB) return degA > degB;
+			for (size_t i = 0; i < m_variables.size(); ++i) {
+				uint64_t expA = exponent(a.first, i);
+				uint64_t expB = exponent(b.first, i);
+				if (expA != expB) return expA > expB;
+			}
+			return false;
+		});
+
+		return res;
+	}
+
+	// The sorted union of the variables of two polynomials
+	LR_NODISCARD("")
+	std::vector<std::string> mergeVariables(const Polynomial &other) const {
+		std::vector<std::string> res;
+		std::set_union(m_variables.begin(),
+					   m_variables.end(),
+					   other.m_variables.begin(),
+					   other.m_variables.end(),
+					   std::back_inserter(res));
+		LR_ASSERT(res.size() <= maxVariables,
+				  "Polynomials support at most {} variables",
+				  maxVariables);
+		return res;
+	}
+
+	// Re-pack the exponents in terms of a superset of this polynomial's
+	// variables
+	LR_NODISCARD("")
+	Polynomial withVariables(const std::vector<std::string> &vars) const {
+		if (vars == m_variables) return *this;
+
+		std::vector<size_t> positions;
+		for (const auto &name : m_variables) {
+			positions.emplace_back(static_cast<size_t>(
+			  std::lower_bound(vars.begin(), vars.end(), name) - vars.begin()));
+		}
+
+		Polynomial res;
+		res.m_variables = vars;
+		res.m_terms.reserve(m_terms.size());
+		for (const auto &term : m_terms) {
+			Exponents exponents = 0;
+			for (size_t i = 0; i < positions.size(); ++i) {
+				exponents |= exponent(term.first, i)
+							 << (positions[i] * exponentBits);
+			}
+			res.m_terms.emplace(exponents, term.second);
+		}
+		return res;
+	}
+
+	void removeZeros() {
+		for (auto it = m_terms.begin(); it != m_terms.end();) {
+			if (it->second == 0)
+				it = m_terms.erase(it);
+			else
+				++it;
+		}
+	}
+
+	std::vector<std::string> m_variables;
+	Terms m_terms;
+};
@@ -0,0 +1,209 @@
+#pragma once
+
+/**
+ * The types an expression can be evaluated in, chosen for each evaluation
+ * rather than when the program is built. Trees always hold their numbers as
+ * Scalar, so one tree can be evaluated in float for speed, double, or
+ * lrc::mpfr for accuracy. See evalAs() and Program::run()
+ */
+enum class Precision { FLOAT32, FLOAT64, MULTIPRECISION };
+
+inline Precision parsePrecision(const std::string &name) {
+	if (name == "float" || name == "float32") return Precision::FLOAT32;
+	if (name == "double" || name == "float64") return Precision::FLOAT64;
+	LR_ASSERT(name == "mpfr", "Unknown precision '{}'", name);
+	return Precision::MULTIPRECISION;
+}
+
+// Call ``func`` with a zero of the type for ``precision``
+template<typename Func>
+decltype(auto) withPrecision(Precision precision, Func &&func) {
+	switch (precision) {
+		case Precision::FLOAT32: return func(float(0));
+		case Precision::FLOAT64: return func(double(0));
+		default: return func(lrc::mpfr(0));
+	}
+}
+
+// Convert a value between Scalar and the evaluation types
+template<typename To, typename From>
+To scalarCast(const From &value) {
+	if constexpr (std::is_same_v<To, From>) {
+		return value;
+	} else {
+		return static_cast<To>(value);
+	}
+}
+
+/**
+ * The function ``name`` with ``numOperands`` operands, evaluated in T. This is
+ * the registered kernel for T (see Function::setKernel()), reduced pairwise
+ * for n-ary ADD and MUL, or if there is no kernel, ``functor`` with its
+ * operands and result converted to and from Scalar. Intervals cannot be
+ * converted, so functions without an Interval kernel cannot be evaluated
+ * over intervals
+ */
+template<typename T>
+std::function<T(const std::vector<T> &)>
+functorAs(const std::string &name, uint64_t numOperands,
+		  const std::function<Scalar(const std::vector<Scalar> &)> &functor) {
+	// Scalar functors are used as they are, since a node's functor may differ
+	// from its prototype's (see strengthReduce())
+	if constexpr (std::is_same_v<T, Scalar>) return functor;
+
+	const Function *prototype = findFunction(name);
+	const auto *kernel = prototype ? &prototype->kernel<T>() : nullptr;
+	if (kernel && *kernel && numOperands == prototype->numOperands())
+		return *kernel;
+
+	if (kernel && *kernel && isAssociative(name)) {
+		T identity(name == "ADD" ? 0 : 1);
+		return [binary = *kernel, identity](const std::vector<T> &operands) {
+			static thread_local std::vector<T> buffer;
+			static thread_local std::vector<T> pair(2);
+			buffer.assign(operands.begin(), operands.end());
+			return reduceBalanced(
+			  buffer, identity, [&](const T &a, const T &b) {
+				  pair[0] = a;
+				  pair[1] = b;
+				  return binary(pair);
+			  });
+		};
+	}
+
+	if constexpr (std::is_same_v<T, Interval>) {
+		LR_ASSERT(false, "Function {} has no interval implementation", name);
+		return {};
+	} else {
+		return [functor](const std::vector<T> &operands) {
+			static thread_local std::vector<Scalar> args;
+			args.clear();
+			for (const auto &val : operands)
+				args.emplace_back(scalarCast<Scalar>(val));
+			return scalarCast<T>(functor(args));
+		};
+	}
+}
+
+/**
+ * Evaluate a tree in T, without substituting the values of its variables.
+ * Functions are evaluated with functorAs(). To evaluate the same tree at many
+ * points, compile it and use Program::run() instead
+ */
+template<typename T>
+T evalAs(const std::shared_ptr<Component> &input,
+		 const std::map<std::string, T> &values) {
+	std::vector<T> operands;
+	auto visitor = [&](const auto &node, auto first, auto last) {
+		std::string type = node->type();
+		if (type == "NUMBER") {
+			return scalarCast<T>(
+			  std::dynamic_pointer_cast<Number>(node)->value());
+		}
+
+		if (type == "VARIABLE") {
+			auto it = values.find(node->name());
+			LR_ASSERT(it != values.end(),
+					  "No value given for variable {}",
+					  node->name());
+			return it->second;
+		}
+
+		LR_ASSERT(type == "FUNCTION" || type == "TREE",
+				  "{} object cannot be evaluated (numerically) directly",
+				  type);
+		if (type == "TREE") return *first;
+
+		auto func = std::dynamic_pointer_cast<Function>(node);
+		operands.assign(first, last);
+		return functorAs<T>(func->name(), operands.size(), func->functor())(
+		  operands);
+	};
+
+	return foldTree<T>(input, visitor);
+}
+
+/**
+ * Bounds on the range of a tree over a box: the interval containing every value
+ * of the tree for variables in their intervals in ``box``. Registered constants
+ * which are not in ``box`` are taken to be within an ulp of their value. The
+ * numbers in the tree are taken to be exact.
+ *
+ * The bounds are guaranteed, as every operation rounds outwards, but are wider
+ * than the true range when a variable appears more than once, since each use
+ * is bounded separately: x - x over [0, 1] is [-1, 1]. Splitting the box into
+ * smaller boxes gives tighter bounds.
+ */
+inline Interval evalInterval(const std::shared_ptr<Component> &input,
+							 std::map<std::string, Interval> box) {
+	for (const auto &[name, constant] : registry().constants()) {
+		if (box.find(name) != box.end()) continue;
+		Interval value = evalAs<Interval>(constant, {});
+		box.emplace(name,
+					Interval(nextDown(value.lower()), nextUp(value.upper())));
+	}
+
+	return evalAs<Interval>(input, box);
+}
+
+// Set the same kernel, written as a generic lambda, for every evaluation type
+template<typename Kernel>
+void setKernels(const std::string &name, Kernel kernel) {
+	for (const auto &func : functions) {
+		if (func->name() != name) continue;
+		func->setKernel<float>(kernel);
+		func->setKernel<double>(kernel);
+		func->setKernel<lrc::mpfr>(kernel);
+		func->setKernel<Interval>(kernel);
+	}
+}
+
+/**
+ * Give the standard functions kernels for each evaluation type, so float
+ * evaluation is not done in Scalar and rounded. Must be called after
+ * registerFunctions() and before publishRegistry()
+ */
+inline void registerKernels() {
+	setKernels("PLUS", [](const auto &x) { return x[0]; });
+	setKernels("MINUS", [](const auto &x) { return -x[0]; });
+	setKernels("ADD", [](const auto &x) { return x[0] + x[1]; });
+	setKernels("SUB", [](const auto &x) { return x[0] - x[1]; });
+	setKernels("MUL", [](const auto &x) { return x[0] * x[1]; });
+	setKernels("DIV", [](const auto &x) { return x[0] / x[1]; });
+	setKernels("POW", [](const auto &x) {
+		using std::pow;
+		return pow(x[0], x[1]);
+	});
+	setKernels("sqrt", [](const auto &x) {
+		using std::sqrt;
+		return sqrt(x[0]);
+	});
+	setKernels("exp", [](const auto &x) {
+		using std::exp;
+		return exp(x[0]);
+	});
+	setKernels("sin", [](const auto &x) {
+		using std::sin;
+		return sin(x[0]);
+	});
+	setKernels("cos", [](const auto &x) {
+		using std::cos;
+		return cos(x[0]);
+	});
+	setKernels("tan", [](const auto &x) {
+		using std::tan;
+		return tan(x[0]);
+	});
+	setKernels("asin", [](const auto &x) {
+		using std::asin;
+		return asin(x[0]);
+	});
+	setKernels("acos", [](const auto &x) {
+		using std::acos;
+		return acos(x[0]);
+	});
+	setKernels("atan", [](const auto &x) {
+		using std::atan;
+		return atan(x[0]);
+	});
+}
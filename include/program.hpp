@@ -0,0 +1,556 @@
+#pragma once
+
+// The names of the variables in a tree, in sorted order
+inline std::vector<std::string>
+variableNames(const std::shared_ptr<Component> &input) {
+	std::set<std::string> names;
+	auto visitor = [&](const auto &node, auto, auto) {
+		if (node->type() == "VARIABLE") names.insert(node->name());
+		return true;
+	};
+
+	foldTree<bool>(input, visitor);
+	return {names.begin(), names.end()};
+}
+
+/**
+ * A tree compiled into a list of instructions, for evaluating the same
+ * expression at many points. Each instruction acts on a chunk of up to
+ * ``chunkSize`` points at once, so the loop over the points is tight and the
+ * cost of dispatching an instruction is shared between them.
+ *
+ * Instructions read from slots: the input columns, then the constants, then
+ * the registers holding intermediate results. A subtree which appears more
+ * than once (by pointer, as produced by substitute() or horner()) is only
+ * evaluated once, and a register is reused once the last instruction which
+ * reads it has run, so the number of registers is usually much smaller than
+ * the number of nodes.
+ *
+ * A Program is not modified by running it, so it can be shared between
+ * threads, each with its own workspace. It can be run in any of the types in
+ * Precision, whatever Scalar is: constants are converted when it is run, and
+ * functions are called with functorAs(). Numbers with an exact value (see
+ * Number::exact()) are rounded from it, so 1/3 is as precise as T allows
+ * rather than as Scalar does, and named constants such as pi are looked up
+ * in ConstantCache at the precision of T.
+ */
+class Program {
+public:
+	static constexpr size_t chunkSize = 256;
+
+	enum class Op : uint8_t { ADD, SUB, MUL, DIV, NEG, SQRT, INTPOW, CALL };
+
+	struct Instruction {
+		Op op;
+		uint32_t dst = 0; // Register
+		uint32_t lhs = 0; // Slot
+		uint32_t rhs = 0; // Slot
+
+		// The power for INTPOW, or for CALL, the functor and the position of
+		// the operand slots in operands()
+		int64_t power	 = 0;
+		uint32_t functor = 0;
+		uint32_t first	 = 0;
+		uint32_t count	 = 0;
+	};
+
+	/**
+	 * Compile a tree. ``variables`` gives the names of the input columns, in
+	 * order, and every variable in the tree must be one of them (substitute
+	 * any others first). Constant subtrees are evaluated during compilation
+	 */
+	static Program compile(const std::shared_ptr<Component> &input,
+						   const std::vector<std::string> &variables) {
+		Program res;
+		res.m_variables = variables;
+		res.compileTree(input);
+		return res;
+	}
+
+	LR_NODISCARD("") const std::vector<std::string> &variables() const {
+		return m_variables;
+	}
+
+	LR_NODISCARD("") const std::vector<Instruction> &instructions() const {
+		return m_instructions;
+	}
+
+	LR_NODISCARD("") const std::vector<uint32_t> &operands() const {
+		return m_operands;
+	}
+
+	LR_NODISCARD("") size_t numRegisters() const { return m_numRegisters; }
+
+	// Save the program in a binary format, and load a saved program, looking
+	// up its functions in the registry. Defined in serialize.hpp
+	LR_NODISCARD("") std::string serialize() const;
+	static Program deserialize(std::string_view data);
+
+	/**
+	 * Evaluate the program at ``count`` points in T. ``columns[i]`` holds the
+	 * values of the i'th variable, and the results are written to ``out``.
+	 * ``workspace`` is resized as needed and may be reused between calls.
+	 * In lrc::mpfr, the workspace is a pool of MPFR values which are computed
+	 * in place, so reusing it avoids allocating (see runMpfr()). In float and
+	 * double, standard functions are computed a chunk at a time by the
+	 * vectorized kernel for ``accuracy`` if there is one (see vectorUnary())
+	 */
+	template<typename T>
+	void run(const std::vector<const T *> &columns, size_t count, T *out,
+			 std::vector<T> &workspace,
+			 Accuracy accuracy = Accuracy::ULP1) const {
+		LR_ASSERT(columns.size() == m_variables.size(),
+				  "Expected {} columns but got {}",
+				  m_variables.size(),
+				  columns.size());
+
+		if constexpr (std::is_same_v<T, lrc::mpfr>) {
+			runMpfr(columns, count, out, workspace);
+			return;
+		}
+
+		size_t numVariables = m_variables.size();
+		size_t numConstants = m_constants.size();
+		workspace.resize((numConstants + m_numRegisters) * chunkSize);
+
+		for (size_t i = 0; i < numConstants; ++i) {
+			std::fill_n(
+			  workspace.begin() + i * chunkSize, chunkSize, constantAs<T>(i));
+		}
+
+		// The vectorized kernel for each functor, or its scalar kernel if it
+		// has none
+		struct Call {
+			VectorUnary<T> unary   = nullptr;
+			VectorBinary<T> binary = nullptr;
+			std::function<T(const std::vector<T> &)> kernel;
+		};
+
+		std::vector<Call> calls(m_functors.size());
+		for (const auto &instr : m_instructions) {
+			if (instr.op != Op::CALL) continue;
+			const std::string &name = m_functionNames[instr.functor];
+			Call &call				= calls[instr.functor];
+			if (instr.count == 1) call.unary = vectorUnary<T>(name, accuracy);
+			if (instr.count == 2) call.binary = vectorBinary<T>(name, accuracy);
+			if (!call.unary && !call.binary) {
+				call.kernel = functorAs<T>(
+				  name, instr.count, m_functors[instr.functor]);
+			}
+		}
+
+		// Registers are written through ``registers``, and all slots are read
+		// through ``slots``
+		T *registers = workspace.data() + numConstants * chunkSize;
+		std::vector<const T *> slots(numVariables + numConstants +
+									 m_numRegisters);
+		for (size_t i = 0; i < numConstants + m_numRegisters; ++i)
+			slots[numVariables + i] = workspace.data() + i * chunkSize;
+
+		std::vector<T> args;
+		for (size_t start = 0; start < count; start += chunkSize) {
+			size_t n = lrc::min(chunkSize, count - start);
+			for (size_t i = 0; i < numVariables; ++i)
+				slots[i] = columns[i] + start;
+
+			for (const auto &instr : m_instructions) {
+				T *dst		 = registers + instr.dst * chunkSize;
+				const T *lhs = slots[instr.lhs];
+				const T *rhs = slots[instr.rhs];
+
+				switch (instr.op) {
+					case Op::ADD:
+						for (size_t i = 0; i < n; ++i) dst[i] = lhs[i] + rhs[i];
+						break;
+					case Op::SUB:
+						for (size_t i = 0; i < n; ++i) dst[i] = lhs[i] - rhs[i];
+						break;
+					case Op::MUL:
+						for (size_t i = 0; i < n; ++i) dst[i] = lhs[i] * rhs[i];
+						break;
+					case Op::DIV:
+						for (size_t i = 0; i < n; ++i) dst[i] = lhs[i] / rhs[i];
+						break;
+					case Op::NEG:
+						for (size_t i = 0; i < n; ++i) dst[i] = -lhs[i];
+						break;
+					case Op::SQRT:
+						for (size_t i = 0; i < n; ++i) {
+							using std::sqrt;
+							dst[i] = sqrt(lhs[i]);
+						}
+						break;
+					case Op::INTPOW:
+						for (size_t i = 0; i < n; ++i)
+							dst[i] = integerPow(lhs[i], instr.power);
+						break;
+					case Op::CALL: {
+						const Call &call		 = calls[instr.functor];
+						const uint32_t *operands =
+						  m_operands.data() + instr.first;
+						if (call.unary) {
+							call.unary(slots[operands[0]], dst, n);
+							break;
+						}
+
+						if (call.binary) {
+							call.binary(
+							  slots[operands[0]], slots[operands[1]], dst, n);
+							break;
+						}
+
+						args.resize(instr.count);
+						for (size_t i = 0; i < n; ++i) {
+							for (uint32_t j = 0; j < instr.count; ++j)
+								args[j] = slots[operands[j]][i];
+							dst[i] = call.kernel(args);
+						}
+						break;
+					}
+				}
+			}
+
+			std::copy_n(slots[m_result], n, out + start);
+		}
+	}
+
+	template<typename T>
+	void run(const std::vector<const T *> &columns, size_t count, T *out,
+			 Accuracy accuracy = Accuracy::ULP1) const {
+		std::vector<T> workspace;
+		run(columns, count, out, workspace, accuracy);
+	}
+
+	// Evaluate the program at a single point
+	template<typename T = Scalar>
+	LR_NODISCARD("")
+	T eval(const std::vector<T> &values) const {
+		std::vector<const T *> columns;
+		for (const auto &val : values) columns.emplace_back(&val);
+
+		T res;
+		run(columns, 1, &res);
+		return res;
+	}
+
+private:
+	// Where a constant comes from, so it can be rounded to the type the
+	// program is run in
+	struct ConstantSource {
+		std::optional<Rational> exact = std::nullopt;
+
+		// Of a constant in ConstantCache, if it is one
+		std::string name = "";
+	};
+
+	// The precision of T in bits, the current one for lrc::mpfr
+	template<typename T>
+	static int64_t precisionOf() {
+		if constexpr (std::is_same_v<T, lrc::mpfr>) {
+			return static_cast<int64_t>(lrc::mpfr::get_default_prec());
+		} else {
+			return std::numeric_limits<T>::digits;
+		}
+	}
+
+	// Constant ``i`` rounded to T
+	template<typename T>
+	LR_NODISCARD("")
+	T constantAs(size_t i) const {
+		const ConstantSource &source = m_sources[i];
+		if (!source.name.empty()) {
+			return scalarCast<T>(
+			  ConstantCache::global().value(source.name, precisionOf<T>()));
+		}
+		if (source.exact) return source.exact->template round<T>();
+		return scalarCast<T>(m_constants[i]);
+	}
+
+	// run() in lrc::mpfr. Defined in mpfrpool.hpp
+	void runMpfr(const std::vector<const lrc::mpfr *> &columns, size_t count,
+				 lrc::mpfr *out, std::vector<lrc::mpfr> &workspace) const;
+
+	// A value during compilation: an input column, a constant, or the
+	// result of the instruction with the given index
+	struct Ref {
+		enum Kind : uint8_t { VARIABLE, CONSTANT, VALUE } kind;
+		uint32_t index;
+	};
+
+	// An instruction whose operands have not been assigned to slots yet
+	struct Pending {
+		Instruction instr;
+		std::vector<Ref> operands;
+	};
+
+	void compileTree(const std::shared_ptr<Component> &input) {
+		std::vector<Pending> pending;
+		std::map<Scalar, uint32_t> constantIndex;
+		std::map<std::string, uint32_t> exactIndex;
+		std::map<std::string, uint32_t> namedIndex;
+
+		auto addConstant = [&](const Scalar &value, ConstantSource source) {
+			m_constants.emplace_back(value);
+			m_sources.emplace_back(std::move(source));
+			return static_cast<uint32_t>(m_constants.size() - 1);
+		};
+
+		// Equal constants share a slot, except zeros (which may differ in
+		// sign) and NaNs (which do not compare equal). Zeros are exact in
+		// every type, so their sign is kept by not using their exact value
+		auto constant = [&](const Scalar &value,
+							const std::optional<Rational> &exact) {
+			if (value == 0 || value != value)
+				return Ref {Ref::CONSTANT,
+							addConstant(value, ConstantSource())};
+
+			if (exact) {
+				auto it = exactIndex.find(exact->str());
+				if (it == exactIndex.end()) {
+					auto index = addConstant(value, ConstantSource {exact, ""});
+					it = exactIndex.emplace(exact->str(), index).first;
+				}
+				return Ref {Ref::CONSTANT, it->second};
+			}
+
+			auto it = constantIndex.find(value);
+			if (it == constantIndex.end()) {
+				auto index = addConstant(value, ConstantSource());
+				it		   = constantIndex.emplace(value, index).first;
+			}
+			return Ref {Ref::CONSTANT, it->second};
+		};
+
+		// Named constants share a slot by name
+		auto named = [&](const Number &number) {
+			const std::string &name = number.constant();
+			auto it					= namedIndex.find(name);
+			if (it == namedIndex.end()) {
+				ConstantSource source;
+				source.name = name;
+				auto index	= addConstant(number.value(), std::move(source));
+				it			= namedIndex.emplace(name, index).first;
+			}
+			return Ref {Ref::CONSTANT, it->second};
+		};
+
+		auto emit = [&](Op op, std::vector<Ref> operands) {
+			Pending res;
+			res.instr.op = op;
+			res.operands = std::move(operands);
+			pending.emplace_back(std::move(res));
+			return Ref {Ref::VALUE, static_cast<uint32_t>(pending.size() - 1)};
+		};
+
+		auto numberValue = [](const std::shared_ptr<Component> &node,
+							  Scalar &value) {
+			if (node->type() != "NUMBER") return false;
+			value = std::dynamic_pointer_cast<Number>(node)->value();
+			return true;
+		};
+
+		// Shared subtrees are only compiled once
+		std::unordered_map<const Component *, Ref> compiled;
+		auto prune = [&](const auto &node, Ref &result) {
+			auto it = compiled.find(node.get());
+			if (it == compiled.end()) return false;
+			result = it->second;
+			return true;
+		};
+
+		std::vector<Scalar> values;
+		std::vector<std::shared_ptr<Component>> exactOperands;
+		auto compileNode = [&](const auto &node, auto first, auto last) {
+			std::string type = node->type();
+			if (type == "NUMBER") {
+				auto number = std::dynamic_pointer_cast<Number>(node);
+				if (!number->constant().empty()) return named(*number);
+				return constant(number->value(), number->exact());
+			}
+
+			if (type == "VARIABLE") {
+				std::string name = node->name();
+				auto it =
+				  std::find(m_variables.begin(), m_variables.end(), name);
+				LR_ASSERT(it != m_variables.end(),
+						  "Variable {} is not an input of the program",
+						  name);
+				return Ref {Ref::VARIABLE,
+							static_cast<uint32_t>(it - m_variables.begin())};
+			}
+
+			if (type != "FUNCTION") return *first;
+
+			// Evaluate functions of constants now, except of named constants,
+			// whose values depend on the type the program is run in
+			bool allConstant = std::all_of(first, last, [&](const Ref &ref) {
+				return ref.kind == Ref::CONSTANT &&
+					   m_sources[ref.index].name.empty();
+			});
+			if (allConstant) {
+				// Exact operands are combined exactly where possible, so the
+				// result is still rounded to the type the program is run in
+				exactOperands.clear();
+				for (auto it = first; it != last; ++it) {
+					const auto &exact = m_sources[it->index].exact;
+					if (!exact) break;
+					exactOperands.emplace_back(
+					  std::make_shared<Number>(*exact));
+				}
+
+				if (exactOperands.size() == size_t(last - first)) {
+					auto exact = exactEval(node->withChildren(exactOperands));
+					if (exact) return constant(exact->toScalar(), exact);
+				}
+
+				values.clear();
+				for (auto it = first; it != last; ++it)
+					values.emplace_back(m_constants[it->index]);
+				return constant(node->evalNode(values), std::nullopt);
+			}
+
+			std::string name = node->name();
+			std::vector<Ref> refs(first, last);
+
+			if (name == "PLUS") return refs[0];
+			if (name == "MINUS") return emit(Op::NEG, {refs[0]});
+
+			if (name == "ADD" || name == "MUL") {
+				// Written as a chain of binary operations
+				Op op	= name == "ADD" ? Op::ADD : Op::MUL;
+				Ref res = refs[0];
+				for (size_t i = 1; i < refs.size(); ++i)
+					res = emit(op, {res, refs[i]});
+				return res;
+			}
+
+			if (name == "SUB") return emit(Op::SUB, refs);
+			if (name == "DIV") return emit(Op::DIV, refs);
+
+			Scalar power;
+			if (name == "POW" && numberValue(node->children()[1], power)) {
+				if (power == Scalar(0.5)) return emit(Op::SQRT, {refs[0]});
+
+				if (isSmallIntegerPower(power)) {
+					Ref res		= emit(Op::INTPOW, {refs[0]});
+					auto &instr = pending[res.index].instr;
+					instr.power = static_cast<int64_t>(power);
+					return res;
+				}
+			}
+
+			auto func	  = std::dynamic_pointer_cast<Function>(node);
+			Ref res		  = emit(Op::CALL, refs);
+			auto &instr	  = pending[res.index].instr;
+			instr.functor = static_cast<uint32_t>(m_functors.size());
+			m_functors.emplace_back(func->functor());
+			m_functionNames.emplace_back(name);
+			return res;
+		};
+
+		auto visitor = [&](const auto &node, auto first, auto last) {
+			Ref res = compileNode(node, first, last);
+			compiled.emplace(node.get(), res);
+			return res;
+		};
+
+		Ref result = foldTree<Ref>(input, visitor, prune);
+		allocateRegisters(pending, result);
+	}
+
+	// Assign slots to the operands and results of the pending instructions,
+	// reusing each register after the last instruction which reads it
+	void allocateRegisters(std::vector<Pending> &pending, const Ref &result) {
+		size_t numVariables = m_variables.size();
+		size_t numConstants = m_constants.size();
+
+		std::vector<size_t> lastUse(pending.size(), 0);
+		for (size_t i = 0; i < pending.size(); ++i) {
+			for (const auto &ref : pending[i].operands)
+				if (ref.kind == Ref::VALUE) lastUse[ref.index] = i;
+		}
+
+		// The result must not be overwritten
+		if (result.kind == Ref::VALUE) lastUse[result.index] = pending.size();
+
+		std::vector<uint32_t> registers(pending.size());
+		std::vector<uint32_t> free;
+
+		auto slot = [&](const Ref &ref) {
+			switch (ref.kind) {
+				case Ref::VARIABLE: return ref.index;
+				case Ref::CONSTANT:
+					return static_cast<uint32_t>(numVariables + ref.index);
+				default:
+					return static_cast<uint32_t>(numVariables + numConstants +
+												 registers[ref.index]);
+			}
+		};
+
+		for (size_t i = 0; i < pending.size(); ++i) {
+			auto &instr = pending[i].instr;
+			std::vector<uint32_t> slots;
+			for (const auto &ref : pending[i].operands)
+				slots.emplace_back(slot(ref));
+
+			if (instr.op == Op::CALL) {
+				instr.first = static_cast<uint32_t>(m_operands.size());
+				instr.count = static_cast<uint32_t>(slots.size());
+				m_operands.insert(m_operands.end(), slots.begin(), slots.end());
+			} else {
+				instr.lhs = slots[0];
+				instr.rhs = slots.size() > 1 ? slots[1] : slots[0];
+			}
+
+			// Operands read for the last time can be overwritten by this
+			// instruction, since each point only depends on the same point
+			// of its operands
+			for (const auto &ref : pending[i].operands) {
+				if (ref.kind == Ref::VALUE && lastUse[ref.index] == i) {
+					free.emplace_back(registers[ref.index]);
+					lastUse[ref.index] = pending.size() + 1; // Only free once
+				}
+			}
+
+			if (free.empty()) {
+				registers[i] = static_cast<uint32_t>(m_numRegisters++);
+			} else {
+				registers[i] = free.back();
+				free.pop_back();
+			}
+
+			instr.dst = registers[i];
+			m_instructions.emplace_back(instr);
+		}
+
+		m_result = slot(result);
+	}
+
+	std::vector<std::string> m_variables;
+	std::vector<Scalar> m_constants;
+	std::vector<ConstantSource> m_sources; // Of each constant
+	std::vector<std::function<Scalar(const std::vector<Scalar> &)>> m_functors;
+	std::vector<std::string> m_functionNames; // Of each functor, for saving
+	std::vector<Instruction> m_instructions;
+	std::vector<uint32_t> m_operands;
+	size_t m_numRegisters = 0;
+	uint32_t m_result	  = 0;
+};
+
+/**
+ * Prepare a tree for evaluating many times and compile it. Registered
+ * constants which are not inputs are substituted (see constantTree()), and
+ * the tree is rewritten with horner() and strengthReduce() before compiling
+ */
+inline Program compileExpression(const std::shared_ptr<Component> &input,
+								 const std::vector<std::string> &variables) {
+	std::map<std::string, std::shared_ptr<Component>> substitutions;
+	for (const auto &[name, tree] : registry().constants()) {
+		if (std::find(variables.begin(), variables.end(), name) ==
+			variables.end())
+			substitutions.emplace(name, constantTree(name, tree));
+	}
+
+	auto tree = flatten(substitute(input, substitutions));
+	return Program::compile(strengthReduce(horner(tree)), variables);
+}
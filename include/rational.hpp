@@ -0,0 +1,533 @@
+#pragma once
+
+// Integers up to this magnitude are represented exactly by a double
+constexpr int64_t maxExactInteger = int64_t(1) << 53;
+
+/**
+ * The gcd of the coefficients of a polynomial if they are all integers, or 0 if
+ * any of them is not (or is too large to be represented exactly)
+ */
+inline int64_t integerContent(const Polynomial &poly) {
+	int64_t res = 0;
+	for (const auto &term : poly.terms()) {
+		const Scalar &value = term.second;
+		if (value > Scalar(maxExactInteger) || value < -Scalar(maxExactInteger))
+			return 0;
+
+		auto integer = static_cast<int64_t>(value);
+		if (Scalar(integer) != value) return 0;
+		res = std::gcd(res, integer);
+	}
+	return res;
+}
+
+/**
+ * Pick a canonical multiple of a polynomial: integer coefficients are divided
+ * by their gcd, anything else by the leading coefficient, and the leading
+ * coefficient is made positive
+ */
+inline Polynomial normalizeMultiple(const Polynomial &poly) {
+	if (poly.isZero()) return poly;
+
+	Scalar lead	 = poly.leadingTerm().second;
+	Scalar scale = lead;
+	if (int64_t content = integerContent(poly)) {
+		scale = Scalar(content);
+		if (lead < 0) scale = -scale;
+	}
+
+	return *poly.divide(Polynomial(scale));
+}
+
+inline Polynomial polynomialGcd(const Polynomial &lhs, const Polynomial &rhs);
+
+// The gcd of the coefficients of a polynomial when it is treated as a
+// polynomial in ``var``
+inline Polynomial polynomialContent(const Polynomial &poly,
+									const std::string &var) {
+	uint64_t degree = poly.degree(var);
+	if (degree == 0) return poly;
+
+	Polynomial res;
+	for (uint64_t power = 0; power <= degree; ++power) {
+		auto coeff = poly.coefficient(var, power);
+		if (coeff.isZero()) continue;
+		res = res.isZero() ? coeff : polynomialGcd(res, coeff);
+		if (res.isConstant()) return Polynomial(1);
+	}
+	return res;
+}
+
+/**
+ * A multiple of the pseudo-remainder of lhs / rhs, treating both as
+ * polynomials in ``var``. Returns an empty optional if an intermediate result
+ * cannot be represented
+ */
+inline std::optional<Polynomial> pseudoRemainder(const Polynomial &lhs,
+												 const Polynomial &rhs,
+												 const std::string &var) {
+	uint64_t rhsDegree = rhs.degree(var);
+	Polynomial lead	   = rhs.coefficient(var, rhsDegree);
+	Polynomial res	   = lhs;
+
+	while (!res.isZero() && res.degree(var) >= rhsDegree) {
+		uint64_t degree = res.degree(var);
+		Polynomial term = res.coefficient(var, degree) *
+						  Polynomial::variable(var).pow(degree - rhsDegree);
+		if (!Polynomial::canMultiply(res, lead) ||
+			!Polynomial::canMultiply(term, rhs))
+			return std::nullopt;
+
+		// The leading terms cancel, but may leave rounding errors behind if
+		// the coefficients are not exact. Only the remainder's multiples
+		// matter to the caller, so it is rescaled to keep the coefficients
+		// small enough to be exact
+		res = res * lead - term * rhs;
+		res.removePower(var, degree);
+		res = normalizeMultiple(res);
+	}
+
+	return res;
+}
+
+/**
+ * The greatest common divisor of two multivariate polynomials, found with the
+ * primitive polynomial remainder sequence in one variable, recursing on the
+ * content (the gcd of the coefficients) in the remaining variables.
+ *
+ * Coefficients are only exact if they are integers small enough to be stored
+ * exactly. If an intermediate result is inexact or cannot be represented, the
+ * result may not divide the inputs, so callers must check the division.
+ */
+inline Polynomial polynomialGcd(const Polynomial &lhs, const Polynomial &rhs) {
+	if (lhs.isZero()) return normalizeMultiple(rhs);
+	if (rhs.isZero()) return normalizeMultiple(lhs);
+	if (lhs.isConstant() || rhs.isConstant()) return Polynomial(1);
+
+	// Use the last variable which appears in either polynomial
+	std::vector<std::string> vars;
+	std::set_union(lhs.variables().begin(),
+				   lhs.variables().end(),
+				   rhs.variables().begin(),
+				   rhs.variables().end(),
+				   std::back_inserter(vars));
+	auto varIt = std::find_if(vars.rbegin(), vars.rend(), [&](const auto &v) {
+		return lhs.degree(v) > 0 || rhs.degree(v) > 0;
+	});
+	const std::string &var = *varIt;
+
+	if (lhs.degree(var) == 0)
+		return polynomialGcd(lhs, polynomialContent(rhs, var));
+	if (rhs.degree(var) == 0)
+		return polynomialGcd(polynomialContent(lhs, var), rhs);
+
+	Polynomial lhsContent = polynomialContent(lhs, var);
+	Polynomial rhsContent = polynomialContent(rhs, var);
+	Polynomial content	  = polynomialGcd(lhsContent, rhsContent);
+
+	auto a = lhs.divide(lhsContent);
+	auto b = rhs.divide(rhsContent);
+	if (!a || !b) return Polynomial(1);
+	if (a->degree(var) < b->degree(var)) std::swap(a, b);
+
+	while (true) {
+		auto rem = pseudoRemainder(*a, *b, var);
+		if (!rem) return Polynomial(1);
+		if (rem->isZero()) break;
+
+		auto primitive = rem->divide(polynomialContent(*rem, var));
+		if (!primitive) return Polynomial(1);
+		a = std::move(b);
+		b = normalizeMultiple(*primitive);
+	}
+
+	if (!Polynomial::canMultiply(content, *b)) return Polynomial(1);
+	return normalizeMultiple(content * *b);
+}
+
+/**
+ * A quotient of two polynomials, kept in a normal form: the numerator and
+ * denominator have no common factor, and the denominator is scaled so its
+ * leading coefficient is positive (and its coefficients are coprime integers
+ * where possible). A constant denominator is always 1.
+ */
+class RationalFunction {
+public:
+	RationalFunction() : m_denominator(1) {}
+
+	explicit RationalFunction(Polynomial numerator,
+							  Polynomial denominator = Polynomial(1)) :
+			m_numerator(std::move(numerator)),
+			m_denominator(std::move(denominator)) {
+		LR_ASSERT(!m_denominator.isZero(), "Denominator cannot be zero");
+		normalize();
+	}
+
+	LR_NODISCARD("") const Polynomial &numerator() const {
+		return m_numerator;
+	}
+
+	LR_NODISCARD("") const Polynomial &denominator() const {
+		return m_denominator;
+	}
+
+	LR_NODISCARD("") bool isZero() const { return m_numerator.isZero(); }
+
+	LR_NODISCARD("") bool isConstant() const {
+		return m_numerator.isConstant() && m_denominator.isConstant();
+	}
+
+	LR_NODISCARD("") RationalFunction operator-() const {
+		RationalFunction res = *this;
+		res.m_numerator		 = -res.m_numerator;
+		return res;
+	}
+
+	LR_NODISCARD("")
+	RationalFunction operator+(const RationalFunction &other) const {
+		if (m_denominator == other.m_denominator) {
+			return RationalFunction(m_numerator + other.m_numerator,
+									m_denominator);
+		}
+
+		return RationalFunction(m_numerator * other.m_denominator +
+								  other.m_numerator * m_denominator,
+								m_denominator * other.m_denominator);
+	}
+
+	LR_NODISCARD("")
+	RationalFunction operator-(const RationalFunction &other) const {
+		return *this + (-other);
+	}
+
+	LR_NODISCARD("")
+	RationalFunction operator*(const RationalFunction &other) const {
+		return RationalFunction(m_numerator * other.m_numerator,
+								m_denominator * other.m_denominator);
+	}
+
+	LR_NODISCARD("")
+	RationalFunction operator/(const RationalFunction &other) const {
+		LR_ASSERT(!other.isZero(), "Division by zero");
+		return RationalFunction(m_numerator * other.m_denominator,
+								m_denominator * other.m_numerator);
+	}
+
+	LR_NODISCARD("") RationalFunction pow(int64_t power) const {
+		LR_ASSERT(power >= 0 || !isZero(), "Division by zero");
+
+		// The numerator and denominator are already coprime, so their powers
+		// are too
+		RationalFunction res;
+		auto absPower	  = static_cast<uint64_t>(power < 0 ? -power : power);
+		res.m_numerator	  = m_numerator.pow(absPower);
+		res.m_denominator = m_denominator.pow(absPower);
+		if (power < 0) std::swap(res.m_numerator, res.m_denominator);
+		res.normalizeScale();
+		return res;
+	}
+
+	// Returns true if the numerators and denominators of two rational
+	// functions can be multiplied together
+	LR_NODISCARD("")
+	static bool canCombine(const RationalFunction &lhs,
+						   const RationalFunction &rhs) {
+		return Polynomial::canMultiply(lhs.m_numerator, rhs.m_numerator) &&
+			   Polynomial::canMultiply(lhs.m_numerator, rhs.m_denominator) &&
+			   Polynomial::canMultiply(lhs.m_denominator, rhs.m_numerator) &&
+			   Polynomial::canMultiply(lhs.m_denominator, rhs.m_denominator);
+	}
+
+	/**
+	 * Convert a Component into a rational function. Returns an empty optional
+	 * if the input contains anything other than numbers, variables, the
+	 * arithmetic operators and integer powers, or if it cannot be represented
+	 * (see Polynomial)
+	 */
+	LR_NODISCARD("")
+	static std::optional<RationalFunction>
+	fromComponent(const std::shared_ptr<Component> &input) {
+		auto visitor = [](const auto &node, auto first, auto last) {
+			return fromNode(node, first, last);
+		};
+
+		return foldTree<std::optional<RationalFunction>>(input, visitor);
+	}
+
+	LR_NODISCARD("") std::shared_ptr<Component> toComponent() const {
+		if (m_denominator.isConstant()) return m_numerator.toComponent();
+		return div(m_numerator.toComponent(), m_denominator.toComponent());
+	}
+
+	// Convert a single node, given its operands converted to rational
+	// functions (or empty if they could not be converted). The operands may be
+	// optionals or pointers
+	template<typename Iter>
+	static std::optional<RationalFunction>
+	fromNode(const std::shared_ptr<Component> &node, Iter first, Iter last) {
+		if (std::any_of(first, last, [](const auto &val) { return !val; }))
+			return std::nullopt;
+
+		std::string type = node->type();
+		if (type == "NUMBER") {
+			Scalar value = std::dynamic_pointer_cast<Number>(node)->value();
+			return RationalFunction(Polynomial(value));
+		}
+		if (type == "VARIABLE")
+			return RationalFunction(Polynomial::variable(node->name()));
+		if (type == "TREE") return **first;
+		if (type != "FUNCTION") return std::nullopt;
+
+		std::string name = node->name();
+		auto count		 = std::distance(first, last);
+		if (name == "PLUS" && count == 1) return **first;
+		if (name == "MINUS" && count == 1) return -**first;
+
+		if (name == "ADD" || name == "MUL") {
+			RationalFunction res(Polynomial(name == "ADD" ? 0 : 1));
+			for (auto it = first; it != last; ++it) {
+				if (!canCombine(res, **it)) return std::nullopt;
+				res = name == "ADD" ? res + **it : res * **it;
+			}
+			return res;
+		}
+
+		if (count != 2) return std::nullopt;
+		const RationalFunction &lhs = **first, &rhs = **(first + 1);
+
+		if (name == "SUB" || name == "DIV") {
+			if (!canCombine(lhs, rhs)) return std::nullopt;
+			if (name == "SUB") return lhs - rhs;
+			if (rhs.isZero()) return std::nullopt;
+			return lhs / rhs;
+		}
+
+		if (name == "POW") {
+			// The exponent must be a small integer
+			if (!rhs.isConstant()) return std::nullopt;
+			Scalar power = rhs.m_numerator.constant();
+			auto limit	 = Scalar(Polynomial::maxExponent);
+			if (power < -limit || power > limit ||
+				power != Scalar(static_cast<int64_t>(power)))
+				return std::nullopt;
+
+			auto intPower = static_cast<int64_t>(power);
+			if (intPower < 0 && lhs.isZero()) return std::nullopt;
+
+			auto absPower = static_cast<uint64_t>(intPower < 0 ? -intPower
+															   : intPower);
+			for (const auto *poly : {&lhs.m_numerator, &lhs.m_denominator}) {
+				for (const auto &var : poly->variables()) {
+					if (poly->degree(var) * absPower > Polynomial::maxExponent)
+						return std::nullopt;
+				}
+			}
+			return lhs.pow(intPower);
+		}
+
+		return std::nullopt;
+	}
+
+private:
+	void normalize() {
+		if (m_numerator.isZero()) {
+			m_denominator = Polynomial(1);
+			return;
+		}
+
+		// Cancel common factors. The gcd is only used if it divides both
+		// exactly, since it may be wrong if the coefficients are inexact
+		if (!m_denominator.isConstant()) {
+			Polynomial gcd = polynomialGcd(m_numerator, m_denominator);
+			if (!gcd.isConstant()) {
+				auto numerator	 = m_numerator.divide(gcd);
+				auto denominator = m_denominator.divide(gcd);
+				if (numerator && denominator) {
+					m_numerator	  = std::move(*numerator);
+					m_denominator = std::move(*denominator);
+				}
+			}
+		}
+
+		normalizeScale();
+	}
+
+	// Scale the numerator and denominator by the same constant so the
+	// denominator is in its canonical form
+	void normalizeScale() {
+		if (m_denominator.isConstant()) {
+			m_numerator	  = *m_numerator.divide(m_denominator);
+			m_denominator = Polynomial(1);
+			return;
+		}
+
+		Scalar lead	 = m_denominator.leadingTerm().second;
+		Scalar scale = lead;
+		int64_t numContent = integerContent(m_numerator);
+		int64_t denContent = integerContent(m_denominator);
+		if (numContent != 0 && denContent != 0) {
+			scale = Scalar(std::gcd(numContent, denContent));
+			if (lead < 0) scale = -scale;
+		}
+
+		if (scale == 1) return;
+		m_numerator	  = *m_numerator.divide(Polynomial(scale));
+		m_denominator = *m_denominator.divide(Polynomial(scale));
+	}
+
+	Polynomial m_numerator;
+	Polynomial m_denominator;
+};
+
+/**
+ * Expand every rational part of a tree and collect like terms, e.g.
+ * (x + 1)^2 * sin(x) becomes (x^2 + 2x + 1) * sin(x), and quotients are
+ * combined into a single fraction in lowest terms (see RationalFunction), so
+ * ((x^2 - x - 1) / (x^2 + x + 1))^5 becomes the quotient of the two expanded
+ * fifth powers. Rational subtrees are converted back into a tree only where
+ * they meet a non-rational node.
+ *
+ * A subtree which needs more than Polynomial::maxVariables variables, or a
+ * degree above Polynomial::maxExponent in any of them, cannot be represented,
+ * so it is left as it is and only its operands are expanded
+ */
+std::shared_ptr<Component> expand(const std::shared_ptr<Component> &input) {
+	struct Expanded {
+		std::optional<RationalFunction> value;
+		std::shared_ptr<Component> node;
+
+		std::shared_ptr<Component> component() const {
+			return value ? value->toComponent() : node;
+		}
+	};
+
+	std::vector<std::optional<RationalFunction>> operands;
+	std::vector<std::shared_ptr<Component>> values;
+
+	auto visitor = [&](const auto &node, auto first, auto last) {
+		operands.clear();
+		for (auto it = first; it != last; ++it)
+			operands.emplace_back(it->value);
+
+		Expanded res;
+		if (node->type() != "TREE") {
+			res.value = RationalFunction::fromNode(
+			  node, operands.begin(), operands.end());
+		}
+		if (res.value) return res;
+
+		values.clear();
+		for (auto it = first; it != last; ++it)
+			values.emplace_back(it->component());
+		res.node = node->withChildren(values);
+		return res;
+	};
+
+	return foldTree<Expanded>(input, visitor).component();
+}
+
+/**
+ * Put rational expressions into the normal form p / q, where p and q are
+ * expanded polynomials with no common factor. This is applied to divisions and
+ * to any sum, difference, product or power with a division as an operand, so
+ * repeated derivatives of a rational expression stay the same size as the
+ * reduced result rather than nesting a new quotient at every step.
+ *
+ * The rule is applied bottom-up, to nested divisions as well as the outermost
+ * one, so the conversion of each node is remembered for the rest of the
+ * simplify() pass. Each node is then converted once rather than once for every
+ * division above it.
+ */
+class SimplifyRational : public SimplificationRule {
+public:
+	SimplifyRational() = default;
+
+	LR_NODISCARD("")
+	bool
+	applicable(const std::shared_ptr<Component> &component) const override {
+		if (component->type() != "FUNCTION") return false;
+
+		std::string name = component->name();
+		if (name == "DIV") return true;
+		if (name != "ADD" && name != "SUB" && name != "MUL" &&
+			name != "MINUS" && name != "POW")
+			return false;
+
+		const auto &values = component->children();
+		if (name == "POW" && values.size() == 2 &&
+			values[1]->type() == "NUMBER" &&
+			std::dynamic_pointer_cast<Number>(values[1])->value() < 0)
+			return true;
+
+		return std::any_of(values.begin(), values.end(), [](const auto &val) {
+			return val->type() == "FUNCTION" && val->name() == "DIV";
+		});
+	}
+
+	LR_NODISCARD("")
+	std::shared_ptr<Component>
+	simplifyInput(const std::shared_ptr<Component> &component) const override {
+		Memo local;
+		Memo &memo =
+		  simplifyPass != nullptr ? simplifyPass->ruleState<Memo>() : local;
+
+		// Constant expressions are kept exact where possible, since the
+		// coefficients of polynomials are Scalars
+		const Converted &converted = convert(component, memo);
+		if (converted.exact) return std::make_shared<Number>(*converted.exact);
+		if (!converted.value) return component;
+
+		auto res = converted.value->toComponent();
+		memo.emplace(res.get(), std::make_pair(res, converted));
+		return res;
+	}
+
+private:
+	// The exact value of a node (see exactEval()) and its rational function
+	struct Converted {
+		std::optional<Rational> exact;
+		std::optional<RationalFunction> value;
+	};
+
+	// Converted nodes, which are kept alive so their addresses are not reused.
+	// References to the values stay valid as the map grows
+	using Memo = std::unordered_map<
+	  const Component *,
+	  std::pair<std::shared_ptr<Component>, Converted>>;
+
+	static const Converted &convert(const std::shared_ptr<Component> &input,
+									Memo &memo) {
+		std::vector<const Rational *> exacts;
+		std::vector<const RationalFunction *> values;
+
+		auto visitor = [&](const auto &node, auto first, auto last) {
+			exacts.clear();
+			values.clear();
+			for (auto it = first; it != last; ++it) {
+				const Converted &operand = **it;
+				exacts.emplace_back(operand.exact ? &*operand.exact : nullptr);
+				values.emplace_back(operand.value ? &*operand.value : nullptr);
+			}
+
+			Converted res;
+			res.exact = exactEvalNode(node, exacts.begin(), exacts.end());
+			res.value =
+			  RationalFunction::fromNode(node, values.begin(), values.end());
+			auto it = memo.emplace(node.get(), std::make_pair(node, res)).first;
+			return &it->second.second;
+		};
+
+		auto prune = [&](const auto &node, const Converted *&res) {
+			auto it = memo.find(node.get());
+			if (it == memo.end()) return false;
+			res = &it->second.second;
+			return true;
+		};
+
+		return *foldTree<const Converted *>(input, visitor, prune);
+	}
+};
+
+void registerRationalSimplifications() {
+	simplificationRules.emplace_back(std::make_shared<SimplifyRational>());
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+struct SamplerOptions {
+	// The largest distance allowed between the function and the lines joining
+	// its samples, as a fraction of the spread of its values at the initial
+	// samples, or ``absoluteTolerance`` if that is larger
+	double tolerance		 = 1e-3;
+	double absoluteTolerance = 0;
+
+	// Evenly spaced intervals sampled before any are refined, at most
+	// maxInitialIntervals
+	size_t initialIntervals = 64;
+
+	// The most times an initial interval is halved, at most maxDepthLimit. An
+	// interval halved 52 times is as narrow as its ends allow
+	size_t maxDepth = 16;
+
+	// The most points a window of initial intervals (see AdaptiveSampler) is
+	// refined to. Refinement stops before a window would exceed this, so a
+	// tolerance too small to meet does not use up the memory
+	size_t maxWindowPoints = 65536;
+
+	static constexpr size_t maxInitialIntervals = size_t(1) << 24;
+	static constexpr size_t maxDepthLimit		= 52;
+};
+
+struct SamplerStats {
+	size_t points	   = 0; // Points passed to the sink
+	size_t evaluations = 0; // Points at which the function was sampled
+	size_t truncated   = 0; // Windows which reached maxWindowPoints
+};
+
+/**
+ * Samples a function of one variable over an interval, placing more points
+ * where it curves, for plotting or tabulating it. The function and its
+ * derivative (see differentiate()) are compiled, and an interval is halved
+ * until the cubic through its ends, with the derivatives there, stays within
+ * the tolerance of the line joining them. An interval with a value or
+ * derivative which is not finite at only one end is halved as far as
+ * allowed, so poles and the edges of the domain are found closely.
+ *
+ * If the function cannot be differentiated, its derivative is estimated from
+ * central differences instead, which costs two more evaluations per point.
+ *
+ * The initial intervals are refined a window at a time, halving every
+ * interval which needs it at once so the new points are evaluated together,
+ * and their points are passed to the sink in order before the next are
+ * refined. A window stops being refined once another round would take it
+ * past SamplerOptions::maxWindowPoints
+ */
+class AdaptiveSampler {
+public:
+	using Sink = std::function<void(double x, double y)>;
+
+	// Sample ``function``, with its ``derivative`` if there is one
+	AdaptiveSampler(Program function, std::optional<Program> derivative,
+					SamplerOptions options = {}) :
+			m_function(std::move(function)),
+			m_derivative(std::move(derivative)), m_options(options) {
+		LR_ASSERT(m_function.variables().size() == 1 &&
+					(!m_derivative || m_derivative->variables().size() == 1),
+				  "The sampled function must have exactly one variable");
+		LR_ASSERT(m_options.initialIntervals > 0 &&
+					m_options.initialIntervals <=
+					  SamplerOptions::maxInitialIntervals,
+				  "The initial intervals must be between 1 and {}",
+				  SamplerOptions::maxInitialIntervals);
+		LR_ASSERT(m_options.maxDepth <= SamplerOptions::maxDepthLimit,
+				  "The depth must be at most {}",
+				  SamplerOptions::maxDepthLimit);
+		LR_ASSERT(m_options.maxWindowPoints > windowIntervals,
+				  "A window must hold more than its {} initial intervals",
+				  windowIntervals);
+	}
+
+	// Sample ``tree`` as a function of ``variable``. Any other variables must
+	// be registered constants
+	AdaptiveSampler(const std::shared_ptr<Component> &tree,
+					const std::string &variable, SamplerOptions options = {}) :
+			AdaptiveSampler(compileExpression(tree, {variable}),
+							compileDerivative(tree, variable), options) {}
+
+	LR_NODISCARD("") bool hasDerivative() const {
+		return m_derivative.has_value();
+	}
+
+	// Pass the samples of the function over [lower, upper] to ``sink``, in
+	// order of x, including both ends
+	SamplerStats sample(double lower, double upper, const Sink &sink) const {
+		LR_ASSERT(lower < upper, "Empty interval [{}, {}]", lower, upper);
+
+		SamplerStats stats;
+		std::vector<double> workspace;
+
+		size_t numIntervals = m_options.initialIntervals;
+		std::vector<double> xs(numIntervals + 1);
+		for (size_t i = 0; i < numIntervals; ++i) {
+			double t = static_cast<double>(i) / numIntervals;
+			xs[i]	 = lower + (upper - lower) * t;
+		}
+		xs[numIntervals] = upper;
+
+		auto initial = evaluate(xs, workspace);
+		stats.evaluations += initial.size();
+
+		double low	= std::numeric_limits<double>::infinity();
+		double high = -low;
+		for (const auto &point : initial) {
+			if (!std::isfinite(point.y)) continue;
+			low	 = lrc::min(low, point.y);
+			high = lrc::max(high, point.y);
+		}
+
+		double spread	 = high > low ? high - low : 0;
+		double tolerance = lrc::max(m_options.absoluteTolerance,
+									m_options.tolerance * spread);
+
+		std::vector<Point> points, refined;
+		std::vector<double> midpoints;
+		for (size_t first = 0; first < numIntervals; first += windowIntervals) {
+			size_t last = lrc::min(first + windowIntervals, numIntervals);
+			points.assign(initial.begin() + first, initial.begin() + last + 1);
+
+			for (size_t depth = 0; depth < m_options.maxDepth; ++depth) {
+				midpoints.clear();
+				for (size_t i = 0; i + 1 < points.size(); ++i) {
+					const Point &left  = points[i];
+					const Point &right = points[i + 1];
+					double mid		   = left.x + (right.x - left.x) / 2;
+					if (mid > left.x && mid < right.x &&
+						!accepted(left, right, tolerance))
+						midpoints.emplace_back(mid);
+				}
+
+				if (midpoints.empty()) break;
+				if (points.size() + midpoints.size() >
+					m_options.maxWindowPoints) {
+					++stats.truncated;
+					break;
+				}
+
+				auto added = evaluate(midpoints, workspace);
+				stats.evaluations += added.size();
+
+				// Insert each new point after the left end of its interval,
+				// which is the next point in ``points`` with a smaller x
+				refined.clear();
+				size_t next = 0;
+				for (const auto &point : points) {
+					while (next < added.size() && added[next].x < point.x)
+						refined.emplace_back(added[next++]);
+					refined.emplace_back(point);
+				}
+				std::swap(points, refined);
+			}
+
+			for (size_t i = 0; i + 1 < points.size(); ++i)
+				sink(points[i].x, points[i].y);
+			stats.points += points.size() - 1;
+		}
+
+		sink(initial.back().x, initial.back().y);
+		++stats.points;
+		return stats;
+	}
+
+private:
+	// Initial intervals refined at once, bounding the points held at a time
+	static constexpr size_t windowIntervals = 16;
+
+	struct Point {
+		double x;
+		double y;
+		double slope; // The derivative at x
+
+		LR_NODISCARD("") bool finite() const {
+			return std::isfinite(y) && std::isfinite(slope);
+		}
+	};
+
+	// The derivative of ``tree``, or nothing if it cannot be differentiated
+	static std::optional<Program>
+	compileDerivative(const std::shared_ptr<Component> &tree,
+					  const std::string &variable) {
+		try {
+			return compileExpression(differentiate(tree, variable), {variable});
+		} catch (const std::exception &) {
+			return std::nullopt;
+		}
+	}
+
+	// The function and its derivative at each of ``xs``
+	std::vector<Point> evaluate(const std::vector<double> &xs,
+								std::vector<double> &workspace) const {
+		size_t count = xs.size();
+		std::vector<double> ys(count), slopes(count);
+		std::vector<const double *> columns = {xs.data()};
+		m_function.run(columns, count, ys.data(), workspace);
+
+		if (m_derivative) {
+			m_derivative->run(columns, count, slopes.data(), workspace);
+		} else {
+			// Steps of about the cube root of the machine epsilon balance the
+			// truncation and rounding errors of a central difference
+			std::vector<double> steps(count), around(count * 2);
+			std::vector<double> values(count * 2);
+			for (size_t i = 0; i < count; ++i) {
+				double step		  = 6e-6 * lrc::max(std::abs(xs[i]), 1.0);
+				around[i]		  = xs[i] + step;
+				around[count + i] = xs[i] - step;
+				steps[i]		  = around[i] - around[count + i];
+			}
+
+			columns = {around.data()};
+			m_function.run(columns, count * 2, values.data(), workspace);
+			for (size_t i = 0; i < count; ++i)
+				slopes[i] = (values[i] - values[count + i]) / steps[i];
+		}
+
+		std::vector<Point> res(count);
+		for (size_t i = 0; i < count; ++i)
+			res[i] = {xs[i], ys[i], slopes[i]};
+		return res;
+	}
+
+	// Whether the line from ``left`` to ``right`` is close enough to the
+	// function, or both ends are outside its domain
+	static bool accepted(const Point &left, const Point &right,
+						 double tolerance) {
+		if (!left.finite() || !right.finite())
+			return !left.finite() && !right.finite();
+
+		// The cubic through both ends with the given slopes differs from the
+		// line joining them by at most width * max(|a|, |b|) / 4, where a and
+		// b are the differences between the slopes and that of the line
+		double width = right.x - left.x;
+		double slope = (right.y - left.y) / width;
+		double error = width *
+					   lrc::max(std::abs(left.slope - slope),
+								std::abs(right.slope - slope)) /
+					   4;
+		return error <= tolerance;
+	}
+
+	Program m_function;
+	std::optional<Program> m_derivative;
+	SamplerOptions m_options;
+};
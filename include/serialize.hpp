@@ -0,0 +1,940 @@
+#pragma once
+
+/*
+ * Binary format for expression trees. The file is a header followed by
+ * sections, each aligned to 8 bytes:
+ *
+ *     nodes           numNodes SerializedNode, in post-order, so every node
+ *                     comes after its children and the root is the last node
+ *     children        numChildren uint32 node indices
+ *     constants       numConstants doubles
+ *     string offsets  numStrings + 1 uint32 offsets into the string data
+ *     string data     the names of variables and functions
+ *
+ * Subtrees shared between several parents are stored once. Integers and
+ * doubles are in native byte order. When Scalar is not a double (see
+ * SYMBOMATH_MULTIPRECISION), numbers are stored as decimal strings in the
+ * string table instead of in the constants section, so no precision is lost.
+ */
+
+inline constexpr char serializedMagic[8] = {'S', 'Y', 'M', 'T', 'R', 'E', 'E'};
+inline constexpr uint32_t serializedVersion = 1;
+
+enum class SerializedKind : uint32_t { NUMBER, VARIABLE, FUNCTION, TREE };
+
+enum class ConstantFormat : uint32_t { FLOAT64, STRING };
+
+struct SerializedNode {
+	SerializedKind kind;
+
+	// The constant index of a NUMBER (or its string index if numbers are
+	// stored as strings), or the string index of a VARIABLE or FUNCTION name
+	uint32_t payload;
+
+	uint32_t firstChild;
+	uint32_t numChildren;
+};
+
+struct SerializedHeader {
+	char magic[8];
+	uint32_t version;
+	ConstantFormat constantFormat;
+
+	uint64_t numNodes;
+	uint64_t numChildren;
+	uint64_t numConstants;
+	uint64_t numStrings;
+	uint64_t stringBytes;
+
+	uint64_t nodesOffset;
+	uint64_t childrenOffset;
+	uint64_t constantsOffset;
+	uint64_t stringOffsetsOffset;
+	uint64_t stringsOffset;
+	uint64_t totalSize;
+};
+
+// Parse a Scalar written by lrc::str() or fmt
+template<typename T = Scalar>
+T scalarFromString(const std::string &str) {
+	if constexpr (std::is_same_v<T, double>) {
+		return std::strtod(str.c_str(), nullptr);
+	} else {
+		return T(str);
+	}
+}
+
+// Serialize a tree into the format described above
+inline std::string
+serializeExpression(const std::shared_ptr<Component> &input) {
+	constexpr bool numbersAsStrings = !std::is_same_v<Scalar, double>;
+
+	std::vector<SerializedNode> nodes;
+	std::vector<uint32_t> children;
+	std::vector<double> constants;
+	std::vector<std::string> strings;
+	std::unordered_map<std::string, uint32_t> stringIndex;
+
+	auto addString = [&](const std::string &str) {
+		auto it = stringIndex.find(str);
+		if (it != stringIndex.end()) return it->second;
+		auto index = static_cast<uint32_t>(strings.size());
+		strings.emplace_back(str);
+		stringIndex.emplace(str, index);
+		return index;
+	};
+
+	// Shared subtrees are only written once
+	std::unordered_map<const Component *, uint32_t> written;
+	auto prune = [&](const auto &node, uint32_t &index) {
+		auto it = written.find(node.get());
+		if (it == written.end()) return false;
+		index = it->second;
+		return true;
+	};
+
+	auto visitor = [&](const auto &node, auto first, auto last) {
+		SerializedNode res {};
+		res.firstChild	= static_cast<uint32_t>(children.size());
+		res.numChildren = static_cast<uint32_t>(std::distance(first, last));
+		children.insert(children.end(), first, last);
+
+		std::string type = node->type();
+		if (type == "NUMBER") {
+			res.kind   = SerializedKind::NUMBER;
+			auto value = std::dynamic_pointer_cast<Number>(node)->value();
+			if constexpr (numbersAsStrings) {
+				res.payload = addString(lrc::str(value));
+			} else {
+				res.payload = static_cast<uint32_t>(constants.size());
+				constants.emplace_back(value);
+			}
+		} else if (type == "VARIABLE") {
+			res.kind	= SerializedKind::VARIABLE;
+			res.payload = addString(node->name());
+		} else if (type == "FUNCTION") {
+			res.kind	= SerializedKind::FUNCTION;
+			res.payload = addString(node->name());
+		} else {
+			LR_ASSERT(type == "TREE", "Cannot serialize {} object", type);
+			res.kind = SerializedKind::TREE;
+		}
+
+		auto index = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back(res);
+		written.emplace(node.get(), index);
+		return index;
+	};
+
+	foldTree<uint32_t>(input, visitor, prune);
+
+	std::vector<uint32_t> stringOffsets {0};
+	for (const auto &str : strings)
+		stringOffsets.emplace_back(stringOffsets.back() + str.size());
+
+	auto align = [](uint64_t offset) { return (offset + 7) & ~uint64_t(7); };
+
+	SerializedHeader header {};
+	std::copy_n(serializedMagic, 8, header.magic);
+	header.version		  = serializedVersion;
+	header.constantFormat = numbersAsStrings ? ConstantFormat::STRING
+											 : ConstantFormat::FLOAT64;
+	header.numNodes		  = nodes.size();
+	header.numChildren	  = children.size();
+	header.numConstants	  = constants.size();
+	header.numStrings	  = strings.size();
+	header.stringBytes	  = stringOffsets.back();
+
+	header.nodesOffset	  = align(sizeof(SerializedHeader));
+	header.childrenOffset = align(header.nodesOffset +
+								  nodes.size() * sizeof(SerializedNode));
+	header.constantsOffset =
+	  align(header.childrenOffset + children.size() * sizeof(uint32_t));
+	header.stringOffsetsOffset =
+	  align(header.constantsOffset + constants.size() * sizeof(double));
+	header.stringsOffset = align(header.stringOffsetsOffset +
+								 stringOffsets.size() * sizeof(uint32_t));
+	header.totalSize	 = align(header.stringsOffset + header.stringBytes);
+
+	std::string res(header.totalSize, '\0');
+	auto write = [&](uint64_t offset, const void *data, size_t bytes) {
+		if (bytes > 0) std::memcpy(res.data() + offset, data, bytes);
+	};
+
+	write(0, &header, sizeof(header));
+	write(header.nodesOffset,
+		  nodes.data(),
+		  nodes.size() * sizeof(SerializedNode));
+	write(header.childrenOffset,
+		  children.data(),
+		  children.size() * sizeof(uint32_t));
+	write(header.constantsOffset,
+		  constants.data(),
+		  constants.size() * sizeof(double));
+	write(header.stringOffsetsOffset,
+		  stringOffsets.data(),
+		  stringOffsets.size() * sizeof(uint32_t));
+	for (size_t i = 0; i < strings.size(); ++i) {
+		write(header.stringsOffset + stringOffsets[i],
+			  strings[i].data(),
+			  strings[i].size());
+	}
+
+	return res;
+}
+
+inline void saveExpression(const std::shared_ptr<Component> &input,
+						   const std::string &path) {
+	std::string data = serializeExpression(input);
+	std::ofstream file(path, std::ios::binary);
+	LR_ASSERT(file.is_open(), "Could not open file '{}'", path);
+	file.write(data.data(), static_cast<std::streamsize>(data.size()));
+	LR_ASSERT(file.good(), "Could not write file '{}'", path);
+}
+
+/**
+ * A serialized tree, used in place without building Component objects. It can
+ * be evaluated, differentiated numerically (by forward-mode automatic
+ * differentiation) or converted back into a tree with toTree().
+ *
+ * The data is validated on construction, so a corrupt or truncated file
+ * raises an error rather than being read out of bounds. Function names are
+ * looked up in the registry once per name, not once per node.
+ */
+class MappedExpression {
+public:
+	// Map a file written by saveExpression()
+	explicit MappedExpression(const std::string &path) :
+			m_file(std::make_shared<MappedFile>(path)) {
+		init(m_file->view());
+	}
+
+	// Use serialized data held elsewhere, which must outlive this object
+	MappedExpression(const char *data, size_t size) : m_file(nullptr) {
+		init({data, size});
+	}
+
+	LR_NODISCARD("") size_t numNodes() const { return m_nodes.size(); }
+
+	// The names of the variables used by the expression
+	LR_NODISCARD("") std::vector<std::string> variables() const {
+		std::set<std::string> names;
+		for (const auto &node : m_nodes) {
+			if (node.kind == SerializedKind::VARIABLE)
+				names.emplace(stringAt(node.payload));
+		}
+		return {names.begin(), names.end()};
+	}
+
+	LR_NODISCARD("")
+	Scalar eval(const std::map<std::string, Scalar> &values) const {
+		auto bound = bindVariables(values, "");
+
+		std::vector<Scalar> results(m_nodes.size());
+		std::vector<Scalar> operands;
+		for (size_t i = 0; i < m_nodes.size(); ++i) {
+			const auto &node = m_nodes[i];
+			switch (node.kind) {
+				case SerializedKind::NUMBER: results[i] = constant(node); break;
+				case SerializedKind::VARIABLE:
+					results[i] = bound[node.payload].first;
+					break;
+				case SerializedKind::TREE:
+					results[i] = results[child(node, 0)];
+					break;
+				case SerializedKind::FUNCTION:
+					operands.clear();
+					for (uint32_t j = 0; j < node.numChildren; ++j)
+						operands.emplace_back(results[child(node, j)]);
+					results[i] = functor(node)(operands);
+					break;
+			}
+		}
+
+		return results.back();
+	}
+
+	/**
+	 * Evaluate the expression and its derivative with respect to ``wrt`` at a
+	 * point, using dual numbers. Arithmetic and powers are differentiated
+	 * directly; for any other function, its partial derivatives are found
+	 * symbolically from the registered derivative rules the first time the
+	 * function is seen, and then evaluated numerically
+	 */
+	LR_NODISCARD("")
+	std::pair<Scalar, Scalar>
+	evalDerivative(const std::map<std::string, Scalar> &values,
+				   const std::string &wrt) const {
+		using Dual = std::pair<Scalar, Scalar>;
+		auto bound = bindVariables(values, wrt);
+
+		std::vector<Dual> results(m_nodes.size());
+		std::vector<Scalar> operands;
+		for (size_t i = 0; i < m_nodes.size(); ++i) {
+			const auto &node = m_nodes[i];
+			auto arg = [&](uint32_t j) { return results[child(node, j)]; };
+
+			if (node.kind == SerializedKind::NUMBER) {
+				results[i] = {constant(node), Scalar(0)};
+				continue;
+			}
+
+			if (node.kind == SerializedKind::VARIABLE) {
+				results[i] = bound[node.payload];
+				continue;
+			}
+
+			if (node.kind == SerializedKind::TREE) {
+				results[i] = arg(0);
+				continue;
+			}
+
+			results[i] = derivativeNode(node, arg, operands);
+		}
+
+		return results.back();
+	}
+
+	// Rebuild the tree, sharing subtrees which were shared when it was saved
+	LR_NODISCARD("") std::shared_ptr<Component> toTree() const {
+		std::vector<std::shared_ptr<Component>> nodes(m_nodes.size());
+		std::vector<std::shared_ptr<Component>> values;
+
+		for (size_t i = 0; i < m_nodes.size(); ++i) {
+			const auto &node = m_nodes[i];
+			values.clear();
+			for (uint32_t j = 0; j < node.numChildren; ++j)
+				values.emplace_back(nodes[child(node, j)]);
+
+			switch (node.kind) {
+				case SerializedKind::NUMBER:
+					nodes[i] = makeNode<Number>(constant(node));
+					break;
+				case SerializedKind::VARIABLE:
+					nodes[i] = makeNode<Variable>(stringAt(node.payload));
+					break;
+				case SerializedKind::TREE: {
+					auto tree	 = makeNode<Tree>();
+					tree->tree() = values;
+					nodes[i]	 = tree;
+					break;
+				}
+				case SerializedKind::FUNCTION: {
+					// Built as saved rather than with makeAssociative(), which
+					// could merge nested operations and change the order in
+					// which they are evaluated
+					const Function &prototype = *m_functions[node.payload];
+					nodes[i] = makeNode<Function>(prototype.name(),
+												  prototype.format(),
+												  functor(node),
+												  node.numChildren,
+												  values);
+					break;
+				}
+			}
+		}
+
+		return nodes.back();
+	}
+
+private:
+	void init(std::string_view data) {
+		LR_ASSERT(data.size() >= sizeof(SerializedHeader),
+				  "Serialized expression is truncated");
+
+		const char *base = data.data();
+		const auto &header =
+		  *reinterpret_cast<const SerializedHeader *>(base);
+		LR_ASSERT(std::equal(header.magic, header.magic + 8, serializedMagic),
+				  "Not a serialized expression");
+		LR_ASSERT(header.version == serializedVersion,
+				  "Unsupported serialized expression version {}",
+				  header.version);
+		LR_ASSERT(header.totalSize <= data.size() && header.numNodes > 0,
+				  "Serialized expression is truncated");
+
+		auto section = [&](uint64_t offset, uint64_t count, size_t size) {
+			LR_ASSERT(offset % 8 == 0 && offset <= header.totalSize &&
+						count <= (header.totalSize - offset) / size,
+					  "Serialized expression is corrupt");
+			return base + offset;
+		};
+
+		const char *nodes =
+		  section(header.nodesOffset, header.numNodes, sizeof(SerializedNode));
+		m_nodes = {reinterpret_cast<const SerializedNode *>(nodes),
+				   header.numNodes};
+		m_children = reinterpret_cast<const uint32_t *>(section(
+		  header.childrenOffset, header.numChildren, sizeof(uint32_t)));
+		const auto *constants = reinterpret_cast<const double *>(section(
+		  header.constantsOffset, header.numConstants, sizeof(double)));
+
+		// Bound the number of strings before adding to it, so it cannot wrap
+		LR_ASSERT(header.numStrings < header.totalSize / sizeof(uint32_t),
+				  "Serialized expression is corrupt");
+		m_stringOffsets = reinterpret_cast<const uint32_t *>(
+		  section(header.stringOffsetsOffset,
+				  header.numStrings + 1,
+				  sizeof(uint32_t)));
+		m_strings = section(header.stringsOffset, header.stringBytes, 1);
+		m_numStrings = header.numStrings;
+
+		for (uint64_t i = 0; i < header.numStrings; ++i) {
+			LR_ASSERT(m_stringOffsets[i] <= m_stringOffsets[i + 1] &&
+						m_stringOffsets[i + 1] <= header.stringBytes,
+					  "Serialized expression is corrupt");
+		}
+
+		// Check that every index is in range, and that children come before
+		// their parents, so evaluation never reads an unset value
+		bool numbersAsStrings = header.constantFormat == ConstantFormat::STRING;
+		m_functions.assign(header.numStrings, nullptr);
+		for (size_t i = 0; i < m_nodes.size(); ++i) {
+			const auto &node = m_nodes[i];
+			LR_ASSERT(uint64_t(node.firstChild) + node.numChildren <=
+						header.numChildren,
+					  "Serialized expression is corrupt");
+			for (uint32_t j = 0; j < node.numChildren; ++j) {
+				LR_ASSERT(child(node, j) < i,
+						  "Serialized expression is corrupt");
+			}
+
+			switch (node.kind) {
+				case SerializedKind::NUMBER:
+					LR_ASSERT(node.payload < (numbersAsStrings
+												? header.numStrings
+												: header.numConstants),
+							  "Serialized expression is corrupt");
+					break;
+				case SerializedKind::VARIABLE:
+					LR_ASSERT(node.payload < header.numStrings,
+							  "Serialized expression is corrupt");
+					break;
+				case SerializedKind::TREE:
+					LR_ASSERT(node.numChildren == 1,
+							  "Serialized expression is corrupt");
+					break;
+				case SerializedKind::FUNCTION:
+					LR_ASSERT(node.payload < header.numStrings,
+							  "Serialized expression is corrupt");
+					resolveFunction(node);
+					break;
+				default: LR_ASSERT(false, "Serialized expression is corrupt");
+			}
+		}
+
+		// Numbers stored as strings are parsed once here. Otherwise they are
+		// read directly from the constants section
+		if (numbersAsStrings) {
+			m_parsedConstants.resize(header.numStrings);
+			for (const auto &node : m_nodes) {
+				if (node.kind == SerializedKind::NUMBER) {
+					m_parsedConstants[node.payload] =
+					  scalarFromString(stringAt(node.payload));
+				}
+			}
+		} else {
+			m_constantPool = constants;
+		}
+	}
+
+	// Look up the function used by a node, checking its number of operands
+	void resolveFunction(const SerializedNode &node) {
+		std::string name = stringAt(node.payload);
+		if (!m_functions[node.payload]) {
+			// The prototype is copied, as the expression may outlive the
+			// registry snapshot it came from (see registryQuiescent())
+			const Function *func = findFunction(name);
+			LR_ASSERT(func != nullptr, "Function {} is not registered", name);
+			m_functions[node.payload] = std::make_shared<const Function>(*func);
+		}
+
+		const Function &prototype = *m_functions[node.payload];
+		LR_ASSERT(node.numChildren == prototype.numOperands() ||
+					(isAssociative(name) && node.numChildren >= 2),
+				  "Function {} has the wrong number of operands",
+				  name);
+	}
+
+	LR_NODISCARD("")
+	uint32_t child(const SerializedNode &node, uint32_t i) const {
+		return m_children[node.firstChild + i];
+	}
+
+	LR_NODISCARD("") Scalar constant(const SerializedNode &node) const {
+		if (m_constantPool) return Scalar(m_constantPool[node.payload]);
+		return m_parsedConstants[node.payload];
+	}
+
+	LR_NODISCARD("") std::string stringAt(uint32_t index) const {
+		return {m_strings + m_stringOffsets[index],
+				m_stringOffsets[index + 1] - m_stringOffsets[index]};
+	}
+
+	LR_NODISCARD("")
+	const std::function<Scalar(const std::vector<Scalar> &)> &
+	functor(const SerializedNode &node) const {
+		const Function &prototype = *m_functions[node.payload];
+		if (node.numChildren == prototype.numOperands())
+			return prototype.functor();
+		return associativeFunctor(prototype.name());
+	}
+
+	// The value of each string used as a variable name, with a derivative of
+	// 1 for ``wrt`` and 0 for every other variable
+	LR_NODISCARD("")
+	std::vector<std::pair<Scalar, Scalar>>
+	bindVariables(const std::map<std::string, Scalar> &values,
+				  const std::string &wrt) const {
+		std::vector<std::pair<Scalar, Scalar>> res(m_numStrings);
+		std::vector<bool> done(m_numStrings, false);
+
+		for (const auto &node : m_nodes) {
+			if (node.kind != SerializedKind::VARIABLE || done[node.payload])
+				continue;
+
+			std::string name = stringAt(node.payload);
+			auto it			 = values.find(name);
+			LR_ASSERT(
+			  it != values.end(), "No value given for variable {}", name);
+			res[node.payload]  = {it->second, Scalar(name == wrt ? 1 : 0)};
+			done[node.payload] = true;
+		}
+
+		return res;
+	}
+
+	template<typename Arg>
+	std::pair<Scalar, Scalar>
+	derivativeNode(const SerializedNode &node, Arg &&arg,
+				   std::vector<Scalar> &operands) const {
+		using std::log;
+		using std::pow;
+
+		const std::string &name = m_functions[node.payload]->name();
+		uint32_t n				= node.numChildren;
+
+		if (name == "PLUS") return arg(0);
+
+		if (name == "MINUS") {
+			auto [a, da] = arg(0);
+			return {-a, -da};
+		}
+
+		if (name == "ADD" || name == "SUB") {
+			auto [v, dv] = arg(0);
+			Scalar sign	 = name == "ADD" ? 1 : -1;
+			for (uint32_t j = 1; j < n; ++j) {
+				auto [b, db] = arg(j);
+				v += sign * b;
+				dv += sign * db;
+			}
+			return {v, dv};
+		}
+
+		if (name == "MUL") {
+			auto [v, dv] = arg(0);
+			for (uint32_t j = 1; j < n; ++j) {
+				auto [b, db] = arg(j);
+				dv			 = dv * b + v * db;
+				v			 = v * b;
+			}
+			return {v, dv};
+		}
+
+		if (name == "DIV") {
+			auto [a, da] = arg(0);
+			auto [b, db] = arg(1);
+			return {a / b, (da * b - a * db) / (b * b)};
+		}
+
+		if (name == "POW") {
+			auto [a, da] = arg(0);
+			auto [b, db] = arg(1);
+			Scalar v	 = pow(a, b);
+			if (db == 0) return {v, b * pow(a, b - 1) * da};
+			return {v, v * (db * log(a) + b * da / a)};
+		}
+
+		// Any other function: f(u)' = sum of df/du_j * u_j'
+		operands.clear();
+		for (uint32_t j = 0; j < n; ++j) operands.emplace_back(arg(j).first);
+
+		const auto &partials = partialDerivatives(node);
+		Scalar derivative(0);
+		for (uint32_t j = 0; j < n; ++j) {
+			Scalar du = arg(j).second;
+			if (du != 0) derivative += partials[j].eval(operands) * du;
+		}
+
+		return {functor(node)(operands), derivative};
+	}
+
+	// Compiled partial derivatives of a function with respect to each of its
+	// operands, found by differentiating f(_0, _1, ...) symbolically
+	const std::vector<Program> &
+	partialDerivatives(const SerializedNode &node) const {
+		std::lock_guard<std::mutex> lock(m_partialsMutex);
+		auto it = m_partials.find(node.payload);
+		if (it != m_partials.end()) return it->second;
+
+		const Function &prototype = *m_functions[node.payload];
+		std::vector<std::string> names;
+		std::vector<std::shared_ptr<Component>> args;
+		for (uint32_t j = 0; j < node.numChildren; ++j) {
+			names.emplace_back("_" + std::to_string(j));
+			args.emplace_back(std::make_shared<Variable>(names.back()));
+		}
+
+		auto func = std::make_shared<Function>(prototype.name(),
+											   prototype.format(),
+											   prototype.functor(),
+											   prototype.numOperands(),
+											   args);
+
+		std::vector<Program> res;
+		for (const auto &name : names) {
+			auto derivative = differentiate(func, name);
+			res.emplace_back(Program::compile(derivative, names));
+		}
+
+		return m_partials.emplace(node.payload, std::move(res)).first->second;
+	}
+
+	// Keeps the mapping alive when constructed from a file
+	std::shared_ptr<MappedFile> m_file;
+
+	struct NodeSpan {
+		const SerializedNode *data = nullptr;
+		size_t count			   = 0;
+
+		LR_NODISCARD("") size_t size() const { return count; }
+		const SerializedNode &operator[](size_t i) const { return data[i]; }
+		const SerializedNode *begin() const { return data; }
+		const SerializedNode *end() const { return data + count; }
+	};
+
+	NodeSpan m_nodes;
+	const uint32_t *m_children		= nullptr;
+	const uint32_t *m_stringOffsets = nullptr;
+	const char *m_strings			= nullptr;
+	size_t m_numStrings				= 0;
+
+	const double *m_constantPool = nullptr;
+	std::vector<Scalar> m_parsedConstants;
+	std::vector<std::shared_ptr<const Function>> m_functions;
+
+	mutable std::mutex m_partialsMutex;
+	mutable std::map<uint32_t, std::vector<Program>> m_partials;
+};
+
+/*
+ * Binary format for compiled programs. Like the tree format, it is a header
+ * followed by sections aligned to 8 bytes:
+ *
+ *     instructions    numInstructions SerializedInstruction
+ *     operands        numOperands uint32 slots read by CALL instructions
+ *     constants       numConstants doubles
+ *     string offsets  numStrings + 1 uint32 offsets into the string data
+ *     string data     the variable names, then the function called by each
+ *                     CALL functor (and the constants, when they are stored
+ *                     as strings), then the source of each constant: its
+ *                     name if it is in ConstantCache, its exact value (see
+ *                     Rational::str()), or an empty string if it has
+ *                     neither
+ *
+ * Functions are saved by name and looked up in the registry when the program
+ * is loaded, so a program can only be loaded by a build which registers the
+ * same functions.
+ */
+
+inline constexpr char programMagic[8] = {'S', 'Y', 'M', 'P', 'R', 'O', 'G'};
+inline constexpr uint32_t programVersion = 2;
+
+struct SerializedInstruction {
+	uint32_t op;
+	uint32_t dst;
+	uint32_t lhs;
+	uint32_t rhs;
+	uint32_t functor;
+	uint32_t first;
+	uint32_t count;
+	uint32_t padding;
+	int64_t power;
+};
+
+struct ProgramHeader {
+	char magic[8];
+	uint32_t version;
+	ConstantFormat constantFormat;
+
+	uint64_t numVariables;
+	uint64_t numConstants;
+	uint64_t numFunctions;
+	uint64_t numInstructions;
+	uint64_t numOperands;
+	uint64_t numRegisters;
+	uint64_t result;
+	uint64_t numStrings;
+	uint64_t stringBytes;
+
+	uint64_t instructionsOffset;
+	uint64_t operandsOffset;
+	uint64_t constantsOffset;
+	uint64_t stringOffsetsOffset;
+	uint64_t stringsOffset;
+	uint64_t totalSize;
+};
+
+inline std::string Program::serialize() const {
+	constexpr bool numbersAsStrings = !std::is_same_v<Scalar, double>;
+
+	std::vector<std::string> strings(m_variables);
+	strings.insert(
+	  strings.end(), m_functionNames.begin(), m_functionNames.end());
+
+	std::vector<double> constants;
+	for (const auto &value : m_constants) {
+		if constexpr (numbersAsStrings) {
+			strings.emplace_back(lrc::str(value));
+		} else {
+			constants.emplace_back(value);
+		}
+	}
+
+	// Names start with a letter, so they cannot be confused with exact values
+	for (const auto &source : m_sources) {
+		if (!source.name.empty())
+			strings.emplace_back(source.name);
+		else
+			strings.emplace_back(source.exact ? source.exact->str() : "");
+	}
+
+	std::vector<SerializedInstruction> instructions;
+	for (const auto &instr : m_instructions) {
+		SerializedInstruction res {};
+		res.op		= static_cast<uint32_t>(instr.op);
+		res.dst		= instr.dst;
+		res.lhs		= instr.lhs;
+		res.rhs		= instr.rhs;
+		res.functor = instr.functor;
+		res.first	= instr.first;
+		res.count	= instr.count;
+		res.power	= instr.power;
+		instructions.emplace_back(res);
+	}
+
+	std::vector<uint32_t> stringOffsets {0};
+	for (const auto &str : strings)
+		stringOffsets.emplace_back(stringOffsets.back() + str.size());
+
+	auto align = [](uint64_t offset) { return (offset + 7) & ~uint64_t(7); };
+
+	ProgramHeader header {};
+	std::copy_n(programMagic, 8, header.magic);
+	header.version		  = programVersion;
+	header.constantFormat = numbersAsStrings ? ConstantFormat::STRING
+											 : ConstantFormat::FLOAT64;
+	header.numVariables	   = m_variables.size();
+	header.numConstants	   = m_constants.size();
+	header.numFunctions	   = m_functionNames.size();
+	header.numInstructions = instructions.size();
+	header.numOperands	   = m_operands.size();
+	header.numRegisters	   = m_numRegisters;
+	header.result		   = m_result;
+	header.numStrings	   = strings.size();
+	header.stringBytes	   = stringOffsets.back();
+
+	header.instructionsOffset = align(sizeof(ProgramHeader));
+	header.operandsOffset	  = align(header.instructionsOffset +
+									  instructions.size() *
+										sizeof(SerializedInstruction));
+	header.constantsOffset =
+	  align(header.operandsOffset + m_operands.size() * sizeof(uint32_t));
+	header.stringOffsetsOffset =
+	  align(header.constantsOffset + constants.size() * sizeof(double));
+	header.stringsOffset = align(header.stringOffsetsOffset +
+								 stringOffsets.size() * sizeof(uint32_t));
+	header.totalSize	 = align(header.stringsOffset + header.stringBytes);
+
+	std::string res(header.totalSize, '\0');
+	auto write = [&](uint64_t offset, const void *data, size_t bytes) {
+		if (bytes > 0) std::memcpy(res.data() + offset, data, bytes);
+	};
+
+	write(0, &header, sizeof(header));
+	write(header.instructionsOffset,
+		  instructions.data(),
+		  instructions.size() * sizeof(SerializedInstruction));
+	write(header.operandsOffset,
+		  m_operands.data(),
+		  m_operands.size() * sizeof(uint32_t));
+	write(header.constantsOffset,
+		  constants.data(),
+		  constants.size() * sizeof(double));
+	write(header.stringOffsetsOffset,
+		  stringOffsets.data(),
+		  stringOffsets.size() * sizeof(uint32_t));
+	for (size_t i = 0; i < strings.size(); ++i) {
+		write(header.stringsOffset + stringOffsets[i],
+			  strings[i].data(),
+			  strings[i].size());
+	}
+
+	return res;
+}
+
+// Every slot and register is checked to be in range, so a corrupt program
+// raises an error here rather than reading out of bounds when it is run
+inline Program Program::deserialize(std::string_view data) {
+	LR_ASSERT(data.size() >= sizeof(ProgramHeader),
+			  "Serialized program is truncated");
+
+	const char *base	 = data.data();
+	const auto &header = *reinterpret_cast<const ProgramHeader *>(base);
+	LR_ASSERT(std::equal(header.magic, header.magic + 8, programMagic),
+			  "Not a serialized program");
+	LR_ASSERT(header.version == programVersion,
+			  "Unsupported serialized program version {}",
+			  header.version);
+	LR_ASSERT(header.totalSize <= data.size(),
+			  "Serialized program is truncated");
+
+	auto section = [&](uint64_t offset, uint64_t count, size_t size) {
+		LR_ASSERT(offset % 8 == 0 && offset <= header.totalSize &&
+					count <= (header.totalSize - offset) / size,
+				  "Serialized program is corrupt");
+		return base + offset;
+	};
+
+	const auto *instructions =
+	  reinterpret_cast<const SerializedInstruction *>(
+		section(header.instructionsOffset,
+				header.numInstructions,
+				sizeof(SerializedInstruction)));
+	const auto *operands = reinterpret_cast<const uint32_t *>(
+	  section(header.operandsOffset, header.numOperands, sizeof(uint32_t)));
+	const auto *constants = reinterpret_cast<const double *>(
+	  section(header.constantsOffset, header.numConstants, sizeof(double)));
+
+	// Bound the number of strings before adding to it, so it cannot wrap
+	LR_ASSERT(header.numStrings < header.totalSize / sizeof(uint32_t),
+			  "Serialized program is corrupt");
+	const auto *stringOffsets = reinterpret_cast<const uint32_t *>(section(
+	  header.stringOffsetsOffset, header.numStrings + 1, sizeof(uint32_t)));
+	const char *strings = section(header.stringsOffset, header.stringBytes, 1);
+
+	// Each count is at most numStrings, so their sum cannot wrap
+	LR_ASSERT(header.numVariables <= header.numStrings &&
+				header.numFunctions <= header.numStrings &&
+				header.numConstants <= header.numStrings,
+			  "Serialized program is corrupt");
+
+	bool numbersAsStrings = header.constantFormat == ConstantFormat::STRING;
+	uint64_t sourcesIndex = header.numVariables + header.numFunctions +
+							(numbersAsStrings ? header.numConstants : 0);
+	uint64_t numStrings	  = sourcesIndex + header.numConstants;
+	LR_ASSERT(header.numStrings == numStrings &&
+				header.numRegisters <= header.numInstructions,
+			  "Serialized program is corrupt");
+
+	auto stringAt = [&](uint64_t index) {
+		LR_ASSERT(stringOffsets[index] <= stringOffsets[index + 1] &&
+					stringOffsets[index + 1] <= header.stringBytes,
+				  "Serialized program is corrupt");
+		return std::string(strings + stringOffsets[index],
+						   stringOffsets[index + 1] - stringOffsets[index]);
+	};
+
+	Program res;
+	for (uint64_t i = 0; i < header.numVariables; ++i)
+		res.m_variables.emplace_back(stringAt(i));
+	for (uint64_t i = 0; i < header.numFunctions; ++i)
+		res.m_functionNames.emplace_back(stringAt(header.numVariables + i));
+	for (uint64_t i = 0; i < header.numConstants; ++i) {
+		if (numbersAsStrings) {
+			uint64_t index = header.numVariables + header.numFunctions + i;
+			res.m_constants.emplace_back(scalarFromString(stringAt(index)));
+		} else {
+			res.m_constants.emplace_back(constants[i]);
+		}
+
+		ConstantSource source;
+		std::string text = stringAt(sourcesIndex + i);
+		if (!text.empty() && std::isalpha(static_cast<uint8_t>(text[0]))) {
+			LR_ASSERT(ConstantCache::global().defines(text),
+					  "Serialized program uses the undefined constant {}",
+					  text);
+			source.name = std::move(text);
+		} else if (!text.empty()) {
+			source.exact = Rational::fromString(text);
+			LR_ASSERT(source.exact, "Serialized program is corrupt");
+		}
+		res.m_sources.emplace_back(std::move(source));
+	}
+
+	res.m_numRegisters = header.numRegisters;
+	res.m_operands.assign(operands, operands + header.numOperands);
+	res.m_functors.resize(header.numFunctions);
+
+	uint64_t numSlots =
+	  header.numVariables + header.numConstants + header.numRegisters;
+	auto checkSlot = [&](uint64_t slot) {
+		LR_ASSERT(slot < numSlots, "Serialized program is corrupt");
+	};
+
+	for (uint64_t i = 0; i < header.numInstructions; ++i) {
+		const auto &saved = instructions[i];
+		LR_ASSERT(saved.op <= static_cast<uint32_t>(Op::CALL) &&
+					saved.dst < header.numRegisters,
+				  "Serialized program is corrupt");
+
+		Instruction instr;
+		instr.op	  = static_cast<Op>(saved.op);
+		instr.dst	  = saved.dst;
+		instr.lhs	  = saved.lhs;
+		instr.rhs	  = saved.rhs;
+		instr.power	  = saved.power;
+		instr.functor = saved.functor;
+		instr.first	  = saved.first;
+		instr.count	  = saved.count;
+
+		// Read by every instruction, though only used by those other than CALL
+		checkSlot(instr.lhs);
+		checkSlot(instr.rhs);
+
+		if (instr.op != Op::CALL) {
+			LR_ASSERT(instr.op != Op::INTPOW ||
+						(instr.power >= -maxIntegerPower &&
+						 instr.power <= maxIntegerPower),
+					  "Serialized program is corrupt");
+			res.m_instructions.emplace_back(instr);
+			continue;
+		}
+
+		LR_ASSERT(instr.functor < header.numFunctions &&
+					uint64_t(instr.first) + instr.count <= header.numOperands,
+				  "Serialized program is corrupt");
+		for (uint32_t j = 0; j < instr.count; ++j)
+			checkSlot(res.m_operands[instr.first + j]);
+
+		// Functions with a different number of operands than they were
+		// registered with are associative (see makeAssociative())
+		const std::string &name = res.m_functionNames[instr.functor];
+		const Function *func	= findFunction(name);
+		LR_ASSERT(func != nullptr, "Function {} is not registered", name);
+		if (instr.count == func->numOperands()) {
+			res.m_functors[instr.functor] = func->functor();
+		} else {
+			LR_ASSERT(isAssociative(name) && instr.count >= 2,
+					  "Function {} has the wrong number of operands",
+					  name);
+			res.m_functors[instr.functor] = associativeFunctor(name);
+		}
+		res.m_instructions.emplace_back(instr);
+	}
+
+	checkSlot(header.result);
+	res.m_result = static_cast<uint32_t>(header.result);
+	return res;
+}
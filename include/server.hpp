@@ -0,0 +1,643 @@
+#pragma once
+
+/*
+ * A local evaluation server. Clients connect to a Unix domain socket and send
+ * requests, each holding an expression, the names of its variables and a
+ * block of records (one double per variable per row). The server replies
+ * with one double per row. All integers and doubles are in native byte
+ * order, since both ends are on the same machine.
+ *
+ *     Request:  RequestHeader, expression, variables (comma-separated),
+ *               numRows * numFields doubles (row-major)
+ *     Response: ResponseHeader, then ``count`` doubles if status is OK, or an
+ *               error message of ``count`` bytes otherwise
+ *
+ * A connection may have several requests in flight. Responses on a
+ * connection are sent in the order of the requests.
+ */
+
+#if !defined(_WIN32)
+
+struct RequestHeader {
+	uint32_t id;
+	uint32_t expressionLength;
+	uint32_t variablesLength;
+	uint32_t numFields;
+	uint32_t numRows;
+};
+
+struct ResponseHeader {
+	static constexpr uint32_t OK	= 0;
+	static constexpr uint32_t ERROR = 1;
+
+	uint32_t id;
+	uint32_t status;
+	uint32_t count;
+};
+
+// Limits on the size of a request, so a bad request cannot exhaust memory
+inline constexpr uint32_t maxExpressionLength = 1 << 20;
+inline constexpr uint64_t maxRequestValues	  = 1 << 24;
+
+// A connected (or listening) Unix domain socket
+class UnixSocket {
+public:
+	UnixSocket() = default;
+	explicit UnixSocket(int fd) : m_fd(fd) {}
+
+	UnixSocket(UnixSocket &&other) noexcept :
+			m_fd(std::exchange(other.m_fd, -1)) {}
+
+	UnixSocket &operator=(UnixSocket &&other) noexcept {
+		std::swap(m_fd, other.m_fd);
+		return *this;
+	}
+
+	~UnixSocket() {
+		if (m_fd >= 0) ::close(m_fd);
+	}
+
+	static UnixSocket connect(const std::string &path) {
+		UnixSocket res(::socket(AF_UNIX, SOCK_STREAM, 0));
+		LR_ASSERT(res.m_fd >= 0, "Could not create socket");
+
+		sockaddr_un addr = address(path);
+		auto *generic	 = reinterpret_cast<sockaddr *>(&addr);
+		int status		 = ::connect(res.m_fd, generic, sizeof(addr));
+		LR_ASSERT(status == 0, "Could not connect to '{}'", path);
+		return res;
+	}
+
+	// Listen on ``path``, replacing any stale socket file left there
+	static UnixSocket listen(const std::string &path) {
+		UnixSocket res(::socket(AF_UNIX, SOCK_STREAM, 0));
+		LR_ASSERT(res.m_fd >= 0, "Could not create socket");
+
+		sockaddr_un addr = address(path);
+		auto *generic	 = reinterpret_cast<sockaddr *>(&addr);
+		::unlink(path.c_str());
+		int status = ::bind(res.m_fd, generic, sizeof(addr));
+		LR_ASSERT(status == 0, "Could not bind to '{}'", path);
+		LR_ASSERT(::listen(res.m_fd, SOMAXCONN) == 0,
+				  "Could not listen on '{}'",
+				  path);
+		return res;
+	}
+
+	LR_NODISCARD("") UnixSocket accept() const {
+		int fd;
+		do {
+			fd = ::accept(m_fd, nullptr, nullptr);
+		} while (fd < 0 && errno == EINTR);
+		LR_ASSERT(fd >= 0, "Could not accept a connection");
+		return UnixSocket(fd);
+	}
+
+	// Read exactly ``bytes`` bytes. Returns false if the connection was
+	// closed before any were read
+	bool read(void *data, size_t bytes) const {
+		auto *pos		 = static_cast<char *>(data);
+		size_t remaining = bytes;
+		while (remaining > 0) {
+			ssize_t n = ::read(m_fd, pos, remaining);
+			if (n < 0 && errno == EINTR) continue;
+			if (n == 0 && remaining == bytes) return false;
+			LR_ASSERT(n > 0, "Connection closed in the middle of a message");
+			pos += n;
+			remaining -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	void write(const void *data, size_t bytes) const {
+		const auto *pos = static_cast<const char *>(data);
+		while (bytes > 0) {
+			ssize_t n = ::write(m_fd, pos, bytes);
+			if (n < 0 && errno == EINTR) continue;
+			LR_ASSERT(n > 0, "Could not write to socket");
+			pos += n;
+			bytes -= static_cast<size_t>(n);
+		}
+	}
+
+private:
+	static sockaddr_un address(const std::string &path) {
+		sockaddr_un res {};
+		res.sun_family = AF_UNIX;
+		LR_ASSERT(path.size() < sizeof(res.sun_path),
+				  "Socket path '{}' is too long",
+				  path);
+		std::copy(path.begin(), path.end(), res.sun_path);
+		return res;
+	}
+
+	int m_fd = -1;
+};
+
+inline void sendRequest(const UnixSocket &socket, uint32_t id,
+						const std::string &expression,
+						const std::vector<std::string> &variables,
+						const std::vector<double> &records) {
+	std::string names;
+	for (const auto &name : variables) {
+		if (!names.empty()) names += ',';
+		names += name;
+	}
+
+	RequestHeader header {};
+	header.id				= id;
+	header.expressionLength = static_cast<uint32_t>(expression.size());
+	header.variablesLength	= static_cast<uint32_t>(names.size());
+	header.numFields		= static_cast<uint32_t>(variables.size());
+	header.numRows			= static_cast<uint32_t>(
+	  variables.empty() ? 0 : records.size() / variables.size());
+
+	socket.write(&header, sizeof(header));
+	socket.write(expression.data(), expression.size());
+	socket.write(names.data(), names.size());
+	socket.write(records.data(), records.size() * sizeof(double));
+}
+
+// Read the response to a request into ``results``, throwing if the server
+// reported an error. Returns the id of the request
+inline uint32_t readResponse(const UnixSocket &socket,
+							 std::vector<double> &results) {
+	ResponseHeader header {};
+	LR_ASSERT(socket.read(&header, sizeof(header)), "Server closed connection");
+
+	if (header.status != ResponseHeader::OK) {
+		std::string message(header.count, '\0');
+		socket.read(message.data(), message.size());
+		throw std::runtime_error(message);
+	}
+
+	results.resize(header.count);
+	socket.read(results.data(), results.size() * sizeof(double));
+	return header.id;
+}
+
+/**
+ * Combines concurrent requests for the same expression into a single call to
+ * Program::run(). The first thread to arrive while no batch is running
+ * becomes the leader: it waits up to ``wait`` for more requests (or until
+ * ``maxRows`` rows are queued), then evaluates everything queued so far on
+ * behalf of the other threads, which sleep until their results are ready.
+ * Requests which arrive while a batch is running are evaluated by the next
+ * leader.
+ */
+class Batcher {
+public:
+	struct Request {
+		const double *records = nullptr;
+		size_t numRows		  = 0;
+		std::vector<double> results;
+		std::exception_ptr error;
+		bool done = false;
+	};
+
+	Batcher(std::shared_ptr<const Program> program,
+			std::chrono::microseconds wait, size_t maxRows) :
+			m_program(std::move(program)),
+			m_wait(wait), m_maxRows(maxRows) {}
+
+	LR_NODISCARD("") size_t numFields() const {
+		return m_program->variables().size();
+	}
+
+	void evaluate(Request &request) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_queue.emplace_back(&request);
+		m_queuedRows += request.numRows;
+		m_changed.notify_all();
+
+		while (!request.done) {
+			if (m_running) {
+				m_changed.wait(lock);
+				continue;
+			}
+
+			m_running = true;
+			m_changed.wait_for(
+			  lock, m_wait, [&]() { return m_queuedRows >= m_maxRows; });
+
+			std::vector<Request *> batch;
+			batch.swap(m_queue);
+			m_queuedRows = 0;
+
+			lock.unlock();
+			run(batch);
+			lock.lock();
+
+			for (auto *req : batch) req->done = true;
+			m_running = false;
+			m_changed.notify_all();
+		}
+	}
+
+private:
+	void run(const std::vector<Request *> &batch) {
+		size_t fields = numFields();
+		size_t rows	  = 0;
+		for (const auto *req : batch) rows += req->numRows;
+
+		try {
+			m_columns.resize(fields);
+			for (auto &column : m_columns) column.resize(rows);
+
+			size_t row = 0;
+			for (const auto *req : batch) {
+				const double *records = req->records;
+				for (size_t i = 0; i < req->numRows; ++i, ++row) {
+					for (size_t j = 0; j < fields; ++j)
+						m_columns[j][row] = Scalar(records[i * fields + j]);
+				}
+			}
+
+			std::vector<const Scalar *> columns;
+			for (const auto &column : m_columns)
+				columns.emplace_back(column.data());
+			m_results.resize(rows);
+			m_program->run(columns, rows, m_results.data(), m_workspace);
+
+			row = 0;
+			for (auto *req : batch) {
+				req->results.resize(req->numRows);
+				for (size_t i = 0; i < req->numRows; ++i, ++row)
+					req->results[i] = static_cast<double>(m_results[row]);
+			}
+		} catch (...) {
+			for (auto *req : batch) req->error = std::current_exception();
+		}
+	}
+
+	std::shared_ptr<const Program> m_program;
+	std::chrono::microseconds m_wait;
+	size_t m_maxRows;
+
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+	std::vector<Request *> m_queue;
+	size_t m_queuedRows = 0;
+	bool m_running		= false;
+
+	// Only used by the leader
+	std::vector<std::vector<Scalar>> m_columns;
+	std::vector<Scalar> m_results;
+	std::vector<Scalar> m_workspace;
+};
+
+/**
+ * Serves evaluation requests on a Unix domain socket. Expressions are parsed
+ * and compiled on first use and stay resident (up to the capacity of the
+ * caches), so repeated requests only pay for the evaluation itself. Each
+ * connection is handled by its own thread, with at most ``maxConnections``
+ * at once; further clients wait in the listen backlog until one closes.
+ */
+class EvalServer {
+public:
+	struct Options {
+		std::string socket;
+		std::chrono::microseconds batchWait {0};
+		size_t maxBatchRows	  = 1 << 16;
+		size_t maxConnections = 64;
+	};
+
+	explicit EvalServer(Options options) : m_options(std::move(options)) {}
+
+	LR_NODISCARD("") const Options &options() const { return m_options; }
+
+	[[noreturn]] void run() {
+		// A client disconnecting must not kill the server
+		std::signal(SIGPIPE, SIG_IGN);
+
+		UnixSocket listener = UnixSocket::listen(m_options.socket);
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(m_connectionMutex);
+				m_connectionClosed.wait(lock, [&]() {
+					return m_connections < m_options.maxConnections;
+				});
+				++m_connections;
+			}
+
+			std::thread([this, socket = listener.accept()]() mutable {
+				serveConnection(std::move(socket));
+				{
+					std::lock_guard<std::mutex> lock(m_connectionMutex);
+					--m_connections;
+				}
+				m_connectionClosed.notify_one();
+			}).detach();
+		}
+	}
+
+private:
+	std::shared_ptr<Batcher> batcher(const std::string &expression,
+									 const std::string &variables) {
+		std::string key = expression + '\n' + variables;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (auto *found = m_batchers.find(key)) return *found;
+		}
+
+		// Compile without holding the lock. If two threads compile the same
+		// expression at once, the first to finish wins
+		auto names = variables.empty() ? std::vector<std::string>()
+									   : splitList(variables);
+		auto res   = std::make_shared<Batcher>(
+			ExpressionCache::global().program(expression, names),
+			m_options.batchWait,
+			m_options.maxBatchRows);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_batchers.insert(key, res);
+	}
+
+	void serveConnection(UnixSocket socket) {
+		std::string expression, variables, message;
+		std::vector<double> records;
+
+		try {
+			RequestHeader header {};
+			while (true) {
+				// An idle connection must not keep replaced registry
+				// snapshots alive (see registryQuiescent())
+				registryQuiescent();
+				if (!socket.read(&header, sizeof(header))) break;
+
+				LR_ASSERT(header.expressionLength <= maxExpressionLength &&
+							header.variablesLength <= maxExpressionLength &&
+							uint64_t(header.numRows) * header.numFields <=
+							  maxRequestValues,
+						  "Request too large");
+
+				expression.resize(header.expressionLength);
+				variables.resize(header.variablesLength);
+				records.resize(size_t(header.numRows) * header.numFields);
+				socket.read(expression.data(), expression.size());
+				socket.read(variables.data(), variables.size());
+				socket.read(records.data(), records.size() * sizeof(double));
+
+				Batcher::Request request;
+				request.records = records.data();
+				request.numRows = header.numRows;
+
+				try {
+					auto batch = batcher(expression, variables);
+					LR_ASSERT(batch->numFields() == header.numFields,
+							  "Expected {} fields but got {}",
+							  batch->numFields(),
+							  header.numFields);
+					batch->evaluate(request);
+					if (request.error) std::rethrow_exception(request.error);
+				} catch (const std::exception &e) {
+					message = e.what();
+					ResponseHeader response {header.id,
+											 ResponseHeader::ERROR,
+											 uint32_t(message.size())};
+					socket.write(&response, sizeof(response));
+					socket.write(message.data(), message.size());
+					continue;
+				}
+
+				ResponseHeader response {
+				  header.id, ResponseHeader::OK, header.numRows};
+				socket.write(&response, sizeof(response));
+				socket.write(request.results.data(),
+							 request.results.size() * sizeof(double));
+			}
+		} catch (const std::exception &e) {
+			// The connection is broken, so there is no one to report to
+		}
+	}
+
+	Options m_options;
+	std::mutex m_mutex;
+	LruCache<std::string, std::shared_ptr<Batcher>> m_batchers {4096};
+
+	// Connections being served
+	std::mutex m_connectionMutex;
+	std::condition_variable m_connectionClosed;
+	size_t m_connections = 0;
+};
+
+/**
+ * Evaluates rows on a server, with the same interface as ChunkEvaluator. Each
+ * chunk is sent as one request
+ */
+class RemoteEvaluator {
+public:
+	RemoteEvaluator(const UnixSocket &socket, std::string expression,
+					std::vector<std::string> variables, size_t chunkRows) :
+			m_socket(socket),
+			m_expression(std::move(expression)),
+			m_variables(std::move(variables)), m_chunkRows(chunkRows),
+			m_row(m_variables.size()) {}
+
+	LR_NODISCARD("") bool full() const { return m_rows == m_chunkRows; }
+
+	LR_NODISCARD("") Scalar &value(size_t variable) {
+		return m_row[variable];
+	}
+
+	void row() {
+		for (const auto &val : m_row)
+			m_records.emplace_back(static_cast<double>(val));
+		++m_rows;
+	}
+
+	std::pair<const Scalar *, size_t> flush() {
+		sendRequest(m_socket, m_nextId++, m_expression, m_variables, m_records);
+		readResponse(m_socket, m_values);
+		m_records.clear();
+		m_rows = 0;
+
+		m_results.assign(m_values.begin(), m_values.end());
+		return {m_results.data(), m_results.size()};
+	}
+
+private:
+	const UnixSocket &m_socket;
+	std::string m_expression;
+	std::vector<std::string> m_variables;
+	size_t m_chunkRows;
+
+	std::vector<Scalar> m_row;
+	std::vector<double> m_records;
+	std::vector<double> m_values;
+	std::vector<Scalar> m_results;
+	size_t m_rows	  = 0;
+	uint32_t m_nextId = 0;
+};
+
+#endif // !_WIN32
+
+#if !defined(_WIN32)
+
+// The options of ``SymboMath serve``
+inline EvalServer::Options
+parseServeOptions(const std::vector<std::string> &args) {
+	EvalServer::Options options;
+	for (size_t i = 0; i < args.size(); ++i) {
+		const std::string &arg = args[i];
+		if (arg == "-s" || arg == "--socket") {
+			options.socket = optionValue(args, i);
+		} else if (arg == "--batch-wait") {
+			options.batchWait = std::chrono::microseconds(parseCountOption(
+			  arg, optionValue(args, i), 0, 1'000'000'000));
+		} else if (arg == "--max-batch") {
+			options.maxBatchRows = parseCountOption(arg, optionValue(args, i));
+		} else if (arg == "--max-connections") {
+			options.maxConnections =
+			  parseCountOption(arg, optionValue(args, i));
+		} else if (arg == "--cache-dir") {
+			ExpressionCache::global().setDiskCache(
+			  std::make_shared<DiskCache>(optionValue(args, i)));
+		} else {
+			LR_ASSERT(false, "Unexpected argument '{}'", arg);
+		}
+	}
+
+	LR_ASSERT(!options.socket.empty(), "No socket given");
+	return options;
+}
+
+// ``SymboMath serve``: run an EvalServer until the process is killed
+inline int serveCommand(const std::vector<std::string> &args) {
+	EvalServer::Options options = parseServeOptions(args);
+	fmt::print(stderr, "Listening on {}\n", options.socket);
+	EvalServer(options).run();
+}
+
+// ``SymboMath client EXPR``: the same as ``eval``, but evaluated by a server
+inline int clientCommand(const std::vector<std::string> &args) {
+	EvalOptions options = parseEvalOptions(args);
+	LR_ASSERT(!options.socket.empty(), "No socket given");
+
+	auto socket = UnixSocket::connect(options.socket);
+	auto tree	= autoParse(options.expression);
+	evalStream(options, tree, [&](const std::vector<std::string> &names) {
+		return RemoteEvaluator(
+		  socket, options.expression, names, options.chunkRows);
+	});
+	return 0;
+}
+
+/**
+ * ``SymboMath loadgen EXPR``: send requests with random inputs to a server
+ * from several connections at once, and report the throughput and the
+ * distribution of request latencies
+ */
+inline int loadgenCommand(const std::vector<std::string> &args) {
+	std::string expression, socketPath;
+	size_t numClients = 4, numRequests = 1000, numRows = 16;
+
+	for (size_t i = 0; i < args.size(); ++i) {
+		const std::string &arg = args[i];
+		if (arg == "-s" || arg == "--socket") {
+			socketPath = optionValue(args, i);
+		} else if (arg == "--clients") {
+			numClients = parseCountOption(arg, optionValue(args, i));
+		} else if (arg == "--requests") {
+			numRequests = parseCountOption(arg, optionValue(args, i));
+		} else if (arg == "--rows") {
+			numRows = parseCountOption(arg, optionValue(args, i));
+		} else {
+			LR_ASSERT(expression.empty(), "Unexpected argument '{}'", arg);
+			expression = arg;
+		}
+	}
+
+	LR_ASSERT(!expression.empty(), "No expression given");
+	LR_ASSERT(!socketPath.empty(), "No socket given");
+
+	std::vector<std::string> names;
+	const auto &constants = registry().constants();
+	for (const auto &name : variableNames(autoParse(expression))) {
+		if (constants.find(name) == constants.end()) names.emplace_back(name);
+	}
+
+	using Clock = std::chrono::steady_clock;
+	std::vector<std::vector<double>> latencies(numClients);
+	std::vector<std::exception_ptr> errors(numClients);
+	std::vector<std::thread> clients;
+
+	auto start = Clock::now();
+	for (size_t c = 0; c < numClients; ++c) {
+		clients.emplace_back([&, c]() {
+			try {
+				auto socket = UnixSocket::connect(socketPath);
+				std::mt19937_64 rng(c);
+				std::uniform_real_distribution<double> dist(0, 1);
+				std::vector<double> records(numRows * names.size()), results;
+
+				for (size_t r = 0; r < numRequests; ++r) {
+					for (auto &val : records) val = dist(rng);
+
+					auto begin = Clock::now();
+					auto id = static_cast<uint32_t>(r);
+					sendRequest(socket, id, expression, names, records);
+					readResponse(socket, results);
+					std::chrono::duration<double, std::micro> elapsed =
+					  Clock::now() - begin;
+					latencies[c].emplace_back(elapsed.count());
+				}
+			} catch (...) { errors[c] = std::current_exception(); }
+		});
+	}
+
+	for (auto &client : clients) client.join();
+	std::chrono::duration<double> elapsed = Clock::now() - start;
+
+	for (const auto &error : errors) {
+		if (error) std::rethrow_exception(error);
+	}
+
+	std::vector<double> all;
+	for (const auto &client : latencies)
+		all.insert(all.end(), client.begin(), client.end());
+	std::sort(all.begin(), all.end());
+
+	auto percentile = [&](double p) {
+		if (all.empty()) return 0.0;
+		auto index = static_cast<size_t>(p * double(all.size() - 1) + 0.5);
+		return all[index];
+	};
+
+	double seconds = elapsed.count();
+	fmt::print("Requests:   {} ({} clients x {}, {} rows each)\n",
+			   all.size(),
+			   numClients,
+			   numRequests,
+			   numRows);
+	fmt::print("Throughput: {:.0f} requests/s, {:.0f} rows/s\n",
+			   double(all.size()) / seconds,
+			   double(all.size() * numRows) / seconds);
+	fmt::print("Latency:    p50 {:.1f} us, p90 {:.1f} us, p99 {:.1f} us, "
+			   "p99.9 {:.1f} us, max {:.1f} us\n",
+			   percentile(0.5),
+			   percentile(0.9),
+			   percentile(0.99),
+			   percentile(0.999),
+			   all.empty() ? 0.0 : all.back());
+	return 0;
+}
+
+#else
+
+inline int serveCommand(const std::vector<std::string> &) {
+	LR_ASSERT(false, "The server is not supported on this platform");
+	return 1;
+}
+
+inline int clientCommand(const std::vector<std::string> &) {
+	LR_ASSERT(false, "The server is not supported on this platform");
+	return 1;
+}
+
+inline int loadgenCommand(const std::vector<std::string> &) {
+	LR_ASSERT(false, "The server is not supported on this platform");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,223 @@
+#pragma once
+
+// Integer powers up to this are evaluated by repeated multiplication
+constexpr int64_t maxIntegerPower = 64;
+
+/**
+ * base^power by binary exponentiation (the binary addition chain for
+ * ``power``), which needs at most 2 log2(power) multiplications
+ */
+template<typename T>
+T integerPow(T base, int64_t power) {
+	bool invert = power < 0;
+	auto n		= static_cast<uint64_t>(invert ? -power : power);
+
+	T res(1);
+	while (n > 0) {
+		if (n & 1) res *= base;
+		n >>= 1;
+		if (n > 0) base *= base;
+	}
+
+	return invert ? T(1) / res : res;
+}
+
+// Whether ``power`` is an integer small enough for integerPow(). The range
+// is checked before converting, since converting NaN, an infinity or a value
+// outside the range of int64_t is undefined
+inline bool isSmallIntegerPower(const Scalar &power) {
+	if (!(power >= -Scalar(maxIntegerPower) &&
+		  power <= Scalar(maxIntegerPower)))
+		return false;
+	return power == Scalar(static_cast<int64_t>(power));
+}
+
+// POW functors used by strength-reduced nodes. The exponent is still an
+// operand, so the node prints and differentiates like any other POW
+inline const std::function<Scalar(const std::vector<Scalar> &)> &
+integerPowFunctor() {
+	static const std::function<Scalar(const std::vector<Scalar> &)> functor =
+	  [](const std::vector<Scalar> &operands) {
+		  return integerPow(operands[0], static_cast<int64_t>(operands[1]));
+	  };
+	return functor;
+}
+
+inline const std::function<Scalar(const std::vector<Scalar> &)> &
+sqrtPowFunctor() {
+	static const std::function<Scalar(const std::vector<Scalar> &)> functor =
+	  [](const std::vector<Scalar> &operands) {
+		  using std::sqrt;
+		  return sqrt(operands[0]);
+	  };
+	return functor;
+}
+
+// Negate a node, removing a double negation or folding it into a number
+inline std::shared_ptr<Component>
+negate(const std::shared_ptr<Component> &input) {
+	if (input->type() == "NUMBER" && !isNamedNumber(input)) {
+		auto number	 = std::dynamic_pointer_cast<Number>(input);
+		Scalar value = number->value();
+
+		// Zero is negated as a Scalar, so its sign is kept
+		if (number->exact() && value != 0)
+			return std::make_shared<Number>(-*number->exact());
+		return std::make_shared<Number>(-value);
+	}
+
+	if (input->type() == "FUNCTION") {
+		std::string name = input->name();
+		const auto &vals = input->children();
+		if (name == "MINUS") return vals[0];
+		if (name == "SUB") return sub(vals[1], vals[0]);
+	}
+
+	return minus(input);
+}
+
+// If a node is a negation, return its operand
+inline std::shared_ptr<Component>
+negatedOperand(const std::shared_ptr<Component> &input) {
+	if (input->type() == "FUNCTION" && input->name() == "MINUS")
+		return input->children()[0];
+	return nullptr;
+}
+
+inline std::shared_ptr<Component>
+strengthReduceNode(const std::shared_ptr<Component> &node,
+				   std::vector<std::shared_ptr<Component>> &values) {
+	if (node->type() != "FUNCTION") return node->withChildren(values);
+
+	auto func		 = std::dynamic_pointer_cast<Function>(node);
+	std::string name = func->name();
+
+	auto numberValue = [](const std::shared_ptr<Component> &val) {
+		return std::dynamic_pointer_cast<Number>(val)->value();
+	};
+
+	if (name == "MINUS") return negate(values[0]);
+
+	// Evaluate constant exponents, so x^(1/2) is treated like x^0.5
+	if (name == "POW" && values[1]->type() != "NUMBER" && values[1]->canEval())
+		values[1] = std::make_shared<Number>(values[1]->eval());
+
+	if (name == "POW" && values[1]->type() == "NUMBER") {
+		Scalar power = numberValue(values[1]);
+
+		if (power == Scalar(0.5)) {
+			auto sqrtIt = findFunction("sqrt");
+			if (sqrtIt != nullptr) {
+				auto res = std::make_shared<Function>(*sqrtIt);
+				res->addValue(values[0]);
+				return res;
+			}
+
+			return std::make_shared<Function>(
+			  name, func->format(), sqrtPowFunctor(), 2, values);
+		}
+
+		if (isSmallIntegerPower(power)) {
+			if (power == 1) return values[0];
+			return std::make_shared<Function>(
+			  name, func->format(), integerPowFunctor(), 2, values);
+		}
+	}
+
+	// a / c = a * (1 / c). The reciprocal is rounded, so the result may
+	// differ from the division in the last place. The reciprocal of an exact
+	// number is exact, so a Program rounds it to the type it is run in. A
+	// named constant is left as a divisor, since its reciprocal would only be
+	// as precise as a Scalar
+	if (name == "DIV" && values[1]->type() == "NUMBER" &&
+		!isNamedNumber(values[1]) && numberValue(values[1]) != 0) {
+		const auto &exact =
+		  std::dynamic_pointer_cast<Number>(values[1])->exact();
+		auto reciprocal =
+		  exact ? std::make_shared<Number>(Rational(1) / *exact)
+				: std::make_shared<Number>(Scalar(1) / numberValue(values[1]));
+		if (auto operand = negatedOperand(values[0]))
+			return mul(operand, negate(reciprocal));
+		return mul(values[0], reciprocal);
+	}
+
+	if (name == "DIV") {
+		// (-a) / (-b) = a / b
+		auto lhs = negatedOperand(values[0]), rhs = negatedOperand(values[1]);
+		if (lhs && rhs) return div(lhs, rhs);
+	}
+
+	if (name == "SUB") {
+		// a - (-b) = a + b
+		if (auto rhs = negatedOperand(values[1])) return add(values[0], rhs);
+	}
+
+	if (name == "ADD") {
+		// a + (-b) + c + (-d) = (a + c) - (b + d)
+		std::vector<std::shared_ptr<Component>> positive, negative;
+		for (const auto &val : values) {
+			if (auto operand = negatedOperand(val))
+				negative.emplace_back(operand);
+			else
+				positive.emplace_back(val);
+		}
+
+		if (!negative.empty()) {
+			auto sum = [&](const std::vector<std::shared_ptr<Component>> &v) {
+				return v.size() == 1 ? v[0] : makeAssociative(*func, v);
+			};
+
+			if (positive.empty()) return negate(sum(negative));
+			return sub(sum(positive), sum(negative));
+		}
+	}
+
+	if (name == "MUL") {
+		// Move the signs of negated operands into a single sign, which is
+		// folded into a numeric operand if there is one
+		bool negative = false;
+		for (auto &val : values) {
+			if (auto operand = negatedOperand(val)) {
+				val		 = operand;
+				negative = !negative;
+			}
+		}
+
+		if (negative) {
+			auto number = std::find_if(
+			  values.begin(), values.end(), [](const auto &val) {
+				  return val->type() == "NUMBER" && !isNamedNumber(val);
+			  });
+
+			if (number != values.end()) {
+				*number = negate(*number);
+				return makeAssociative(*func, values);
+			}
+
+			return minus(makeAssociative(*func, values));
+		}
+	}
+
+	return node->withChildren(values);
+}
+
+/**
+ * Rewrite a tree into an equivalent form which is cheaper to evaluate:
+ *  - x^n for small integers n is evaluated by repeated squaring rather than
+ *    the general POW functor. The node is still a POW node, so it prints and
+ *    differentiates as before
+ *  - x^0.5 is replaced by sqrt(x), after evaluating constant exponents
+ *  - Division by a constant becomes multiplication by its reciprocal
+ *  - Negations are cancelled or folded into neighbouring operations, so
+ *    -(-x) becomes x and a + (-b) becomes a - b
+ */
+std::shared_ptr<Component>
+strengthReduce(const std::shared_ptr<Component> &input) {
+	std::vector<std::shared_ptr<Component>> values;
+	auto visitor = [&](const auto &node, auto first, auto last) {
+		values.assign(first, last);
+		return strengthReduceNode(node, values);
+	};
+
+	return foldTree<std::shared_ptr<Component>>(input, visitor);
+}
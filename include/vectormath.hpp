@@ -0,0 +1,999 @@
+#pragma once
+
+/**
+ * How accurate the vectorized standard functions must be, as the largest
+ * error in ulps (units in the last place) of the result. ULP4 kernels use
+ * shorter polynomials and skip the extra-precision steps of the ULP1 kernels.
+ * See vectorUnary()
+ */
+enum class Accuracy { ULP1, ULP4 };
+
+inline Accuracy parseAccuracy(const std::string &name) {
+	if (name == "1ulp" || name == "1") return Accuracy::ULP1;
+	LR_ASSERT(name == "4ulp" || name == "4", "Unknown accuracy '{}'", name);
+	return Accuracy::ULP4;
+}
+
+template<typename T>
+using VectorUnary = void (*)(const T *, T *, size_t);
+
+template<typename T>
+using VectorBinary = void (*)(const T *, const T *, T *, size_t);
+
+// The kernels need AVX2 or AVX-512. Without them, one lane at a time is slower
+// than the standard library, so no vector kernels are provided
+#if defined(__AVX512F__) || defined(__AVX2__)
+#	define SYMBOMATH_VECTOR_KERNELS
+#endif
+
+#if defined(SYMBOMATH_VECTOR_KERNELS)
+
+/*
+ * A SIMD register of doubles: 8 lanes with AVX-512 or 4 with AVX2. The kernels
+ * below are written once against this interface. Bit operations act on the
+ * IEEE representation of each lane.
+ */
+
+#	if defined(__AVX512F__)
+
+struct DoubleMask {
+	__mmask8 m;
+
+	friend DoubleMask operator|(DoubleMask a, DoubleMask b) {
+		return {static_cast<__mmask8>(a.m | b.m)};
+	}
+
+	friend DoubleMask operator&(DoubleMask a, DoubleMask b) {
+		return {static_cast<__mmask8>(a.m & b.m)};
+	}
+
+	friend DoubleMask operator~(DoubleMask a) {
+		return {static_cast<__mmask8>(~a.m)};
+	}
+
+	// Whether any lane is set
+	LR_NODISCARD("") bool any() const { return m != 0; }
+};
+
+struct DoublePack {
+	static constexpr size_t lanes = 8;
+
+	DoublePack(__m512d v) : v(v) {}
+	DoublePack(double x) : v(_mm512_set1_pd(x)) {}
+
+	static DoublePack load(const double *src) { return _mm512_loadu_pd(src); }
+	void store(double *dst) const { _mm512_storeu_pd(dst, v); }
+
+	__m512d v;
+};
+
+inline DoublePack operator+(DoublePack a, DoublePack b) {
+	return _mm512_add_pd(a.v, b.v);
+}
+
+inline DoublePack operator-(DoublePack a, DoublePack b) {
+	return _mm512_sub_pd(a.v, b.v);
+}
+
+inline DoublePack operator*(DoublePack a, DoublePack b) {
+	return _mm512_mul_pd(a.v, b.v);
+}
+
+inline DoublePack operator/(DoublePack a, DoublePack b) {
+	return _mm512_div_pd(a.v, b.v);
+}
+
+inline DoubleMask operator<(DoublePack a, DoublePack b) {
+	return {_mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ)};
+}
+
+inline DoubleMask operator<=(DoublePack a, DoublePack b) {
+	return {_mm512_cmp_pd_mask(a.v, b.v, _CMP_LE_OQ)};
+}
+
+inline DoubleMask operator>(DoublePack a, DoublePack b) { return b < a; }
+inline DoubleMask operator>=(DoublePack a, DoublePack b) { return b <= a; }
+
+inline DoublePack select(DoubleMask mask, DoublePack a, DoublePack b) {
+	return _mm512_mask_blend_pd(mask.m, b.v, a.v);
+}
+
+inline DoublePack sqrt(DoublePack a) { return _mm512_sqrt_pd(a.v); }
+
+inline __m512i packBits(DoublePack a) { return _mm512_castpd_si512(a.v); }
+inline DoublePack fromBits(__m512i a) { return _mm512_castsi512_pd(a); }
+
+inline DoublePack bitAnd(DoublePack a, uint64_t mask) {
+	return fromBits(_mm512_and_si512(
+	  packBits(a), _mm512_set1_epi64(static_cast<int64_t>(mask))));
+}
+
+inline DoublePack bitOr(DoublePack a, uint64_t bits) {
+	return fromBits(_mm512_or_si512(
+	  packBits(a), _mm512_set1_epi64(static_cast<int64_t>(bits))));
+}
+
+inline DoublePack bitXor(DoublePack a, DoublePack b) {
+	return fromBits(_mm512_xor_si512(packBits(a), packBits(b)));
+}
+
+inline DoublePack addBits(DoublePack a, int64_t k) {
+	return fromBits(_mm512_add_epi64(packBits(a), _mm512_set1_epi64(k)));
+}
+
+inline DoublePack shiftBitsLeft(DoublePack a, unsigned int k) {
+	return fromBits(_mm512_slli_epi64(packBits(a), k));
+}
+
+inline DoublePack shiftBitsRight(DoublePack a, unsigned int k) {
+	return fromBits(_mm512_srli_epi64(packBits(a), k));
+}
+
+// The lanes with any of the bits in ``mask`` set
+inline DoubleMask testBits(DoublePack a, uint64_t mask) {
+	return {_mm512_test_epi64_mask(
+	  packBits(a), _mm512_set1_epi64(static_cast<int64_t>(mask)))};
+}
+
+// a * b - p, exactly, where p is the rounded product
+inline DoublePack productError(DoublePack a, DoublePack b, DoublePack p) {
+	return _mm512_fmsub_pd(a.v, b.v, p.v);
+}
+
+#	else
+
+struct DoubleMask {
+	__m256d m;
+
+	friend DoubleMask operator|(DoubleMask a, DoubleMask b) {
+		return {_mm256_or_pd(a.m, b.m)};
+	}
+
+	friend DoubleMask operator&(DoubleMask a, DoubleMask b) {
+		return {_mm256_and_pd(a.m, b.m)};
+	}
+
+	friend DoubleMask operator~(DoubleMask a) {
+		return {_mm256_xor_pd(
+		  a.m, _mm256_castsi256_pd(_mm256_set1_epi64x(int64_t(-1))))};
+	}
+
+	// Whether any lane is set
+	LR_NODISCARD("") bool any() const { return _mm256_movemask_pd(m) != 0; }
+};
+
+struct DoublePack {
+	static constexpr size_t lanes = 4;
+
+	DoublePack(__m256d v) : v(v) {}
+	DoublePack(double x) : v(_mm256_set1_pd(x)) {}
+
+	static DoublePack load(const double *src) { return _mm256_loadu_pd(src); }
+	void store(double *dst) const { _mm256_storeu_pd(dst, v); }
+
+	__m256d v;
+};
+
+inline DoublePack operator+(DoublePack a, DoublePack b) {
+	return _mm256_add_pd(a.v, b.v);
+}
+
+inline DoublePack operator-(DoublePack a, DoublePack b) {
+	return _mm256_sub_pd(a.v, b.v);
+}
+
+inline DoublePack operator*(DoublePack a, DoublePack b) {
+	return _mm256_mul_pd(a.v, b.v);
+}
+
+inline DoublePack operator/(DoublePack a, DoublePack b) {
+	return _mm256_div_pd(a.v, b.v);
+}
+
+inline DoubleMask operator<(DoublePack a, DoublePack b) {
+	return {_mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ)};
+}
+
+inline DoubleMask operator<=(DoublePack a, DoublePack b) {
+	return {_mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ)};
+}
+
+inline DoubleMask operator>(DoublePack a, DoublePack b) { return b < a; }
+inline DoubleMask operator>=(DoublePack a, DoublePack b) { return b <= a; }
+
+inline DoublePack select(DoubleMask mask, DoublePack a, DoublePack b) {
+	return _mm256_blendv_pd(b.v, a.v, mask.m);
+}
+
+inline DoublePack sqrt(DoublePack a) { return _mm256_sqrt_pd(a.v); }
+
+inline __m256i packBits(DoublePack a) { return _mm256_castpd_si256(a.v); }
+inline DoublePack fromBits(__m256i a) { return _mm256_castsi256_pd(a); }
+
+inline DoublePack bitAnd(DoublePack a, uint64_t mask) {
+	return fromBits(_mm256_and_si256(
+	  packBits(a), _mm256_set1_epi64x(static_cast<int64_t>(mask))));
+}
+
+inline DoublePack bitOr(DoublePack a, uint64_t bits) {
+	return fromBits(_mm256_or_si256(
+	  packBits(a), _mm256_set1_epi64x(static_cast<int64_t>(bits))));
+}
+
+inline DoublePack bitXor(DoublePack a, DoublePack b) {
+	return fromBits(_mm256_xor_si256(packBits(a), packBits(b)));
+}
+
+inline DoublePack addBits(DoublePack a, int64_t k) {
+	return fromBits(_mm256_add_epi64(packBits(a), _mm256_set1_epi64x(k)));
+}
+
+inline DoublePack shiftBitsLeft(DoublePack a, int k) {
+	return fromBits(_mm256_slli_epi64(packBits(a), k));
+}
+
+inline DoublePack shiftBitsRight(DoublePack a, int k) {
+	return fromBits(_mm256_srli_epi64(packBits(a), k));
+}
+
+// The lanes with any of the bits in ``mask`` set
+inline DoubleMask testBits(DoublePack a, uint64_t mask) {
+	__m256i bits = packBits(bitAnd(a, mask));
+	__m256i zero = _mm256_cmpeq_epi64(bits, _mm256_setzero_si256());
+	return ~DoubleMask {_mm256_castsi256_pd(zero)};
+}
+
+// a * b - p, exactly, where p is the rounded product
+inline DoublePack productError(DoublePack a, DoublePack b, DoublePack p) {
+#		if defined(__FMA__)
+	return _mm256_fmsub_pd(a.v, b.v, p.v);
+#		else
+	// Dekker's product, splitting each operand into two halves
+	auto split = [](DoublePack x, DoublePack &hi, DoublePack &lo) {
+		DoublePack c = x * DoublePack(134217729.0);
+		hi			 = c - (c - x);
+		lo			 = x - hi;
+	};
+
+	DoublePack ah = 0.0, al = 0.0, bh = 0.0, bl = 0.0;
+	split(a, ah, al);
+	split(b, bh, bl);
+	return ((ah * bh - p) + ah * bl + al * bh) + al * bl;
+#		endif
+}
+
+#	endif
+
+inline DoublePack operator-(DoublePack a) { return DoublePack(0.0) - a; }
+
+inline DoublePack abs(DoublePack a) {
+	return bitAnd(a, 0x7FFFFFFFFFFFFFFF);
+}
+
+// The lanes which are NaN. Comparisons with NaN are false, so a NaN lane
+// compares neither below nor at least another value
+inline DoubleMask isNan(DoublePack a) { return ~(a <= a); }
+
+// Evaluate a polynomial given its coefficients from the highest degree
+template<size_t N>
+DoublePack polyPack(DoublePack x, const double (&coefficients)[N]) {
+	DoublePack res = coefficients[0];
+	for (size_t i = 1; i < N; ++i) res = res * x + DoublePack(coefficients[i]);
+	return res;
+}
+
+// The lanes of ``x`` rounded to integers, which must be below 2^51. The
+// integer is also left in the low bits of ``shifted``
+inline DoublePack roundPack(DoublePack x, DoublePack &shifted) {
+	const DoublePack shifter = 0x1.8p52;
+	shifted					 = x + shifter;
+	return shifted - shifter;
+}
+
+// 2^n for integers n in [-1022, 1023], from the ``shifted`` value of
+// roundPack()
+inline DoublePack powerOfTwo(DoublePack shifted) {
+	return shiftBitsLeft(addBits(shifted, 1023), 52);
+}
+
+inline constexpr double vectorNan = std::numeric_limits<double>::quiet_NaN();
+inline constexpr double vectorInfinity =
+  std::numeric_limits<double>::infinity();
+
+// Remove the low 32 bits, so products of two such values are exact
+inline DoublePack highHalf(DoublePack x) {
+	return bitAnd(x, 0xFFFFFFFF00000000);
+}
+
+/*
+ * Polynomial coefficients, from the highest degree, fitted on the reduced
+ * ranges with Chebyshev interpolation. Each comment gives the function the
+ * polynomial approximates.
+ */
+
+// (e^r - 1 - r) / r^2, |r| <= ln(2) / 2
+inline constexpr double expCoefficients1[] = {
+  2.09147553258932e-09,	 2.5105312729622103e-08, 2.755727347871858e-07,
+  2.755725517000089e-06, 2.480158732567746e-05,	 0.0001984126987500228,
+  0.0013888888888883711, 0.008333333333326084,	 0.04166666666666667,
+  0.1666666666666667,	 0.5};
+
+inline constexpr double expCoefficients4[] = {
+  2.5100472505694996e-08, 2.7620201591031547e-07, 2.7557268276905696e-06,
+  2.4801521057868204e-05, 0.00019841269863171557, 0.0013888888917367081,
+  0.008333333333330039,	  0.041666666666623824,	  0.16666666666666669,
+  0.5000000000000001};
+
+// (2 atanh(s) / s - 2) / s^2 in s^2, |s| <= 3 - 2 sqrt(2)
+inline constexpr double logCoefficients1[] = {
+  0.13101171852591828, 0.13267375084628505, 0.1538629217588882,
+  0.18181794670417264, 0.222222224008359,	0.2857142857076317,
+  0.40000000000000946, 0.6666666666666666};
+
+inline constexpr double logCoefficients4[] = {
+  0.14630465387106195, 0.1533058183634364, 0.18182923591453207,
+  0.22222210659293473, 0.2857142862890348, 0.39999999999893016,
+  0.666666666666667};
+
+// (sin(r) - r) / r^3 in r^2, |r| <= pi / 4
+inline constexpr double sinCoefficients1[] = {
+  -7.586636882825159e-13, 1.6058530596645953e-10, -2.50521062259944e-08,
+  2.755731921932058e-06,  -0.0001984126984126504, 0.008333333333333331,
+  -0.16666666666666666};
+
+inline constexpr double sinCoefficients4[] = {
+  1.5917988979397435e-10, -2.5051129896450185e-08, 2.7557316093198404e-06,
+  -0.00019841269836740532, 0.008333333333330936,	 -0.16666666666666666};
+
+// (cos(r) - 1 + r^2 / 2) / r^4 in r^2, |r| <= pi / 4
+inline constexpr double cosCoefficients[] = {
+  -1.138254464534925e-11, 2.087614504941318e-09, -2.755731726587808e-07,
+  2.48015872987544e-05,	  -0.0013888888888887389, 0.041666666666666664};
+
+// (tan(r) - r - r^3 / 3) / r^5 in r^2, |r| <= pi / 4
+inline constexpr double tanCoefficients[] = {
+  8.503058194385711e-06,  -1.8397236604839596e-05, 3.666783983827127e-05,
+  -1.1178698604230587e-05, 5.5705132251992434e-05, 8.992810538417746e-05,
+  0.00024124581146815736, 0.0005895709473878464,	 0.0014559035141199599,
+  0.0035921208933150546,  0.008863236009826123,	 0.02186948851679944,
+  0.05396825396866166,	  0.13333333333332995};
+
+// (atan(x) - x) / x^3 in x^2, |x| <= tan(pi / 8)
+inline constexpr double atanCoefficients1[] = {
+  0.01627194475162406,	 -0.034558092551413795, 0.04551108126325172,
+  -0.052303478730160745, 0.058789145444006215,	-0.06666423628069258,
+  0.0769229630497447,	 -0.09090908751076636,	0.11111111105106705,
+  -0.14285714285659326,	 0.199999999999998,		-0.3333333333333333};
+
+inline constexpr double atanCoefficients4[] = {
+  0.022734660289432312, -0.04482174587127949, 0.057359799104905136,
+  -0.06649556219483789, 0.0769104971487617,	  -0.09090852255728335,
+  0.11111109627206857,	-0.1428571426595293,  0.1999999999989756,
+  -0.3333333333333324};
+
+// (asin(x) - x) / x^3 in x^2, |x| <= 1 / 2
+inline constexpr double asinCoefficients1[] = {
+  0.028757851367421566, -0.014851887071247204, 0.01740087944269402,
+  0.005457506718640358, 0.01032281435018578,   0.011479177415184906,
+  0.013971212973552933, 0.017352392720869973,  0.02237217294214989,
+  0.030381944138531247, 0.04464285714635543,   0.07499999999998433,
+  0.16666666666666669};
+
+inline constexpr double asinCoefficients4[] = {
+  0.028169218060881414, -0.010749050339697808, 0.01603551434914882,
+  0.0078029494773533175, 0.011875494382636922, 0.013929652902326633,
+  0.017355259955786323, 0.02237204763174451,	 0.03038194736709848,
+  0.044642857103423646, 0.07500000000020764,	 0.1666666666666665};
+
+// (3 log((1 + s) / (1 - s)) / (2 s) - 3 - s^2) / s^4 in s^2, |s| <= 0.1011
+inline constexpr double powLogCoefficients[] = {
+  0.2055053304833352, 0.23070557336969208, 0.2727276109825097,
+  0.33333333252190733, 0.4285714285721399, 0.5999999999999999};
+
+// ln(2) split so that its product with an exponent is exact
+inline constexpr double ln2Hi = 0.6931471805598903;
+inline constexpr double ln2Lo = 5.497923018708371e-14;
+
+// pi / 2 split into parts of 33, 33 and 53 bits, for reducing by it
+inline constexpr double pio2Part1 = 1.5707963267341256;
+inline constexpr double pio2Part2 = 6.077100506303966e-11;
+inline constexpr double pio2Part3 = 2.0222662487959506e-21;
+
+inline constexpr double pio2Hi = 1.5707963267948966;
+inline constexpr double pio2Lo = 6.123233995736766e-17;
+inline constexpr double pio4Hi = 0.7853981633974483;
+inline constexpr double pio4Lo = 3.061616997868383e-17;
+
+/**
+ * The elementary functions over a pack of doubles. Each kernel's ``pack<A>()``
+ * evaluates the function to the accuracy A over the arguments it handles,
+ * and returns NaN in the other lanes, which are evaluated again with
+ * ``scalar()`` from the standard library. These are arguments which are rare
+ * in practice: non-finite values, results which overflow or are subnormal,
+ * and trigonometric arguments too large to reduce exactly.
+ *
+ * The bounds on the error are those of the algorithms (fdlibm's, for log,
+ * asin, acos and pow), and were checked against long double evaluation
+ */
+struct ExpKernel {
+	template<Accuracy A>
+	static DoublePack pack(DoublePack x) {
+		// e^x = 2^n e^r, with r = x - n ln(2) in [-ln(2) / 2, ln(2) / 2]
+		DoublePack shifted = 0.0;
+		DoublePack n = roundPack(x * DoublePack(1.4426950408889634), shifted);
+		DoublePack a = x - n * DoublePack(ln2Hi);
+		DoublePack r = a - n * DoublePack(ln2Lo);
+
+		DoublePack res = 0.0;
+		if constexpr (A == Accuracy::ULP1) {
+			// 1 + r is computed exactly in two parts, as is the error of r
+			DoublePack rl	= (a - r) - n * DoublePack(ln2Lo);
+			DoublePack poly = r * r * polyPack(r, expCoefficients1);
+			DoublePack hi	= DoublePack(1.0) + r;
+			DoublePack lo	= (DoublePack(1.0) - hi) + r;
+			res				= hi + (lo + (poly + rl));
+		} else {
+			DoublePack poly = r * r * polyPack(r, expCoefficients4);
+			res				= DoublePack(1.0) + (r + poly);
+		}
+
+		res = res * powerOfTwo(shifted);
+		return select(abs(x) < DoublePack(708.0), res, vectorNan);
+	}
+
+	static double scalar(double x) { return std::exp(x); }
+};
+
+struct LogKernel {
+	template<Accuracy A>
+	static DoublePack pack(DoublePack x) {
+		// x = 2^e m, with m in [sqrt(2) / 2, sqrt(2)]
+		const DoublePack exponentBias = 0x1p52 + 1023;
+		DoublePack e = bitOr(shiftBitsRight(x, 52), 0x4330000000000000) -
+					   exponentBias;
+		DoublePack m = bitOr(bitAnd(x, 0x000FFFFFFFFFFFFF), 0x3FF0000000000000);
+		DoubleMask high = m > DoublePack(1.4142135623730951);
+		m				= select(high, m * DoublePack(0.5), m);
+		e				= select(high, e + DoublePack(1.0), e);
+
+		// log(m) = log(1 + f) = 2 atanh(s), with s = f / (2 + f)
+		DoublePack f = m - DoublePack(1.0);
+		DoublePack s = f / (DoublePack(2.0) + f);
+		DoublePack z = s * s;
+
+		DoublePack res = 0.0;
+		if constexpr (A == Accuracy::ULP1) {
+			// log(1 + f) = f - f^2 / 2 + s (f^2 / 2 + R), so s is only used
+			// in the smaller terms
+			DoublePack r	= z * polyPack(z, logCoefficients1);
+			DoublePack hfsq = DoublePack(0.5) * f * f;
+			res = e * DoublePack(ln2Hi) -
+				  ((hfsq - (s * (hfsq + r) + e * DoublePack(ln2Lo))) - f);
+		} else {
+			DoublePack r = z * polyPack(z, logCoefficients4);
+			res			 = e * DoublePack(ln2Hi) +
+				  (DoublePack(2.0) * s + (s * r + e * DoublePack(ln2Lo)));
+		}
+
+		DoubleMask normal = (x >= DoublePack(0x1p-1022)) &
+							(x < DoublePack(vectorInfinity));
+		return select(normal, res, vectorNan);
+	}
+
+	static double scalar(double x) { return std::log(x); }
+};
+
+/**
+ * The argument of a trigonometric function reduced by pi / 2: x = q pi / 2
+ * + r + rl, with |r| <= pi / 4. The integer q is in the low bits of
+ * ``shifted``. Arguments above 1e5, or close enough to a multiple of pi / 2
+ * to lose accuracy, are marked in ``invalid``
+ */
+struct ReducedPack {
+	explicit ReducedPack(DoublePack x) {
+		DoublePack q = roundPack(x * DoublePack(0.6366197723675814), shifted);
+
+		// The first two products are exact, as is the first difference
+		DoublePack a  = x - q * DoublePack(pio2Part1);
+		DoublePack b  = q * DoublePack(pio2Part2);
+		DoublePack r1 = a - b;
+		DoublePack bb = r1 - a;
+		DoublePack e1 = (a - (r1 - bb)) - (b + bb);
+		DoublePack c  = e1 - q * DoublePack(pio2Part3);
+		r			  = r1 + c;
+		rl			  = (r1 - r) + c;
+
+		invalid = ~(abs(x) <= DoublePack(1e5)) |
+				  (abs(r) < abs(x) * DoublePack(0x1p-40));
+	}
+
+	DoublePack shifted = 0.0;
+	DoublePack r	   = 0.0;
+	DoublePack rl	   = 0.0;
+	DoubleMask invalid;
+};
+
+// sin(r + rl) and cos(r + rl) for |r| <= pi / 4
+template<Accuracy A>
+DoublePack sinReduced(const ReducedPack &x) {
+	DoublePack z = x.r * x.r;
+	if constexpr (A == Accuracy::ULP1) {
+		DoublePack poly = polyPack(z, sinCoefficients1);
+		return x.r + (z * x.r * poly + x.rl);
+	} else {
+		return x.r + z * x.r * polyPack(z, sinCoefficients4);
+	}
+}
+
+template<Accuracy A>
+DoublePack cosReduced(const ReducedPack &x) {
+	DoublePack z	= x.r * x.r;
+	DoublePack hz	= DoublePack(0.5) * z;
+	DoublePack tail = z * z * polyPack(z, cosCoefficients);
+	if constexpr (A == Accuracy::ULP1) {
+		// 1 - hz is rounded, and its error added back
+		DoublePack w = DoublePack(1.0) - hz;
+		return w + (((DoublePack(1.0) - w) - hz) + (tail - x.r * x.rl));
+	} else {
+		return DoublePack(1.0) - (hz - tail);
+	}
+}
+
+struct SinKernel {
+	template<Accuracy A>
+	static DoublePack pack(DoublePack x) {
+		ReducedPack reduced(x);
+		DoublePack sin = sinReduced<A>(reduced);
+		DoublePack cos = cosReduced<A>(reduced);
+
+		// sin(q pi / 2 + r) is sin(r), cos(r), -sin(r) or -cos(r)
+		DoublePack res = select(testBits(reduced.shifted, 1), cos, sin);
+		res			   = select(testBits(reduced.shifted, 2), -res, res);
+
+		// Below 2^-27, sin(x) rounds to x. Returning x also keeps the sign of
+		// -0, which the reduction loses
+		res = select(abs(x) < DoublePack(0x1p-27), x, res);
+		return select(reduced.invalid, vectorNan, res);
+	}
+
+	static double scalar(double x) { return std::sin(x); }
+};
+
+struct CosKernel {
+	template<Accuracy A>
+	static DoublePack pack(DoublePack x) {
+		ReducedPack reduced(x);
+		DoublePack sin = sinReduced<A>(reduced);
+		DoublePack cos = cosReduced<A>(reduced);
+
+		// cos(q pi / 2 + r) is cos(r), -sin(r), -cos(r) or sin(r)
+		DoublePack res = select(testBits(reduced.shifted, 1), sin, cos);
+		DoubleMask negate = testBits(addBits(reduced.shifted, 1), 2);
+		res				  = select(negate, -res, res);
+		return select(reduced.invalid, vectorNan, res);
+	}
+
+	static double scalar(double x) { return std::cos(x); }
+};
+
+struct TanKernel {
+	template<Accuracy A>
+	static DoublePack pack(DoublePack x) {
+		ReducedPack reduced(x);
+		DoubleMask odd = testBits(reduced.shifted, 1);
+
+		// tan(q pi / 2 + r) is tan(r) for even q and -1 / tan(r) for odd q
+		DoublePack res = 0.0;
+		if constexpr (A == Accuracy::ULP1) {
+			// tan(r) = r + r^3 / 3 + r^5 P(r^2), with r^3 / 3 computed in
+			// two parts since it is up to a fifth of the result
+			DoublePack r  = reduced.r;
+			DoublePack z  = r * r;
+			DoublePack zl = productError(r, r, z);
+			DoublePack c  = z * r;
+			DoublePack cl = productError(z, r, c) + zl * r;
+			DoublePack c3 = c / DoublePack(3.0);
+			DoublePack p3 = c3 * DoublePack(3.0);
+			DoublePack c3l =
+			  (((c - p3) - productError(c3, 3.0, p3)) + cl) / DoublePack(3.0);
+			DoublePack tail = c * z * polyPack(z, tanCoefficients);
+
+			DoublePack sum = r + c3;
+			DoublePack lo  = (r - sum) + c3;
+			lo = lo + (c3l + (tail + reduced.rl * (DoublePack(1.0) + z)));
+			DoublePack hi = sum + lo;
+			lo			  = lo - (hi - sum);
+
+			// -1 / (hi + lo), correcting the rounded quotient a with the
+			// exact remainder 1 + a hi
+			DoublePack a = DoublePack(-1.0) / hi;
+			DoublePack p = a * hi;
+			DoublePack e = (DoublePack(1.0) + p) + productError(a, hi, p);
+			DoublePack inverse = a + (a * e + a * a * lo);
+			res				   = select(odd, inverse, hi);
+		} else {
+			DoublePack sin = sinReduced<A>(reduced);
+			DoublePack cos = cosReduced<A>(reduced);
+			res			   = select(odd, -cos / sin, sin / cos);
+		}
+
+		// As for sin, tan(x) rounds to x below 2^-27
+		res = select(abs(x) < DoublePack(0x1p-27), x, res);
+		return select(reduced.invalid, vectorNan, res);
+	}
+
+	static double scalar(double x) { return std::tan(x); }
+};
+
+struct AtanKernel {
+	template<Accuracy A>
+	static DoublePack pack(DoublePack x) {
+		// atan(x) = atan(c) + atan((x - c) / (1 + x c)), for c = 0, 1 or
+		// infinity, so the reduced argument is at most tan(pi / 8)
+		DoublePack ax	= abs(x);
+		DoubleMask large = ax > DoublePack(2.414213562373095);
+		DoubleMask mid	= ~large & (ax > DoublePack(0.41421356237309503));
+
+		DoublePack num = select(large, -1.0, select(mid, ax - 1.0, ax));
+		DoublePack den = select(large, ax, select(mid, ax + 1.0, 1.0));
+		DoublePack t   = num / den;
+		DoublePack yh  = select(large, pio2Hi, select(mid, pio4Hi, 0.0));
+		DoublePack yl  = select(large, pio2Lo, select(mid, pio4Lo, 0.0));
+
+		DoublePack z   = t * t;
+		DoublePack res = 0.0;
+		if constexpr (A == Accuracy::ULP1) {
+			// Add the error of the quotient, including the rounding errors
+			// of ax - 1 and ax + 1
+			DoublePack nb	 = num - ax;
+			DoublePack numLo = (ax - (num - nb)) + (DoublePack(-1.0) - nb);
+			DoublePack db	 = den - ax;
+			DoublePack denLo = (ax - (den - db)) + (DoublePack(1.0) - db);
+			numLo			 = select(mid, numLo, 0.0);
+			denLo			 = select(mid, denLo, 0.0);
+
+			DoublePack p		 = t * den;
+			DoublePack remainder = ((num - p) - productError(t, den, p)) +
+								   (numLo - t * denLo);
+			DoublePack tl = remainder / den;
+
+			// yh + t is exact in two parts, as |t| < yh when yh is not 0
+			DoublePack poly = t * z * polyPack(z, atanCoefficients1);
+			DoublePack sum	= yh + t;
+			DoublePack lo	= (yh - sum) + t;
+			res = sum + (lo + (poly + (yl + tl / (DoublePack(1.0) + z))));
+		} else {
+			DoublePack poly = polyPack(z, atanCoefficients4);
+			res				= yh + (t + (t * z * poly + yl));
+		}
+
+		// atan is odd, so take the sign of x (including -0)
+		res = bitXor(res, bitAnd(x, 0x8000000000000000));
+		return select(isNan(x), vectorNan, res);
+	}
+
+	static double scalar(double x) { return std::atan(x); }
+};
+
+// t P(t), so that asin(x) = x + x t P(t) with t = x^2 (see AsinKernel)
+template<Accuracy A>
+DoublePack asinPolynomial(DoublePack t) {
+	if constexpr (A == Accuracy::ULP1) {
+		return t * polyPack(t, asinCoefficients1);
+	} else {
+		return t * polyPack(t, asinCoefficients4);
+	}
+}
+
+struct AsinKernel {
+	template<Accuracy A>
+	static DoublePack pack(DoublePack x) {
+		// asin(x) = x + x^3 P(x^2) for |x| <= 1/2, and otherwise
+		// asin(x) = pi / 2 - 2 asin(s), with s = sqrt((1 - |x|) / 2)
+		DoublePack ax	= abs(x);
+		DoubleMask small = ax <= DoublePack(0.5);
+		DoublePack t	= select(small, ax * ax, (1.0 - ax) * 0.5);
+		DoublePack s	= select(small, ax, sqrt(t));
+		DoublePack r	= asinPolynomial<A>(t);
+
+		DoublePack large = 0.0;
+		if constexpr (A == Accuracy::ULP1) {
+			// s = df + c, with df exact in a few bits so 2 df is exact
+			DoublePack df = highHalf(s);
+			DoublePack c  = (t - df * df) / (s + df);
+			DoublePack p  = DoublePack(2.0) * s * r - (pio2Lo - 2.0 * c);
+			DoublePack q  = DoublePack(pio4Hi) - 2.0 * df;
+			large		  = DoublePack(pio4Hi) - (p - q);
+		} else {
+			large = DoublePack(pio2Hi) - (2.0 * (s + s * r) - pio2Lo);
+		}
+
+		DoublePack res = select(small, ax + ax * r, large);
+		res			   = bitXor(res, bitAnd(x, 0x8000000000000000));
+		return select(ax <= DoublePack(1.0), res, vectorNan);
+	}
+
+	static double scalar(double x) { return std::asin(x); }
+};
+
+struct AcosKernel {
+	template<Accuracy A>
+	static DoublePack pack(DoublePack x) {
+		// acos(x) = pi / 2 - asin(x) for |x| <= 1/2, 2 asin(s) for x > 1/2
+		// and pi - 2 asin(s) for x < -1/2, with s = sqrt((1 - |x|) / 2)
+		DoublePack ax	= abs(x);
+		DoubleMask small = ax <= DoublePack(0.5);
+		DoubleMask neg	= x < DoublePack(0.0);
+		DoublePack t	= select(small, x * x, (1.0 - ax) * 0.5);
+		DoublePack s	= sqrt(t);
+		DoublePack r	= asinPolynomial<A>(t);
+
+		DoublePack smallRes =
+		  DoublePack(pio2Hi) - (x - (DoublePack(pio2Lo) - x * r));
+		DoublePack negRes =
+		  DoublePack(2.0 * pio2Hi) - 2.0 * (s + (s * r - pio2Lo));
+
+		DoublePack posRes = 0.0;
+		if constexpr (A == Accuracy::ULP1) {
+			DoublePack df = highHalf(s);
+			DoublePack c  = (t - df * df) / (s + df);
+			posRes		  = 2.0 * (df + (s * r + c));
+		} else {
+			posRes = 2.0 * (s + s * r);
+		}
+
+		DoublePack res = select(small, smallRes, select(neg, negRes, posRes));
+		return select(ax <= DoublePack(1.0), res, vectorNan);
+	}
+
+	static double scalar(double x) { return std::acos(x); }
+};
+
+struct SqrtKernel {
+	template<Accuracy A>
+	static DoublePack pack(DoublePack x) {
+		return sqrt(x);
+	}
+
+	static double scalar(double x) { return std::sqrt(x); }
+};
+
+/**
+ * x^y for x > 0, as 2^(y log2(x)), after fdlibm's pow. log2(x) and its
+ * product with y are carried in two parts, so the product is accurate to
+ * about 2^-64 relative to the result's exponent however large y is. Other
+ * signs of x, and results which are not normal, are left to std::pow
+ */
+struct PowKernel {
+	template<Accuracy A>
+	static DoublePack pack(DoublePack x, DoublePack y) {
+		// x = 2^n ax, with ax in [1, 2), and ax / bp in
+		// [sqrt(2/3), sqrt(3/2)] for bp = 1 or 3/2. Halving ax when it
+		// is above sqrt(3) gives ax / 1 in [sqrt(3)/2, 1)
+		const DoublePack exponentBias = 0x1p52 + 1023;
+		DoublePack n = bitOr(shiftBitsRight(x, 52), 0x4330000000000000) -
+					   exponentBias;
+		DoublePack ax =
+		  bitOr(bitAnd(x, 0x000FFFFFFFFFFFFF), 0x3FF0000000000000);
+		DoubleMask top = ax >= DoublePack(1.7320508075688772);
+		ax			   = select(top, ax * DoublePack(0.5), ax);
+		n			   = select(top, n + DoublePack(1.0), n);
+		DoubleMask k   = ~top & (ax > DoublePack(1.224744871391589));
+		DoublePack bp  = select(k, 1.5, 1.0);
+		DoublePack dpH = select(k, 0.5849623680114746, 0.0);
+		DoublePack dpL = select(k, 1.3270968157207873e-07, 0.0);
+
+		// s = (ax - bp) / (ax + bp) = sh + sl, with sh exact in 21 bits
+		DoublePack u  = ax - bp;
+		DoublePack v  = DoublePack(1.0) / (ax + bp);
+		DoublePack ss = u * v;
+		DoublePack sh = highHalf(ss);
+		DoublePack th = highHalf(ax + bp);
+		DoublePack tl = ax - (th - bp);
+		DoublePack sl = v * ((u - sh * th) - sh * tl);
+
+		// log(ax / bp) = 2/3 s (3 + s^2 + r)
+		DoublePack s2 = ss * ss;
+		DoublePack r  = s2 * s2 * polyPack(s2, powLogCoefficients);
+		r			  = r + sl * (sh + ss);
+		s2			  = sh * sh;
+		th			  = highHalf(DoublePack(3.0) + s2 + r);
+		tl			  = r - ((th - DoublePack(3.0)) - s2);
+
+		// ss (3 + s^2 + r) = ph + pl, then log2(x) = t1 + t2 after
+		// multiplying by 2 / (3 ln(2)) and adding log2(bp) and n
+		u			  = sh * th;
+		v			  = sl * th + tl * ss;
+		DoublePack ph = highHalf(u + v);
+		DoublePack pl = v - (ph - u);
+		DoublePack zh = DoublePack(0.9617962837219238) * ph;
+		DoublePack zl = DoublePack(4.102040517767816e-07) * ph +
+						pl * DoublePack(0.9617966939259756) + dpL;
+		DoublePack t1 = highHalf(((zh + zl) + dpH) + n);
+		DoublePack t2 = zl - (((t1 - n) - dpH) - zh);
+
+		// y log2(x) = ph + pl, with y split so y1 t1 is exact
+		DoublePack y1 = highHalf(y);
+		pl			  = (y - y1) * t1 + y * t2;
+		ph			  = y1 * t1;
+
+		// 2^(ph + pl) = 2^m e^z, with m = round(ph)
+		DoublePack shifted = 0.0;
+		DoublePack m	   = roundPack(ph, shifted);
+		DoublePack fh	   = ph - m;
+		DoublePack t	   = highHalf(pl + fh);
+		u = t * DoublePack(0.6931467056274414);
+		v = (pl - (t - fh)) * DoublePack(0.6931471805599453) +
+			t * DoublePack(4.7493250390316726e-07);
+		DoublePack z = u + v;
+		DoublePack w = v - (z - u);
+
+		DoublePack poly = A == Accuracy::ULP1 ? polyPack(z, expCoefficients1)
+											  : polyPack(z, expCoefficients4);
+		DoublePack tail = z * z * poly + w * (DoublePack(1.0) + z);
+		DoublePack hi	= DoublePack(1.0) + z;
+		DoublePack lo	= (DoublePack(1.0) - hi) + z;
+		DoublePack res	= (hi + (lo + tail)) * powerOfTwo(shifted);
+
+		DoubleMask valid = (x >= DoublePack(0x1p-1022)) &
+						   (x < DoublePack(vectorInfinity)) &
+						   (abs(ph) < DoublePack(1020.0));
+		return select(valid, res, vectorNan);
+	}
+
+	static double scalar(double x, double y) { return std::pow(x, y); }
+};
+
+/**
+ * Evaluate a kernel over ``count`` values, a pack at a time. The last values
+ * are copied into a full pack, padded with a value every kernel accepts.
+ * Lanes the kernel leaves NaN are evaluated again with its scalar(). ``out``
+ * may be one of the arguments, as registers are in Program::run()
+ */
+template<typename Kernel, Accuracy A>
+void vectorMap(const double *x, double *out, size_t count) {
+	constexpr size_t lanes = DoublePack::lanes;
+	double args[lanes], res[lanes];
+	for (size_t i = 0; i < count; i += lanes) {
+		size_t n	   = lrc::min(lanes, count - i);
+		DoublePack arg = 0.5;
+		if (n == lanes) {
+			arg = DoublePack::load(x + i);
+		} else {
+			std::fill_n(args, lanes, 0.5);
+			std::copy_n(x + i, n, args);
+			arg = DoublePack::load(args);
+		}
+
+		DoublePack val = Kernel::template pack<A>(arg);
+		if (n == lanes && !isNan(val).any()) {
+			val.store(out + i);
+			continue;
+		}
+
+		arg.store(args);
+		val.store(res);
+		for (size_t j = 0; j < n; ++j)
+			out[i + j] = res[j] == res[j] ? res[j] : Kernel::scalar(args[j]);
+	}
+}
+
+template<typename Kernel, Accuracy A>
+void vectorMap(const double *x, const double *y, double *out, size_t count) {
+	constexpr size_t lanes = DoublePack::lanes;
+	double argsX[lanes], argsY[lanes], res[lanes];
+	for (size_t i = 0; i < count; i += lanes) {
+		size_t n		= lrc::min(lanes, count - i);
+		DoublePack argX = 0.5;
+		DoublePack argY = 0.5;
+		if (n == lanes) {
+			argX = DoublePack::load(x + i);
+			argY = DoublePack::load(y + i);
+		} else {
+			std::fill_n(argsX, lanes, 0.5);
+			std::fill_n(argsY, lanes, 0.5);
+			std::copy_n(x + i, n, argsX);
+			std::copy_n(y + i, n, argsY);
+			argX = DoublePack::load(argsX);
+			argY = DoublePack::load(argsY);
+		}
+
+		DoublePack val = Kernel::template pack<A>(argX, argY);
+		if (n == lanes && !isNan(val).any()) {
+			val.store(out + i);
+			continue;
+		}
+
+		argX.store(argsX);
+		argY.store(argsY);
+		val.store(res);
+		for (size_t j = 0; j < n; ++j) {
+			out[i + j] =
+			  res[j] == res[j] ? res[j] : Kernel::scalar(argsX[j], argsY[j]);
+		}
+	}
+}
+
+/*
+ * Floats are evaluated with the ULP4 double kernels, whose error is far below
+ * a float ulp, so the rounded result is within 1 ulp in either tier
+ */
+template<typename Kernel, Accuracy A>
+void vectorMap(const float *x, float *out, size_t count) {
+	static thread_local std::vector<double> buffer;
+	buffer.assign(x, x + count);
+	vectorMap<Kernel, Accuracy::ULP4>(buffer.data(), buffer.data(), count);
+	std::copy(buffer.begin(), buffer.end(), out);
+}
+
+template<typename Kernel, Accuracy A>
+void vectorMap(const float *x, const float *y, float *out, size_t count) {
+	static thread_local std::vector<double> bufferX, bufferY;
+	bufferX.assign(x, x + count);
+	bufferY.assign(y, y + count);
+	vectorMap<Kernel, Accuracy::ULP4>(
+	  bufferX.data(), bufferY.data(), bufferX.data(), count);
+	std::copy(bufferX.begin(), bufferX.end(), out);
+}
+
+/**
+ * The vectorized kernel for the standard function ``name`` (see
+ * registerKernels()) in float or double at the given accuracy, or nullptr for
+ * other functions and types, or always nullptr without AVX2 or AVX-512. These
+ * are used for CALL instructions by Program::run(), and may be used by any
+ * evaluator which has its operands in arrays
+ */
+template<typename T>
+VectorUnary<T> vectorUnary(const std::string &name, Accuracy accuracy) {
+	if constexpr (!std::is_same_v<T, float> && !std::is_same_v<T, double>) {
+		return nullptr;
+	} else {
+		using Tiers = std::array<VectorUnary<T>, 2>;
+		auto tiers	= [](auto kernel) {
+			 using Kernel = decltype(kernel);
+			 return Tiers {vectorMap<Kernel, Accuracy::ULP1>,
+						   vectorMap<Kernel, Accuracy::ULP4>};
+		};
+
+		static const std::unordered_map<std::string, Tiers> table = {
+		  {"sqrt", tiers(SqrtKernel {})},
+		  {"exp", tiers(ExpKernel {})},
+		  {"log", tiers(LogKernel {})},
+		  {"sin", tiers(SinKernel {})},
+		  {"cos", tiers(CosKernel {})},
+		  {"tan", tiers(TanKernel {})},
+		  {"asin", tiers(AsinKernel {})},
+		  {"acos", tiers(AcosKernel {})},
+		  {"atan", tiers(AtanKernel {})}};
+
+		auto it = table.find(name);
+		if (it == table.end()) return nullptr;
+		return it->second[static_cast<size_t>(accuracy)];
+	}
+}
+
+template<typename T>
+VectorBinary<T> vectorBinary(const std::string &name, Accuracy accuracy) {
+	if constexpr (!std::is_same_v<T, float> && !std::is_same_v<T, double>) {
+		return nullptr;
+	} else {
+		if (name != "POW") return nullptr;
+		if (accuracy == Accuracy::ULP1)
+			return vectorMap<PowKernel, Accuracy::ULP1>;
+		return vectorMap<PowKernel, Accuracy::ULP4>;
+	}
+}
+
+#else
+
+template<typename T>
+VectorUnary<T> vectorUnary(const std::string &, Accuracy) {
+	return nullptr;
+}
+
+template<typename T>
+VectorBinary<T> vectorBinary(const std::string &, Accuracy) {
+	return nullptr;
+}
+
+#endif
@@ -3,18 +3,62 @@
 #include <memory>
 #include <functional>
 #include <utility>
+#include <tuple>
+#include <array>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <numeric>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#include <string_view>
+#include <charconv>
+#include <set>
+#include <list>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <csignal>
+#include <cerrno>
+#include <typeinfo>
+#include <typeindex>
+
+#include <gmp.h>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#	include <immintrin.h>
+#endif
+
+#if !defined(_WIN32)
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/socket.h>
+#	include <sys/stat.h>
+#	include <sys/un.h>
+#	include <unistd.h>
+#else
+#	include <direct.h>
+#endif
 
 namespace lrc = librapid;
 
 // #define SYMBOMATH_MULTIPRECISION
 
-// Type used in all calculations
+// Type of the numbers in trees, used for symbolic work and by eval(). Compiled
+// expressions can also be evaluated in other types (see Precision)
 #if defined(SYMBOMATH_MULTIPRECISION)
 using Scalar = lrc::mpfr; // MPFR multiprecision float
 #else
 using Scalar = double; // Normal 64bit float
 #endif
 
+#include "include/interval.hpp"
+#include "include/exact.hpp"
+
 inline constexpr int64_t formatWidth = 15;
 
 static inline constexpr uint64_t TYPE_VARIABLE = 1ULL << 63;
@@ -53,40 +97,207 @@ int64_t precedence(const uint64_t type) {
 	return 0;
 }
 
+/**
+ * A monotonic arena for tree nodes. Memory is handed out in order from large
+ * blocks and is only released when the arena itself is destroyed, which
+ * happens once every node allocated from it has been destroyed (see
+ * ArenaAllocator). An arena must only be allocated from by one thread at a
+ * time.
+ */
+class NodeArena {
+public:
+	explicit NodeArena(size_t blockSize = 1 << 16) : m_blockSize(blockSize) {}
+
+	NodeArena(const NodeArena &) = delete;
+	NodeArena &operator=(const NodeArena &) = delete;
+
+	void *allocate(size_t bytes, size_t alignment) {
+		// Allocations larger than a block get a block of their own
+		if (bytes + alignment > m_blockSize) {
+			size_t space = bytes + alignment;
+			m_large.emplace_back(std::make_unique<char[]>(space));
+			void *ptr = m_large.back().get();
+			return std::align(alignment, bytes, ptr, space);
+		}
+
+		if (!m_blocks.empty()) {
+			void *ptr	 = m_blocks.back().get() + m_used;
+			size_t space = m_blockSize - m_used;
+			if (std::align(alignment, bytes, ptr, space)) {
+				m_used = m_blockSize - space + bytes;
+				return ptr;
+			}
+		}
+
+		m_blocks.emplace_back(std::make_unique<char[]>(m_blockSize));
+		m_used = 0;
+		return allocate(bytes, alignment);
+	}
+
+private:
+	std::vector<std::unique_ptr<char[]>> m_blocks;
+	std::vector<std::unique_ptr<char[]>> m_large;
+	size_t m_blockSize;
+	size_t m_used = 0;
+};
+
+// An allocator for std::allocate_shared() which takes memory from a NodeArena.
+// Each node keeps its arena alive, so trees may outlive the code which built
+// them
+template<typename T>
+class ArenaAllocator {
+public:
+	using value_type = T;
+
+	explicit ArenaAllocator(std::shared_ptr<NodeArena> arena) :
+			m_arena(std::move(arena)) {}
+
+	template<typename U>
+	ArenaAllocator(const ArenaAllocator<U> &other) : m_arena(other.arena()) {}
+
+	T *allocate(size_t n) {
+		return static_cast<T *>(m_arena->allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T *, size_t) {}
+
+	LR_NODISCARD("") const std::shared_ptr<NodeArena> &arena() const {
+		return m_arena;
+	}
+
+	template<typename U>
+	bool operator==(const ArenaAllocator<U> &other) const {
+		return m_arena == other.arena();
+	}
+
+	template<typename U>
+	bool operator!=(const ArenaAllocator<U> &other) const {
+		return m_arena != other.arena();
+	}
+
+private:
+	std::shared_ptr<NodeArena> m_arena;
+};
+
+// The arena used by makeNode() on the calling thread, if any
+inline std::shared_ptr<NodeArena> &currentArena() {
+	static thread_local std::shared_ptr<NodeArena> arena;
+	return arena;
+}
+
+// Use an arena for the nodes created by the calling thread within a scope
+class ArenaScope {
+public:
+	explicit ArenaScope(std::shared_ptr<NodeArena> arena) :
+			m_previous(std::exchange(currentArena(), std::move(arena))) {}
+
+	ArenaScope(const ArenaScope &) = delete;
+	ArenaScope &operator=(const ArenaScope &) = delete;
+
+	~ArenaScope() { currentArena() = std::move(m_previous); }
+
+private:
+	std::shared_ptr<NodeArena> m_previous;
+};
+
+/**
+ * Create a node, allocating it from the calling thread's arena if there is one
+ * (see ArenaScope), and from the heap otherwise. Used by the parser, so trees
+ * parsed in bulk are packed together in memory rather than spread across the
+ * heap
+ */
+template<typename T, typename... Args>
+std::shared_ptr<T> makeNode(Args &&...args) {
+	if (const auto &arena = currentArena()) {
+		return std::allocate_shared<T>(ArenaAllocator<T>(arena),
+									   std::forward<Args>(args)...);
+	}
+	return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
 /**
  * The most fundamental type. All numbers, functions, variables, etc. inherit
  * from this.
+ *
+ * Components are always owned by a std::shared_ptr, and subtrees may be shared
+ * between several trees (see substitute()), so a node must not be modified
+ * once it has been attached to a tree.
+ *
+ * Operations over a whole tree (eval, canEval, treeDepth, substitute) walk the
+ * tree with an explicit stack (see foldTree()), so subclasses only implement
+ * the *Node() functions, which act on a single node given the results already
+ * computed for its children. This allows trees of any depth to be processed.
  */
-class Component {
+class Component : public std::enable_shared_from_this<Component> {
 public:
 	Component() = default;
+	virtual ~Component() = default;
+
+	virtual void treeDepth(int64_t &depth) const;
+
+	LR_NODISCARD("") virtual Scalar eval() const;
+
+	LR_NODISCARD("")
+	virtual std::shared_ptr<Component> substitute(
+	  const std::map<std::string, std::shared_ptr<Component>> &substitutions)
+	  const;
 
-	virtual void treeDepth(int64_t &depth) const {}
+	LR_NODISCARD("")
+	virtual std::shared_ptr<Component>
+	differentiate(const std::string &wrt) const {
+		LR_ASSERT(false, "{} object cannot be differentiated", type());
+		return nullptr;
+	}
+
+	LR_NODISCARD("") virtual bool canEval() const;
 
+	// Depth of this node, given the greatest depth of its children
+	LR_NODISCARD("") virtual int64_t depthNode(int64_t childDepth) const {
+		return childDepth;
+	}
+
+	// Evaluate this node, given the values of its children
 	LR_NODISCARD("")
-	virtual Scalar eval() const {
+	virtual Scalar evalNode(const std::vector<Scalar> &operands) const {
 		LR_ASSERT(false,
 				  "{} object cannot be evaluated (numerically) directly",
 				  type());
 		return 0;
 	}
 
+	// Substitute into this node, given its (possibly substituted) children
 	LR_NODISCARD("")
-	virtual std::shared_ptr<Component> substitute(
-	  const std::map<std::string, std::shared_ptr<Component>> &substitutions)
-	  const {
+	virtual std::shared_ptr<Component> substituteNode(
+	  const std::map<std::string, std::shared_ptr<Component>> &substitutions,
+	  const std::vector<std::shared_ptr<Component>> &values) const {
 		LR_ASSERT(false, "{} object cannot be substituted into", type());
 		return nullptr;
 	}
 
+	// Returns true if this node can be evaluated, given whether all of its
+	// children can be
+	LR_NODISCARD("") virtual bool canEvalNode(bool childrenCanEval) const {
+		return false;
+	}
+
+	// The operands of this node
+	LR_NODISCARD("")
+	virtual const std::vector<std::shared_ptr<Component>> &children() const {
+		return m_tmpTree;
+	}
+
+	// Return a copy of this node with different operands, or this node itself
+	// if the operands are unchanged
 	LR_NODISCARD("")
 	virtual std::shared_ptr<Component>
-	differentiate(const std::string &wrt) const {
-		LR_ASSERT(false, "{} object cannot be differentiated", type());
-		return nullptr;
+	withChildren(const std::vector<std::shared_ptr<Component>> &values) const {
+		return self();
 	}
 
-	LR_NODISCARD("") virtual bool canEval() const { return false; }
+	// Move the children of this node into ``out``. Used to destroy trees
+	// without recursing
+	virtual void
+	releaseChildren(std::vector<std::shared_ptr<Component>> &out) {}
 
 	LR_NODISCARD("") virtual std::string str(uint64_t indent) const {
 		return fmt::format("{:>{}}{}", "", indent, "NONE");
@@ -110,42 +321,204 @@ public:
 
 	LR_NODISCARD("") virtual std::string type() const { return "COMPONENT"; }
 
+protected:
+	// Return a shared pointer to this object, allowing unchanged subtrees to be
+	// reused instead of copied
+	LR_NODISCARD("") std::shared_ptr<Component> self() const {
+		return std::const_pointer_cast<Component>(shared_from_this());
+	}
+
 private:
 	std::vector<std::shared_ptr<Component>>
 	  m_tmpTree; // Empty value to return in tree()
 };
 
+/**
+ * Apply ``visit`` to every node in the tree below (and including) ``root`` in
+ * post-order, using an explicit stack instead of recursion. For each node,
+ * ``visit(node, first, last)`` is passed the results for the node's children
+ * in [first, last) and returns the result for the node.
+ *
+ * ``prune(node, result)`` is called before a node's children are visited. If
+ * it returns true, the children are skipped and ``result`` is used as the
+ * result for the node.
+ */
+template<typename Result, typename Visitor, typename Prune>
+Result foldTree(const std::shared_ptr<Component> &root, Visitor &&visit,
+				Prune &&prune) {
+	struct Frame {
+		const std::shared_ptr<Component> *node;
+		size_t next;
+	};
+
+	std::vector<Frame> stack;
+	std::vector<Result> results;
+	stack.emplace_back(Frame {&root, 0});
+
+	while (!stack.empty()) {
+		Frame &frame	 = stack.back();
+		const auto &node = *frame.node;
+
+		if (frame.next == 0) {
+			Result result {};
+			if (prune(node, result)) {
+				results.emplace_back(std::move(result));
+				stack.pop_back();
+				continue;
+			}
+		}
+
+		const auto &children = node->children();
+		if (frame.next < children.size()) {
+			// Note that this invalidates frame
+			const auto *child = &children[frame.next++];
+			stack.emplace_back(Frame {child, 0});
+			continue;
+		}
+
+		auto first	  = results.end() - static_cast<int64_t>(children.size());
+		Result result = visit(node, first, results.end());
+		results.erase(first, results.end());
+		results.emplace_back(std::move(result));
+		stack.pop_back();
+	}
+
+	return std::move(results.back());
+}
+
+template<typename Result, typename Visitor>
+Result foldTree(const std::shared_ptr<Component> &root, Visitor &&visit) {
+	return foldTree<Result>(
+	  root, std::forward<Visitor>(visit), [](const auto &, Result &) {
+		  return false;
+	  });
+}
+
+/**
+ * Destroy the subtrees in ``nodes`` without recursing. Any node which is not
+ * referenced elsewhere has its children moved into the work list before it is
+ * freed, so the destructor of a node never has to destroy a deep subtree.
+ */
+inline void releaseSubtrees(std::vector<std::shared_ptr<Component>> &nodes) {
+	if (nodes.empty()) return;
+
+	std::vector<std::shared_ptr<Component>> pending = std::move(nodes);
+	nodes.clear();
+
+	while (!pending.empty()) {
+		std::shared_ptr<Component> node = std::move(pending.back());
+		pending.pop_back();
+		if (node && node.use_count() == 1) node->releaseChildren(pending);
+	}
+}
+
+inline void Component::treeDepth(int64_t &depth) const {
+	auto visitor = [](const auto &node, auto first, auto last) {
+		int64_t childDepth = 0;
+		for (auto it = first; it != last; ++it)
+			childDepth = lrc::max(childDepth, *it);
+		return node->depthNode(childDepth);
+	};
+
+	int64_t childDepth = 0;
+	for (const auto &child : children())
+		childDepth = lrc::max(childDepth, foldTree<int64_t>(child, visitor));
+	depth += depthNode(childDepth);
+}
+
+inline Scalar Component::eval() const {
+	// Reuse the operand list between nodes to avoid allocating
+	std::vector<Scalar> operands;
+	auto visitor = [&](const auto &node, auto first, auto last) {
+		operands.assign(first, last);
+		return node->evalNode(operands);
+	};
+
+	std::vector<Scalar> values;
+	for (const auto &child : children())
+		values.emplace_back(foldTree<Scalar>(child, visitor));
+	return evalNode(values);
+}
+
+inline bool Component::canEval() const {
+	auto visitor = [](const auto &node, auto first, auto last) {
+		return node->canEvalNode(
+		  std::all_of(first, last, [](bool val) { return val; }));
+	};
+
+	bool childrenCanEval = true;
+	for (const auto &child : children())
+		childrenCanEval &= foldTree<bool>(child, visitor);
+	return canEvalNode(childrenCanEval);
+}
+
+inline std::shared_ptr<Component> Component::substitute(
+  const std::map<std::string, std::shared_ptr<Component>> &substitutions)
+  const {
+	std::vector<std::shared_ptr<Component>> values;
+	auto visitor = [&](const auto &node, auto first, auto last) {
+		values.assign(first, last);
+		return node->substituteNode(substitutions, values);
+	};
+
+	std::vector<std::shared_ptr<Component>> substituted;
+	for (const auto &child : children()) {
+		substituted.emplace_back(
+		  foldTree<std::shared_ptr<Component>>(child, visitor));
+	}
+	return substituteNode(substitutions, substituted);
+}
+
 class Tree : public Component {
 public:
 	Tree() : Component() {}
 
+	~Tree() override { releaseSubtrees(m_tree); }
+
 	LR_NODISCARD("")
-	Scalar eval() const override { return m_tree[0]->eval(); }
+	Scalar evalNode(const std::vector<Scalar> &operands) const override {
+		return operands[0];
+	}
 
 	LR_NODISCARD("")
-	std::shared_ptr<Component> substitute(
-	  const std::map<std::string, std::shared_ptr<Component>> &substitutions)
-	  const override {
+	std::shared_ptr<Component> substituteNode(
+	  const std::map<std::string, std::shared_ptr<Component>> &substitutions,
+	  const std::vector<std::shared_ptr<Component>> &values) const override {
+		return withChildren(values);
+	}
+
+	LR_NODISCARD("")
+	std::shared_ptr<Component> withChildren(
+	  const std::vector<std::shared_ptr<Component>> &values) const override {
+		if (values == m_tree) return self();
+
 		std::shared_ptr<Tree> res = std::make_shared<Tree>();
-		res->tree().emplace_back(m_tree[0]->substitute(substitutions));
+		res->tree() = values;
 		return res;
 	}
 
-	LR_NODISCARD("") bool canEval() const override {
-		return m_tree[0]->canEval();
+	LR_NODISCARD("") bool canEvalNode(bool childrenCanEval) const override {
+		return childrenCanEval;
 	}
 
 	LR_NODISCARD("")
-	const std::vector<std::shared_ptr<Component>> &tree() const {
+	const std::vector<std::shared_ptr<Component>> &children() const override {
 		return m_tree;
 	}
 
-	LR_NODISCARD("") std::vector<std::shared_ptr<Component>> &tree() {
+	void
+	releaseChildren(std::vector<std::shared_ptr<Component>> &out) override {
+		for (auto &val : m_tree) out.emplace_back(std::move(val));
+		m_tree.clear();
+	}
+
+	LR_NODISCARD("")
+	const std::vector<std::shared_ptr<Component>> &tree() const {
 		return m_tree;
 	}
 
-	void treeDepth(int64_t &depth) const override {
-		m_tree[0]->treeDepth(depth);
+	LR_NODISCARD("") std::vector<std::shared_ptr<Component>> &tree() {
+		return m_tree;
 	}
 
 	LR_NODISCARD("") std::string str(uint64_t indent) const override {
@@ -175,28 +548,85 @@ private:
 	std::vector<std::shared_ptr<Component>> m_tree;
 };
 
+/**
+ * Parse a decimal literal such as "12" or "0.125" into the nearest double or
+ * lrc::mpfr, reading straight from ``literal`` rather than a copy of it where
+ * possible. Characters after the longest valid prefix are ignored
+ */
+inline void parseLiteral(std::string_view literal, double &out) {
+	out = 0;
+#if defined(__cpp_lib_to_chars)
+	auto [end, error] =
+	  std::from_chars(literal.data(), literal.data() + literal.size(), out);
+	if (error != std::errc::result_out_of_range) return;
+#endif
+	// Out of range of a double, or no floating point std::from_chars
+	out = std::strtod(std::string(literal).c_str(), nullptr);
+}
+
+inline void parseLiteral(std::string_view literal, lrc::mpfr &out) {
+	// mpfr_strtofr needs a terminated string, so the literal is copied into a
+	// buffer which is reused by later literals
+	static thread_local std::string buffer;
+	buffer.assign(literal.data(), literal.size());
+	mpfr_strtofr(out.mpfr_ptr(),
+				 buffer.c_str(),
+				 nullptr,
+				 10,
+				 lrc::mpfr::get_default_rnd());
+}
+
+/**
+ * A number in a tree. Numbers are held exactly, as a Rational, if they are
+ * integers, fractions or decimal literals, so that symbolic work on them does
+ * not accumulate rounding error; anything else, such as the value of sin(1),
+ * is only held as a Scalar. value() is always the nearest Scalar
+ */
 class Number : public Component {
 public:
 	Number() : Component() {}
-	explicit Number(const Scalar &value) : Component(), m_value(value) {}
 
-	explicit Number(const std::string &value) : Component() {
-		scn::scan(value, "{}", m_value);
+	explicit Number(const Scalar &value) :
+			Component(), m_value(value),
+			m_exact(Rational::fromInteger(value)) {}
+
+	explicit Number(const Rational &value) :
+			Component(), m_value(value.toScalar()), m_exact(value) {}
+
+	// The value of the named constant ``constant`` (see ConstantCache)
+	Number(const Scalar &value, std::string constant) :
+			Component(), m_value(value), m_exact(std::nullopt),
+			m_constant(std::move(constant)) {}
+
+	explicit Number(std::string_view literal) :
+			Component(), m_exact(Rational::parse(literal)) {
+		parseLiteral(literal, m_value);
 	}
 
-	void treeDepth(int64_t &depth) const override { ++depth; }
+	explicit Number(const std::string &literal) :
+			Number(std::string_view(literal)) {}
+
+	explicit Number(const char *literal) : Number(std::string_view(literal)) {}
+
+	LR_NODISCARD("") int64_t depthNode(int64_t childDepth) const override {
+		return childDepth + 1;
+	}
 
 	LR_NODISCARD("")
-	Scalar eval() const override { return m_value; }
+	Scalar evalNode(const std::vector<Scalar> &operands) const override {
+		return m_value;
+	}
 
 	LR_NODISCARD("")
-	std::shared_ptr<Component> substitute(
-	  const std::map<std::string, std::shared_ptr<Component>> &substitutions)
-	  const override {
-		return std::make_shared<Number>(m_value);
+	std::shared_ptr<Component> substituteNode(
+	  const std::map<std::string, std::shared_ptr<Component>> &substitutions,
+	  const std::vector<std::shared_ptr<Component>> &values) const override {
+		return self();
 	}
 
-	LR_NODISCARD("") bool canEval() const override { return true; }
+	LR_NODISCARD("") bool canEvalNode(bool childrenCanEval) const override {
+		return true;
+	}
 
 	LR_NODISCARD("") std::string str(uint64_t indent) const override {
 		return fmt::format("{: >{}}{}", "", indent, m_value);
@@ -210,10 +640,28 @@ public:
 
 	LR_NODISCARD("") Scalar value() const { return m_value; }
 
+	// The exact value, or nullopt if the number is only known as a Scalar
+	LR_NODISCARD("") const std::optional<Rational> &exact() const {
+		return m_exact;
+	}
+
+	// The named constant this is the value of, or an empty string
+	LR_NODISCARD("") const std::string &constant() const { return m_constant; }
+
 private:
 	Scalar m_value = 0;
+	std::optional<Rational> m_exact = Rational(0);
+	std::string m_constant;
 };
 
+// Whether a node is the value of a named constant, which is computed in the
+// precision it is evaluated in (see ConstantCache), so it must not be folded
+// into other numbers
+inline bool isNamedNumber(const std::shared_ptr<Component> &node) {
+	return node->type() == "NUMBER" &&
+		   !std::dynamic_pointer_cast<Number>(node)->constant().empty();
+}
+
 class Variable : public Component {
 public:
 	Variable() : Component() {}
@@ -221,7 +669,7 @@ public:
 			Component(), m_name(std::move(name)) {}
 
 	LR_NODISCARD("")
-	Scalar eval() const override {
+	Scalar evalNode(const std::vector<Scalar> &operands) const override {
 		LR_ASSERT(false,
 				  "Cannot numerically evaluate variable {}. Missing call to "
 				  "'substitute'?",
@@ -230,23 +678,24 @@ public:
 		return Scalar(0);
 	}
 
-	void treeDepth(int64_t &depth) const override { ++depth; }
+	LR_NODISCARD("") int64_t depthNode(int64_t childDepth) const override {
+		return childDepth + 1;
+	}
 
 	LR_NODISCARD("")
-	std::shared_ptr<Component> substitute(
-	  const std::map<std::string, std::shared_ptr<Component>> &substitutions)
-	  const override {
-		auto it =
-		  std::find_if(substitutions.begin(),
-					   substitutions.end(),
-					   [&](auto &pair) { return pair.first == m_name; });
+	std::shared_ptr<Component> substituteNode(
+	  const std::map<std::string, std::shared_ptr<Component>> &substitutions,
+	  const std::vector<std::shared_ptr<Component>> &values) const override {
+		auto it = substitutions.find(m_name);
 		if (it != substitutions.end())
 			return it->second->substitute(substitutions);
 
-		return std::make_shared<Variable>(m_name);
+		return self();
 	}
 
-	LR_NODISCARD("") bool canEval() const override { return false; }
+	LR_NODISCARD("") bool canEvalNode(bool childrenCanEval) const override {
+		return false;
+	}
 
 	LR_NODISCARD("") std::string str(uint64_t indent) const override {
 		return m_name;
@@ -276,40 +725,48 @@ public:
 			m_functor(std::move(functor)), m_numOperands(numOperands),
 			m_values(std::move(values)) {}
 
-	void treeDepth(int64_t &depth) const override {
-		std::vector<int64_t> depths(numOperands(), 0);
-		for (int64_t i = 0; i < numOperands(); ++i) {
-			int64_t tmpDepth = depth;
-			m_values[i]->treeDepth(tmpDepth);
-			depths[i] = tmpDepth;
-		}
+	~Function() override { releaseSubtrees(m_values); }
 
-		depth = *std::max_element(depths.begin(), depths.end());
-		++depth;
+	LR_NODISCARD("") int64_t depthNode(int64_t childDepth) const override {
+		return childDepth + 1;
 	}
 
 	LR_NODISCARD("")
-	Scalar eval() const override {
-		std::vector<Scalar> operands;
-		for (const auto &val : m_values) operands.push_back(val->eval());
+	Scalar evalNode(const std::vector<Scalar> &operands) const override {
 		return m_functor(operands);
 	}
 
 	LR_NODISCARD("")
-	std::shared_ptr<Component> substitute(
-	  const std::map<std::string, std::shared_ptr<Component>> &substitutions)
-	  const override {
-		std::shared_ptr<Function> res = std::make_shared<Function>(
-		  m_name, m_format, m_functor, m_numOperands);
-		for (const auto &val : m_values)
-			res->addValue(val->substitute(substitutions));
-		return res;
+	std::shared_ptr<Component> substituteNode(
+	  const std::map<std::string, std::shared_ptr<Component>> &substitutions,
+	  const std::vector<std::shared_ptr<Component>> &values) const override {
+		// Only rebuild the nodes above a substituted variable. Every other
+		// subtree is shared with the original tree
+		return withChildren(values);
 	}
 
-	LR_NODISCARD("") bool canEval() const override {
-		return std::all_of(m_values.begin(), m_values.end(), [](auto &val) {
-			return val->canEval();
-		});
+	LR_NODISCARD("")
+	std::shared_ptr<Component> withChildren(
+	  const std::vector<std::shared_ptr<Component>> &values) const override {
+		if (values == m_values) return self();
+
+		return std::make_shared<Function>(
+		  m_name, m_format, m_functor, m_numOperands, values);
+	}
+
+	LR_NODISCARD("") bool canEvalNode(bool childrenCanEval) const override {
+		return childrenCanEval;
+	}
+
+	LR_NODISCARD("")
+	const std::vector<std::shared_ptr<Component>> &children() const override {
+		return m_values;
+	}
+
+	void
+	releaseChildren(std::vector<std::shared_ptr<Component>> &out) override {
+		for (auto &val : m_values) out.emplace_back(std::move(val));
+		m_values.clear();
 	}
 
 	LR_NODISCARD("") std::string str(uint64_t indent) const override {
@@ -367,21 +824,170 @@ public:
 
 	void clearValues() { m_values.clear(); }
 
+	// Add operands to an n-ary ADD or MUL node. Like addValue(), this must
+	// only be used while the node is being built
+	void extendAssociative(
+	  const std::vector<std::shared_ptr<Component>> &operands);
+
 	LR_NODISCARD("") std::string name() const override { return m_name; }
 
 	LR_NODISCARD("") std::string type() const override { return "FUNCTION"; }
 
 	LR_NODISCARD("") std::string format() const { return m_format; }
 
+	LR_NODISCARD("")
+	const std::function<Scalar(const std::vector<Scalar> &)> &functor() const {
+		return m_functor;
+	}
+
+	/**
+	 * Set the function used to evaluate this function in T (float, double,
+	 * lrc::mpfr or Interval) rather than Scalar. Kernels are only used by
+	 * evalAs() and Program::run(), and only set on registered prototypes;
+	 * functions with no kernel for a type are evaluated in Scalar, converting
+	 * their operands and result (see functorAs()). Interval kernels must
+	 * return an interval containing every result for operands in the given
+	 * intervals
+	 */
+	template<typename T>
+	void setKernel(std::function<T(const std::vector<T> &)> kernel) {
+		auto kernels = m_kernels ? std::make_shared<KernelSet>(*m_kernels)
+								 : std::make_shared<KernelSet>();
+		std::get<std::function<T(const std::vector<T> &)>>(*kernels) =
+		  std::move(kernel);
+		m_kernels = std::move(kernels);
+	}
+
+	// The kernel set for T, or an empty function if there is none
+	template<typename T>
+	LR_NODISCARD("")
+	const std::function<T(const std::vector<T> &)> &kernel() const {
+		static const std::function<T(const std::vector<T> &)> none;
+		if (!m_kernels) return none;
+		return std::get<std::function<T(const std::vector<T> &)>>(*m_kernels);
+	}
+
 private:
+	using KernelSet =
+	  std::tuple<std::function<float(const std::vector<float> &)>,
+				 std::function<double(const std::vector<double> &)>,
+				 std::function<lrc::mpfr(const std::vector<lrc::mpfr> &)>,
+				 std::function<Interval(const std::vector<Interval> &)>>;
+
 	std::string m_name	 = "NULLOP";
 	std::string m_format = "NULLOP";
 	std::function<Scalar(const std::vector<Scalar> &)> m_functor;
+	std::shared_ptr<const KernelSet> m_kernels; // Shared between copies
 	uint64_t m_numOperands = 0;
 
 	std::vector<std::shared_ptr<Component>> m_values = {};
 };
 
+// Returns true for operators which can take any number of operands
+inline bool isAssociative(const std::string &name) {
+	return name == "ADD" || name == "MUL";
+}
+
+/**
+ * Reduce a list of values as a balanced tree rather than a left-to-right
+ * chain. Each pass combines the first half of the list with the second half,
+ * so the operations within a pass are independent (and can be vectorised) and
+ * rounding error grows with log(n) rather than n.
+ */
+template<typename T, typename Op>
+T reduceBalanced(std::vector<T> &values, const T &identity, Op op) {
+	size_t n = values.size();
+	if (n == 0) return identity;
+
+	while (n > 1) {
+		size_t half	  = n / 2;
+		size_t offset = n - half;
+		for (size_t i = 0; i < half; ++i)
+			values[i] = op(values[i], values[offset + i]);
+		n = offset;
+	}
+
+	return values[0];
+}
+
+// The functor used by n-ary ADD and MUL nodes
+inline const std::function<Scalar(const std::vector<Scalar> &)> &
+associativeFunctor(const std::string &name) {
+	static const std::function<Scalar(const std::vector<Scalar> &)> sum =
+	  [](const std::vector<Scalar> &operands) {
+		  static thread_local std::vector<Scalar> buffer;
+		  buffer.assign(operands.begin(), operands.end());
+		  return reduceBalanced(
+			buffer, Scalar(0), [](const Scalar &a, const Scalar &b) {
+				return a + b;
+			});
+	  };
+
+	static const std::function<Scalar(const std::vector<Scalar> &)> product =
+	  [](const std::vector<Scalar> &operands) {
+		  static thread_local std::vector<Scalar> buffer;
+		  buffer.assign(operands.begin(), operands.end());
+		  return reduceBalanced(
+			buffer, Scalar(1), [](const Scalar &a, const Scalar &b) {
+				return a * b;
+			});
+	  };
+
+	LR_ASSERT(isAssociative(name), "{} is not an associative operator", name);
+	return name == "ADD" ? sum : product;
+}
+
+inline void Function::extendAssociative(
+  const std::vector<std::shared_ptr<Component>> &operands) {
+	for (const auto &val : operands) {
+		if (val->type() == "FUNCTION" && val->name() == m_name) {
+			const auto &inner = val->children();
+			m_values.insert(m_values.end(), inner.begin(), inner.end());
+		} else {
+			m_values.emplace_back(val);
+		}
+	}
+
+	m_numOperands = m_values.size();
+	m_functor	  = associativeFunctor(m_name);
+}
+
+/**
+ * Create an ADD or MUL node from a prototype and a list of operands. Operands
+ * which are the same operation are merged into the new node, so (a + b) + c
+ * becomes a single node a + b + c. Nodes with exactly two operands keep the
+ * prototype's own functor.
+ */
+inline std::shared_ptr<Function>
+makeAssociative(const Function &prototype,
+				const std::vector<std::shared_ptr<Component>> &operands) {
+	std::vector<std::shared_ptr<Component>> values;
+	values.reserve(operands.size());
+	for (const auto &val : operands) {
+		if (val->type() == "FUNCTION" && val->name() == prototype.name()) {
+			const auto &inner = val->children();
+			values.insert(values.end(), inner.begin(), inner.end());
+		} else {
+			values.emplace_back(val);
+		}
+	}
+
+	uint64_t numOperands = values.size();
+	if (numOperands == 2 && prototype.numOperands() == 2) {
+		return makeNode<Function>(prototype.name(),
+								  prototype.format(),
+								  prototype.functor(),
+								  numOperands,
+								  std::move(values));
+	}
+
+	return makeNode<Function>(prototype.name(),
+							  prototype.format(),
+							  associativeFunctor(prototype.name()),
+							  numOperands,
+							  std::move(values));
+}
+
 // All derivative rules will inherit from this class
 class DerivativeRule {
 public:
@@ -401,25 +1007,249 @@ public:
 private:
 };
 
+class SimplificationRule;
+
+/*
+ * The registration functions add to the lists below, which are only a staging
+ * area: the rest of the program reads the snapshot made by the most recent
+ * call to publishRegistry(). The lists must not be modified while another
+ * thread is publishing them.
+ */
+
 // Registered functions
 static inline std::vector<std::shared_ptr<Function>> functions;
 
 // Registered constants
 static inline std::map<std::string, std::shared_ptr<Component>> constants;
 
-auto findFunction(const std::string &name) {
-	// This should probably be a hash-map
-	return std::find_if(functions.begin(),
-						functions.end(),
-						[&](const auto &val) { return val->name() == name; });
+// Derivative rules
+static inline std::vector<std::shared_ptr<DerivativeRule>> derivativeRules;
+
+// Simplification rules
+static inline std::vector<std::shared_ptr<SimplificationRule>>
+  simplificationRules;
+
+/**
+ * An immutable snapshot of the registered functions, constants and rules.
+ * Function prototypes are copied when the snapshot is made, so later changes
+ * to the staging lists cannot be seen by threads using the snapshot.
+ */
+class Registry {
+public:
+	Registry(
+	  const std::vector<std::shared_ptr<Function>> &functions,
+	  std::map<std::string, std::shared_ptr<Component>> constants,
+	  std::vector<std::shared_ptr<DerivativeRule>> derivativeRules,
+	  std::vector<std::shared_ptr<SimplificationRule>> simplificationRules,
+	  uint64_t version) :
+			m_constants(std::move(constants)),
+			m_derivativeRules(std::move(derivativeRules)),
+			m_simplificationRules(std::move(simplificationRules)),
+			m_version(version) {
+		for (const auto &func : functions) {
+			auto copy = std::make_shared<Function>(*func);
+			m_functions.emplace_back(copy);
+			// The first function registered with a name takes priority
+			m_functionIndex.emplace(copy->name(), copy.get());
+		}
+	}
+
+	// Returns the prototype of the function with the given name, or nullptr
+	// if there is no such function
+	LR_NODISCARD("")
+	const Function *findFunction(const std::string &name) const {
+		auto it = m_functionIndex.find(name);
+		return it == m_functionIndex.end() ? nullptr : it->second;
+	}
+
+	LR_NODISCARD("")
+	const std::vector<std::shared_ptr<Function>> &functions() const {
+		return m_functions;
+	}
+
+	LR_NODISCARD("")
+	const std::map<std::string, std::shared_ptr<Component>> &constants() const {
+		return m_constants;
+	}
+
+	LR_NODISCARD("")
+	const std::vector<std::shared_ptr<DerivativeRule>> &
+	derivativeRules() const {
+		return m_derivativeRules;
+	}
+
+	LR_NODISCARD("")
+	const std::vector<std::shared_ptr<SimplificationRule>> &
+	simplificationRules() const {
+		return m_simplificationRules;
+	}
+
+	// Incremented each time the registry is published
+	LR_NODISCARD("") uint64_t version() const { return m_version; }
+
+private:
+	std::vector<std::shared_ptr<Function>> m_functions;
+	std::unordered_map<std::string, const Function *> m_functionIndex;
+	std::map<std::string, std::shared_ptr<Component>> m_constants;
+	std::vector<std::shared_ptr<DerivativeRule>> m_derivativeRules;
+	std::vector<std::shared_ptr<SimplificationRule>> m_simplificationRules;
+	uint64_t m_version;
+};
+
+/*
+ * Published snapshots are read with a single acquire load, with no reference
+ * counting or locking, and are freed by quiescent-state-based reclamation. A
+ * thread announces the epoch in which it first reads the registry, and the
+ * references it gets stay valid until it calls registryQuiescent() or exits.
+ * A replaced snapshot is freed once every thread still reading announced a
+ * later epoch than the one it was replaced in.
+ */
+static inline std::atomic<const Registry *> currentRegistry {nullptr};
+static inline std::atomic<uint64_t> registryEpoch {1};
+static inline std::mutex registryMutex;
+static inline uint64_t registryVersion = 0;
+
+// The epoch a thread announced, or 0 if it holds no references. Readers are
+// on separate cache lines, so announcing does not contend
+struct alignas(64) RegistryReader {
+	std::atomic<uint64_t> epoch {0};
+};
+
+struct RetiredRegistry {
+	std::unique_ptr<const Registry> snapshot;
+	uint64_t epoch; // In which it was replaced
+};
+
+// Guarded by registryMutex
+static inline std::vector<RegistryReader *> registryReaders;
+static inline std::vector<RetiredRegistry> retiredRegistries;
+static inline std::atomic<size_t> numRetiredRegistries {0};
+
+// The calling thread's reader, registered for as long as the thread runs
+class ThreadRegistryReader {
+public:
+	ThreadRegistryReader() {
+		std::lock_guard<std::mutex> lock(registryMutex);
+		registryReaders.emplace_back(&m_reader);
+	}
+
+	ThreadRegistryReader(const ThreadRegistryReader &)			  = delete;
+	ThreadRegistryReader &operator=(const ThreadRegistryReader &) = delete;
+
+	~ThreadRegistryReader() {
+		std::lock_guard<std::mutex> lock(registryMutex);
+		registryReaders.erase(std::find(
+		  registryReaders.begin(), registryReaders.end(), &m_reader));
+	}
+
+	static ThreadRegistryReader &current() {
+		static thread_local ThreadRegistryReader reader;
+		return reader;
+	}
+
+	RegistryReader m_reader;
+	bool m_reading = false;
+};
+
+// Free the retired snapshots no thread can still be using. Must be called
+// with registryMutex held
+inline void reclaimRegistriesLocked() {
+	uint64_t oldest = std::numeric_limits<uint64_t>::max();
+	for (const auto *reader : registryReaders) {
+		uint64_t epoch = reader->epoch.load(std::memory_order_seq_cst);
+		if (epoch != 0) oldest = lrc::min(oldest, epoch);
+	}
+
+	auto freed = std::remove_if(
+	  retiredRegistries.begin(),
+	  retiredRegistries.end(),
+	  [&](const RetiredRegistry &retired) { return retired.epoch < oldest; });
+	retiredRegistries.erase(freed, retiredRegistries.end());
+	numRetiredRegistries.store(retiredRegistries.size(),
+							   std::memory_order_relaxed);
+}
+
+/**
+ * Make a snapshot of everything registered so far and make it visible to all
+ * threads. Threads already using the previous snapshot continue to see it
+ * until they next call registry() after registryQuiescent(). Nothing can be
+ * looked up until this has been called once, so a reader cannot see a partly
+ * registered snapshot
+ */
+inline const Registry &publishRegistry() {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	auto *res = new Registry(functions,
+							 constants,
+							 derivativeRules,
+							 simplificationRules,
+							 ++registryVersion);
+	const Registry *old =
+	  currentRegistry.exchange(res, std::memory_order_seq_cst);
+	uint64_t epoch = registryEpoch.fetch_add(1, std::memory_order_seq_cst);
+	if (old != nullptr)
+		retiredRegistries.emplace_back(RetiredRegistry {
+		  std::unique_ptr<const Registry>(old), epoch});
+	reclaimRegistriesLocked();
+	return *res;
+}
+
+/**
+ * The most recently published registry. The reference, and the functions,
+ * constants and rules in it, stay valid until the calling thread next calls
+ * registryQuiescent()
+ */
+inline const Registry &registry() {
+	auto &reader		= ThreadRegistryReader::current();
+	const Registry *res = nullptr;
+	if (reader.m_reading) {
+		res = currentRegistry.load(std::memory_order_acquire);
+	} else {
+		// The epoch is announced before the snapshot is loaded, so a
+		// publisher which replaces the snapshot afterwards sees it
+		uint64_t epoch = registryEpoch.load(std::memory_order_seq_cst);
+		reader.m_reader.epoch.store(epoch, std::memory_order_seq_cst);
+		reader.m_reading = true;
+		res				 = currentRegistry.load(std::memory_order_seq_cst);
+	}
+
+	LR_ASSERT(res != nullptr,
+			  "Nothing has been published. Call publishRegistry() after "
+			  "registering functions, constants and rules");
+	return *res;
 }
 
+/**
+ * Declare that the calling thread holds no references from registry() or
+ * findFunction(), so snapshots replaced since it started reading may be
+ * freed. Long-running threads call this between units of work, such as
+ * requests or tasks
+ */
+inline void registryQuiescent() {
+	auto &reader = ThreadRegistryReader::current();
+	if (!reader.m_reading) return;
+	reader.m_reader.epoch.store(0, std::memory_order_release);
+	reader.m_reading = false;
+
+	if (numRetiredRegistries.load(std::memory_order_relaxed) > 0) {
+		std::unique_lock<std::mutex> lock(registryMutex, std::try_to_lock);
+		if (lock) reclaimRegistriesLocked();
+	}
+}
+
+// Returns the prototype of a registered function, or nullptr if there is no
+// function with the given name. It is valid for as long as registry() is
+inline const Function *findFunction(const std::string &name) {
+	return registry().findFunction(name);
+}
+
+// A character of the input, and where it is
 struct Token {
 	uint64_t type;
 	char val;
+	const char *pos;
 };
 
-std::vector<Token> tokenize(const std::string &input) {
+std::vector<Token> tokenize(std::string_view input) {
 	/*
 	 * Valid objects:
 	 *
@@ -440,25 +1270,25 @@ std::vector<Token> tokenize(const std::string &input) {
 	// Scan the input string
 	for (const auto &c : input) {
 		if ('0' <= c && c <= '9')
-			res.emplace_back(Token {TYPE_DIGIT, c});
+			res.emplace_back(Token {TYPE_DIGIT, c, &c});
 		else if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z'))
-			res.emplace_back(Token {TYPE_CHAR, c});
+			res.emplace_back(Token {TYPE_CHAR, c, &c});
 		else if (c == '+')
-			res.emplace_back(Token {TYPE_ADD | TYPE_OPERATOR, c});
+			res.emplace_back(Token {TYPE_ADD | TYPE_OPERATOR, c, &c});
 		else if (c == '-')
-			res.emplace_back(Token {TYPE_SUB | TYPE_OPERATOR, c});
+			res.emplace_back(Token {TYPE_SUB | TYPE_OPERATOR, c, &c});
 		else if (c == '*')
-			res.emplace_back(Token {TYPE_MUL | TYPE_OPERATOR, c});
+			res.emplace_back(Token {TYPE_MUL | TYPE_OPERATOR, c, &c});
 		else if (c == '/')
-			res.emplace_back(Token {TYPE_DIV | TYPE_OPERATOR, c});
+			res.emplace_back(Token {TYPE_DIV | TYPE_OPERATOR, c, &c});
 		else if (c == '^')
-			res.emplace_back(Token {TYPE_CARET | TYPE_OPERATOR, c});
+			res.emplace_back(Token {TYPE_CARET | TYPE_OPERATOR, c, &c});
 		else if (c == '(')
-			res.emplace_back(Token {TYPE_LPAREN, c});
+			res.emplace_back(Token {TYPE_LPAREN, c, &c});
 		else if (c == ')')
-			res.emplace_back(Token {TYPE_RPAREN, c});
+			res.emplace_back(Token {TYPE_RPAREN, c, &c});
 		else if (c == '.')
-			res.emplace_back(Token {TYPE_POINT, c});
+			res.emplace_back(Token {TYPE_POINT, c, &c});
 		else if (c == ' ')
 			continue;
 		else
@@ -468,12 +1298,14 @@ std::vector<Token> tokenize(const std::string &input) {
 	return res;
 }
 
+// Lexed objects are views of the input, so it must outlive them
 struct Lexed {
 	uint64_t type;
-	std::string val;
+	std::string_view val;
 };
 
-// Take a list of tokens and return a list of lexed objects
+// Take a list of tokens and return a list of lexed objects. Tokens which are
+// not next to each other in the input (separated by spaces) are never joined
 std::vector<Lexed> lexer(const std::vector<Token> &tokens) {
 	/*
 	 * Grammar:
@@ -489,7 +1321,7 @@ std::vector<Lexed> lexer(const std::vector<Token> &tokens) {
 	std::vector<Lexed> res;
 
 	// Stores the current value
-	std::string currentLex;
+	std::string_view currentLex;
 
 	// Valid next characters that would continue the string
 	uint64_t validNext;
@@ -498,18 +1330,18 @@ std::vector<Lexed> lexer(const std::vector<Token> &tokens) {
 	// Iterate over all tokens, "eating" them to form a list of lexed objects
 	auto it = tokens.begin();
 	while (it != tokens.end()) {
-		// If currentLex is empty, append value
-		if (currentLex.empty() || it->type & validNext) {
-			// Next type can be appended because:
-			// 1. current string is empty
-			// 2. it's a valid next character
-			currentLex += it->val;
+		bool adjacent = it->pos == currentLex.data() + currentLex.size();
+		if (currentLex.empty()) {
+			currentLex = {it->pos, 1};
+		} else if (it->type & validNext && adjacent) {
+			// A valid next character, so extend the current lexeme
+			currentLex = {currentLex.data(), currentLex.size() + 1};
 		} else {
 			// Invalid to append, so cache current result
 			// and reset
 			Lexed lexed {type, currentLex};
 			res.emplace_back(lexed);
-			currentLex = it->val;
+			currentLex = {it->pos, 1};
 		}
 
 		if (it->type & TYPE_DIGIT) {
@@ -578,10 +1410,7 @@ std::vector<Lexed> process(const std::vector<Lexed> &lexed) {
 			res.emplace_back(Lexed {TYPE_MUL | TYPE_OPERATOR, "*"});
 		} else if (tmp[i].type & TYPE_STRING && tmp[i + 1].type & TYPE_LPAREN) {
 			// Check the value is not a function
-			if (std::find_if(
-				  functions.begin(), functions.end(), [&](const auto &f) {
-					  return f->name() == tmp[i].val;
-				  }) == functions.end()) {
+			if (findFunction(std::string(tmp[i].val)) == nullptr) {
 				res.emplace_back(tmp[i]);
 				res.emplace_back(Lexed {TYPE_MUL | TYPE_OPERATOR, "*"});
 				if (addParen) {
@@ -596,6 +1425,9 @@ std::vector<Lexed> process(const std::vector<Lexed> &lexed) {
 					auto tmpIndex		 = i + 1;
 					while (bracketCount > 0) {
 						tmpIndex++;
+						LR_ASSERT(static_cast<size_t>(tmpIndex) < tmp.size(),
+								  "Invalid expression: unclosed call to {}",
+								  tmp[i].val);
 						if (tmp[tmpIndex].type & TYPE_LPAREN)
 							++bracketCount;
 						else if (tmp[tmpIndex].type & TYPE_RPAREN)
@@ -682,16 +1514,17 @@ parse(const std::vector<Lexed> &postfix) {
 
 	for (const auto &lex : postfix) {
 		if (lex.type & TYPE_NUMBER) {
-			res.emplace_back(std::make_shared<Number>(lex.val));
+			res.emplace_back(makeNode<Number>(lex.val));
 		} else if (lex.type & TYPE_STRING) {
 			// Check for a function
-			auto func = findFunction(lex.val);
-			if (func != functions.end()) {
-				// Function was found, add it to result
-				res.emplace_back(*func);
+			std::string name(lex.val);
+			auto func = findFunction(name);
+			if (func != nullptr) {
+				// Function was found, add a copy of it to the result
+				res.emplace_back(makeNode<Function>(*func));
 			} else {
 				// Not a function. Use as a variable
-				res.emplace_back(std::make_shared<Variable>(lex.val));
+				res.emplace_back(makeNode<Variable>(std::move(name)));
 			}
 		} else if (lex.type & TYPE_OPERATOR) {
 			// Operators are just special functions
@@ -704,9 +1537,9 @@ parse(const std::vector<Lexed> &postfix) {
 			if (lex.type & TYPE_DIV) func = findFunction("DIV");
 			if (lex.type & TYPE_CARET) func = findFunction("POW");
 
-			LR_ASSERT(func != functions.end(), "Operator not found");
+			LR_ASSERT(func != nullptr, "Operator not found");
 
-			res.emplace_back(*func);
+			res.emplace_back(makeNode<Function>(*func));
 		}
 	}
 
@@ -716,7 +1549,7 @@ parse(const std::vector<Lexed> &postfix) {
 std::shared_ptr<Tree>
 genTree(const std::vector<std::shared_ptr<Component>> &values) {
 	// Construct a tree from the processed list
-	auto res = std::make_shared<Tree>();
+	auto res = makeNode<Tree>();
 	std::vector<std::shared_ptr<Component>> stack;
 
 	for (const auto &lex : values) {
@@ -724,18 +1557,34 @@ genTree(const std::vector<std::shared_ptr<Component>> &values) {
 			stack.emplace_back(lex);
 		} else if (lex->type() == "FUNCTION") {
 			auto funcCast = std::dynamic_pointer_cast<Function>(lex);
+			LR_ASSERT(stack.size() >= funcCast->numOperands(),
+					  "Invalid expression: missing operand for {}",
+					  funcCast->name());
+
 			std::vector<std::shared_ptr<Component>> args;
 			for (uint64_t i = 0; i < funcCast->numOperands(); ++i) {
 				args.emplace_back(stack.back());
 				stack.pop_back();
 			}
 
-			// Function is valid -- clone it
-			auto node = std::make_shared<Function>(
-			  *std::dynamic_pointer_cast<Function>(lex));
-
-			for (auto it = args.rbegin(); it != args.rend(); ++it) {
-				node->addValue(*it);
+			std::reverse(args.begin(), args.end());
+
+			// Chains of ADD or MUL become a single n-ary node. Otherwise,
+			// the function is valid -- clone it
+			std::shared_ptr<Function> node;
+			auto lhs = std::dynamic_pointer_cast<Function>(args[0]);
+			if (isAssociative(funcCast->name()) && lhs &&
+				lhs->name() == funcCast->name()) {
+				// The left operand was built by this loop and is not part of
+				// a tree yet, so extend it rather than copying its operands.
+				// This keeps parsing a + b + c + ... linear
+				lhs->extendAssociative({args.begin() + 1, args.end()});
+				node = lhs;
+			} else if (isAssociative(funcCast->name())) {
+				node = makeAssociative(*funcCast, args);
+			} else {
+				node = makeNode<Function>(*funcCast);
+				for (const auto &arg : args) node->addValue(arg);
 			}
 
 			// Push the node back onto the stack
@@ -744,6 +1593,7 @@ genTree(const std::vector<std::shared_ptr<Component>> &values) {
 	}
 
 	// Push the result to the tree
+	LR_ASSERT(!stack.empty(), "Invalid expression: no value");
 	res->tree().emplace_back(stack.back());
 
 	return res;
@@ -763,14 +1613,25 @@ std::shared_ptr<Component> substitute(
 }
 
 std::shared_ptr<Component> autoParse(const std::string &input) {
-	auto tokenized = tokenize(input);
+	// Spaces are ignored, even inside numbers and names. Lexemes are views of
+	// the input, so the spaces are removed from a copy first
+	std::string_view source = input;
+	std::string compact;
+	if (input.find(' ') != input.npos) {
+		compact.reserve(input.size());
+		for (char c : input)
+			if (c != ' ') compact += c;
+		source = compact;
+	}
+
+	auto tokenized = tokenize(source);
 	auto lexed	   = lexer(tokenized);
 
 	if (lexed.size() == 1) { // A single term
 		if (lexed[0].type & TYPE_NUMBER)
-			return std::make_shared<Number>(lexed[0].val);
+			return makeNode<Number>(lexed[0].val);
 		else if (lexed[0].type & TYPE_VARIABLE)
-			return std::make_shared<Variable>(lexed[0].val);
+			return makeNode<Variable>(std::string(lexed[0].val));
 	}
 
 	auto processed = process(lexed);
@@ -854,9 +1715,9 @@ public:
 
 		// Duplicate function
 		auto it = findFunction(op->name());
-		LR_ASSERT(it != functions.end(), "Function not found");
+		LR_ASSERT(it != nullptr, "Function not found");
 
-		auto func = std::make_shared<Function>(**it);
+		auto func = std::make_shared<Function>(*it);
 		func->addValue(lhs);
 
 		return func;
@@ -891,6 +1752,15 @@ public:
 		// Extract operands
 		auto op	  = std::dynamic_pointer_cast<Function>(component);
 		auto vals = op->values();
+
+		if (op->name() == "ADD" && vals.size() != 2) {
+			// d/dx (a + b + ...) = d/dx a + d/dx b + ...
+			std::vector<std::shared_ptr<Component>> derivs;
+			for (const auto &val : vals)
+				derivs.emplace_back(differentiate(val, wrt));
+			return makeAssociative(*op, derivs);
+		}
+
 		LR_ASSERT(vals.size() == 2, "Expected 2 operands");
 		std::shared_ptr<Component> lhs, rhs;
 		lhs = differentiate(vals[0], wrt);
@@ -898,9 +1768,9 @@ public:
 
 		// Duplicate addition function
 		auto it = findFunction(op->name());
-		LR_ASSERT(it != functions.end(), "Function not found");
+		LR_ASSERT(it != nullptr, "Function not found");
 
-		auto func = std::make_shared<Function>(**it);
+		auto func = std::make_shared<Function>(*it);
 		func->addValue(lhs);
 		func->addValue(rhs);
 
@@ -935,6 +1805,27 @@ public:
 		// Extract operands
 		auto op	  = std::dynamic_pointer_cast<Function>(component);
 		auto vals = op->values();
+
+		if (vals.size() != 2) {
+			/*
+			 * d/dx (a * b * c * ...) = d/dx a * b * c * ...
+			 *                        + a * d/dx b * c * ...
+			 *                        + ...
+			 */
+
+			auto addIt = findFunction("ADD");
+			LR_ASSERT(addIt != nullptr, "Function not found");
+
+			std::vector<std::shared_ptr<Component>> terms;
+			for (size_t i = 0; i < vals.size(); ++i) {
+				auto factors = vals;
+				factors[i]	 = differentiate(vals[i], wrt);
+				terms.emplace_back(makeAssociative(*op, factors));
+			}
+
+			return makeAssociative(*addIt, terms);
+		}
+
 		LR_ASSERT(vals.size() == 2, "Expected 2 operands");
 		std::shared_ptr<Component> da, db;
 		da = differentiate(vals[0], wrt);
@@ -943,18 +1834,18 @@ public:
 		// Duplicate addition function
 		auto addIt = findFunction("ADD");
 		auto mulIt = findFunction("MUL");
-		LR_ASSERT(addIt != functions.end(), "Function not found");
-		LR_ASSERT(mulIt != functions.end(), "Function not found");
+		LR_ASSERT(addIt != nullptr, "Function not found");
+		LR_ASSERT(mulIt != nullptr, "Function not found");
 
-		auto leftMul = std::make_shared<Function>(**mulIt);
+		auto leftMul = std::make_shared<Function>(*mulIt);
 		leftMul->addValue(da);
 		leftMul->addValue(vals[1]);
 
-		auto rightMul = std::make_shared<Function>(**mulIt);
+		auto rightMul = std::make_shared<Function>(*mulIt);
 		rightMul->addValue(vals[0]);
 		rightMul->addValue(db);
 
-		auto sum = std::make_shared<Function>(**addIt);
+		auto sum = std::make_shared<Function>(*addIt);
 		sum->addValue(leftMul);
 		sum->addValue(rightMul);
 
@@ -999,28 +1890,28 @@ public:
 		auto mulIt = findFunction("MUL");
 		auto divIt = findFunction("DIV");
 		auto powIt = findFunction("POW");
-		LR_ASSERT(subIt != functions.end(), "Function not found");
-		LR_ASSERT(mulIt != functions.end(), "Function not found");
-		LR_ASSERT(divIt != functions.end(), "Function not found");
-		LR_ASSERT(powIt != functions.end(), "Function not found");
+		LR_ASSERT(subIt != nullptr, "Function not found");
+		LR_ASSERT(mulIt != nullptr, "Function not found");
+		LR_ASSERT(divIt != nullptr, "Function not found");
+		LR_ASSERT(powIt != nullptr, "Function not found");
 
-		auto leftMul = std::make_shared<Function>(**mulIt);
+		auto leftMul = std::make_shared<Function>(*mulIt);
 		leftMul->addValue(da);
 		leftMul->addValue(vals[1]);
 
-		auto rightMul = std::make_shared<Function>(**mulIt);
+		auto rightMul = std::make_shared<Function>(*mulIt);
 		rightMul->addValue(vals[0]);
 		rightMul->addValue(db);
 
-		auto sum = std::make_shared<Function>(**subIt);
+		auto sum = std::make_shared<Function>(*subIt);
 		sum->addValue(leftMul);
 		sum->addValue(rightMul);
 
-		auto bSquare = std::make_shared<Function>(**powIt);
+		auto bSquare = std::make_shared<Function>(*powIt);
 		bSquare->addValue(vals[1]);
-		bSquare->addValue(autoParse("2"));
+		bSquare->addValue(std::make_shared<Number>(2));
 
-		auto div = std::make_shared<Function>(**divIt);
+		auto div = std::make_shared<Function>(*divIt);
 		div->addValue(sum);
 		div->addValue(bSquare);
 
@@ -1066,28 +1957,28 @@ public:
 			auto mulIt = findFunction("MUL");
 			auto divIt = findFunction("DIV");
 			auto powIt = findFunction("POW");
-			LR_ASSERT(subIt != functions.end(), "Function not found");
-			LR_ASSERT(mulIt != functions.end(), "Function not found");
-			LR_ASSERT(divIt != functions.end(), "Function not found");
-			LR_ASSERT(powIt != functions.end(), "Function not found");
+			LR_ASSERT(subIt != nullptr, "Function not found");
+			LR_ASSERT(mulIt != nullptr, "Function not found");
+			LR_ASSERT(divIt != nullptr, "Function not found");
+			LR_ASSERT(powIt != nullptr, "Function not found");
 
 			// (b - 1)
-			auto bSub = std::make_shared<Function>(**subIt);
+			auto bSub = std::make_shared<Function>(*subIt);
 			bSub->addValue(vals[1]);
-			bSub->addValue(autoParse("1"));
+			bSub->addValue(std::make_shared<Number>(1));
 
 			// a ^ (b - 1)
-			auto aPow = std::make_shared<Function>(**powIt);
+			auto aPow = std::make_shared<Function>(*powIt);
 			aPow->addValue(vals[0]);
 			aPow->addValue(bSub);
 
 			// b * a ^ (b - 1)
-			auto bMul = std::make_shared<Function>(**mulIt);
+			auto bMul = std::make_shared<Function>(*mulIt);
 			bMul->addValue(vals[1]);
 			bMul->addValue(aPow);
 
 			// b * a ^ (b - 1) * d/dx a
-			auto mul = std::make_shared<Function>(**mulIt);
+			auto mul = std::make_shared<Function>(*mulIt);
 			mul->addValue(bMul);
 			mul->addValue(da);
 
@@ -1099,8 +1990,58 @@ public:
 	}
 };
 
-// Derivative rules
-static inline std::vector<std::shared_ptr<DerivativeRule>> derivativeRules;
+// The exact value of a single node, given the exact values of its operands
+// (or empty if they have none) as optionals or pointers. Used by exactEval()
+template<typename Iter>
+inline std::optional<Rational>
+exactEvalNode(const std::shared_ptr<Component> &node, Iter first, Iter last) {
+	using Exact		 = std::optional<Rational>;
+	std::string type = node->type();
+	if (type == "NUMBER")
+		return std::dynamic_pointer_cast<Number>(node)->exact();
+	if (first == last) return {};
+	if (std::any_of(first, last, [](const auto &val) { return !val; }))
+		return {};
+	if (type == "TREE") return Exact(**first);
+	if (type != "FUNCTION") return {};
+
+	std::string name  = node->name();
+	const Rational &a = **first;
+	if (name == "PLUS") return a;
+	if (name == "MINUS") return -a;
+
+	if (name == "ADD" || name == "MUL") {
+		Rational res = a;
+		for (auto it = first + 1; it != last; ++it)
+			res = name == "ADD" ? res + **it : res * **it;
+		return res;
+	}
+
+	if (last - first != 2) return {};
+	const Rational &b = *first[1];
+	if (name == "SUB") return a - b;
+	if (name == "DIV") return b.sign() == 0 ? Exact {} : a / b;
+
+	if (name == "POW" && b.isInteger() && !b.isBig() &&
+		std::abs(b.numerator()) <= maxExactPower &&
+		!(a.sign() == 0 && b.sign() < 0))
+		return a.pow(b.numerator());
+
+	return {};
+}
+
+/**
+ * The exact value of a tree, if it only applies arithmetic and integer powers
+ * to exact numbers (see Number::exact()), or nullopt otherwise
+ */
+inline std::optional<Rational>
+exactEval(const std::shared_ptr<Component> &input) {
+	auto visitor = [](const auto &node, auto first, auto last) {
+		return exactEvalNode(node, first, last);
+	};
+
+	return foldTree<std::optional<Rational>>(input, visitor);
+}
 
 class SimplificationRule {
 public:
@@ -1129,6 +2070,8 @@ public:
 	LR_NODISCARD("")
 	std::shared_ptr<Component>
 	simplifyInput(const std::shared_ptr<Component> &component) const override {
+		if (auto exact = exactEval(component))
+			return std::make_shared<Number>(*exact);
 		return std::make_shared<Number>(component->eval());
 	}
 };
@@ -1203,29 +2146,50 @@ public:
 	std::shared_ptr<Component>
 	simplifyInput(const std::shared_ptr<Component> &component) const override {
 		auto func = std::dynamic_pointer_cast<Function>(component);
-		LR_ASSERT(func->numOperands() == 2, "Expected 2 operands");
-		auto left  = simplify(func->values()[0]);
-		auto right = simplify(func->values()[1]);
 
+		// (a + b) + c = a + b + c
+		std::vector<std::shared_ptr<Component>> operands;
+		for (const auto &val : func->values())
+			operands.emplace_back(simplify(val));
+		auto sum = makeAssociative(*func, operands);
+
+		// 2 + x + 3 = 5 + x
 		// 0 + x = x
-		if (left->type() == "NUMBER") {
-			if (std::dynamic_pointer_cast<Number>(left)->value() == 0) {
-				return right;
+		// x + 0 = x
+		// The constant is summed exactly while every term is exact
+		std::vector<std::shared_ptr<Component>> terms;
+		int64_t constantIndex = -1;
+		Scalar constant		  = 0;
+		std::optional<Rational> exact = Rational(0);
+		for (const auto &term : sum->values()) {
+			if (term->type() == "NUMBER") {
+				if (constantIndex < 0) {
+					constantIndex = static_cast<int64_t>(terms.size());
+					terms.emplace_back(term);
+				}
+				auto number = std::dynamic_pointer_cast<Number>(term);
+				constant += number->value();
+				if (exact && number->exact())
+					exact = *exact + *number->exact();
+				else
+					exact.reset();
+				continue;
 			}
+			terms.emplace_back(term);
 		}
 
-		// x + 0 = x
-		if (right->type() == "NUMBER") {
-			if (std::dynamic_pointer_cast<Number>(right)->value() == 0) {
-				return left;
-			}
+		if (constantIndex >= 0) {
+			if (exact ? exact->sign() == 0 : constant == 0)
+				terms.erase(terms.begin() + constantIndex);
+			else if (exact)
+				terms[constantIndex] = std::make_shared<Number>(*exact);
+			else
+				terms[constantIndex] = std::make_shared<Number>(constant);
 		}
 
-		auto res = std::make_shared<Function>(*func);
-		res->clearValues();
-		res->addValue(left);
-		res->addValue(right);
-		return res;
+		if (terms.empty()) return std::make_shared<Number>(0);
+		if (terms.size() == 1) return terms[0];
+		return makeAssociative(*func, terms);
 	}
 };
 
@@ -1252,8 +2216,8 @@ public:
 		if (left->type() == "NUMBER") {
 			if (std::dynamic_pointer_cast<Number>(left)->value() == 0) {
 				auto minusIt = findFunction("MINUS");
-				LR_ASSERT(minusIt != functions.end(), "Function not found");
-				auto minus = std::make_shared<Function>(**minusIt);
+				LR_ASSERT(minusIt != nullptr, "Function not found");
+				auto minus = std::make_shared<Function>(*minusIt);
 				minus->addValue(right);
 				return minus;
 			}
@@ -1289,39 +2253,52 @@ public:
 	std::shared_ptr<Component>
 	simplifyInput(const std::shared_ptr<Component> &component) const override {
 		auto func = std::dynamic_pointer_cast<Function>(component);
-		LR_ASSERT(func->numOperands() == 2, "Expected 2 operands");
-		auto left  = simplify(func->values()[0]);
-		auto right = simplify(func->values()[1]);
 
-		if (left->type() == "NUMBER") {
-			// 0 * x = 0
-			if (std::dynamic_pointer_cast<Number>(left)->value() == 0) {
-				return std::make_shared<Number>(0);
-			}
-
-			// 1 * x = x
-			if (std::dynamic_pointer_cast<Number>(left)->value() == 1) {
-				return right;
+		// (a * b) * c = a * b * c
+		std::vector<std::shared_ptr<Component>> operands;
+		for (const auto &val : func->values())
+			operands.emplace_back(simplify(val));
+		auto product = makeAssociative(*func, operands);
+
+		// 2 * x * 3 = 6 * x
+		// 0 * x = x * 0 = 0
+		// 1 * x = x * 1 = x
+		// The constant is multiplied exactly while every factor is exact
+		std::vector<std::shared_ptr<Component>> factors;
+		int64_t constantIndex = -1;
+		Scalar constant		  = 1;
+		std::optional<Rational> exact = Rational(1);
+		for (const auto &factor : product->values()) {
+			if (factor->type() == "NUMBER") {
+				if (constantIndex < 0) {
+					constantIndex = static_cast<int64_t>(factors.size());
+					factors.emplace_back(factor);
+				}
+				auto number = std::dynamic_pointer_cast<Number>(factor);
+				constant *= number->value();
+				if (exact && number->exact())
+					exact = *exact * *number->exact();
+				else
+					exact.reset();
+				continue;
 			}
+			factors.emplace_back(factor);
 		}
 
-		if (right->type() == "NUMBER") {
-			// x * 0 = 0
-			if (std::dynamic_pointer_cast<Number>(right)->value() == 0) {
+		if (constantIndex >= 0) {
+			if (exact ? exact->sign() == 0 : constant == 0)
 				return std::make_shared<Number>(0);
-			}
-
-			// x * 1 = x
-			if (std::dynamic_pointer_cast<Number>(right)->value() == 1) {
-				return left;
-			}
+			if (exact ? *exact == Rational(1) : constant == 1)
+				factors.erase(factors.begin() + constantIndex);
+			else if (exact)
+				factors[constantIndex] = std::make_shared<Number>(*exact);
+			else
+				factors[constantIndex] = std::make_shared<Number>(constant);
 		}
 
-		auto res = std::make_shared<Function>(*func);
-		res->clearValues();
-		res->addValue(left);
-		res->addValue(right);
-		return res;
+		if (factors.empty()) return std::make_shared<Number>(1);
+		if (factors.size() == 1) return factors[0];
+		return makeAssociative(*func, factors);
 	}
 };
 
@@ -1362,6 +2339,12 @@ public:
 		res->clearValues();
 		res->addValue(left);
 		res->addValue(right);
+
+		// 1 / 3 = 1/3, held exactly
+		if (left->type() == "NUMBER" && right->type() == "NUMBER") {
+			if (auto exact = exactEval(res))
+				return std::make_shared<Number>(*exact);
+		}
 		return res;
 	}
 };
@@ -1407,52 +2390,146 @@ public:
 		res->clearValues();
 		res->addValue(left);
 		res->addValue(right);
+
+		// 2 ^ -3 = 1/8, held exactly
+		if (left->type() == "NUMBER" && right->type() == "NUMBER") {
+			if (auto exact = exactEval(res))
+				return std::make_shared<Number>(*exact);
+		}
 		return res;
 	}
 };
 
-// Simplification rules
-static inline std::vector<std::shared_ptr<SimplificationRule>>
-  simplificationRules;
-
 std::string prettyPrint(const std::shared_ptr<Component> &object) {
-	if (object->type() == "TREE")
-		return prettyPrint(std::dynamic_pointer_cast<Tree>(object)->tree()[0]);
-
-	if (object->type() == "NUMBER")
-		return lrc::str(std::dynamic_pointer_cast<Number>(object)->eval());
-
-	if (object->type() == "VARIABLE")
-		return std::dynamic_pointer_cast<Variable>(object)->name();
-
-	if (object->type() == "FUNCTION") {
-		auto func	= std::dynamic_pointer_cast<Function>(object);
-		auto format = func->format();
-		std::vector<std::string> args;
-		for (uint64_t i = 0; i < func->numOperands(); ++i) {
-			std::shared_ptr<Component> current = func->values()[i];
-			std::string printed				   = prettyPrint(current);
-			int64_t depth					   = 0;
-			current->treeDepth(depth);
-			if (depth > 1)
-				args.emplace_back("(" + printed + ")");
-			else
-				args.emplace_back(printed);
-		}
+	// Each node returns its printed form along with its depth, so the depth of
+	// an operand (used to decide where brackets are needed) is never
+	// recalculated
+	using Printed = std::pair<std::string, int64_t>;
+
+	auto visitor = [](const auto &node, auto first, auto last) -> Printed {
+		if (node->type() == "TREE")
+			return first == last ? Printed {"", 0} : std::move(*first);
+
+		if (node->type() == "NUMBER")
+			return {lrc::str(std::dynamic_pointer_cast<Number>(node)->eval()),
+					1};
+
+		if (node->type() == "VARIABLE")
+			return {std::dynamic_pointer_cast<Variable>(node)->name(), 1};
+
+		if (node->type() == "FUNCTION") {
+			auto func	  = std::dynamic_pointer_cast<Function>(node);
+			auto format	  = func->format();
+			int64_t depth = 0;
+			std::vector<std::string> args;
+			for (auto it = first; it != last; ++it) {
+				if (it->second > 1)
+					args.emplace_back("(" + it->first + ")");
+				else
+					args.emplace_back(std::move(it->first));
+				depth = lrc::max(depth, it->second);
+			}
 
-		switch (func->numOperands()) {
-			case 1: return fmt::format(format, args[0]);
-			case 2: return fmt::format(format, args[0], args[1]);
-			case 3: return fmt::format(format, args[0], args[1], args[2]);
-			case 4:
-				return fmt::format(format, args[0], args[1], args[2], args[3]);
-			default: return "too_many_args";
+			// n-ary ADD and MUL apply their (binary) format repeatedly
+			if (args.size() > 2 && isAssociative(func->name())) {
+				std::string res = args[0];
+				for (size_t i = 1; i < args.size(); ++i)
+					res = fmt::format(format, res, args[i]);
+				return {res, depth + 1};
+			}
+
+			switch (func->numOperands()) {
+				case 1: return {fmt::format(format, args[0]), depth + 1};
+				case 2:
+					return {fmt::format(format, args[0], args[1]), depth + 1};
+				case 3:
+					return {fmt::format(format, args[0], args[1], args[2]),
+							depth + 1};
+				case 4:
+					return {
+					  fmt::format(format, args[0], args[1], args[2], args[3]),
+					  depth + 1};
+				default: return {"too_many_args", depth + 1};
+			}
 		}
-	}
 
-	return "";
+		return {"", 0};
+	};
+
+	return foldTree<Printed>(object, visitor).first;
 }
 
+/**
+ * Results of a differentiate() or simplify() pass, keyed by input node.
+ *
+ * Both passes visit the tree bottom-up with foldTree(), so by the time a rule
+ * asks for the derivative (or simplified form) of one of its operands, the
+ * result is already cached and no recursion takes place. Input nodes are kept
+ * alive for the duration of the pass so their addresses cannot be reused by
+ * newly created nodes.
+ */
+class PassCache {
+public:
+	explicit PassCache(std::string wrt = "") : m_wrt(std::move(wrt)) {}
+
+	LR_NODISCARD("") const std::string &wrt() const { return m_wrt; }
+
+	LR_NODISCARD("")
+	std::shared_ptr<Component>
+	find(const std::shared_ptr<Component> &node) const {
+		auto it = m_results.find(node.get());
+		if (it == m_results.end()) return nullptr;
+		return it->second.second;
+	}
+
+	void insert(const std::shared_ptr<Component> &node,
+				const std::shared_ptr<Component> &result) {
+		m_results[node.get()] = std::make_pair(node, result);
+		m_outputs.insert(result.get());
+	}
+
+	// Returns true if the node was produced by this pass
+	LR_NODISCARD("") bool isResult(const Component *node) const {
+		return m_outputs.find(node) != m_outputs.end();
+	}
+
+	// State kept by a rule for the length of the pass, created on first use.
+	// There is one State per type, shared by every rule which uses it
+	template<typename State>
+	LR_NODISCARD("") State &ruleState() {
+		auto &state = m_ruleStates[std::type_index(typeid(State))];
+		if (!state) state = std::make_shared<State>();
+		return *std::static_pointer_cast<State>(state);
+	}
+
+private:
+	std::string m_wrt;
+	std::unordered_map<
+	  const Component *,
+	  std::pair<std::shared_ptr<Component>, std::shared_ptr<Component>>>
+	  m_results;
+	std::unordered_set<const Component *> m_outputs;
+	std::unordered_map<std::type_index, std::shared_ptr<void>> m_ruleStates;
+};
+
+// Set the pass cache used by the current thread, restoring the previous one
+// when the scope ends
+class PassScope {
+public:
+	PassScope(PassCache *&slot, PassCache *cache) : m_slot(slot), m_prev(slot) {
+		slot = cache;
+	}
+
+	PassScope(const PassScope &) = delete;
+	PassScope &operator=(const PassScope &) = delete;
+
+	~PassScope() { m_slot = m_prev; }
+
+private:
+	PassCache *&m_slot;
+	PassCache *m_prev;
+};
+
 #include "include/differentiate.hpp"
 #include "include/constants.hpp"
 #include "include/simplify.hpp"
@@ -1468,15 +2545,43 @@ differentiate(const std::shared_ptr<Component> &input,
 		return tree;
 	}
 
-	for (const auto &rule : derivativeRules) {
-		if (rule->applicable(input, wrt)) {
-			return rule->derivative(input, wrt);
-		}
-	}
-
-	LR_ASSERT(false, "No applicable rule found for type {}", input->type());
+	// Derivatives calculated by the pass running on this thread
+	static thread_local PassCache *cache = nullptr;
+
+	bool nested = cache != nullptr && cache->wrt() == wrt;
+	if (nested) {
+		if (auto res = cache->find(input)) return res;
+	}
+
+	PassCache local(wrt);
+	PassScope scope(cache, nested ? cache : &local);
+	const Registry &rules = registry();
+
+	// Differentiate every node, operands first. Nodes without an applicable
+	// rule are skipped, and only cause an error if a rule actually needs them
+	foldTree<bool>(
+	  input,
+	  [&](const auto &node, auto, auto) {
+		  for (const auto &rule : rules.derivativeRules()) {
+			  if (rule->applicable(node, wrt)) {
+				  cache->insert(node, rule->derivative(node, wrt));
+				  break;
+			  }
+		  }
+		  return true;
+	  },
+	  [&](const auto &node, bool &) { return cache->find(node) != nullptr; });
+
+	auto res = cache->find(input);
+	LR_ASSERT(
+	  res != nullptr, "No applicable rule found for type {}", input->type());
+	return res;
 }
 
+// The simplify() pass running on this thread, if any, so that rules can keep
+// state for its length (see PassCache::ruleState())
+inline thread_local PassCache *simplifyPass = nullptr;
+
 std::shared_ptr<Component> simplify(const std::shared_ptr<Component> &input) {
 	if (input->type() == "TREE") {
 		auto item = simplify(std::dynamic_pointer_cast<Tree>(input)->tree()[0]);
@@ -1485,29 +2590,87 @@ std::shared_ptr<Component> simplify(const std::shared_ptr<Component> &input) {
 		return tree;
 	}
 
-	static auto evalRule = std::make_shared<SimplifyEval>();
-	auto current		 = input;
+	// Simplified nodes calculated by the pass running on this thread
+	PassCache *&cache = simplifyPass;
 
-	for (const auto &rule : simplificationRules) {
-		if (rule->applicable(current)) {
-			current = rule->simplifyInput(current);
-		}
+	if (cache != nullptr) {
+		if (auto res = cache->find(input)) return res;
 	}
 
-	// Apply numeric evaluation after all simplification is complete
-	if (evalRule->applicable(current)) {
-		current = evalRule->simplifyInput(current);
-	}
+	PassCache local;
+	PassScope scope(cache, cache != nullptr ? cache : &local);
+
+	static auto evalRule = std::make_shared<SimplifyEval>();
+	const Registry &rules = registry();
+
+	// Every node produced by this pass is either a number or something that
+	// cannot be evaluated, so only the operands need to be checked to find
+	// out if a node can be evaluated
+	auto canEval = [&](const std::shared_ptr<Component> &node) {
+		if (cache->isResult(node.get())) return false;
+		for (const auto &child : node->children()) {
+			if (child->type() == "NUMBER") continue;
+			if (cache->isResult(child.get()) || !child->canEval()) return false;
+		}
+		return node->canEvalNode(true);
+	};
+
+	foldTree<bool>(
+	  input,
+	  [&](const auto &node, auto, auto) {
+		  // Trees are unwrapped by simplify() itself
+		  if (node->type() == "TREE") return true;
+
+		  auto current = node;
+		  for (const auto &rule : rules.simplificationRules()) {
+			  if (rule->applicable(current)) {
+				  current = rule->simplifyInput(current);
+			  }
+		  }
+
+		  // Apply numeric evaluation after all simplification is complete
+		  if (current->type() != "NUMBER" && canEval(current)) {
+			  current = evalRule->simplifyInput(current);
+		  }
+
+		  cache->insert(node, current);
+		  return true;
+	  },
+	  [&](const auto &node, bool &) { return cache->find(node) != nullptr; });
+
+	return cache->find(input);
+}
+
+// Merge nested ADD and MUL operations into n-ary nodes. Trees produced by
+// autoParse() are already flat, but the output of differentiate() may not be
+std::shared_ptr<Component> flatten(const std::shared_ptr<Component> &input) {
+	std::vector<std::shared_ptr<Component>> values;
+	auto visitor = [&](const auto &node, auto first, auto last) {
+		values.assign(first, last);
+		if (node->type() == "FUNCTION" && isAssociative(node->name())) {
+			bool nested =
+			  std::any_of(values.begin(), values.end(), [&](const auto &val) {
+				  return val->type() == "FUNCTION" &&
+						 val->name() == node->name();
+			  });
+
+			if (nested) {
+				return std::static_pointer_cast<Component>(makeAssociative(
+				  *std::dynamic_pointer_cast<Function>(node), values));
+			}
+		}
+		return node->withChildren(values);
+	};
 
-	return current;
+	return foldTree<std::shared_ptr<Component>>(input, visitor);
 }
 
 // More helper functions
 std::shared_ptr<Component> add(const std::shared_ptr<Component> &left,
 							   const std::shared_ptr<Component> &right) {
 	auto addOp = findFunction("ADD");
-	LR_ASSERT(addOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**addOp);
+	LR_ASSERT(addOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*addOp);
 	func->addValue(left);
 	func->addValue(right);
 	return func;
@@ -1516,8 +2679,8 @@ std::shared_ptr<Component> add(const std::shared_ptr<Component> &left,
 std::shared_ptr<Component> sub(const std::shared_ptr<Component> &left,
 							   const std::shared_ptr<Component> &right) {
 	auto subOp = findFunction("SUB");
-	LR_ASSERT(subOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**subOp);
+	LR_ASSERT(subOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*subOp);
 	func->addValue(left);
 	func->addValue(right);
 	return func;
@@ -1526,8 +2689,8 @@ std::shared_ptr<Component> sub(const std::shared_ptr<Component> &left,
 std::shared_ptr<Component> mul(const std::shared_ptr<Component> &left,
 							   const std::shared_ptr<Component> &right) {
 	auto mulOp = findFunction("MUL");
-	LR_ASSERT(mulOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**mulOp);
+	LR_ASSERT(mulOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*mulOp);
 	func->addValue(left);
 	func->addValue(right);
 	return func;
@@ -1536,8 +2699,8 @@ std::shared_ptr<Component> mul(const std::shared_ptr<Component> &left,
 std::shared_ptr<Component> div(const std::shared_ptr<Component> &left,
 							   const std::shared_ptr<Component> &right) {
 	auto divOp = findFunction("DIV");
-	LR_ASSERT(divOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**divOp);
+	LR_ASSERT(divOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*divOp);
 	func->addValue(left);
 	func->addValue(right);
 	return func;
@@ -1546,8 +2709,8 @@ std::shared_ptr<Component> div(const std::shared_ptr<Component> &left,
 std::shared_ptr<Component> pow(const std::shared_ptr<Component> &left,
 							   const std::shared_ptr<Component> &right) {
 	auto powOp = findFunction("POW");
-	LR_ASSERT(powOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**powOp);
+	LR_ASSERT(powOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*powOp);
 	func->addValue(left);
 	func->addValue(right);
 	return func;
@@ -1555,67 +2718,93 @@ std::shared_ptr<Component> pow(const std::shared_ptr<Component> &left,
 
 std::shared_ptr<Component> minus(const std::shared_ptr<Component> &input) {
 	auto negOp = findFunction("MINUS");
-	LR_ASSERT(negOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**negOp);
+	LR_ASSERT(negOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*negOp);
 	func->addValue(input);
 	return func;
 }
 
 std::shared_ptr<Component> sin(const std::shared_ptr<Component> &input) {
 	auto sinOp = findFunction("sin");
-	LR_ASSERT(sinOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**sinOp);
+	LR_ASSERT(sinOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*sinOp);
 	func->addValue(input);
 	return func;
 }
 
 std::shared_ptr<Component> cos(const std::shared_ptr<Component> &input) {
 	auto cosOp = findFunction("cos");
-	LR_ASSERT(cosOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**cosOp);
+	LR_ASSERT(cosOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*cosOp);
 	func->addValue(input);
 	return func;
 }
 
 std::shared_ptr<Component> tan(const std::shared_ptr<Component> &input) {
 	auto tanOp = findFunction("tan");
-	LR_ASSERT(tanOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**tanOp);
+	LR_ASSERT(tanOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*tanOp);
 	func->addValue(input);
 	return func;
 }
 
 std::shared_ptr<Component> asin(const std::shared_ptr<Component> &input) {
 	auto asinOp = findFunction("asin");
-	LR_ASSERT(asinOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**asinOp);
+	LR_ASSERT(asinOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*asinOp);
 	func->addValue(input);
 	return func;
 }
 
 std::shared_ptr<Component> acos(const std::shared_ptr<Component> &input) {
 	auto acosOp = findFunction("acos");
-	LR_ASSERT(acosOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**acosOp);
+	LR_ASSERT(acosOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*acosOp);
 	func->addValue(input);
 	return func;
 }
 
 std::shared_ptr<Component> atan(const std::shared_ptr<Component> &input) {
 	auto atanOp = findFunction("atan");
-	LR_ASSERT(atanOp != functions.end(), "Could not locate function");
-	auto func = std::make_shared<Function>(**atanOp);
+	LR_ASSERT(atanOp != nullptr, "Could not locate function");
+	auto func = std::make_shared<Function>(*atanOp);
 	func->addValue(input);
 	return func;
 }
 
-int main() {
+#include "include/polynomial.hpp"
+#include "include/horner.hpp"
+#include "include/rational.hpp"
+#include "include/strength.hpp"
+#include "include/parallel.hpp"
+#include "include/batch.hpp"
+#include "include/precision.hpp"
+#include "include/vectormath.hpp"
+#include "include/adaptive.hpp"
+#include "include/constantcache.hpp"
+#include "include/program.hpp"
+#include "include/mpfrpool.hpp"
+#include "include/grid.hpp"
+#include "include/sampler.hpp"
+#include "include/serialize.hpp"
+#include "include/diskcache.hpp"
+#include "include/cache.hpp"
+#include "include/cli.hpp"
+#include "include/server.hpp"
+
+#if !defined(SYMBOMATH_NO_MAIN)
+int main(int argc, char **argv) {
 	lrc::prec(1000);
 
 	registerFunctions();
+	registerKernels();
 	registerDerivativeRules();
 	registerConstants();
 	registerSimplifications();
+	registerRationalSimplifications();
+	publishRegistry();
+
+	if (argc > 1) return runCommand({argv + 1, argv + argc});
 
 	/*
 	std::string equation("1/x");
@@ -1678,9 +2867,7 @@ int main() {
 	fmt::print("Derivative: {}\n", prettyPrint(simplify(differentiate(parsed))));
 	fmt::print("Tree: \n{}\n", parsed->str(0));
 	std::map<std::string, std::shared_ptr<Component>> vars = {
-	  {std::pair(
-		"e",
-		autoParse("2.71828182845904523536028747135266249775724709369995"))},
+	  {std::pair("e", ConstantCache::global().node("e"))},
 	  {std::pair("x", autoParse("5"))}
 	};
 	auto substituted = substitute(parsed, vars);
@@ -1688,3 +2875,4 @@ int main() {
 
 	return 0;
 }
+#endif // !SYMBOMATH_NO_MAIN
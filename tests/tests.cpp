@@ -0,0 +1,770 @@
+// Regression tests, run by ctest. Each test reports its failed checks, and the
+// program fails if any check did
+
+#define SYMBOMATH_NO_MAIN
+#include "../main.cpp"
+
+#include <filesystem>
+#include <sstream>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+	do {                                                                       \
+		if (!(cond)) {                                                         \
+			fmt::print(stderr, "{}:{}: {}\n", __FILE__, __LINE__, #cond);      \
+			++failures;                                                        \
+		}                                                                      \
+	} while (false)
+
+#define CHECK_THROWS(expr)                                                     \
+	do {                                                                       \
+		bool thrown = false;                                                   \
+		try {                                                                  \
+			(void)(expr);                                                      \
+		} catch (const std::exception &) { thrown = true; }                    \
+		if (!thrown) {                                                         \
+			fmt::print(                                                        \
+			  stderr, "{}:{}: {} did not throw\n", __FILE__, __LINE__, #expr); \
+			++failures;                                                        \
+		}                                                                      \
+	} while (false)
+
+// Serialized data with a field of its header replaced
+template<typename Header, typename Field>
+std::string withHeaderField(std::string data, Field Header::*field,
+							Field value) {
+	Header header;
+	std::memcpy(&header, data.data(), sizeof(header));
+	header.*field = value;
+	std::memcpy(data.data(), &header, sizeof(header));
+	return data;
+}
+
+// The value of a tree with its variables given the values in ``values``
+Scalar evalAt(const std::shared_ptr<Component> &tree,
+			  const std::map<std::string, Scalar> &values) {
+	std::map<std::string, std::shared_ptr<Component>> substitutions;
+	for (const auto &[name, value] : values)
+		substitutions[name] = std::make_shared<Number>(value);
+	return eval(substitute(tree, substitutions));
+}
+
+void testSubstituteSharesUnchangedSubtrees() {
+	auto tree	= autoParse("sin(y) * 2 + x^2");
+	auto three	= std::make_shared<Number>(3);
+	auto res	= substitute(tree, {{"x", three}});
+	auto before = tree->children()[0], after = res->children()[0];
+
+	// Only the path from the root to x is rebuilt
+	CHECK(before != after);
+	CHECK(before->children()[0] == after->children()[0]);
+	CHECK(before->children()[1] != after->children()[1]);
+	CHECK(after->children()[1]->children()[0] == three);
+	CHECK(substitute(tree, {{"z", three}}) == tree);
+	CHECK(evalAt(res, {{"y", 0}}) == 9);
+
+	// Every use of a variable shares the node substituted for it
+	auto sum	= autoParse("a + b");
+	auto square = substitute(autoParse("x * x"), {{"x", sum}})->children()[0];
+	CHECK(square->children()[0] == sum && square->children()[1] == sum);
+}
+
+void testDeepTreesDoNotRecurse() {
+	// Far deeper than the call stack allows, if any of these recursed
+	std::shared_ptr<Component> deep = std::make_shared<Variable>("x");
+	for (int i = 0; i < 200000; ++i) deep = minus(deep);
+
+	int64_t depth = 0;
+	deep->treeDepth(depth);
+	CHECK(depth > 200000);
+	CHECK(evalAt(deep, {{"x", 3}}) == 3);
+	CHECK(eval(differentiate(deep, "x")) == 1);
+	CHECK(evalAt(simplify(deep), {{"x", 3}}) == 3);
+
+	// The destructor releases the chain without recursing either
+	deep.reset();
+}
+
+void testAssociativeChainsAreFlattened() {
+	auto sum = autoParse("a + b + c + d")->children()[0];
+	CHECK(sum->name() == "ADD" && sum->children().size() == 4);
+	auto difference = autoParse("a * b * c - d")->children()[0];
+	CHECK(difference->name() == "SUB");
+	CHECK(difference->children()[0]->children().size() == 3);
+
+	auto a		= std::make_shared<Variable>("a");
+	auto b		= std::make_shared<Variable>("b");
+	auto nested = add(mul(mul(a, b), mul(b, a)), add(a, b));
+	auto flat	= flatten(nested);
+	CHECK(flat->name() == "ADD" && flat->children().size() == 3);
+	CHECK(flat->children()[0]->children().size() == 4);
+	CHECK(evalAt(flat, {{"a", 2}, {"b", 3}}) == 41);
+
+	// The operands are summed as a balanced tree, so 1 + h + h + h is
+	// 1 + (h + h) rather than 1 (which adding them in turn would give)
+	Scalar h = std::ldexp(Scalar(1), -53);
+	CHECK(evalAt(autoParse("1 + h + h + h"), {{"h", h}}) == 1 + 2 * h);
+}
+
+void testStrengthReductionMatchesOriginal() {
+	CHECK(prettyPrint(strengthReduce(autoParse("x^0.5"))) == "sqrt(x)");
+	CHECK(prettyPrint(strengthReduce(autoParse("x / 4"))) == "x * 0.25");
+	CHECK(prettyPrint(strengthReduce(autoParse("-(-x) + (-y)"))) == "x - y");
+
+	// Reciprocals and repeated squaring round differently, so the results
+	// only agree to within a few ulps
+	auto close = [](Scalar a, Scalar b) {
+		return std::abs(a - b) <= 1e-14 * lrc::max(Scalar(1), std::abs(b));
+	};
+
+	for (const char *input : {"x^0.5 + x/3", "-(-x) + (-y) * 7",
+							  "x^7 * y^(-2)", "(x + y)^5 / 2 - x^2"}) {
+		auto tree	 = autoParse(input);
+		auto reduced = strengthReduce(tree);
+		auto program = compileExpression(tree, {"x", "y"});
+		CHECK(evalCost(reduced) < evalCost(tree));
+
+		std::vector<double> workspace;
+		for (double x : {0.5, 2.0, 9.0}) {
+			for (double y : {-1.5, 3.0}) {
+				Scalar expected = evalAt(tree, {{"x", x}, {"y", y}});
+				double compiled;
+				program.run<double>({&x, &y}, 1, &compiled, workspace);
+				CHECK(close(evalAt(reduced, {{"x", x}, {"y", y}}), expected));
+				CHECK(close(compiled, expected));
+			}
+		}
+	}
+}
+
+void testParallelEvalMatchesSerial() {
+	// Many independent subtrees, so a small grain size gives many tasks
+	std::string input = "0";
+	for (int k = 1; k <= 400; ++k)
+		input += fmt::format(" + sin({0}) * cos({0}) + {0}^2 / ({0} + 1)", k);
+	auto tree = autoParse(input);
+
+	ThreadPool pool(4);
+	for (uint64_t grainSize : {16, 256, 1 << 20})
+		CHECK(parallelEval(tree, grainSize, pool) == eval(tree));
+
+	// An error in any task is rethrown by the caller
+	auto missing = autoParse(input + " + y");
+	CHECK_THROWS(parallelEval(missing, 16, pool));
+}
+
+void testParseLinesKeepsOrder() {
+	std::string text;
+	for (int i = 0; i < 100; ++i) text += fmt::format("x + {}\n\n", i);
+
+	ThreadPool pool(3);
+	auto trees = parseLines(text, pool, 7);
+	CHECK(trees.size() == 100);
+	for (size_t i = 0; i < trees.size(); ++i)
+		CHECK(evalAt(trees[i], {{"x", 0}}) == Scalar(i));
+
+	// The first bad line is reported with its number, counting blank lines
+	try {
+		(void)parseLines("x\r\n\n1 +\nsin(\n", pool, 1);
+		CHECK(false);
+	} catch (const std::exception &e) {
+		CHECK(std::string(e.what()).find("Line 3:") != std::string::npos);
+	}
+}
+
+void testRegistryRepublishFreesSnapshots() {
+	// Readers parse while the registry is republished, and are quiescent
+	// between expressions, so the snapshots they used can be freed
+	std::atomic<bool> stop {false};
+	std::atomic<size_t> parsed {0};
+	std::vector<std::thread> readers;
+	for (int i = 0; i < 4; ++i) {
+		readers.emplace_back([&]() {
+			while (!stop) {
+				auto tree = autoParse("sin(x)^2 + 3x * y - 1");
+				if (tree && findFunction("ADD") != nullptr) ++parsed;
+				registryQuiescent();
+			}
+		});
+	}
+
+	uint64_t version = registry().version();
+	for (int i = 0; i < 200; ++i) publishRegistry();
+	while (parsed == 0) std::this_thread::yield();
+	stop = true;
+	for (auto &reader : readers) reader.join();
+	CHECK(registry().version() == version + 200);
+
+	// Nothing is reading, so every replaced snapshot is freed
+	registryQuiescent();
+	publishRegistry();
+	CHECK(numRetiredRegistries == 0);
+}
+
+void testCorruptSerializedExpression() {
+	auto data = serializeExpression(autoParse("3x^2 + sin(y) - 1"));
+	CHECK(MappedExpression(data.data(), data.size()).numNodes() > 0);
+
+	// A string count of 2^64 - 1 wraps to 0 if one is added to it, which
+	// would let the string offsets start at the end of the data
+	auto header = reinterpret_cast<const SerializedHeader *>(data.data());
+	for (uint64_t numStrings : {~uint64_t(0), uint64_t(1) << 62}) {
+		auto corrupt = withHeaderField(
+		  data, &SerializedHeader::stringOffsetsOffset, header->totalSize);
+		corrupt		 = withHeaderField(
+		  corrupt, &SerializedHeader::numStrings, numStrings);
+		CHECK_THROWS(MappedExpression(corrupt.data(), corrupt.size()));
+	}
+
+	CHECK_THROWS(MappedExpression(data.data(), data.size() / 2));
+}
+
+void testCorruptSerializedProgram() {
+	auto program = compileExpression(autoParse("3x^2 + y"), {"x", "y"});
+	auto data	 = program.serialize();
+	CHECK(Program::deserialize(data).variables().size() == 2);
+
+	auto header	 = reinterpret_cast<const ProgramHeader *>(data.data());
+	auto corrupt = withHeaderField(
+	  data, &ProgramHeader::stringOffsetsOffset, header->totalSize);
+	corrupt		 = withHeaderField(
+	  corrupt, &ProgramHeader::numStrings, ~uint64_t(0));
+	CHECK_THROWS(Program::deserialize(corrupt));
+
+	CHECK_THROWS(Program::deserialize({data.data(), data.size() / 2}));
+}
+
+void testExactConstantsRoundToType() {
+	// 1/3 and 0.1 are not doubles, so they must be rounded to lrc::mpfr from
+	// their exact values, also after the program is saved and loaded
+	for (const char *input : {"x/3", "0.1x"}) {
+		auto program = compileExpression(autoParse(input), {"x"});
+		auto exact	 = std::string(input) == "x/3" ? Rational(1, 3)
+												  : Rational(1, 10);
+		for (const auto &loaded :
+			 {program, Program::deserialize(program.serialize())}) {
+			lrc::mpfr x(1), y;
+			std::vector<lrc::mpfr> workspace;
+			loaded.run<lrc::mpfr>({&x}, 1, &y, workspace);
+			CHECK(y == exact.round<lrc::mpfr>());
+			CHECK(y != lrc::mpfr(exact.toScalar()));
+		}
+	}
+}
+
+void testNamedConstantsUseRunPrecision() {
+	// pi is looked up at the precision the program is run in, so in lrc::mpfr
+	// it is more precise than a double
+	auto program   = compileExpression(autoParse("pi * x"), {"x"});
+	int64_t bits   = static_cast<int64_t>(lrc::mpfr::get_default_prec());
+	const auto &pi = ConstantCache::global().value("pi", bits);
+	for (const auto &loaded :
+		 {program, Program::deserialize(program.serialize())}) {
+		lrc::mpfr x(1), y;
+		std::vector<lrc::mpfr> workspace;
+		loaded.run<lrc::mpfr>({&x}, 1, &y, workspace);
+		CHECK(y == pi);
+		CHECK(y != lrc::mpfr(static_cast<double>(pi)));
+
+		double z, one = 1;
+		std::vector<double> doubles;
+		loaded.run<double>({&one}, 1, &z, doubles);
+		CHECK(z == static_cast<double>(pi));
+	}
+}
+
+void testMpfrWorkspaceIsReused() {
+	auto tree = autoParse("sqrt(x) * exp(y) - sin(x) / cos(y) + atan(x * y)");
+	auto program = compileExpression(tree, {"x", "y"});
+
+	std::vector<lrc::mpfr> xs, ys;
+	for (int i = 1; i <= 10; ++i) {
+		xs.emplace_back(lrc::mpfr(i) / 7);
+		ys.emplace_back(lrc::mpfr(i) / 11);
+	}
+
+	std::vector<lrc::mpfr> out(xs.size()), workspace;
+	auto check = [&]() {
+		program.run<lrc::mpfr>({xs.data(), ys.data()},
+							   xs.size(),
+							   out.data(),
+							   workspace);
+		for (size_t i = 0; i < xs.size(); ++i)
+			CHECK(out[i] ==
+				  evalAs<lrc::mpfr>(tree, {{"x", xs[i]}, {"y", ys[i]}}));
+	};
+
+	// A second run computes into the same values
+	check();
+	const lrc::mpfr *pool = workspace.data();
+	size_t size			  = workspace.size();
+	check();
+	CHECK(workspace.data() == pool && workspace.size() == size);
+
+	// The pool follows the default precision
+	MpfrPrecisionScope scope(
+	  static_cast<int64_t>(lrc::mpfr::get_default_prec()) * 2);
+	check();
+	CHECK(workspace.data() == pool);
+	for (const auto &value : workspace)
+		CHECK(value.get_prec() == lrc::mpfr::get_default_prec());
+}
+
+void testDiskCacheCountsFailedWrites() {
+	auto directory = std::filesystem::temp_directory_path() /
+					 fmt::format("symbomath-tests-{:016x}",
+								 std::random_device {}());
+	DiskCache cache(directory.string());
+	cache.storeTree("x", autoParse("x + 1"));
+	CHECK(cache.loadTree("x") != nullptr);
+
+	// Saving into a directory which no longer exists fails
+	std::filesystem::remove_all(directory);
+	cache.storeTree("y", autoParse("y + 1"));
+	auto stats = cache.stats();
+	CHECK(stats.writes == 1);
+	CHECK(stats.failedWrites == 1);
+	CHECK(stats.hits == 1);
+}
+
+void testExpandCombinesRationalFunctions() {
+	auto x		  = Polynomial::variable("x");
+	auto quotient = RationalFunction::fromComponent(
+	  expand(autoParse("((x^2 - x - 1)/(x^2 + x + 1))^5")));
+	CHECK(quotient.has_value());
+	CHECK(quotient->numerator() == (x * x - x - Polynomial(1)).pow(5));
+	CHECK(quotient->denominator() == (x * x + x + Polynomial(1)).pow(5));
+
+	CHECK(prettyPrint(expand(autoParse("(x + 1)^2 * sin(x)"))) ==
+		  "((x ^ 2) + (2 * x) + 1) * (sin(x))");
+	CHECK(prettyPrint(expand(autoParse("1/x + 1/y"))) == "(x + y) / (x * y)");
+	CHECK(prettyPrint(expand(autoParse("x^2/(x^2 - 1) - 1/(x - 1)"))) ==
+		  "((x ^ 2) + (-x) + -1) / ((x ^ 2) + -1)");
+}
+
+void testExpandLeavesUnrepresentableParts() {
+	// At most 8 variables, with a degree of at most 255 in each
+	auto eight = expand(autoParse("(a + b + c + d + e + f + g + h)^2"));
+	CHECK(Polynomial::fromComponent(eight)->terms().size() == 36);
+	CHECK(prettyPrint(expand(autoParse("(a+b+c+d+e+f+g+h+i)^2"))) ==
+		  "(a + b + c + d + e + f + g + h + i) ^ 2");
+
+	CHECK(Polynomial::fromComponent(expand(autoParse("(x + 1)^255")))
+			->terms()
+			.size() == 256);
+	CHECK(prettyPrint(expand(autoParse("(x + 1)^256"))) == "(x + 1) ^ 256");
+	CHECK(prettyPrint(expand(autoParse("(x^128 + 1) * (x^128 - 1)"))) ==
+		  "((x ^ 128) + 1) * ((x ^ 128) + -1)");
+}
+
+void testRationalFunctionsCancelCommonFactors() {
+	auto x	 = Polynomial::variable("x");
+	auto y	 = Polynomial::variable("y");
+	auto one = Polynomial(1);
+	CHECK(polynomialGcd(x * x - one, x * x + x + x + one) == x + one);
+	CHECK(polynomialGcd((x * y + y) * (x - y), (x + one) * (x + y)) ==
+		  x + one);
+	CHECK(polynomialGcd(x + one, x - one).isConstant());
+
+	RationalFunction reduced(x * x - one, (x - one) * (y + one));
+	CHECK(reduced.numerator() == x + one && reduced.denominator() == y + one);
+
+	// Repeated derivatives keep the denominator (x^2 + 1)^(n + 1) instead of
+	// nesting quotients
+	auto tree = autoParse("x/(x^2 + 1)");
+	for (int i = 0; i < 4; ++i) tree = simplify(differentiate(tree, "x"));
+	auto quotient = RationalFunction::fromComponent(tree);
+	CHECK(quotient && quotient->denominator() == (x * x + one).pow(5));
+
+	// Each division is converted once per pass, however deeply it is nested
+	std::string nested = "x";
+	for (int i = 0; i < 200; ++i)
+		nested = fmt::format("1/({}/(x + {}))", i % 3 + 2, nested);
+	auto linear = Polynomial::fromComponent(simplify(autoParse(nested)));
+	CHECK(linear && linear->degree("x") == 1);
+}
+
+void testHornerFormMatchesOriginal() {
+	// The values are exact in a double, so the rewritten trees must give
+	// exactly the same results
+	for (const char *input : {"3x^2 - 5x + 2", "x^16 + x^8 + 1",
+							  "x^7 + x^5 + x^3 + x", "2x^12 - 3x^4 + x",
+							  "x^3 * y - 2x * y^2 + y - 4"}) {
+		auto tree	   = autoParse(input);
+		auto rewritten = horner(tree);
+		CHECK(evalCost(rewritten) < evalCost(tree));
+		for (Scalar x : {-1.5, 0.5, 2.0}) {
+			for (Scalar y : {-0.25, 3.0}) {
+				CHECK(evalAt(rewritten, {{"x", x}, {"y", y}}) ==
+					  evalAt(tree, {{"x", x}, {"y", y}}));
+			}
+		}
+	}
+
+	// Estrin's scheme shares x^2, x^4 and x^8, where Horner's would compute
+	// x^8 twice
+	CHECK(evalCost(horner(autoParse("x^16 + x^8 + 1"))) <= 6);
+	CHECK(evalCost(horner(autoParse("x^2 + x + 1"))) == 3);
+}
+
+void testEvalStreamsRowsInChunks() {
+	// The columns are matched to the variables by name, whatever their order
+	auto makeEvaluator = [](const std::vector<std::string> &names) {
+		return ChunkEvaluator<double>(
+		  compileExpression(autoParse("x - 2y"), names), 3);
+	};
+	std::istringstream in("y, x\n1,2\n\n3 ,4\r\n5,6\n7,8\n");
+	std::ostringstream out;
+	evalCsv(in, out, makeEvaluator);
+	CHECK(out.str() == "result\n0\n-2\n-4\n-6\n");
+
+	for (const char *bad : {"x,y\n1,2,3\n", "x,y\n1\n", "x,y\n1,a\n", ""}) {
+		std::istringstream badIn(bad);
+		CHECK_THROWS(evalCsv(badIn, out, makeEvaluator));
+	}
+
+	// Binary records are read a chunk at a time, and a partial one is an
+	// error
+	auto path = [](const char *name) {
+		auto file = fmt::format(
+		  "symbomath-{}-{:08x}", name, std::random_device {}());
+		return (std::filesystem::temp_directory_path() / file).string();
+	};
+	auto input = path("in"), output = path("out");
+	std::vector<double> records = {1, 2, 3, 4, 5, 6};
+	std::ofstream(input, std::ios::binary)
+	  .write(reinterpret_cast<const char *>(records.data()),
+			 static_cast<std::streamsize>(records.size() * sizeof(double)));
+	CHECK(evalCommand({"x * y", "-f", "binary", "--vars", "x,y", "--chunk",
+					   "2", "-i", input, "-o", output}) == 0);
+
+	std::vector<double> results(4, 0);
+	std::ifstream(output, std::ios::binary)
+	  .read(reinterpret_cast<char *>(results.data()),
+			static_cast<std::streamsize>(results.size() * sizeof(double)));
+	CHECK(results[0] == 2 && results[1] == 12 && results[2] == 30);
+	CHECK(results[3] == 0);
+
+	std::ofstream(input, std::ios::binary).write("12345", 5);
+	CHECK_THROWS(evalCommand(
+	  {"x * y", "-f", "binary", "--vars", "x,y", "-i", input, "-o", output}));
+	std::filesystem::remove(input);
+	std::filesystem::remove(output);
+}
+
+void testCountOptionsAreStrict() {
+	CHECK(parseEvalOptions({"x", "--chunk", "128"}).chunkRows == 128);
+	for (const char *chunk : {"-1", "0", "12abc", "", "+5", "1e3",
+							  "99999999999999999999"})
+		CHECK_THROWS(parseEvalOptions({"x", "--chunk", chunk}));
+
+	CHECK(parseCountOption("--n", "0", 0) == 0);
+	CHECK_THROWS(parseCountOption("--n", "53", 0, 52));
+}
+
+void testServeOptionsAreStrict() {
+	auto options = parseServeOptions(
+	  {"-s", "sock", "--batch-wait", "0", "--max-connections", "3"});
+	CHECK(options.batchWait.count() == 0 && options.maxConnections == 3);
+
+	for (const char *option : {"--batch-wait", "--max-batch",
+							   "--max-connections"}) {
+		for (const char *value : {"-1", "5ms", ""})
+			CHECK_THROWS(parseServeOptions({"-s", "sock", option, value}));
+	}
+	CHECK_THROWS(parseServeOptions({"-s", "sock", "--max-connections", "0"}));
+}
+
+void testServerRoundTrip() {
+	auto path = (std::filesystem::temp_directory_path() /
+				 fmt::format("symbomath-{:08x}.sock", std::random_device {}()))
+				  .string();
+	EvalServer::Options options;
+	options.socket	  = path;
+	options.batchWait = std::chrono::microseconds(100);
+
+	// The server never returns, so it is left running until the tests exit
+	std::thread([options]() { EvalServer(options).run(); }).detach();
+
+	UnixSocket socket;
+	for (int attempt = 0; attempt < 1000; ++attempt) {
+		try {
+			socket = UnixSocket::connect(path);
+			break;
+		} catch (const std::exception &) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	// Rows are evaluated remotely exactly as they are locally
+	std::string csv = "x,y\n1,2\n3,4\n5,6\n7,8\n9,10\n";
+	std::istringstream localIn(csv), remoteIn(csv);
+	std::ostringstream localOut, remoteOut;
+	evalCsv(localIn, localOut, [](const std::vector<std::string> &names) {
+		return ChunkEvaluator<double>(
+		  compileExpression(autoParse("x * y + 1"), names), 2);
+	});
+	evalCsv(remoteIn, remoteOut, [&](const std::vector<std::string> &names) {
+		return RemoteEvaluator(socket, "x * y + 1", names, 2);
+	});
+	CHECK(remoteOut.str() == localOut.str());
+	CHECK(remoteOut.str() == "result\n3\n13\n31\n57\n91\n");
+
+	// Errors are reported per request, and the connection stays usable
+	RemoteEvaluator bad(socket, "x +", {"x"}, 1);
+	bad.value(0) = 1;
+	bad.row();
+	CHECK_THROWS(bad.flush());
+
+	RemoteEvaluator good(socket, "2x", {"x"}, 1);
+	good.value(0) = 4;
+	good.row();
+	auto [results, count] = good.flush();
+	CHECK(count == 1 && results[0] == 8);
+}
+
+void testExpressionCacheHitsAndEvicts() {
+	ExpressionCache cache(2);
+
+	// Whitespace is not part of the key, and each result is computed once
+	auto tree = cache.parse("x * y + 1");
+	CHECK(cache.parse(" x*y +1") == tree);
+	auto program = cache.program("x*y+1", {"x", "y"});
+	CHECK(cache.program("x*y+1", {"x", "y"}) == program);
+	CHECK(cache.program("x*y+1", {"y", "x"}) != program);
+	auto derivative = cache.derivative("x*y+1", "x");
+	CHECK(cache.derivative("x*y+1", "x") == derivative);
+	CHECK(evalAt(derivative, {{"x", 5}, {"y", 3}}) == 3);
+
+	auto stats = cache.stats();
+	CHECK(stats.hits == 3 && stats.misses == 4 && stats.size == 1);
+
+	// The least recently used expression is evicted first
+	cache.parse("x + 1");
+	cache.parse("x*y+1");
+	cache.parse("x + 2");
+	stats = cache.stats();
+	CHECK(stats.evictions == 1 && stats.size == 2);
+	CHECK(cache.parse("x*y+1") == tree);
+	CHECK(cache.parse("x + 1") != nullptr);
+	CHECK(cache.stats().evictions == 2);
+
+	cache.clear();
+	CHECK(cache.stats().size == 0 && cache.parse("x*y+1") != tree);
+}
+
+void testAdaptiveEvalEscalatesOnCancellation() {
+	// Exact in double, so no more precise attempt is made
+	auto res = evalAdaptive(autoParse("x * 3 + 1"), {{"x", 2}});
+	CHECK(res.precision == 53 && res.converged && res.value == 7);
+	CHECK(res.errorBound == 0);
+
+	// 1e16 + 1 rounds to 1e16 in double, so the bound forces MPFR
+	res = evalAdaptive(autoParse("(x + 1) - x"), {{"x", 1e16}});
+	CHECK(res.precision > 53 && res.converged && res.value == 1);
+
+	// A tolerance which is never met stops at the largest precision
+	AdaptiveOptions options;
+	options.relativeTolerance = 0;
+	options.maxPrecision	  = 256;
+	res = evalAdaptive(autoParse("sin(x)"), {{"x", 1}}, options);
+	CHECK(res.precision == 256 && !res.converged && res.errorBound > 0);
+	CHECK(std::abs(static_cast<double>(res.value) - std::sin(1.0)) < 1e-15);
+}
+
+void testDecimalArithmeticIsExact() {
+	// The exact value of a simplified constant expression, if it has one
+	auto exactValue = [](const char *input) -> std::optional<Rational> {
+		auto res = simplify(autoParse(input));
+		if (res->type() == "TREE") res = res->children()[0];
+		auto number = std::dynamic_pointer_cast<Number>(res);
+		if (!number) return std::nullopt;
+		return number->exact();
+	};
+
+	CHECK(exactValue("0.1*3-0.3") == Rational(0));
+	CHECK(exactValue("1/3 + 1/6") == Rational(1, 2));
+	CHECK(exactValue("(2/3)^3") == Rational(8, 27));
+	CHECK(exactValue("0.1 + 0.2") == Rational(3, 10));
+
+	// Results which overflow 64 bits are held by GMP until they fit again
+	Rational big   = Rational(INT64_MAX) * Rational(INT64_MAX);
+	Rational small = big / Rational(INT64_MAX);
+	CHECK(big.isBig() && !small.isBig() && small == Rational(INT64_MAX));
+	CHECK((Rational(INT64_MIN) / Rational(-1)).isBig());
+}
+
+void testLiteralsParseExactly() {
+	CHECK(Rational::parse("0.1") == Rational(1, 10));
+	CHECK(Rational::parse("1.5e-3") == Rational(3, 2000));
+	CHECK(Rational::parse("12E+2") == Rational(1200));
+	CHECK(Rational::parse("000.250") == Rational(1, 4));
+
+	// Literals longer than 18 digits are read by GMP
+	auto longer = Rational::parse("123456789012345678901");
+	CHECK(longer && longer->isBig());
+	CHECK(*longer - Rational(1) == *Rational::parse("12345678901234567890e1"));
+
+	for (const char *bad : {"", ".", "1e", "1.5x", "1e5000"})
+		CHECK(!Rational::parse(bad));
+
+	// Doubles are correctly rounded, and spaces are ignored
+	CHECK(Number("0.30000000000000004").value() == 0.1 + 0.2);
+	CHECK(Number("2.5e-3").value() == 0.0025);
+	CHECK(evalAt(autoParse("1 000.5 * x"), {{"x", 2}}) == 2001);
+}
+
+void testGridBroadcastsIntoTransposedOutput() {
+	// Large enough to be divided between tasks, and written column by column
+	constexpr size_t rows = 300, cols = 301;
+	std::vector<double> xs(rows), ys(cols), out(rows * cols, -1);
+	std::iota(xs.begin(), xs.end(), 0.0);
+	std::iota(ys.begin(), ys.end(), 0.0);
+
+	// x varies down the rows, and y is a row broadcast to every row
+	auto x = ArrayView<const double>::axis(xs.data(), rows, 0, 2);
+	auto y = ArrayView<const double>(ys.data(), {cols});
+	ArrayView<double> transposed(out.data(), {rows, cols}, {1, rows});
+
+	ThreadPool pool(4);
+	evalGrid<double>(autoParse("1000x + y"),
+					 {{"x", x}, {"y", y}},
+					 transposed,
+					 Accuracy::ULP1,
+					 pool);
+
+	bool matches = true;
+	for (size_t i = 0; i < rows; ++i) {
+		for (size_t j = 0; j < cols; ++j)
+			matches &= out[j * rows + i] == double(1000 * i + j);
+	}
+	CHECK(matches);
+
+	// Shapes which do not broadcast are rejected
+	CHECK_THROWS(evalGrid<double>(
+	  autoParse("x"),
+	  {{"x", ArrayView<const double>(xs.data(), {rows - 1})}},
+	  transposed));
+}
+
+void testSamplerPointsAreOrderedAndBounded() {
+	std::vector<std::pair<double, double>> points;
+	auto sink = [&](double x, double y) { points.emplace_back(x, y); };
+
+	AdaptiveSampler sampler(autoParse("1/(1 + 2500(x - 0.3)^2)"), "x");
+	auto stats = sampler.sample(-1, 1, sink);
+	CHECK(stats.points == points.size() && stats.truncated == 0);
+	CHECK(points.front().first == -1 && points.back().first == 1);
+	for (size_t i = 1; i < points.size(); ++i)
+		CHECK(points[i - 1].first < points[i].first);
+
+	// A tolerance of 0 is never met, so each window stops at its budget
+	SamplerOptions options;
+	options.tolerance		= 0;
+	options.maxDepth		= SamplerOptions::maxDepthLimit;
+	options.maxWindowPoints = 1000;
+	points.clear();
+	stats = AdaptiveSampler(autoParse("x^2"), "x", options).sample(0, 1, sink);
+	CHECK(stats.truncated == 4 && points.size() <= 4 * 1000 + 1);
+	for (size_t i = 1; i < points.size(); ++i)
+		CHECK(points[i - 1].first < points[i].first);
+
+	for (const char *depth : {"-1", "53", "4x"})
+		CHECK_THROWS(plotCommand({"x^2", "x=0:1", "--max-depth", depth}));
+	CHECK_THROWS(plotCommand({"x^2", "x=0:1", "--intervals", "0"}));
+}
+
+void testRangeArgumentsRejectTrailingCharacters() {
+	auto range = parseRangeArgument("x=-1:2.5");
+	CHECK(range.name == "x" && range.lower == -1 && range.upper == 2.5);
+	CHECK(parseRangeArgument("y=3").upper == 3);
+
+	for (const char *arg : {"x=-1,2", "x=0:1abc", "x=1:", "x=:1", "x=1e999"})
+		CHECK_THROWS(parseRangeArgument(arg));
+}
+
+void testIntervalPowEnclosesNegativeBases() {
+	auto range = [](double xLower, double xUpper, double yLower,
+					double yUpper) {
+		return evalInterval(autoParse("x^y"),
+							{{"x", Interval(xLower, xUpper)},
+							 {"y", Interval(yLower, yUpper)}});
+	};
+
+	// (-1)^3 = -1 and 1^2 = 1
+	Interval mixed = range(-1, 1, 2, 3);
+	CHECK(mixed.contains(-1) && mixed.contains(1));
+
+	// The true range is [-8, 4], from (-2)^3 and (-2)^2
+	Interval negative = range(-2, -1, 2, 3);
+	CHECK(!negative.isEmpty());
+	CHECK(negative.contains(-8) && negative.contains(4));
+
+	// Too many integers in y to take one at a time
+	Interval wide = range(-2, -1, 0, 1000);
+	CHECK(wide.lower() == -intervalInfinity);
+	CHECK(wide.upper() == intervalInfinity);
+}
+
+void testVectorKernelsKeepSignedZeros() {
+	// Odd functions map -0 to -0. The kernels are only built with AVX2 or
+	// AVX-512 (see SYMBOMATH_NATIVE), so there may be nothing to check
+	for (const char *name : {"sin", "tan", "asin", "atan"}) {
+		for (Accuracy accuracy : {Accuracy::ULP1, Accuracy::ULP4}) {
+			auto kernel = vectorUnary<double>(name, accuracy);
+			if (kernel == nullptr) continue;
+
+			std::vector<double> xs(32), ys(xs.size());
+			for (size_t i = 0; i < xs.size(); ++i)
+				xs[i] = i % 2 == 0 ? -0.0 : -0x1p-1000;
+			kernel(xs.data(), ys.data(), xs.size());
+			for (size_t i = 0; i < xs.size(); ++i)
+				CHECK(ys[i] == xs[i] && std::signbit(ys[i]));
+		}
+	}
+}
+
+int main() {
+	registerFunctions();
+	registerKernels();
+	registerDerivativeRules();
+	registerConstants();
+	registerSimplifications();
+	registerRationalSimplifications();
+	publishRegistry();
+
+	testSubstituteSharesUnchangedSubtrees();
+	testDeepTreesDoNotRecurse();
+	testAssociativeChainsAreFlattened();
+	testStrengthReductionMatchesOriginal();
+	testParallelEvalMatchesSerial();
+	testParseLinesKeepsOrder();
+	testRegistryRepublishFreesSnapshots();
+	testCorruptSerializedExpression();
+	testCorruptSerializedProgram();
+	testExactConstantsRoundToType();
+	testNamedConstantsUseRunPrecision();
+	testMpfrWorkspaceIsReused();
+	testDiskCacheCountsFailedWrites();
+	testExpandCombinesRationalFunctions();
+	testExpandLeavesUnrepresentableParts();
+	testRationalFunctionsCancelCommonFactors();
+	testHornerFormMatchesOriginal();
+	testEvalStreamsRowsInChunks();
+	testCountOptionsAreStrict();
+	testServeOptionsAreStrict();
+	testServerRoundTrip();
+	testExpressionCacheHitsAndEvicts();
+	testAdaptiveEvalEscalatesOnCancellation();
+	testDecimalArithmeticIsExact();
+	testLiteralsParseExactly();
+	testGridBroadcastsIntoTransposedOutput();
+	testSamplerPointsAreOrderedAndBounded();
+	testRangeArgumentsRejectTrailingCharacters();
+	testIntervalPowEnclosesNegativeBases();
+	testVectorKernelsKeepSignedZeros();
+
+	if (failures > 0) fmt::print(stderr, "{} checks failed\n", failures);
+	return failures > 0 ? 1 : 0;
+}